@@ -0,0 +1,177 @@
+/*
+ * Rufux - Runtime Configuration Implementation
+ * Francesco Lauritano
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#include "config.h"
+#include "utils.h"
+#include "../platform/platform.h"
+#include <glib.h>
+#include <stdlib.h>
+#include <string.h>
+
+static rufus_config_t config = {
+    .readahead_bytes = 0,
+    .readahead_threads = CONFIG_DEFAULT_RA_THREADS,
+    .spool_dir = NULL,
+    .memory_budget_bytes = 0,
+    .worker_threads = 0,
+    .cache_bytes = 0,
+    .verify_writes = true,
+    .chunk_digest = CHUNK_DIGEST_SHA256,
+    .prediscard = DISCARD_AUTO,
+    .prebuild_dir = NULL,
+    .grow_images = false,
+    .ioprio_class = IOPRIO_CLASS_NONE,
+    .ioprio_level = 4,
+    .write_bps = 0,
+    .memory_high_bytes = 0,
+    .audit_per_hub = 0,
+    .catalog_dirs = NULL,
+};
+
+rufus_config_t *config_get(void)
+{
+    return &config;
+}
+
+bool config_set_ioprio(const char *spec)
+{
+    static const struct {
+        const char *name;
+        int io_class;
+    } classes[] = {
+        { "none",        IOPRIO_CLASS_NONE },
+        { "realtime",    IOPRIO_CLASS_RT },
+        { "best-effort", IOPRIO_CLASS_BE },
+        { "idle",        IOPRIO_CLASS_IDLE },
+    };
+
+    if (!spec)
+        return false;
+
+    const char *colon = strchr(spec, ':');
+    size_t len = colon ? (size_t)(colon - spec) : strlen(spec);
+    int level = 4;
+    if (colon) {
+        char *end;
+        level = (int)strtol(colon + 1, &end, 10);
+        if (*end || end == colon + 1 || level < 0 || level > 7) {
+            rufus_error("Invalid I/O priority level in '%s' (0-7)", spec);
+            return false;
+        }
+    }
+
+    for (size_t i = 0; i < G_N_ELEMENTS(classes); i++) {
+        if (strlen(classes[i].name) == len && strncmp(spec, classes[i].name, len) == 0) {
+            config.ioprio_class = classes[i].io_class;
+            config.ioprio_level = level;
+            return true;
+        }
+    }
+
+    rufus_error("Unknown I/O priority '%s'", spec);
+    return false;
+}
+
+bool config_load(const char *path)
+{
+    char *default_path = NULL;
+    if (!path) {
+        default_path = g_build_filename(g_get_user_config_dir(), "rufux", "rufux.conf", NULL);
+        path = default_path;
+        if (!g_file_test(path, G_FILE_TEST_EXISTS)) {
+            g_free(default_path);
+            return true;
+        }
+    }
+
+    GKeyFile *kf = g_key_file_new();
+    GError *error = NULL;
+
+    if (!g_key_file_load_from_file(kf, path, G_KEY_FILE_NONE, &error)) {
+        rufus_error("Failed to load config %s: %s", path, error->message);
+        g_error_free(error);
+        g_key_file_free(kf);
+        g_free(default_path);
+        return false;
+    }
+
+    if (g_key_file_has_key(kf, "io", "readahead_mb", NULL))
+        config.readahead_bytes =
+            (uint64_t)g_key_file_get_uint64(kf, "io", "readahead_mb", NULL) * 1024 * 1024;
+
+    if (g_key_file_has_key(kf, "io", "readahead_threads", NULL))
+        config.readahead_threads = g_key_file_get_integer(kf, "io", "readahead_threads", NULL);
+
+    if (g_key_file_has_key(kf, "io", "memory_budget_mb", NULL))
+        config.memory_budget_bytes =
+            (uint64_t)g_key_file_get_uint64(kf, "io", "memory_budget_mb", NULL) * 1024 * 1024;
+
+    char *spool = g_key_file_get_string(kf, "io", "spool_dir", NULL);
+    if (spool) {
+        free(config.spool_dir);
+        config.spool_dir = strdup(spool);
+        g_free(spool);
+    }
+
+    if (g_key_file_has_key(kf, "jobs", "workers", NULL))
+        config.worker_threads = g_key_file_get_integer(kf, "jobs", "workers", NULL);
+
+    if (g_key_file_has_key(kf, "cache", "budget_mb", NULL))
+        config.cache_bytes =
+            (uint64_t)g_key_file_get_uint64(kf, "cache", "budget_mb", NULL) * 1024 * 1024;
+
+    if (g_key_file_has_key(kf, "write", "verify", NULL))
+        config.verify_writes = g_key_file_get_boolean(kf, "write", "verify", NULL);
+
+    char *chunk_digest = g_key_file_get_string(kf, "write", "chunk_digest", NULL);
+    if (chunk_digest && !chunk_digest_parse(chunk_digest, &config.chunk_digest))
+        rufus_error("Unknown chunk digest '%s'", chunk_digest);
+    g_free(chunk_digest);
+
+    char *prediscard = g_key_file_get_string(kf, "write", "prediscard", NULL);
+    if (prediscard && !discard_policy_parse(prediscard, &config.prediscard))
+        rufus_error("Unknown prediscard setting '%s'", prediscard);
+    g_free(prediscard);
+
+    char *prebuild = g_key_file_get_string(kf, "write", "prebuild_dir", NULL);
+    if (prebuild) {
+        free(config.prebuild_dir);
+        config.prebuild_dir = strdup(prebuild);
+        g_free(prebuild);
+    }
+
+    if (g_key_file_has_key(kf, "write", "grow", NULL))
+        config.grow_images = g_key_file_get_boolean(kf, "write", "grow", NULL);
+
+    char *ioprio = g_key_file_get_string(kf, "throttle", "ioprio", NULL);
+    if (ioprio) {
+        config_set_ioprio(ioprio);
+        g_free(ioprio);
+    }
+
+    if (g_key_file_has_key(kf, "throttle", "write_mbps", NULL))
+        config.write_bps =
+            (uint64_t)g_key_file_get_uint64(kf, "throttle", "write_mbps", NULL) * 1024 * 1024;
+
+    if (g_key_file_has_key(kf, "throttle", "memory_high_mb", NULL))
+        config.memory_high_bytes =
+            (uint64_t)g_key_file_get_uint64(kf, "throttle", "memory_high_mb", NULL) * 1024 * 1024;
+
+    if (g_key_file_has_key(kf, "audit", "per_hub", NULL))
+        config.audit_per_hub = g_key_file_get_integer(kf, "audit", "per_hub", NULL);
+
+    char **dirs = g_key_file_get_string_list(kf, "catalog", "dirs", NULL, NULL);
+    if (dirs) {
+        g_strfreev(config.catalog_dirs);
+        config.catalog_dirs = dirs;
+    }
+
+    rufus_log("Loaded config %s", path);
+
+    g_key_file_free(kf);
+    g_free(default_path);
+    return true;
+}
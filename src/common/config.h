@@ -0,0 +1,81 @@
+/*
+ * Rufux - Runtime Configuration
+ * Francesco Lauritano
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ *
+ * Process-wide tunables, loaded from a key file (the station config) and
+ * overridden from the command line at startup.
+ */
+
+#ifndef RUFUS_CONFIG_H
+#define RUFUS_CONFIG_H
+
+#include "hash.h"
+#include "../disk/discard.h"
+#include <stdbool.h>
+#include <stdint.h>
+
+typedef struct {
+    /* Image source readahead (0 = only for network/FUSE sources, at the default depth) */
+    uint64_t readahead_bytes;
+    int readahead_threads;
+    char *spool_dir;            /* Local spool for slow sources (NULL = off) */
+
+    /* Budget for I/O buffers and readahead rings (0 = half of RAM less the cache) */
+    uint64_t memory_budget_bytes;
+
+    /* Job engine workers (0 = one per CPU) */
+    int worker_threads;
+
+    /* RAM staging cache for repeatedly written images (0 = off) */
+    uint64_t cache_bytes;
+
+    /* Read raw writes back and record a manifest of the stick */
+    bool verify_writes;
+
+    /* Digest of each chunk in new manifests and readback */
+    chunk_digest_t chunk_digest;
+
+    /* Discard the stick before a raw write */
+    discard_policy_t prediscard;
+
+    /* Build FAT32 file-copy sticks once here and write them raw (NULL = off) */
+    char *prebuild_dir;
+
+    /* Grow a compact disk image's last partition to fill the stick */
+    bool grow_images;
+
+    /* I/O class and level for write stages (class 0 = leave unchanged) */
+    int ioprio_class;
+    int ioprio_level;
+
+    /* cgroup v2 limits for flashing (0 = none): write bandwidth per stick
+     * and the page cache the flashing processes may hold */
+    uint64_t write_bps;
+    uint64_t memory_high_bytes;
+
+    /* Concurrent readers per USB hub in audit mode (0 = default) */
+    int audit_per_hub;
+
+    /* Image directories watched by the catalog (NULL-terminated, NULL = off) */
+    char **catalog_dirs;
+} rufus_config_t;
+
+/* Default readahead depth when a slow source is detected */
+#define CONFIG_DEFAULT_READAHEAD   (512ULL * 1024 * 1024)
+#define CONFIG_DEFAULT_RA_THREADS  4
+
+/* Get the process-wide configuration (set up at startup, read-only afterwards) */
+rufus_config_t *config_get(void);
+
+/* Load settings from a key file. NULL loads ~/.config/rufux/rufux.conf.
+ * A missing default file is not an error.
+ */
+bool config_load(const char *path);
+
+/* Parse an I/O priority of the form "idle", "best-effort[:LEVEL]" or
+ * "realtime[:LEVEL]" (also "none") into config
+ */
+bool config_set_ioprio(const char *spec);
+
+#endif /* RUFUS_CONFIG_H */
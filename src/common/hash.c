@@ -3,7 +3,8 @@
  * Francesco Lauritano
  * SPDX-License-Identifier: GPL-3.0-or-later
  *
- * Uses OpenSSL/libcrypto for hash computation
+ * Uses OpenSSL/libcrypto for hash computation. CRC32C chunk digests use
+ * the CPU's CRC instructions when present, with a table fallback.
  */
 
 #define _GNU_SOURCE
@@ -13,9 +14,22 @@
 #include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/stat.h>
 #include <openssl/evp.h>
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#elif defined(__aarch64__)
+#include <arm_acle.h>
+#include <sys/auxv.h>
+#ifndef HWCAP_CRC32
+#define HWCAP_CRC32 (1 << 7)
+#endif
+#endif
 
 #define HASH_BUFFER_SIZE (1024 * 1024)  /* 1MB read buffer */
+#define SIDECAR_MAX_SIZE (1024 * 1024)  /* Larger files are not checksum lists */
 
 static const char *hash_names[] = {
     [HASH_MD5]    = "MD5",
@@ -90,22 +104,86 @@ cleanup:
     return success;
 }
 
-bool hash_file(hash_type_t type, const char *path,
-               uint8_t *digest, size_t digest_len,
-               hash_progress_callback_t progress_cb, void *user_data)
+struct hash_ctx {
+    hash_type_t type;
+    EVP_MD_CTX *md_ctx;
+};
+
+hash_ctx_t *hash_ctx_new(hash_type_t type)
 {
     const EVP_MD *md = get_evp_md(type);
     if (!md)
+        return NULL;
+
+    hash_ctx_t *ctx = calloc(1, sizeof(hash_ctx_t));
+    if (!ctx)
+        return NULL;
+
+    ctx->type = type;
+    ctx->md_ctx = EVP_MD_CTX_new();
+    if (!ctx->md_ctx || EVP_DigestInit_ex(ctx->md_ctx, md, NULL) != 1) {
+        hash_ctx_free(ctx);
+        return NULL;
+    }
+
+    return ctx;
+}
+
+bool hash_ctx_update(hash_ctx_t *ctx, const void *data, size_t len)
+{
+    if (!ctx)
         return false;
+    return EVP_DigestUpdate(ctx->md_ctx, data, len) == 1;
+}
 
-    size_t expected_size = hash_digest_size(type);
+bool hash_ctx_final(hash_ctx_t *ctx, uint8_t *digest, size_t digest_len)
+{
+    if (!ctx)
+        return false;
+
+    size_t expected_size = hash_digest_size(ctx->type);
     if (digest_len < expected_size)
         return false;
 
+    unsigned int actual_len = 0;
+    if (EVP_DigestFinal_ex(ctx->md_ctx, digest, &actual_len) != 1)
+        return false;
+
+    return actual_len == expected_size;
+}
+
+void hash_ctx_free(hash_ctx_t *ctx)
+{
+    if (!ctx)
+        return;
+    EVP_MD_CTX_free(ctx->md_ctx);
+    free(ctx);
+}
+
+bool hash_file_multi(const hash_type_t *types, int count, const char *path,
+                     uint8_t (*digests)[MAX_DIGEST_SIZE],
+                     hash_progress_callback_t progress_cb, void *user_data)
+{
+    if (!types || !digests || count <= 0 || count > HASH_TYPE_COUNT)
+        return false;
+
+    EVP_MD_CTX *ctx[HASH_TYPE_COUNT] = { 0 };
+    for (int i = 0; i < count; i++) {
+        const EVP_MD *md = get_evp_md(types[i]);
+        ctx[i] = md ? EVP_MD_CTX_new() : NULL;
+        if (!ctx[i] || EVP_DigestInit_ex(ctx[i], md, NULL) != 1) {
+            for (int j = 0; j <= i; j++)
+                EVP_MD_CTX_free(ctx[j]);
+            return false;
+        }
+    }
+
+    bool success = false;
+    uint8_t *buffer = NULL;
     FILE *fp = fopen(path, "rb");
     if (!fp) {
         rufus_error("Failed to open file for hashing: %s", path);
-        return false;
+        goto cleanup;
     }
 
     /* Get file size for progress */
@@ -113,29 +191,19 @@ bool hash_file(hash_type_t type, const char *path,
     uint64_t total_size = ftell(fp);
     fseek(fp, 0, SEEK_SET);
 
-    EVP_MD_CTX *ctx = EVP_MD_CTX_new();
-    if (!ctx) {
-        fclose(fp);
-        return false;
-    }
-
-    bool success = false;
-    uint8_t *buffer = malloc(HASH_BUFFER_SIZE);
-    if (!buffer) {
-        EVP_MD_CTX_free(ctx);
-        fclose(fp);
-        return false;
-    }
-
-    if (EVP_DigestInit_ex(ctx, md, NULL) != 1)
+    buffer = malloc(HASH_BUFFER_SIZE);
+    if (!buffer)
         goto cleanup;
 
     uint64_t bytes_read = 0;
     size_t n;
 
+    /* Every algorithm sees each block while it is still in cache */
     while ((n = fread(buffer, 1, HASH_BUFFER_SIZE, fp)) > 0) {
-        if (EVP_DigestUpdate(ctx, buffer, n) != 1)
-            goto cleanup;
+        for (int i = 0; i < count; i++) {
+            if (EVP_DigestUpdate(ctx[i], buffer, n) != 1)
+                goto cleanup;
+        }
 
         bytes_read += n;
 
@@ -148,19 +216,40 @@ bool hash_file(hash_type_t type, const char *path,
         goto cleanup;
     }
 
-    unsigned int actual_len = 0;
-    if (EVP_DigestFinal_ex(ctx, digest, &actual_len) != 1)
-        goto cleanup;
+    for (int i = 0; i < count; i++) {
+        unsigned int actual_len = 0;
+        if (EVP_DigestFinal_ex(ctx[i], digests[i], &actual_len) != 1 ||
+            actual_len != hash_digest_size(types[i]))
+            goto cleanup;
+    }
 
-    success = (actual_len == expected_size);
+    success = true;
 
 cleanup:
     free(buffer);
-    EVP_MD_CTX_free(ctx);
-    fclose(fp);
+    for (int i = 0; i < count; i++)
+        EVP_MD_CTX_free(ctx[i]);
+    if (fp)
+        fclose(fp);
     return success;
 }
 
+bool hash_file(hash_type_t type, const char *path,
+               uint8_t *digest, size_t digest_len,
+               hash_progress_callback_t progress_cb, void *user_data)
+{
+    size_t expected_size = hash_digest_size(type);
+    if (expected_size == 0 || digest_len < expected_size)
+        return false;
+
+    uint8_t result[1][MAX_DIGEST_SIZE];
+    if (!hash_file_multi(&type, 1, path, result, progress_cb, user_data))
+        return false;
+
+    memcpy(digest, result[0], expected_size);
+    return true;
+}
+
 void hash_digest_to_hex(const uint8_t *digest, size_t digest_len, char *hex)
 {
     static const char hex_chars[] = "0123456789abcdef";
@@ -218,3 +307,482 @@ char *hash_file_hex(hash_type_t type, const char *path,
 
     return hex;
 }
+
+/* ============== Checksum Files ============== */
+
+/* Per-image sidecar extensions, e.g. debian.iso.sha256 */
+static const char *sidecar_exts[] = {
+    "sha512", "sha256", "sha1", "md5",
+    "sha512sum", "sha256sum", "sha1sum", "md5sum",
+    "checksum", "digests", NULL
+};
+
+/* Algorithm implied by the length of a hex digest, or HASH_TYPE_COUNT */
+static hash_type_t hash_type_for_hex(const char *hex, size_t len)
+{
+    for (size_t i = 0; i < len; i++) {
+        if (!isxdigit((unsigned char)hex[i]))
+            return HASH_TYPE_COUNT;
+    }
+
+    for (int t = 0; t < HASH_TYPE_COUNT; t++) {
+        if (len == hash_sizes[t] * 2)
+            return t;
+    }
+    return HASH_TYPE_COUNT;
+}
+
+/* Names in lists may carry a "./" prefix or a directory */
+static bool sidecar_name_matches(const char *listed, size_t len, const char *image)
+{
+    const char *base = listed;
+    for (size_t i = 0; i < len; i++) {
+        if (listed[i] == '/')
+            base = listed + i + 1;
+    }
+    len -= base - listed;
+    return len == strlen(image) && strncmp(base, image, len) == 0;
+}
+
+static bool is_sidecar_name(const char *name, const char *image)
+{
+    size_t image_len = strlen(image);
+    if (strncmp(name, image, image_len) == 0 && name[image_len] == '.') {
+        for (int i = 0; sidecar_exts[i]; i++) {
+            if (strcasecmp(name + image_len + 1, sidecar_exts[i]) == 0)
+                return true;
+        }
+        return false;
+    }
+
+    /* Detached signatures are not checksum lists */
+    const char *ext = strrchr(name, '.');
+    if (ext && (strcasecmp(ext, ".sig") == 0 || strcasecmp(ext, ".gpg") == 0 ||
+                strcasecmp(ext, ".asc") == 0))
+        return false;
+
+    /* SHA256SUMS, MD5SUMS, sha256sum.txt, CHECKSUM, Fedora-...-CHECKSUM */
+    return strcasestr(name, "sums") || strcasestr(name, "sum.txt") ||
+           strcasestr(name, "checksum");
+}
+
+/*
+ * Parse one checksum file. Understands the coreutils format
+ * ("<hex>  name" or "<hex> *name"), the BSD/tagged format
+ * ("SHA256 (name) = <hex>") used by Fedora CHECKSUM files, and a bare
+ * digest in a per-image file. Clear-signed armor lines are skipped.
+ */
+static bool sidecar_parse_stream(FILE *fp, const char *name, const char *image,
+                                 hash_sidecar_t *best)
+{
+    bool found = false;
+    size_t image_len = strlen(image);
+    bool own_file = strncmp(name, image, image_len) == 0 && name[image_len] == '.';
+    char line[1024];
+
+    while (fgets(line, sizeof(line), fp)) {
+        char *p = line;
+        while (isspace((unsigned char)*p))
+            p++;
+        char *end = p + strlen(p);
+        while (end > p && isspace((unsigned char)end[-1]))
+            *--end = '\0';
+        if (!*p || *p == '#' || strncmp(p, "-----", 5) == 0 || strncmp(p, "Hash:", 5) == 0)
+            continue;
+
+        const char *hex = NULL;
+        size_t hex_len = 0;
+        bool matches = false;
+
+        char *open = strstr(p, " (");
+        char *close = open ? strstr(open, ") = ") : NULL;
+        if (close) {
+            /* Tagged: ALG (name) = hex */
+            hex = close + 4;
+            hex_len = strlen(hex);
+            matches = sidecar_name_matches(open + 2, close - (open + 2), image);
+        } else {
+            /* Coreutils: hex, whitespace, optional '*', name */
+            hex = p;
+            hex_len = strcspn(p, " \t");
+            const char *listed = p + hex_len;
+            while (*listed == ' ' || *listed == '\t')
+                listed++;
+            if (*listed == '*')
+                listed++;
+            matches = *listed ? sidecar_name_matches(listed, strlen(listed), image) : own_file;
+        }
+
+        hash_type_t type = hash_type_for_hex(hex, hex_len);
+        if (!matches || type == HASH_TYPE_COUNT)
+            continue;
+
+        /* Prefer the strongest algorithm any file offers */
+        if (best->source && hash_sizes[type] <= hash_sizes[best->type])
+            continue;
+
+        best->type = type;
+        for (size_t i = 0; i < hex_len; i++)
+            best->expected[i] = tolower((unsigned char)hex[i]);
+        best->expected[hex_len] = '\0';
+        free(best->source);
+        best->source = strdup(name);
+        found = true;
+    }
+
+    return found;
+}
+
+static void sidecar_parse(const char *file, const char *name, const char *image,
+                          hash_sidecar_t *best)
+{
+    struct stat st;
+    if (stat(file, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size > SIDECAR_MAX_SIZE)
+        return;
+
+    FILE *fp = fopen(file, "r");
+    if (!fp)
+        return;
+
+    sidecar_parse_stream(fp, name, image, best);
+    fclose(fp);
+}
+
+bool hash_sidecar_parse(const char *text, size_t len, const char *source, const char *image,
+                        hash_sidecar_t *best)
+{
+    if (!text || !len || !source || !image || !best || len > SIDECAR_MAX_SIZE)
+        return false;
+
+    FILE *fp = fmemopen((void *)text, len, "r");
+    if (!fp)
+        return false;
+
+    bool found = sidecar_parse_stream(fp, source, image, best);
+    fclose(fp);
+    return found;
+}
+
+hash_sidecar_t *hash_sidecar_find(const char *image_path)
+{
+    if (!image_path)
+        return NULL;
+
+    char *dir = strdup(image_path);
+    if (!dir)
+        return NULL;
+
+    char *slash = strrchr(dir, '/');
+    const char *image = slash ? image_path + (slash - dir) + 1 : image_path;
+    if (slash)
+        *slash = '\0';
+
+    DIR *d = opendir(slash ? (*dir ? dir : "/") : ".");
+    if (!d) {
+        free(dir);
+        return NULL;
+    }
+
+    hash_sidecar_t best = { 0 };
+    struct dirent *ent;
+    while ((ent = readdir(d)) != NULL) {
+        if (ent->d_name[0] == '.' || strcmp(ent->d_name, image) == 0 ||
+            !is_sidecar_name(ent->d_name, image))
+            continue;
+
+        char *file = NULL;
+        if (asprintf(&file, "%s/%s", slash ? (*dir ? dir : "") : ".", ent->d_name) < 0)
+            continue;
+        sidecar_parse(file, ent->d_name, image, &best);
+        free(file);
+    }
+
+    closedir(d);
+    free(dir);
+
+    if (!best.source)
+        return NULL;
+
+    hash_sidecar_t *sidecar = malloc(sizeof(hash_sidecar_t));
+    if (!sidecar) {
+        free(best.source);
+        return NULL;
+    }
+    *sidecar = best;
+    return sidecar;
+}
+
+void hash_sidecar_free(hash_sidecar_t *sidecar)
+{
+    if (!sidecar)
+        return;
+    free(sidecar->source);
+    free(sidecar);
+}
+
+char *hash_file_checked(const char *path, const hash_sidecar_t *sidecar, hash_check_t *check,
+                        hash_progress_callback_t progress_cb, void *user_data)
+{
+    if (check)
+        *check = HASH_CHECK_NONE;
+
+    hash_type_t types[2] = { HASH_SHA256, HASH_SHA256 };
+    int count = 1;
+    if (sidecar && sidecar->type != HASH_SHA256)
+        types[count++] = sidecar->type;
+
+    uint8_t digests[2][MAX_DIGEST_SIZE];
+    if (!hash_file_multi(types, count, path, digests, progress_cb, user_data))
+        return NULL;
+
+    char *hex = malloc(SHA256_DIGEST_SIZE * 2 + 1);
+    if (!hex)
+        return NULL;
+    hash_digest_to_hex(digests[0], SHA256_DIGEST_SIZE, hex);
+
+    if (sidecar && check) {
+        bool ok = hash_verify_hex(digests[count - 1], hash_digest_size(sidecar->type),
+                                  sidecar->expected);
+        *check = ok ? HASH_CHECK_VERIFIED : HASH_CHECK_MISMATCH;
+    }
+
+    return hex;
+}
+
+/* ============== Chunk digests ============== */
+
+/* Independent CRC chains over contiguous quarters of the chunk. The CRC
+ * instruction has a latency of several cycles but issues every cycle, so
+ * interleaving the lanes keeps it busy, and four 32-bit CRCs make a change
+ * far less likely to go unnoticed than one. */
+#define CRC32C_LANES  4
+#define CRC32C_POLY   0x82F63B78U     /* Castagnoli, reflected */
+
+typedef void (*crc32c_lanes_fn)(const uint8_t *const lanes[CRC32C_LANES], size_t lane_len,
+                                size_t last_len, uint32_t crc[CRC32C_LANES]);
+
+static const char *chunk_digest_names[] = {
+    [CHUNK_DIGEST_SHA256] = "sha256",
+    [CHUNK_DIGEST_CRC32C] = "crc32c",
+};
+
+static uint32_t crc32c_table[8][256];
+
+static void crc32c_table_init(void)
+{
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t crc = i;
+        for (int k = 0; k < 8; k++)
+            crc = crc & 1 ? (crc >> 1) ^ CRC32C_POLY : crc >> 1;
+        crc32c_table[0][i] = crc;
+    }
+    for (uint32_t i = 0; i < 256; i++) {
+        for (int t = 1; t < 8; t++)
+            crc32c_table[t][i] = (crc32c_table[t - 1][i] >> 8) ^
+                                 crc32c_table[0][crc32c_table[t - 1][i] & 0xFF];
+    }
+}
+
+/* Slicing-by-8 */
+static uint32_t crc32c_sw(uint32_t crc, const uint8_t *p, size_t len)
+{
+    for (; len >= 8; p += 8, len -= 8) {
+        uint64_t v;
+        memcpy(&v, p, 8);
+        v ^= crc;
+        crc = crc32c_table[7][v & 0xFF] ^ crc32c_table[6][(v >> 8) & 0xFF] ^
+              crc32c_table[5][(v >> 16) & 0xFF] ^ crc32c_table[4][(v >> 24) & 0xFF] ^
+              crc32c_table[3][(v >> 32) & 0xFF] ^ crc32c_table[2][(v >> 40) & 0xFF] ^
+              crc32c_table[1][(v >> 48) & 0xFF] ^ crc32c_table[0][v >> 56];
+    }
+    while (len--)
+        crc = (crc >> 8) ^ crc32c_table[0][(crc ^ *p++) & 0xFF];
+    return crc;
+}
+
+static void crc32c_lanes_sw(const uint8_t *const lanes[CRC32C_LANES], size_t lane_len,
+                            size_t last_len, uint32_t crc[CRC32C_LANES])
+{
+    for (int l = 0; l < CRC32C_LANES; l++)
+        crc[l] = crc32c_sw(crc[l], lanes[l], l == CRC32C_LANES - 1 ? last_len : lane_len);
+}
+
+#if defined(__x86_64__)
+
+__attribute__((target("sse4.2")))
+static void crc32c_lanes_hw(const uint8_t *const lanes[CRC32C_LANES], size_t lane_len,
+                            size_t last_len, uint32_t crc[CRC32C_LANES])
+{
+    uint64_t c0 = crc[0], c1 = crc[1], c2 = crc[2], c3 = crc[3];
+    for (size_t i = 0; i < lane_len; i += 8) {
+        uint64_t v0, v1, v2, v3;
+        memcpy(&v0, lanes[0] + i, 8);
+        memcpy(&v1, lanes[1] + i, 8);
+        memcpy(&v2, lanes[2] + i, 8);
+        memcpy(&v3, lanes[3] + i, 8);
+        c0 = _mm_crc32_u64(c0, v0);
+        c1 = _mm_crc32_u64(c1, v1);
+        c2 = _mm_crc32_u64(c2, v2);
+        c3 = _mm_crc32_u64(c3, v3);
+    }
+
+    /* The last lane also takes the remainder */
+    const uint8_t *p = lanes[3] + lane_len;
+    size_t rest = last_len - lane_len;
+    for (; rest >= 8; p += 8, rest -= 8) {
+        uint64_t v;
+        memcpy(&v, p, 8);
+        c3 = _mm_crc32_u64(c3, v);
+    }
+    uint32_t c3_32 = (uint32_t)c3;
+    while (rest--)
+        c3_32 = _mm_crc32_u8(c3_32, *p++);
+
+    crc[0] = (uint32_t)c0;
+    crc[1] = (uint32_t)c1;
+    crc[2] = (uint32_t)c2;
+    crc[3] = c3_32;
+}
+
+static bool crc32c_hw_supported(void)
+{
+    return __builtin_cpu_supports("sse4.2");
+}
+
+#define CRC32C_HW_NAME "SSE4.2"
+
+#elif defined(__aarch64__)
+
+__attribute__((target("+crc")))
+static void crc32c_lanes_hw(const uint8_t *const lanes[CRC32C_LANES], size_t lane_len,
+                            size_t last_len, uint32_t crc[CRC32C_LANES])
+{
+    uint32_t c0 = crc[0], c1 = crc[1], c2 = crc[2], c3 = crc[3];
+    for (size_t i = 0; i < lane_len; i += 8) {
+        uint64_t v0, v1, v2, v3;
+        memcpy(&v0, lanes[0] + i, 8);
+        memcpy(&v1, lanes[1] + i, 8);
+        memcpy(&v2, lanes[2] + i, 8);
+        memcpy(&v3, lanes[3] + i, 8);
+        c0 = __crc32cd(c0, v0);
+        c1 = __crc32cd(c1, v1);
+        c2 = __crc32cd(c2, v2);
+        c3 = __crc32cd(c3, v3);
+    }
+
+    const uint8_t *p = lanes[3] + lane_len;
+    size_t rest = last_len - lane_len;
+    for (; rest >= 8; p += 8, rest -= 8) {
+        uint64_t v;
+        memcpy(&v, p, 8);
+        c3 = __crc32cd(c3, v);
+    }
+    while (rest--)
+        c3 = __crc32cb(c3, *p++);
+
+    crc[0] = c0;
+    crc[1] = c1;
+    crc[2] = c2;
+    crc[3] = c3;
+}
+
+static bool crc32c_hw_supported(void)
+{
+    return (getauxval(AT_HWCAP) & HWCAP_CRC32) != 0;
+}
+
+#define CRC32C_HW_NAME "ARMv8"
+
+#endif
+
+static pthread_once_t crc32c_once = PTHREAD_ONCE_INIT;
+static crc32c_lanes_fn crc32c_lanes = crc32c_lanes_sw;
+static const char *crc32c_impl = "table";
+
+static void crc32c_init(void)
+{
+    crc32c_table_init();
+#ifdef CRC32C_HW_NAME
+    if (crc32c_hw_supported()) {
+        crc32c_lanes = crc32c_lanes_hw;
+        crc32c_impl = CRC32C_HW_NAME;
+    }
+#endif
+}
+
+const char *hash_crc32c_impl(void)
+{
+    pthread_once(&crc32c_once, crc32c_init);
+    return crc32c_impl;
+}
+
+bool hash_crc32c_set_hw(bool hw)
+{
+    pthread_once(&crc32c_once, crc32c_init);
+#ifdef CRC32C_HW_NAME
+    if (hw && !crc32c_hw_supported())
+        return false;
+    crc32c_lanes = hw ? crc32c_lanes_hw : crc32c_lanes_sw;
+    crc32c_impl = hw ? CRC32C_HW_NAME : "table";
+    return true;
+#else
+    return !hw;
+#endif
+}
+
+const char *chunk_digest_name(chunk_digest_t type)
+{
+    if (type >= CHUNK_DIGEST_COUNT)
+        return "unknown";
+    return chunk_digest_names[type];
+}
+
+bool chunk_digest_parse(const char *name, chunk_digest_t *type)
+{
+    for (int t = 0; name && t < CHUNK_DIGEST_COUNT; t++) {
+        if (strcasecmp(name, chunk_digest_names[t]) == 0) {
+            *type = (chunk_digest_t)t;
+            return true;
+        }
+    }
+    return false;
+}
+
+size_t chunk_digest_size(chunk_digest_t type)
+{
+    switch (type) {
+    case CHUNK_DIGEST_SHA256: return SHA256_DIGEST_SIZE;
+    case CHUNK_DIGEST_CRC32C: return CRC32C_LANES * sizeof(uint32_t);
+    default:                  return 0;
+    }
+}
+
+bool hash_chunk(chunk_digest_t type, const void *data, size_t len,
+                uint8_t digest[CHUNK_DIGEST_SIZE])
+{
+    if (type == CHUNK_DIGEST_SHA256)
+        return hash_buffer(HASH_SHA256, data, len, digest, CHUNK_DIGEST_SIZE);
+    if (type != CHUNK_DIGEST_CRC32C)
+        return false;
+
+    pthread_once(&crc32c_once, crc32c_init);
+
+    /* Equal lanes of whole words; the last one takes what is left */
+    size_t lane_len = (len / CRC32C_LANES) & ~(size_t)7;
+    const uint8_t *lanes[CRC32C_LANES];
+    for (int l = 0; l < CRC32C_LANES; l++)
+        lanes[l] = (const uint8_t *)data + l * lane_len;
+
+    uint32_t crc[CRC32C_LANES] = { ~0U, ~0U, ~0U, ~0U };
+    crc32c_lanes(lanes, lane_len, len - (CRC32C_LANES - 1) * lane_len, crc);
+
+    memset(digest, 0, CHUNK_DIGEST_SIZE);
+    for (int l = 0; l < CRC32C_LANES; l++) {
+        uint32_t v = ~crc[l];
+        digest[l * 4]     = v;
+        digest[l * 4 + 1] = v >> 8;
+        digest[l * 4 + 2] = v >> 16;
+        digest[l * 4 + 3] = v >> 24;
+    }
+    return true;
+}
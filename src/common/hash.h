@@ -3,7 +3,9 @@
  * Francesco Lauritano
  * SPDX-License-Identifier: GPL-3.0-or-later
  *
- * Compute MD5, SHA-1, SHA-256, SHA-512 hashes
+ * Compute MD5, SHA-1, SHA-256, SHA-512 hashes and check them against
+ * checksum files published next to an image, plus fast chunk digests for
+ * readback and manifests
  */
 
 #ifndef RUFUS_HASH_H
@@ -29,6 +31,20 @@ typedef enum {
 #define SHA512_DIGEST_SIZE  64
 #define MAX_DIGEST_SIZE     SHA512_DIGEST_SIZE
 
+/* Result of checking an image against its checksum file */
+typedef enum {
+    HASH_CHECK_NONE = 0,        /* No checksum file lists the image */
+    HASH_CHECK_VERIFIED,
+    HASH_CHECK_MISMATCH,
+} hash_check_t;
+
+/* Expected digest of an image taken from a checksum file beside it */
+typedef struct {
+    hash_type_t type;
+    char expected[MAX_DIGEST_SIZE * 2 + 1];
+    char *source;               /* Checksum file name */
+} hash_sidecar_t;
+
 /* Progress callback for file hashing */
 typedef void (*hash_progress_callback_t)(
     uint64_t bytes_processed,
@@ -36,6 +52,9 @@ typedef void (*hash_progress_callback_t)(
     void *user_data
 );
 
+/* Incremental hashing context */
+typedef struct hash_ctx hash_ctx_t;
+
 /* Get human-readable name for hash type */
 const char *hash_type_name(hash_type_t type);
 
@@ -46,11 +65,38 @@ size_t hash_digest_size(hash_type_t type);
 bool hash_buffer(hash_type_t type, const void *data, size_t len,
                  uint8_t *digest, size_t digest_len);
 
+/* Incremental hashing: new, update any number of times, final, free */
+hash_ctx_t *hash_ctx_new(hash_type_t type);
+bool hash_ctx_update(hash_ctx_t *ctx, const void *data, size_t len);
+bool hash_ctx_final(hash_ctx_t *ctx, uint8_t *digest, size_t digest_len);
+void hash_ctx_free(hash_ctx_t *ctx);
+
 /* Hash a file with optional progress callback */
 bool hash_file(hash_type_t type, const char *path,
                uint8_t *digest, size_t digest_len,
                hash_progress_callback_t progress_cb, void *user_data);
 
+/* Hash a file with several algorithms in a single read; digests[i] receives
+ * the digest of types[i] */
+bool hash_file_multi(const hash_type_t *types, int count, const char *path,
+                     uint8_t (*digests)[MAX_DIGEST_SIZE],
+                     hash_progress_callback_t progress_cb, void *user_data);
+
+/* Find the strongest digest for image_path in SHA256SUMS, <image>.sha256,
+ * CHECKSUM and similar files in its directory. NULL if none lists it. */
+hash_sidecar_t *hash_sidecar_find(const char *image_path);
+void hash_sidecar_free(hash_sidecar_t *sidecar);
+
+/* Parse checksum file contents fetched from elsewhere into best, keeping the
+ * stronger digest. True if source listed image with a stronger digest. */
+bool hash_sidecar_parse(const char *text, size_t len, const char *source, const char *image,
+                        hash_sidecar_t *best);
+
+/* SHA-256 of a file as hex (caller frees), checking it against sidecar
+ * (may be NULL) in the same read */
+char *hash_file_checked(const char *path, const hash_sidecar_t *sidecar, hash_check_t *check,
+                        hash_progress_callback_t progress_cb, void *user_data);
+
 /* Convert digest to hex string (caller provides buffer of digest_len*2+1) */
 void hash_digest_to_hex(const uint8_t *digest, size_t digest_len, char *hex);
 
@@ -61,4 +107,40 @@ bool hash_verify_hex(const uint8_t *digest, size_t digest_len, const char *expec
 char *hash_file_hex(hash_type_t type, const char *path,
                     hash_progress_callback_t progress_cb, void *user_data);
 
+/* Digest of one written chunk, for readback, Merkle leaves and delta
+ * detection. New manifests take the process-wide chunk_digest setting and
+ * record it, so later checks use whichever digest each stick was written
+ * with. Whole-image digests are always SHA-256.
+ */
+typedef enum {
+    CHUNK_DIGEST_SHA256 = 0,
+    CHUNK_DIGEST_CRC32C,        /* CRC32C of 4 interleaved lanes, 16 bytes */
+    CHUNK_DIGEST_COUNT
+} chunk_digest_t;
+
+/* Room for any chunk digest; shorter ones are zero padded */
+#define CHUNK_DIGEST_SIZE  SHA256_DIGEST_SIZE
+
+/* Name used in config and manifests ("sha256", "crc32c") */
+const char *chunk_digest_name(chunk_digest_t type);
+
+/* Look up a chunk digest by name; false if unknown */
+bool chunk_digest_parse(const char *name, chunk_digest_t *type);
+
+/* Significant bytes of a chunk digest */
+size_t chunk_digest_size(chunk_digest_t type);
+
+/* Digest a chunk into digest, zero padded to CHUNK_DIGEST_SIZE */
+bool hash_chunk(chunk_digest_t type, const void *data, size_t len,
+                uint8_t digest[CHUNK_DIGEST_SIZE]);
+
+/* CRC32C implementation picked for this CPU ("SSE4.2", "ARMv8", "table") */
+const char *hash_crc32c_impl(void);
+
+/* Switch between the hardware and table CRC32C (for comparisons). Returns
+ * false if the CPU lacks the hardware one. Not thread safe against
+ * concurrent digests.
+ */
+bool hash_crc32c_set_hw(bool hw);
+
 #endif /* RUFUS_HASH_H */
@@ -0,0 +1,727 @@
+/*
+ * Rufux - Job Engine Implementation
+ * Francesco Lauritano
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ *
+ * Each worker owns one deque per priority. Jobs submitted from a worker go
+ * to the back of its own deque and are taken LIFO by the owner; idle workers
+ * steal from the front of other deques. Jobs submitted from other threads go
+ * through a shared injection queue. A worker always looks for the highest
+ * priority job anywhere before taking a lower priority one.
+ *
+ * Writes and background jobs may occupy at most all workers but one, so an
+ * analysis job never waits behind a long write. Background jobs are capped
+ * again below that and always leave a worker for writes, so a long hash
+ * never holds up a write.
+ */
+
+#define _GNU_SOURCE
+#include "jobs.h"
+#include "../platform/platform.h"
+#include <glib.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define JOBS_MIN_THREADS 4
+
+/* Enough for one analysis, one write and one background job */
+#define JOBS_MIN_POOL    3
+#define JOBS_MAX_THREADS 64
+
+struct job_token {
+    atomic_int refs;
+    atomic_bool cancelled;
+};
+
+typedef struct {
+    job_t *head;
+    job_t *tail;
+} job_deque_t;
+
+struct job {
+    atomic_int refs;
+    job_func_t func;
+    job_done_func_t done;
+    void *data;
+    job_priority_t priority;
+    job_token_t *token;
+
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    job_status_t status;
+
+    /* Unmet dependencies, plus one until submitted */
+    atomic_int pending;
+    atomic_bool dep_failed;
+    job_t **dependents;
+    int dependent_count;
+    int dependent_capacity;
+
+    uint64_t due_ms;
+
+    /* Deque / delayed list links */
+    job_t *prev;
+    job_t *next;
+};
+
+typedef struct {
+    pthread_t thread;
+    pthread_mutex_t lock;
+    job_deque_t queues[JOB_PRIO_COUNT];
+    int index;
+} worker_t;
+
+static struct {
+    pthread_mutex_t init_lock;
+    worker_t *workers;
+    atomic_int worker_count;    /* Read by workers without locking */
+
+    pthread_mutex_t inject_lock;
+    job_deque_t inject[JOB_PRIO_COUNT];
+
+    /* Sleep/wake; epoch changes whenever a worker might find new work */
+    pthread_mutex_t sleep_lock;
+    pthread_cond_t wake;
+    uint64_t epoch;
+    job_t *delayed;   /* Sorted by due_ms */
+    bool stop;
+
+    atomic_int queued;
+    atomic_int running;
+    atomic_int low_busy;        /* Write and background jobs running */
+    atomic_int background_busy;
+} pool = {
+    .init_lock = PTHREAD_MUTEX_INITIALIZER,
+    .inject_lock = PTHREAD_MUTEX_INITIALIZER,
+    .sleep_lock = PTHREAD_MUTEX_INITIALIZER,
+    .wake = PTHREAD_COND_INITIALIZER,
+};
+
+static __thread worker_t *current_worker;
+
+static uint64_t now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* ============== Deques ============== */
+
+static void deque_push_back(job_deque_t *q, job_t *job)
+{
+    job->next = NULL;
+    job->prev = q->tail;
+    if (q->tail)
+        q->tail->next = job;
+    else
+        q->head = job;
+    q->tail = job;
+}
+
+static job_t *deque_pop_front(job_deque_t *q)
+{
+    job_t *job = q->head;
+    if (!job)
+        return NULL;
+    q->head = job->next;
+    if (q->head)
+        q->head->prev = NULL;
+    else
+        q->tail = NULL;
+    job->next = job->prev = NULL;
+    return job;
+}
+
+static job_t *deque_pop_back(job_deque_t *q)
+{
+    job_t *job = q->tail;
+    if (!job)
+        return NULL;
+    q->tail = job->prev;
+    if (q->tail)
+        q->tail->next = NULL;
+    else
+        q->head = NULL;
+    job->next = job->prev = NULL;
+    return job;
+}
+
+/* ============== Scheduling ============== */
+
+/* Wake idle workers. Caller must hold sleep_lock. */
+static void notify_locked(void)
+{
+    pool.epoch++;
+    pthread_cond_broadcast(&pool.wake);
+}
+
+static void notify(void)
+{
+    pthread_mutex_lock(&pool.sleep_lock);
+    notify_locked();
+    pthread_mutex_unlock(&pool.sleep_lock);
+}
+
+static void push_job(job_t *job)
+{
+    pthread_mutex_lock(&job->lock);
+    job->status = JOB_STATUS_QUEUED;
+    pthread_mutex_unlock(&job->lock);
+
+    atomic_fetch_add(&pool.queued, 1);
+
+    worker_t *w = current_worker;
+    if (w) {
+        pthread_mutex_lock(&w->lock);
+        deque_push_back(&w->queues[job->priority], job);
+        pthread_mutex_unlock(&w->lock);
+    } else {
+        pthread_mutex_lock(&pool.inject_lock);
+        deque_push_back(&pool.inject[job->priority], job);
+        pthread_mutex_unlock(&pool.inject_lock);
+    }
+}
+
+/* Insert into the delayed list. Caller must hold sleep_lock. */
+static void add_delayed_locked(job_t *job)
+{
+    job_t **link = &pool.delayed;
+    while (*link && (*link)->due_ms <= job->due_ms)
+        link = &(*link)->next;
+    job->next = *link;
+    *link = job;
+}
+
+/* Move due delayed jobs to the queues. Caller must hold sleep_lock. */
+static bool promote_delayed_locked(uint64_t now)
+{
+    bool promoted = false;
+    while (pool.delayed && pool.delayed->due_ms <= now) {
+        job_t *job = pool.delayed;
+        pool.delayed = job->next;
+        job->next = NULL;
+        push_job(job);
+        promoted = true;
+    }
+    if (promoted)
+        notify_locked();
+    return promoted;
+}
+
+/* Drop one hold on a job; the last one queues it */
+static void release_pending(job_t *job)
+{
+    if (atomic_fetch_sub(&job->pending, 1) != 1)
+        return;
+
+    if (job->due_ms > now_ms()) {
+        pthread_mutex_lock(&pool.sleep_lock);
+        add_delayed_locked(job);
+        notify_locked();
+        pthread_mutex_unlock(&pool.sleep_lock);
+        return;
+    }
+
+    push_job(job);
+    notify();
+}
+
+static job_t *take_at(worker_t *self, job_priority_t prio)
+{
+    job_t *job;
+
+    pthread_mutex_lock(&self->lock);
+    job = deque_pop_back(&self->queues[prio]);
+    pthread_mutex_unlock(&self->lock);
+    if (job)
+        return job;
+
+    pthread_mutex_lock(&pool.inject_lock);
+    job = deque_pop_front(&pool.inject[prio]);
+    pthread_mutex_unlock(&pool.inject_lock);
+    if (job)
+        return job;
+
+    int count = atomic_load(&pool.worker_count);
+    for (int i = 1; i < count; i++) {
+        worker_t *victim = &pool.workers[(self->index + i) % count];
+        pthread_mutex_lock(&victim->lock);
+        job = deque_pop_front(&victim->queues[prio]);
+        pthread_mutex_unlock(&victim->lock);
+        if (job)
+            return job;
+    }
+
+    return NULL;
+}
+
+/* Take one of limit slots counted by busy; false when all are taken */
+static bool claim_slot(atomic_int *busy, int limit)
+{
+    int current = atomic_load(busy);
+    do {
+        if (current >= limit)
+            return false;
+    } while (!atomic_compare_exchange_weak(busy, &current, current + 1));
+    return true;
+}
+
+/* Background jobs get half of what a write and an analysis job leave */
+static int background_limit(int workers)
+{
+    int limit = (workers - 2) / 2;
+    return limit > 0 ? limit : 1;
+}
+
+static job_t *take_job(worker_t *self)
+{
+    int workers = atomic_load(&pool.worker_count);
+
+    for (int prio = 0; prio < JOB_PRIO_COUNT; prio++) {
+        if (prio == JOB_PRIO_ANALYSIS) {
+            job_t *job = take_at(self, prio);
+            if (job)
+                return job;
+            continue;
+        }
+
+        /* Claim the slots before looking */
+        bool background = prio == JOB_PRIO_BACKGROUND;
+        if (background && !claim_slot(&pool.background_busy, background_limit(workers)))
+            return NULL;
+        if (!claim_slot(&pool.low_busy, workers - 1)) {
+            if (background)
+                atomic_fetch_sub(&pool.background_busy, 1);
+            return NULL;
+        }
+
+        job_t *job = take_at(self, prio);
+        if (job)
+            return job;
+
+        atomic_fetch_sub(&pool.low_busy, 1);
+        if (background)
+            atomic_fetch_sub(&pool.background_busy, 1);
+    }
+
+    return NULL;
+}
+
+/* ============== Execution ============== */
+
+static gboolean deliver_done(gpointer data)
+{
+    job_t *job = data;
+    job->done(job, job->data);
+    job_unref(job);
+    return G_SOURCE_REMOVE;
+}
+
+static void finish_job(job_t *job, job_status_t status)
+{
+    pthread_mutex_lock(&job->lock);
+    job->status = status;
+    job_t **dependents = job->dependents;
+    int count = job->dependent_count;
+    job->dependents = NULL;
+    job->dependent_count = 0;
+    pthread_cond_broadcast(&job->cond);
+    pthread_mutex_unlock(&job->lock);
+
+    for (int i = 0; i < count; i++) {
+        if (status != JOB_STATUS_DONE)
+            atomic_store(&dependents[i]->dep_failed, true);
+        release_pending(dependents[i]);
+        job_unref(dependents[i]);
+    }
+    free(dependents);
+
+    if (job->done)
+        g_main_context_invoke(NULL, deliver_done, job_ref(job));
+}
+
+static void run_job(job_t *job)
+{
+    job_status_t status;
+
+    atomic_fetch_sub(&pool.queued, 1);
+
+    if (job_is_cancelled(job) || atomic_load(&job->dep_failed)) {
+        status = JOB_STATUS_CANCELLED;
+    } else {
+        pthread_mutex_lock(&job->lock);
+        job->status = JOB_STATUS_RUNNING;
+        pthread_mutex_unlock(&job->lock);
+
+        atomic_fetch_add(&pool.running, 1);
+        bool ok = job->func(job, job->data);
+        atomic_fetch_sub(&pool.running, 1);
+
+        if (ok)
+            status = JOB_STATUS_DONE;
+        else
+            status = job_is_cancelled(job) ? JOB_STATUS_CANCELLED : JOB_STATUS_FAILED;
+    }
+
+    if (job->priority != JOB_PRIO_ANALYSIS)
+        atomic_fetch_sub(&pool.low_busy, 1);
+    if (job->priority == JOB_PRIO_BACKGROUND)
+        atomic_fetch_sub(&pool.background_busy, 1);
+
+    finish_job(job, status);
+    job_unref(job);
+    notify();
+}
+
+static void *worker_main(void *arg)
+{
+    worker_t *self = arg;
+    current_worker = self;
+
+    for (;;) {
+        pthread_mutex_lock(&pool.sleep_lock);
+        uint64_t epoch = pool.epoch;
+        bool stop = pool.stop;
+        promote_delayed_locked(now_ms());
+        pthread_mutex_unlock(&pool.sleep_lock);
+
+        if (stop)
+            break;
+
+        job_t *job = take_job(self);
+        if (job) {
+            run_job(job);
+            continue;
+        }
+
+        pthread_mutex_lock(&pool.sleep_lock);
+        if (pool.epoch == epoch && !pool.stop) {
+            if (pool.delayed) {
+                uint64_t due = pool.delayed->due_ms;
+                struct timespec ts;
+                clock_gettime(CLOCK_MONOTONIC, &ts);
+                uint64_t wait_ms = due > now_ms() ? due - now_ms() : 0;
+                ts.tv_sec += wait_ms / 1000;
+                ts.tv_nsec += (wait_ms % 1000) * 1000000;
+                if (ts.tv_nsec >= 1000000000) {
+                    ts.tv_sec++;
+                    ts.tv_nsec -= 1000000000;
+                }
+                pthread_cond_timedwait(&pool.wake, &pool.sleep_lock, &ts);
+            } else {
+                pthread_cond_wait(&pool.wake, &pool.sleep_lock);
+            }
+        }
+        pthread_mutex_unlock(&pool.sleep_lock);
+    }
+
+    return NULL;
+}
+
+/* ============== Pool ============== */
+
+void jobs_init(int threads)
+{
+    pthread_mutex_lock(&pool.init_lock);
+    if (pool.workers) {
+        pthread_mutex_unlock(&pool.init_lock);
+        return;
+    }
+
+    if (threads <= 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        threads = cpus > JOBS_MIN_THREADS ? (int)cpus : JOBS_MIN_THREADS;
+    }
+    if (threads < JOBS_MIN_POOL)
+        threads = JOBS_MIN_POOL;
+    if (threads > JOBS_MAX_THREADS)
+        threads = JOBS_MAX_THREADS;
+
+    /* Delayed waits use the monotonic clock */
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_destroy(&pool.wake);
+    pthread_cond_init(&pool.wake, &attr);
+    pthread_condattr_destroy(&attr);
+
+    pool.stop = false;
+    pool.workers = calloc(threads, sizeof(worker_t));
+    if (!pool.workers) {
+        pthread_mutex_unlock(&pool.init_lock);
+        return;
+    }
+
+    atomic_store(&pool.worker_count, threads);
+    for (int i = 0; i < threads; i++) {
+        pool.workers[i].index = i;
+        pthread_mutex_init(&pool.workers[i].lock, NULL);
+    }
+
+    int started = 0;
+    for (int i = 0; i < threads; i++) {
+        if (pthread_create(&pool.workers[i].thread, NULL, worker_main, &pool.workers[i]) != 0) {
+            rufus_error("Failed to start job worker %d", i);
+            break;
+        }
+        started++;
+    }
+    atomic_store(&pool.worker_count, started);
+
+    rufus_log("Job engine: %d workers", started);
+    pthread_mutex_unlock(&pool.init_lock);
+}
+
+void jobs_shutdown(void)
+{
+    pthread_mutex_lock(&pool.init_lock);
+    if (!pool.workers) {
+        pthread_mutex_unlock(&pool.init_lock);
+        return;
+    }
+
+    pthread_mutex_lock(&pool.sleep_lock);
+    pool.stop = true;
+    notify_locked();
+    pthread_mutex_unlock(&pool.sleep_lock);
+
+    int count = atomic_load(&pool.worker_count);
+    for (int i = 0; i < count; i++)
+        pthread_join(pool.workers[i].thread, NULL);
+
+    /* Cancel what never ran so waiters wake and the jobs are freed.
+     * Finishing a job can release its dependents into the queues, so
+     * repeat until nothing is left. */
+    for (job_t *job = NULL;; job = NULL) {
+        pthread_mutex_lock(&pool.sleep_lock);
+        if (pool.delayed) {
+            job = pool.delayed;
+            pool.delayed = job->next;
+            job->next = NULL;
+        }
+        pthread_mutex_unlock(&pool.sleep_lock);
+
+        for (int prio = 0; !job && prio < JOB_PRIO_COUNT; prio++) {
+            pthread_mutex_lock(&pool.inject_lock);
+            job = deque_pop_front(&pool.inject[prio]);
+            pthread_mutex_unlock(&pool.inject_lock);
+            for (int i = 0; !job && i < count; i++)
+                job = deque_pop_front(&pool.workers[i].queues[prio]);
+            if (job)
+                atomic_fetch_sub(&pool.queued, 1);
+        }
+
+        if (!job)
+            break;
+        finish_job(job, JOB_STATUS_CANCELLED);
+        job_unref(job);
+    }
+
+    for (int i = 0; i < count; i++)
+        pthread_mutex_destroy(&pool.workers[i].lock);
+
+    free(pool.workers);
+    pool.workers = NULL;
+    atomic_store(&pool.worker_count, 0);
+    pthread_mutex_unlock(&pool.init_lock);
+}
+
+void jobs_get_stats(int *workers, int *running, int *queued)
+{
+    if (workers)
+        *workers = atomic_load(&pool.worker_count);
+    if (running)
+        *running = atomic_load(&pool.running);
+    if (queued)
+        *queued = atomic_load(&pool.queued);
+}
+
+/* ============== Tokens ============== */
+
+job_token_t *job_token_new(void)
+{
+    job_token_t *token = calloc(1, sizeof(job_token_t));
+    if (token)
+        atomic_init(&token->refs, 1);
+    return token;
+}
+
+job_token_t *job_token_ref(job_token_t *token)
+{
+    if (token)
+        atomic_fetch_add(&token->refs, 1);
+    return token;
+}
+
+void job_token_unref(job_token_t *token)
+{
+    if (token && atomic_fetch_sub(&token->refs, 1) == 1)
+        free(token);
+}
+
+void job_token_cancel(job_token_t *token)
+{
+    if (token)
+        atomic_store(&token->cancelled, true);
+}
+
+bool job_token_is_cancelled(const job_token_t *token)
+{
+    return token && atomic_load(&token->cancelled);
+}
+
+/* ============== Jobs ============== */
+
+job_t *job_new(job_func_t func, void *data, job_priority_t priority)
+{
+    if (!func || priority >= JOB_PRIO_COUNT)
+        return NULL;
+
+    job_t *job = calloc(1, sizeof(job_t));
+    if (!job)
+        return NULL;
+
+    job->token = job_token_new();
+    if (!job->token) {
+        free(job);
+        return NULL;
+    }
+
+    atomic_init(&job->refs, 1);
+    atomic_init(&job->pending, 1);
+    job->func = func;
+    job->data = data;
+    job->priority = priority;
+    job->status = JOB_STATUS_PENDING;
+    pthread_mutex_init(&job->lock, NULL);
+    pthread_cond_init(&job->cond, NULL);
+
+    return job;
+}
+
+job_t *job_ref(job_t *job)
+{
+    if (job)
+        atomic_fetch_add(&job->refs, 1);
+    return job;
+}
+
+void job_unref(job_t *job)
+{
+    if (!job || atomic_fetch_sub(&job->refs, 1) != 1)
+        return;
+
+    job_token_unref(job->token);
+    pthread_mutex_destroy(&job->lock);
+    pthread_cond_destroy(&job->cond);
+    free(job->dependents);
+    free(job);
+}
+
+void job_set_done(job_t *job, job_done_func_t done)
+{
+    if (job)
+        job->done = done;
+}
+
+void job_set_token(job_t *job, job_token_t *token)
+{
+    if (!job || !token)
+        return;
+    job_token_unref(job->token);
+    job->token = job_token_ref(token);
+}
+
+void job_depends_on(job_t *job, job_t *dep)
+{
+    if (!job || !dep)
+        return;
+
+    pthread_mutex_lock(&dep->lock);
+
+    if (dep->status >= JOB_STATUS_DONE) {
+        if (dep->status != JOB_STATUS_DONE)
+            atomic_store(&job->dep_failed, true);
+        pthread_mutex_unlock(&dep->lock);
+        return;
+    }
+
+    if (dep->dependent_count == dep->dependent_capacity) {
+        int capacity = dep->dependent_capacity ? dep->dependent_capacity * 2 : 4;
+        job_t **grown = realloc(dep->dependents, capacity * sizeof(job_t *));
+        if (!grown) {
+            /* Running without the dependency could see its result unset */
+            atomic_store(&job->dep_failed, true);
+            pthread_mutex_unlock(&dep->lock);
+            rufus_error("Out of memory tracking a job dependency");
+            return;
+        }
+        dep->dependents = grown;
+        dep->dependent_capacity = capacity;
+    }
+
+    atomic_fetch_add(&job->pending, 1);
+    dep->dependents[dep->dependent_count++] = job_ref(job);
+    pthread_mutex_unlock(&dep->lock);
+}
+
+void job_submit(job_t *job)
+{
+    if (!job)
+        return;
+
+    jobs_init(0);
+    release_pending(job);
+}
+
+void job_submit_delayed(job_t *job, unsigned int delay_ms)
+{
+    if (!job)
+        return;
+
+    job->due_ms = now_ms() + delay_ms;
+    job_submit(job);
+}
+
+void job_cancel(job_t *job)
+{
+    if (job)
+        job_token_cancel(job->token);
+}
+
+bool job_is_cancelled(const job_t *job)
+{
+    return job && job_token_is_cancelled(job->token);
+}
+
+job_token_t *job_get_token(job_t *job)
+{
+    return job ? job->token : NULL;
+}
+
+void job_wait(job_t *job)
+{
+    if (!job)
+        return;
+
+    pthread_mutex_lock(&job->lock);
+    while (job->status < JOB_STATUS_DONE)
+        pthread_cond_wait(&job->cond, &job->lock);
+    pthread_mutex_unlock(&job->lock);
+}
+
+job_status_t job_get_status(job_t *job)
+{
+    if (!job)
+        return JOB_STATUS_CANCELLED;
+
+    pthread_mutex_lock(&job->lock);
+    job_status_t status = job->status;
+    pthread_mutex_unlock(&job->lock);
+    return status;
+}
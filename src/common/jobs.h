@@ -0,0 +1,96 @@
+/*
+ * Rufux - Job Engine
+ * Francesco Lauritano
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ *
+ * Shared worker pool for all background work. Jobs run by priority on a
+ * bounded set of work-stealing workers, can be cancelled through tokens,
+ * can wait for other jobs, and report completion on the GLib main context.
+ */
+
+#ifndef RUFUS_JOBS_H
+#define RUFUS_JOBS_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* Lower value runs first */
+typedef enum {
+    JOB_PRIO_ANALYSIS = 0,  /* UI is waiting on the result */
+    JOB_PRIO_WRITE,         /* Device writes and formatting */
+    JOB_PRIO_BACKGROUND,    /* Hashing, housekeeping */
+    JOB_PRIO_COUNT
+} job_priority_t;
+
+typedef enum {
+    JOB_STATUS_PENDING = 0, /* Waiting for submission or dependencies */
+    JOB_STATUS_QUEUED,
+    JOB_STATUS_RUNNING,
+    JOB_STATUS_DONE,
+    JOB_STATUS_FAILED,
+    JOB_STATUS_CANCELLED,
+} job_status_t;
+
+typedef struct job job_t;
+typedef struct job_token job_token_t;
+
+/* Work function, runs on a worker. Return false on failure. */
+typedef bool (*job_func_t)(job_t *job, void *data);
+
+/* Completion callback, runs on the main context after the job finished,
+ * failed or was cancelled (check job_get_status()) */
+typedef void (*job_done_func_t)(job_t *job, void *data);
+
+/* Start the pool with the given worker count (0 = one per CPU, at least 4;
+ * never fewer than 3). Called implicitly with 0 on first submission.
+ */
+void jobs_init(int threads);
+
+/* Stop the workers after their current job. Queued and delayed jobs are
+ * finished as cancelled, so their waiters and done callbacks still run. */
+void jobs_shutdown(void);
+
+/* Current pool load */
+void jobs_get_stats(int *workers, int *running, int *queued);
+
+/* Cancellation tokens can be shared by several jobs */
+job_token_t *job_token_new(void);
+job_token_t *job_token_ref(job_token_t *token);
+void job_token_unref(job_token_t *token);
+void job_token_cancel(job_token_t *token);
+bool job_token_is_cancelled(const job_token_t *token);
+
+/* Create a job (one reference owned by the caller) */
+job_t *job_new(job_func_t func, void *data, job_priority_t priority);
+job_t *job_ref(job_t *job);
+void job_unref(job_t *job);
+
+/* Setup, before submission */
+void job_set_done(job_t *job, job_done_func_t done);
+void job_set_token(job_t *job, job_token_t *token);
+
+/* Run job only after dep finished; if dep fails or is cancelled, or the
+ * dependency cannot be recorded, job is cancelled too */
+void job_depends_on(job_t *job, job_t *dep);
+
+/* Queue a job; consumes the caller's reference (take one with job_ref()
+ * first to wait on or cancel the job later) */
+void job_submit(job_t *job);
+
+/* Queue a job once delay_ms has passed */
+void job_submit_delayed(job_t *job, unsigned int delay_ms);
+
+/* Request cancellation. A queued job is dropped; a running job should poll
+ * job_is_cancelled() */
+void job_cancel(job_t *job);
+bool job_is_cancelled(const job_t *job);
+
+/* The job's cancellation token (borrowed) */
+job_token_t *job_get_token(job_t *job);
+
+/* Block until the job finished (does not wait for its done callback) */
+void job_wait(job_t *job);
+
+job_status_t job_get_status(job_t *job);
+
+#endif /* RUFUS_JOBS_H */
@@ -0,0 +1,435 @@
+/*
+ * Rufux - Buffer Kernels Implementation
+ * Francesco Lauritano
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ *
+ * The test pattern is a sequence of little-endian 64-bit words; word n is
+ * the splitmix64 finalizer of (seed + n * golden ratio). Each word only
+ * depends on its index, which keeps generation embarrassingly parallel.
+ *
+ * Vector variants only handle whole blocks; heads and tails go through the
+ * scalar code. RUFUX_KERNELS=scalar|sse2|avx2|avx512 forces a level.
+ */
+
+#define _GNU_SOURCE
+#include "kernels.h"
+#include "../platform/platform.h"
+#include <endian.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define KERNELS_X86 1
+#include <immintrin.h>
+#endif
+
+#define PATTERN_GOLDEN  0x9E3779B97F4A7C15ULL
+#define PATTERN_MUL1    0xBF58476D1CE4E5B9ULL
+#define PATTERN_MUL2    0x94D049BB133111EBULL
+
+/* Scratch size for pattern_check */
+#define PATTERN_CHUNK   4096
+
+typedef struct {
+    bool (*is_zero)(const uint8_t *buf, size_t len);
+    size_t (*first_diff)(const uint8_t *a, const uint8_t *b, size_t len);
+    /* Write 'words' pattern words starting at word index 'index' */
+    void (*fill_words)(uint8_t *out, size_t words, uint64_t seed, uint64_t index);
+} kernel_ops_t;
+
+static const char *level_names[] = {
+    [KERNEL_SCALAR] = "scalar",
+    [KERNEL_SSE2]   = "sse2",
+    [KERNEL_AVX2]   = "avx2",
+    [KERNEL_AVX512] = "avx512",
+};
+
+static kernel_ops_t ops;
+static kernel_level_t current_level = KERNEL_SCALAR;
+static pthread_once_t init_once = PTHREAD_ONCE_INIT;
+
+/* ============== Scalar ============== */
+
+static inline uint64_t pattern_word(uint64_t seed, uint64_t index)
+{
+    uint64_t z = seed + index * PATTERN_GOLDEN;
+    z = (z ^ (z >> 30)) * PATTERN_MUL1;
+    z = (z ^ (z >> 27)) * PATTERN_MUL2;
+    return z ^ (z >> 31);
+}
+
+static bool is_zero_scalar(const uint8_t *buf, size_t len)
+{
+    size_t i = 0;
+
+    for (; i + 8 <= len; i += 8) {
+        uint64_t w;
+        memcpy(&w, buf + i, 8);
+        if (w)
+            return false;
+    }
+    for (; i < len; i++) {
+        if (buf[i])
+            return false;
+    }
+    return true;
+}
+
+static size_t first_diff_scalar(const uint8_t *a, const uint8_t *b, size_t len)
+{
+    size_t i = 0;
+
+    for (; i + 8 <= len; i += 8) {
+        uint64_t wa, wb;
+        memcpy(&wa, a + i, 8);
+        memcpy(&wb, b + i, 8);
+        if (wa != wb)
+            break;
+    }
+    for (; i < len; i++) {
+        if (a[i] != b[i])
+            return i;
+    }
+    return len;
+}
+
+static void fill_words_scalar(uint8_t *out, size_t words, uint64_t seed, uint64_t index)
+{
+    for (size_t i = 0; i < words; i++) {
+        uint64_t w = htole64(pattern_word(seed, index + i));
+        memcpy(out + i * 8, &w, 8);
+    }
+}
+
+#ifdef KERNELS_X86
+
+/* ============== SSE2 ============== */
+
+__attribute__((target("sse2")))
+static inline __m128i mul64_sse2(__m128i a, __m128i b)
+{
+    __m128i lo = _mm_mul_epu32(a, b);
+    __m128i hi_lo = _mm_mul_epu32(_mm_srli_epi64(a, 32), b);
+    __m128i lo_hi = _mm_mul_epu32(a, _mm_srli_epi64(b, 32));
+    return _mm_add_epi64(lo, _mm_slli_epi64(_mm_add_epi64(hi_lo, lo_hi), 32));
+}
+
+__attribute__((target("sse2")))
+static bool is_zero_sse2(const uint8_t *buf, size_t len)
+{
+    const __m128i zero = _mm_setzero_si128();
+    size_t i = 0;
+
+    for (; i + 64 <= len; i += 64) {
+        __m128i acc = _mm_or_si128(
+            _mm_or_si128(_mm_loadu_si128((const __m128i *)(buf + i)),
+                         _mm_loadu_si128((const __m128i *)(buf + i + 16))),
+            _mm_or_si128(_mm_loadu_si128((const __m128i *)(buf + i + 32)),
+                         _mm_loadu_si128((const __m128i *)(buf + i + 48))));
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(acc, zero)) != 0xFFFF)
+            return false;
+    }
+    return is_zero_scalar(buf + i, len - i);
+}
+
+__attribute__((target("sse2")))
+static size_t first_diff_sse2(const uint8_t *a, const uint8_t *b, size_t len)
+{
+    size_t i = 0;
+
+    for (; i + 16 <= len; i += 16) {
+        __m128i va = _mm_loadu_si128((const __m128i *)(a + i));
+        __m128i vb = _mm_loadu_si128((const __m128i *)(b + i));
+        unsigned int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(va, vb));
+        if (mask != 0xFFFF)
+            return i + __builtin_ctz(~mask);
+    }
+    return i + first_diff_scalar(a + i, b + i, len - i);
+}
+
+__attribute__((target("sse2")))
+static void fill_words_sse2(uint8_t *out, size_t words, uint64_t seed, uint64_t index)
+{
+    const __m128i mul1 = _mm_set1_epi64x((long long)PATTERN_MUL1);
+    const __m128i mul2 = _mm_set1_epi64x((long long)PATTERN_MUL2);
+    const __m128i step = _mm_set1_epi64x((long long)(2 * PATTERN_GOLDEN));
+    __m128i z = _mm_set_epi64x((long long)(seed + (index + 1) * PATTERN_GOLDEN),
+                               (long long)(seed + index * PATTERN_GOLDEN));
+    size_t i = 0;
+
+    for (; i + 2 <= words; i += 2) {
+        __m128i x = z;
+        x = mul64_sse2(_mm_xor_si128(x, _mm_srli_epi64(x, 30)), mul1);
+        x = mul64_sse2(_mm_xor_si128(x, _mm_srli_epi64(x, 27)), mul2);
+        x = _mm_xor_si128(x, _mm_srli_epi64(x, 31));
+        _mm_storeu_si128((__m128i *)(out + i * 8), x);
+        z = _mm_add_epi64(z, step);
+    }
+    fill_words_scalar(out + i * 8, words - i, seed, index + i);
+}
+
+/* ============== AVX2 ============== */
+
+__attribute__((target("avx2")))
+static inline __m256i mul64_avx2(__m256i a, __m256i b)
+{
+    __m256i lo = _mm256_mul_epu32(a, b);
+    __m256i hi_lo = _mm256_mul_epu32(_mm256_srli_epi64(a, 32), b);
+    __m256i lo_hi = _mm256_mul_epu32(a, _mm256_srli_epi64(b, 32));
+    return _mm256_add_epi64(lo, _mm256_slli_epi64(_mm256_add_epi64(hi_lo, lo_hi), 32));
+}
+
+__attribute__((target("avx2")))
+static bool is_zero_avx2(const uint8_t *buf, size_t len)
+{
+    size_t i = 0;
+
+    for (; i + 128 <= len; i += 128) {
+        __m256i acc = _mm256_or_si256(
+            _mm256_or_si256(_mm256_loadu_si256((const __m256i *)(buf + i)),
+                            _mm256_loadu_si256((const __m256i *)(buf + i + 32))),
+            _mm256_or_si256(_mm256_loadu_si256((const __m256i *)(buf + i + 64)),
+                            _mm256_loadu_si256((const __m256i *)(buf + i + 96))));
+        if (!_mm256_testz_si256(acc, acc))
+            return false;
+    }
+    return is_zero_scalar(buf + i, len - i);
+}
+
+__attribute__((target("avx2")))
+static size_t first_diff_avx2(const uint8_t *a, const uint8_t *b, size_t len)
+{
+    size_t i = 0;
+
+    for (; i + 32 <= len; i += 32) {
+        __m256i va = _mm256_loadu_si256((const __m256i *)(a + i));
+        __m256i vb = _mm256_loadu_si256((const __m256i *)(b + i));
+        unsigned int mask = (unsigned int)_mm256_movemask_epi8(_mm256_cmpeq_epi8(va, vb));
+        if (mask != 0xFFFFFFFFu)
+            return i + __builtin_ctz(~mask);
+    }
+    return i + first_diff_scalar(a + i, b + i, len - i);
+}
+
+__attribute__((target("avx2")))
+static void fill_words_avx2(uint8_t *out, size_t words, uint64_t seed, uint64_t index)
+{
+    const __m256i mul1 = _mm256_set1_epi64x((long long)PATTERN_MUL1);
+    const __m256i mul2 = _mm256_set1_epi64x((long long)PATTERN_MUL2);
+    const __m256i step = _mm256_set1_epi64x((long long)(4 * PATTERN_GOLDEN));
+    __m256i z = _mm256_set_epi64x((long long)(seed + (index + 3) * PATTERN_GOLDEN),
+                                  (long long)(seed + (index + 2) * PATTERN_GOLDEN),
+                                  (long long)(seed + (index + 1) * PATTERN_GOLDEN),
+                                  (long long)(seed + index * PATTERN_GOLDEN));
+    size_t i = 0;
+
+    for (; i + 4 <= words; i += 4) {
+        __m256i x = z;
+        x = mul64_avx2(_mm256_xor_si256(x, _mm256_srli_epi64(x, 30)), mul1);
+        x = mul64_avx2(_mm256_xor_si256(x, _mm256_srli_epi64(x, 27)), mul2);
+        x = _mm256_xor_si256(x, _mm256_srli_epi64(x, 31));
+        _mm256_storeu_si256((__m256i *)(out + i * 8), x);
+        z = _mm256_add_epi64(z, step);
+    }
+    fill_words_scalar(out + i * 8, words - i, seed, index + i);
+}
+
+/* ============== AVX-512 (F + BW + DQ) ============== */
+
+__attribute__((target("avx512f,avx512bw,avx512dq")))
+static bool is_zero_avx512(const uint8_t *buf, size_t len)
+{
+    size_t i = 0;
+
+    for (; i + 256 <= len; i += 256) {
+        __m512i acc = _mm512_or_si512(
+            _mm512_or_si512(_mm512_loadu_si512(buf + i), _mm512_loadu_si512(buf + i + 64)),
+            _mm512_or_si512(_mm512_loadu_si512(buf + i + 128), _mm512_loadu_si512(buf + i + 192)));
+        if (_mm512_test_epi64_mask(acc, acc))
+            return false;
+    }
+    return is_zero_scalar(buf + i, len - i);
+}
+
+__attribute__((target("avx512f,avx512bw,avx512dq")))
+static size_t first_diff_avx512(const uint8_t *a, const uint8_t *b, size_t len)
+{
+    size_t i = 0;
+
+    for (; i + 64 <= len; i += 64) {
+        __mmask64 ne = _mm512_cmpneq_epi8_mask(_mm512_loadu_si512(a + i),
+                                               _mm512_loadu_si512(b + i));
+        if (ne)
+            return i + __builtin_ctzll(ne);
+    }
+    return i + first_diff_scalar(a + i, b + i, len - i);
+}
+
+__attribute__((target("avx512f,avx512bw,avx512dq")))
+static void fill_words_avx512(uint8_t *out, size_t words, uint64_t seed, uint64_t index)
+{
+    const __m512i mul1 = _mm512_set1_epi64((long long)PATTERN_MUL1);
+    const __m512i mul2 = _mm512_set1_epi64((long long)PATTERN_MUL2);
+    const __m512i step = _mm512_set1_epi64((long long)(8 * PATTERN_GOLDEN));
+    __m512i z = _mm512_add_epi64(
+        _mm512_set1_epi64((long long)(seed + index * PATTERN_GOLDEN)),
+        _mm512_mullo_epi64(_mm512_set_epi64(7, 6, 5, 4, 3, 2, 1, 0),
+                           _mm512_set1_epi64((long long)PATTERN_GOLDEN)));
+    size_t i = 0;
+
+    for (; i + 8 <= words; i += 8) {
+        __m512i x = z;
+        x = _mm512_mullo_epi64(_mm512_xor_si512(x, _mm512_srli_epi64(x, 30)), mul1);
+        x = _mm512_mullo_epi64(_mm512_xor_si512(x, _mm512_srli_epi64(x, 27)), mul2);
+        x = _mm512_xor_si512(x, _mm512_srli_epi64(x, 31));
+        _mm512_storeu_si512(out + i * 8, x);
+        z = _mm512_add_epi64(z, step);
+    }
+    fill_words_scalar(out + i * 8, words - i, seed, index + i);
+}
+
+#endif /* KERNELS_X86 */
+
+/* ============== Dispatch ============== */
+
+bool kernels_level_supported(kernel_level_t level)
+{
+    switch (level) {
+    case KERNEL_SCALAR:
+        return true;
+#ifdef KERNELS_X86
+    case KERNEL_SSE2:
+        __builtin_cpu_init();
+        return __builtin_cpu_supports("sse2");
+    case KERNEL_AVX2:
+        __builtin_cpu_init();
+        return __builtin_cpu_supports("avx2");
+    case KERNEL_AVX512:
+        __builtin_cpu_init();
+        return __builtin_cpu_supports("avx512f") &&
+               __builtin_cpu_supports("avx512bw") &&
+               __builtin_cpu_supports("avx512dq");
+#endif
+    default:
+        return false;
+    }
+}
+
+static void select_level(kernel_level_t level)
+{
+    static const kernel_ops_t table[KERNEL_LEVEL_COUNT] = {
+        [KERNEL_SCALAR] = { is_zero_scalar, first_diff_scalar, fill_words_scalar },
+#ifdef KERNELS_X86
+        [KERNEL_SSE2]   = { is_zero_sse2, first_diff_sse2, fill_words_sse2 },
+        [KERNEL_AVX2]   = { is_zero_avx2, first_diff_avx2, fill_words_avx2 },
+        [KERNEL_AVX512] = { is_zero_avx512, first_diff_avx512, fill_words_avx512 },
+#endif
+    };
+
+    ops = table[level];
+    current_level = level;
+}
+
+static void kernels_init(void)
+{
+    kernel_level_t best = KERNEL_SCALAR;
+    for (int level = KERNEL_LEVEL_COUNT - 1; level > KERNEL_SCALAR; level--) {
+        if (kernels_level_supported(level)) {
+            best = level;
+            break;
+        }
+    }
+
+    const char *forced = getenv("RUFUX_KERNELS");
+    if (forced) {
+        for (int level = 0; level < KERNEL_LEVEL_COUNT; level++) {
+            if (strcmp(forced, level_names[level]) == 0 && kernels_level_supported(level))
+                best = level;
+        }
+    }
+
+    select_level(best);
+    rufus_log("Buffer kernels: %s", level_names[best]);
+}
+
+kernel_level_t kernels_level(void)
+{
+    pthread_once(&init_once, kernels_init);
+    return current_level;
+}
+
+const char *kernels_level_name(kernel_level_t level)
+{
+    if (level >= KERNEL_LEVEL_COUNT)
+        return "unknown";
+    return level_names[level];
+}
+
+bool kernels_set_level(kernel_level_t level)
+{
+    pthread_once(&init_once, kernels_init);
+    if (level >= KERNEL_LEVEL_COUNT || !kernels_level_supported(level))
+        return false;
+    select_level(level);
+    return true;
+}
+
+/* ============== Public Kernels ============== */
+
+bool buf_is_zero(const void *buf, size_t len)
+{
+    pthread_once(&init_once, kernels_init);
+    return ops.is_zero(buf, len);
+}
+
+size_t buf_first_diff(const void *a, const void *b, size_t len)
+{
+    pthread_once(&init_once, kernels_init);
+    return ops.first_diff(a, b, len);
+}
+
+void pattern_fill(void *buf, size_t len, uint64_t seed, uint64_t offset)
+{
+    pthread_once(&init_once, kernels_init);
+
+    uint8_t *out = buf;
+
+    /* Bytes before the first word boundary */
+    while (len > 0 && (offset & 7)) {
+        *out++ = (uint8_t)(pattern_word(seed, offset >> 3) >> ((offset & 7) * 8));
+        offset++;
+        len--;
+    }
+
+    size_t words = len / 8;
+    ops.fill_words(out, words, seed, offset >> 3);
+    out += words * 8;
+    offset += words * 8;
+    len -= words * 8;
+
+    while (len > 0) {
+        *out++ = (uint8_t)(pattern_word(seed, offset >> 3) >> ((offset & 7) * 8));
+        offset++;
+        len--;
+    }
+}
+
+size_t pattern_check(const void *buf, size_t len, uint64_t seed, uint64_t offset)
+{
+    uint8_t expected[PATTERN_CHUNK];
+    const uint8_t *in = buf;
+    size_t done = 0;
+
+    while (done < len) {
+        size_t n = len - done < PATTERN_CHUNK ? len - done : PATTERN_CHUNK;
+        pattern_fill(expected, n, seed, offset + done);
+
+        size_t diff = buf_first_diff(in + done, expected, n);
+        if (diff < n)
+            return done + diff;
+        done += n;
+    }
+
+    return len;
+}
@@ -0,0 +1,54 @@
+/*
+ * Rufux - Buffer Kernels
+ * Francesco Lauritano
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ *
+ * Byte-crunching primitives used for sparse skipping, verify, delta
+ * reflash and test patterns. Scalar, SSE2, AVX2 and AVX-512 variants are
+ * selected once from the CPU features at first use.
+ */
+
+#ifndef RUFUS_KERNELS_H
+#define RUFUS_KERNELS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+typedef enum {
+    KERNEL_SCALAR = 0,
+    KERNEL_SSE2,
+    KERNEL_AVX2,
+    KERNEL_AVX512,
+    KERNEL_LEVEL_COUNT
+} kernel_level_t;
+
+/* Level in use (the best the CPU supports unless overridden) */
+kernel_level_t kernels_level(void);
+
+const char *kernels_level_name(kernel_level_t level);
+
+/* Check whether the CPU can run a level */
+bool kernels_level_supported(kernel_level_t level);
+
+/* Switch to a specific level (for comparisons). Returns false if the CPU
+ * lacks it. Not thread safe against concurrent kernel calls.
+ */
+bool kernels_set_level(kernel_level_t level);
+
+/* True if all len bytes are zero */
+bool buf_is_zero(const void *buf, size_t len);
+
+/* Index of the first differing byte, or len if equal */
+size_t buf_first_diff(const void *a, const void *b, size_t len);
+
+/* Fill with the pseudo-random test pattern for (seed, offset). The pattern
+ * depends only on the absolute byte position, so any region of a device
+ * can be generated or checked on its own.
+ */
+void pattern_fill(void *buf, size_t len, uint64_t seed, uint64_t offset);
+
+/* Index of the first byte not matching the pattern, or len if it matches */
+size_t pattern_check(const void *buf, size_t len, uint64_t seed, uint64_t offset);
+
+#endif /* RUFUS_KERNELS_H */
@@ -0,0 +1,275 @@
+/*
+ * Rufux - Memory Budget Implementation
+ * Francesco Lauritano
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ *
+ * Buffers are never refused for being over budget: a write needs its chunk
+ * buffer to make progress at all, so the rings, which only add depth, are
+ * what gives way. Pressure is read from /proc/pressure/memory at most once
+ * a second. A job's part is recomputed on every query, so a job that starts
+ * next to a running write takes half from the write's rings at their next
+ * retune.
+ */
+
+#define _GNU_SOURCE
+#include "membudget.h"
+#include "config.h"
+#include "utils.h"
+#include "../platform/platform.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MIN_BUDGET          (256ULL * 1024 * 1024)
+#define PSI_INTERVAL_NS     1000000000LL
+
+/* PSI "some" avg10 thresholds, in percent of wall time stalled */
+#define PSI_MODERATE        5.0
+#define PSI_SEVERE          20.0
+
+struct membudget_job {
+    char *name;
+    uint64_t used;          /* All pools */
+    uint64_t readahead;     /* Of which ring slots */
+    uint64_t peak;
+    int rings;
+};
+
+static pthread_mutex_t budget_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t used[MEM_POOL_COUNT];
+static uint64_t peak[MEM_POOL_COUNT];
+static int rings_open;
+static int jobs_open;
+
+static __thread membudget_job_t *thread_job;
+
+static double psi_some = -1;
+static int64_t psi_read_ns;
+static int psi_scale = 100;
+
+static const char *pool_names[] = {
+    [MEM_POOL_READAHEAD] = "readahead",
+    [MEM_POOL_WRITE]     = "write",
+    [MEM_POOL_VERIFY]    = "verify",
+    [MEM_POOL_EXTRACT]   = "extract",
+};
+
+uint64_t membudget_total(void)
+{
+    const rufus_config_t *cfg = config_get();
+    if (cfg->memory_budget_bytes)
+        return cfg->memory_budget_bytes;
+
+    long pages = sysconf(_SC_PHYS_PAGES);
+    long page_size = sysconf(_SC_PAGESIZE);
+    if (pages <= 0 || page_size <= 0)
+        return MIN_BUDGET;
+
+    /* The staging cache lives in /dev/shm and is not ours to hand out */
+    uint64_t half = (uint64_t)pages * page_size / 2;
+    uint64_t total = half > cfg->cache_bytes ? half - cfg->cache_bytes : 0;
+    return total > MIN_BUDGET ? total : MIN_BUDGET;
+}
+
+static void add_clamped(uint64_t *counter, int64_t bytes)
+{
+    if (bytes < 0 && (uint64_t)-bytes > *counter)
+        *counter = 0;
+    else
+        *counter += bytes;
+}
+
+static void charge_locked(mem_pool_t pool, int64_t bytes)
+{
+    add_clamped(&used[pool], bytes);
+    if (used[pool] > peak[pool])
+        peak[pool] = used[pool];
+
+    membudget_job_t *job = thread_job;
+    if (!job)
+        return;
+
+    add_clamped(&job->used, bytes);
+    if (pool == MEM_POOL_READAHEAD)
+        add_clamped(&job->readahead, bytes);
+    if (job->used > job->peak)
+        job->peak = job->used;
+}
+
+void membudget_charge(mem_pool_t pool, int64_t bytes)
+{
+    if (pool >= MEM_POOL_COUNT)
+        return;
+
+    pthread_mutex_lock(&budget_lock);
+    charge_locked(pool, bytes);
+    pthread_mutex_unlock(&budget_lock);
+}
+
+membudget_job_t *membudget_job_new(const char *name)
+{
+    membudget_job_t *job = calloc(1, sizeof(membudget_job_t));
+    if (!job)
+        return NULL;
+
+    job->name = strdup(name ? name : "Job");
+    if (!job->name) {
+        free(job);
+        return NULL;
+    }
+
+    pthread_mutex_lock(&budget_lock);
+    jobs_open++;
+    pthread_mutex_unlock(&budget_lock);
+    return job;
+}
+
+void membudget_job_free(membudget_job_t *job)
+{
+    if (!job)
+        return;
+
+    pthread_mutex_lock(&budget_lock);
+    if (jobs_open > 0)
+        jobs_open--;
+    uint64_t job_peak = job->peak;
+    pthread_mutex_unlock(&budget_lock);
+
+    rufus_log("%s: peak memory %llu MB", job->name, (unsigned long long)(job_peak >> 20));
+    free(job->name);
+    free(job);
+}
+
+membudget_job_t *membudget_set_thread_job(membudget_job_t *job)
+{
+    membudget_job_t *prev = thread_job;
+    thread_job = job;
+    return prev;
+}
+
+membudget_job_t *membudget_thread_job(void)
+{
+    return thread_job;
+}
+
+void *membudget_alloc(mem_pool_t pool, size_t size)
+{
+    void *ptr;
+    if (posix_memalign(&ptr, 4096, size) != 0)
+        return NULL;
+
+    membudget_charge(pool, (int64_t)size);
+    return ptr;
+}
+
+void membudget_free(mem_pool_t pool, void *ptr, size_t size)
+{
+    if (!ptr)
+        return;
+
+    free(ptr);
+    membudget_charge(pool, -(int64_t)size);
+}
+
+/* PSI "some avg10", or -1 when the kernel does not report it */
+static double read_psi(void)
+{
+    FILE *fp = fopen("/proc/pressure/memory", "r");
+    if (!fp)
+        return -1;
+
+    double avg10 = -1;
+    if (fscanf(fp, "some avg10=%lf", &avg10) != 1)
+        avg10 = -1;
+    fclose(fp);
+    return avg10;
+}
+
+/* Percentage of its share a ring may fill, refreshed from PSI */
+static int pressure_scale_locked(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    int64_t now = (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+    if (psi_read_ns && now - psi_read_ns < PSI_INTERVAL_NS)
+        return psi_scale;
+    psi_read_ns = now;
+
+    psi_some = read_psi();
+    int scale = psi_some >= PSI_SEVERE ? 25 : psi_some >= PSI_MODERATE ? 50 : 100;
+    if (scale != psi_scale)
+        rufus_log("Memory pressure %.1f%%, readahead rings at %d%% of their share",
+                  psi_some, scale);
+    psi_scale = scale;
+    return scale;
+}
+
+void membudget_ring_open(membudget_job_t *job)
+{
+    pthread_mutex_lock(&budget_lock);
+    rings_open++;
+    if (job)
+        job->rings++;
+    pthread_mutex_unlock(&budget_lock);
+}
+
+void membudget_ring_close(membudget_job_t *job)
+{
+    pthread_mutex_lock(&budget_lock);
+    if (rings_open > 0)
+        rings_open--;
+    if (job && job->rings > 0)
+        job->rings--;
+    pthread_mutex_unlock(&budget_lock);
+}
+
+uint64_t membudget_ring_share(membudget_job_t *job, uint64_t want)
+{
+    uint64_t total = membudget_total();
+
+    pthread_mutex_lock(&budget_lock);
+    uint64_t buffers = 0;
+    for (int i = 0; i < MEM_POOL_COUNT; i++) {
+        if (i != MEM_POOL_READAHEAD)
+            buffers += used[i];
+    }
+
+    uint64_t share = buffers < total ? (total - buffers) / (rings_open > 0 ? rings_open : 1) : 0;
+
+    /* The job's part, less its own buffers, split between its rings */
+    if (job) {
+        uint64_t part = total / (jobs_open > 0 ? jobs_open : 1);
+        uint64_t own = job->used - job->readahead;
+        part = own < part ? (part - own) / (job->rings > 0 ? job->rings : 1) : 0;
+        if (part < share)
+            share = part;
+    }
+    share = share / 100 * pressure_scale_locked();
+    pthread_mutex_unlock(&budget_lock);
+
+    return share < want ? share : want;
+}
+
+void membudget_log(void)
+{
+    uint64_t total = membudget_total();
+
+    pthread_mutex_lock(&budget_lock);
+    char line[256];
+    int len = snprintf(line, sizeof(line), "Memory budget %llu MB:",
+                       (unsigned long long)(total >> 20));
+    for (int i = 0; i < MEM_POOL_COUNT && len < (int)sizeof(line); i++)
+        len += snprintf(line + len, sizeof(line) - len, " %s %llu/%llu MB", pool_names[i],
+                        (unsigned long long)(used[i] >> 20),
+                        (unsigned long long)(peak[i] >> 20));
+    double some = psi_some;
+    pthread_mutex_unlock(&budget_lock);
+
+    if (some >= 0)
+        rufus_log("%s (now/peak), pressure %.1f%%", line, some);
+    else
+        rufus_log("%s (now/peak)", line);
+}
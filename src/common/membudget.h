@@ -0,0 +1,63 @@
+/*
+ * Rufux - Memory Budget
+ * Francesco Lauritano
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ *
+ * One process-wide budget for the large buffers of the I/O paths, so
+ * concurrent jobs cannot oversubscribe the host. Chunk buffers are always
+ * granted and counted; readahead rings share whatever is left between them
+ * and shrink further while the kernel reports memory pressure (PSI).
+ */
+
+#ifndef RUFUS_MEMBUDGET_H
+#define RUFUS_MEMBUDGET_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct membudget_job membudget_job_t;
+
+typedef enum {
+    MEM_POOL_READAHEAD = 0,     /* Image source rings */
+    MEM_POOL_WRITE,             /* Write and fan-out buffers */
+    MEM_POOL_VERIFY,            /* Readback, audit and manifest buffers */
+    MEM_POOL_EXTRACT,           /* File-copy buffers */
+    MEM_POOL_COUNT,
+} mem_pool_t;
+
+/* Budget in bytes: memory_budget_bytes, or half of RAM less the staging
+ * cache when that is 0 */
+uint64_t membudget_total(void);
+
+/* Grant for one job (name is copied, for the log). Free it when the job
+ * ends; its peak use is logged then. */
+membudget_job_t *membudget_job_new(const char *name);
+void membudget_job_free(membudget_job_t *job);
+
+/* Job charged for allocations made on the calling thread (NULL for none).
+ * Returns the previous one so callers can restore it. */
+membudget_job_t *membudget_set_thread_job(membudget_job_t *job);
+membudget_job_t *membudget_thread_job(void);
+
+/* Page-aligned buffer counted against pool and the thread's job (NULL on
+ * failure). Release it with membudget_free and the same size.
+ */
+void *membudget_alloc(mem_pool_t pool, size_t size);
+void membudget_free(mem_pool_t pool, void *ptr, size_t size);
+
+/* Count memory allocated elsewhere against pool and the thread's job
+ * (negative to release) */
+void membudget_charge(mem_pool_t pool, int64_t bytes);
+
+/* Readahead rings register while open, with the job they read for (may
+ * be NULL); each gets an equal share of what the buffers leave, capped at
+ * want and at its job's part, and scaled down under pressure
+ */
+void membudget_ring_open(membudget_job_t *job);
+void membudget_ring_close(membudget_job_t *job);
+uint64_t membudget_ring_share(membudget_job_t *job, uint64_t want);
+
+/* Log the budget, current and peak use per pool, and memory pressure */
+void membudget_log(void);
+
+#endif /* RUFUS_MEMBUDGET_H */
@@ -0,0 +1,445 @@
+/*
+ * Rufux - Stage Graph Implementation
+ * Francesco Lauritano
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ *
+ * The calling thread runs stages itself and helper jobs pull from the same
+ * ready set, so a graph always completes even when the pool has no free
+ * worker to lend. Helpers are only submitted for stages that are ready and
+ * return as soon as none are, so a linear chain holds no idle workers;
+ * finishing a stage submits helpers for the stages it unlocked.
+ */
+
+#define _GNU_SOURCE
+#include "stages.h"
+#include "config.h"
+#include "membudget.h"
+#include "utils.h"
+#include "../platform/platform.h"
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+typedef enum {
+    STAGE_WAITING = 0,
+    STAGE_RUNNING,
+    STAGE_DONE,
+    STAGE_FAILED,
+    STAGE_SKIPPED,
+} stage_state_t;
+
+struct stage {
+    char *name;
+    stage_func_t func;
+    void *data;
+    bool optional;
+
+    const char *resources[STAGE_MAX_RESOURCES];
+    int resource_count;
+
+    stage_t **deps;
+    int dep_count;
+
+    stage_state_t state;
+    double start;
+    double end;
+};
+
+/* Shared with helper jobs, which may start after the run is over */
+typedef struct {
+    atomic_int refs;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    stage_graph_t *graph;   /* NULL once the run is over */
+    int active;
+} helper_ctx_t;
+
+struct stage_graph {
+    char *name;
+    stage_t **stages;
+    int count;
+
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int running;
+    bool failed;
+    job_t *parent;
+    membudget_job_t *budget;
+
+    helper_ctx_t *helpers;  /* NULL when helpers could not be set up */
+    int parallel;
+    int queued;             /* Helpers submitted that have not started */
+};
+
+static double now_sec(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+stage_graph_t *stage_graph_new(const char *name)
+{
+    stage_graph_t *graph = calloc(1, sizeof(stage_graph_t));
+    if (!graph)
+        return NULL;
+
+    graph->name = strdup(name ? name : "operation");
+    pthread_mutex_init(&graph->lock, NULL);
+    pthread_cond_init(&graph->cond, NULL);
+    return graph;
+}
+
+void stage_graph_free(stage_graph_t *graph)
+{
+    if (!graph)
+        return;
+
+    for (int i = 0; i < graph->count; i++) {
+        free(graph->stages[i]->name);
+        free(graph->stages[i]->deps);
+        free(graph->stages[i]);
+    }
+
+    pthread_mutex_destroy(&graph->lock);
+    pthread_cond_destroy(&graph->cond);
+    free(graph->stages);
+    free(graph->name);
+    free(graph);
+}
+
+stage_t *stage_add(stage_graph_t *graph, const char *name, stage_func_t func, void *data)
+{
+    if (!graph || !func)
+        return NULL;
+
+    stage_t **grown = realloc(graph->stages, (graph->count + 1) * sizeof(stage_t *));
+    if (!grown)
+        return NULL;
+    graph->stages = grown;
+
+    stage_t *stage = calloc(1, sizeof(stage_t));
+    if (!stage)
+        return NULL;
+
+    stage->name = strdup(name);
+    stage->func = func;
+    stage->data = data;
+    graph->stages[graph->count++] = stage;
+    return stage;
+}
+
+void stage_depends_on(stage_t *stage, stage_t *dep)
+{
+    if (!stage || !dep)
+        return;
+
+    stage_t **grown = realloc(stage->deps, (stage->dep_count + 1) * sizeof(stage_t *));
+    if (!grown)
+        return;
+    stage->deps = grown;
+    stage->deps[stage->dep_count++] = dep;
+}
+
+void stage_use(stage_t *stage, const char *resource)
+{
+    if (stage && resource && stage->resource_count < STAGE_MAX_RESOURCES)
+        stage->resources[stage->resource_count++] = resource;
+}
+
+void stage_set_optional(stage_t *stage, bool optional)
+{
+    if (stage)
+        stage->optional = optional;
+}
+
+/* Caller must hold graph->lock */
+static bool resource_busy(stage_graph_t *graph, const stage_t *stage)
+{
+    for (int i = 0; i < graph->count; i++) {
+        const stage_t *other = graph->stages[i];
+        if (other->state != STAGE_RUNNING)
+            continue;
+        for (int a = 0; a < stage->resource_count; a++)
+            for (int b = 0; b < other->resource_count; b++)
+                if (strcmp(stage->resources[a], other->resources[b]) == 0)
+                    return true;
+    }
+    return false;
+}
+
+/* Pick a runnable stage, skipping those behind a failed dependency.
+ * Caller must hold graph->lock. */
+static stage_t *next_stage(stage_graph_t *graph, bool *pending)
+{
+    *pending = false;
+
+    for (int i = 0; i < graph->count; i++) {
+        stage_t *stage = graph->stages[i];
+        if (stage->state != STAGE_WAITING)
+            continue;
+
+        bool ready = true;
+        for (int d = 0; d < stage->dep_count; d++) {
+            stage_state_t dep_state = stage->deps[d]->state;
+            if (dep_state == STAGE_FAILED || dep_state == STAGE_SKIPPED) {
+                stage->state = STAGE_SKIPPED;
+                ready = false;
+                break;
+            }
+            if (dep_state != STAGE_DONE)
+                ready = false;
+        }
+
+        if (stage->state == STAGE_SKIPPED)
+            continue;
+
+        *pending = true;
+        if (ready && !resource_busy(graph, stage))
+            return stage;
+    }
+
+    return NULL;
+}
+
+static bool helper_job(job_t *job, void *data);
+
+/* Stages that could start right now. Caller must hold graph->lock. */
+static int count_ready(stage_graph_t *graph)
+{
+    int ready = 0;
+    for (int i = 0; i < graph->count; i++) {
+        stage_t *stage = graph->stages[i];
+        bool ok = stage->state == STAGE_WAITING && !resource_busy(graph, stage);
+        for (int d = 0; ok && d < stage->dep_count; d++)
+            ok = stage->deps[d]->state == STAGE_DONE;
+        ready += ok;
+    }
+    return ready;
+}
+
+/* Submit helpers for the ready stages the calling thread, which takes one
+ * itself, and the helpers already queued will not get to. Caller must hold
+ * graph->lock. */
+static void submit_helpers_locked(stage_graph_t *graph)
+{
+    helper_ctx_t *ctx = graph->helpers;
+    if (!ctx || graph->failed)
+        return;
+
+    int want = count_ready(graph) - 1 - graph->queued;
+    int room = graph->parallel - graph->running - 1 - graph->queued;
+    for (int i = 0; i < want && i < room; i++) {
+        job_t *job = job_new(helper_job, ctx, JOB_PRIO_WRITE);
+        if (!job)
+            break;
+        atomic_fetch_add(&ctx->refs, 1);
+        graph->queued++;
+        job_submit(job);
+    }
+}
+
+/* Run stages until none are left for this thread. A helper returns once
+ * nothing is ready; the caller of stage_graph_run waits for the rest. */
+static void run_stages(stage_graph_t *graph, bool helper)
+{
+    pthread_mutex_lock(&graph->lock);
+    if (helper && graph->queued > 0)
+        graph->queued--;
+
+    for (;;) {
+        if (!graph->failed && job_is_cancelled(graph->parent)) {
+            rufus_log("%s: cancelled", graph->name);
+            graph->failed = true;
+        }
+
+        bool pending = false;
+        stage_t *stage = graph->failed ? NULL : next_stage(graph, &pending);
+
+        if (!stage) {
+            if (graph->running == 0) {
+                if (pending && !graph->failed) {
+                    rufus_error("%s: stages can never become ready", graph->name);
+                    graph->failed = true;
+                }
+                break;
+            }
+            if (helper)
+                break;
+            pthread_cond_wait(&graph->cond, &graph->lock);
+            continue;
+        }
+
+        stage->state = STAGE_RUNNING;
+        stage->start = now_sec();
+        graph->running++;
+        pthread_mutex_unlock(&graph->lock);
+
+        /* Helpers and tools started by the stage watch the parent job and
+         * inherit its I/O class; buffers count against its memory grant */
+        const rufus_config_t *cfg = config_get();
+        job_token_t *prev = thread_set_cancel_token(job_get_token(graph->parent));
+        membudget_job_t *prev_budget = membudget_set_thread_job(graph->budget);
+        int prio = cfg->ioprio_class != IOPRIO_CLASS_NONE ?
+                   thread_ioprio_set(cfg->ioprio_class, cfg->ioprio_level) : -1;
+        bool ok = stage->func(stage->data);
+        thread_ioprio_restore(prio);
+        membudget_set_thread_job(prev_budget);
+        thread_set_cancel_token(prev);
+
+        pthread_mutex_lock(&graph->lock);
+        stage->end = now_sec();
+        stage->state = ok ? STAGE_DONE : STAGE_FAILED;
+        graph->running--;
+
+        if (!ok) {
+            if (stage->optional) {
+                rufus_log("%s: optional stage %s failed", graph->name, stage->name);
+            } else {
+                rufus_error("%s: stage %s failed", graph->name, stage->name);
+                graph->failed = true;
+            }
+        }
+
+        submit_helpers_locked(graph);
+        pthread_cond_broadcast(&graph->cond);
+    }
+
+    pthread_cond_broadcast(&graph->cond);
+    pthread_mutex_unlock(&graph->lock);
+}
+
+static void helper_ctx_unref(helper_ctx_t *ctx)
+{
+    if (atomic_fetch_sub(&ctx->refs, 1) != 1)
+        return;
+    pthread_mutex_destroy(&ctx->lock);
+    pthread_cond_destroy(&ctx->cond);
+    free(ctx);
+}
+
+static bool helper_job(job_t *job, void *data)
+{
+    (void)job;
+    helper_ctx_t *ctx = data;
+
+    pthread_mutex_lock(&ctx->lock);
+    stage_graph_t *graph = ctx->graph;
+    if (graph)
+        ctx->active++;
+    pthread_mutex_unlock(&ctx->lock);
+
+    if (graph) {
+        run_stages(graph, true);
+
+        pthread_mutex_lock(&ctx->lock);
+        ctx->active--;
+        pthread_cond_broadcast(&ctx->cond);
+        pthread_mutex_unlock(&ctx->lock);
+    }
+
+    helper_ctx_unref(ctx);
+    return true;
+}
+
+/* Longest chain of stage durations ending at each stage, by dependency */
+static void log_critical_path(stage_graph_t *graph, double wall)
+{
+    int n = graph->count;
+    double *cost = calloc(n, sizeof(double));
+    int *prev = calloc(n, sizeof(int));
+    if (!cost || !prev) {
+        free(cost);
+        free(prev);
+        return;
+    }
+
+    /* Stages are added after their dependencies, so one pass suffices */
+    int tail = -1;
+    for (int i = 0; i < n; i++) {
+        stage_t *stage = graph->stages[i];
+        prev[i] = -1;
+        for (int d = 0; d < stage->dep_count; d++) {
+            for (int j = 0; j < i; j++) {
+                if (graph->stages[j] == stage->deps[d] && cost[j] > (prev[i] >= 0 ? cost[prev[i]] : 0))
+                    prev[i] = j;
+            }
+        }
+        double duration = stage->end > stage->start ? stage->end - stage->start : 0;
+        cost[i] = duration + (prev[i] >= 0 ? cost[prev[i]] : 0);
+        if (tail < 0 || cost[i] > cost[tail])
+            tail = i;
+    }
+
+    if (tail >= 0) {
+        /* Walk back from the most expensive stage, print front to back */
+        int chain[64];
+        int length = 0;
+        for (int i = tail; i >= 0 && length < 64; i = prev[i])
+            chain[length++] = i;
+
+        char path[512] = "";
+        for (int k = length - 1; k >= 0; k--) {
+            stage_t *stage = graph->stages[chain[k]];
+            char item[128];
+            snprintf(item, sizeof(item), "%s%s %.1fs", k == length - 1 ? "" : " -> ",
+                     stage->name, stage->end > stage->start ? stage->end - stage->start : 0);
+            strncat(path, item, sizeof(path) - strlen(path) - 1);
+        }
+        rufus_log("%s: critical path %.1fs of %.1fs wall: %s",
+                  graph->name, cost[tail], wall, path);
+    }
+
+    free(cost);
+    free(prev);
+}
+
+bool stage_graph_run(stage_graph_t *graph, int parallel, job_t *parent)
+{
+    if (!graph)
+        return false;
+
+    graph->parent = parent;
+    graph->budget = membudget_thread_job();
+    graph->failed = false;
+
+    helper_ctx_t *ctx = calloc(1, sizeof(helper_ctx_t));
+    if (ctx) {
+        atomic_init(&ctx->refs, 1);
+        pthread_mutex_init(&ctx->lock, NULL);
+        pthread_cond_init(&ctx->cond, NULL);
+        ctx->graph = graph;
+    }
+
+    /* Helpers only add parallelism; this thread alone can finish the graph */
+    pthread_mutex_lock(&graph->lock);
+    graph->helpers = ctx;
+    graph->parallel = parallel;
+    graph->queued = 0;
+    submit_helpers_locked(graph);
+    pthread_mutex_unlock(&graph->lock);
+
+    double start = now_sec();
+    run_stages(graph, false);
+    double wall = now_sec() - start;
+
+    /* Helpers that start from now on find nothing to do */
+    if (ctx) {
+        pthread_mutex_lock(&graph->lock);
+        graph->helpers = NULL;
+        pthread_mutex_unlock(&graph->lock);
+
+        pthread_mutex_lock(&ctx->lock);
+        ctx->graph = NULL;
+        while (ctx->active > 0)
+            pthread_cond_wait(&ctx->cond, &ctx->lock);
+        pthread_mutex_unlock(&ctx->lock);
+        helper_ctx_unref(ctx);
+    }
+
+    log_critical_path(graph, wall);
+    return !graph->failed;
+}
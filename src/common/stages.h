@@ -0,0 +1,48 @@
+/*
+ * Rufux - Stage Graph
+ * Francesco Lauritano
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ *
+ * An operation is a set of named stages with dependencies and resources
+ * (a device, a partition, the source image). Stages whose dependencies are
+ * met and whose resources are free run concurrently; stages sharing a
+ * resource never overlap. After a run the critical path is logged.
+ */
+
+#ifndef RUFUS_STAGES_H
+#define RUFUS_STAGES_H
+
+#include "jobs.h"
+#include <stdbool.h>
+
+#define STAGE_MAX_RESOURCES 4
+
+typedef struct stage_graph stage_graph_t;
+typedef struct stage stage_t;
+
+/* Stage body. Return false to fail the operation. */
+typedef bool (*stage_func_t)(void *data);
+
+stage_graph_t *stage_graph_new(const char *name);
+void stage_graph_free(stage_graph_t *graph);
+
+/* Add a stage (the name is copied) */
+stage_t *stage_add(stage_graph_t *graph, const char *name, stage_func_t func, void *data);
+
+/* Stage runs only after dep succeeded */
+void stage_depends_on(stage_t *stage, stage_t *dep);
+
+/* Stage needs exclusive use of a resource while running */
+void stage_use(stage_t *stage, const char *resource);
+
+/* Optional stage: its failure is logged but does not fail the operation */
+void stage_set_optional(stage_t *stage, bool optional);
+
+/* Run the graph to completion on the calling thread, with up to
+ * parallel - 1 helper jobs from the job engine. No new stages start once
+ * a required stage fails or parent (may be NULL) is cancelled. Every
+ * stage is charged to the calling thread's memory grant.
+ */
+bool stage_graph_run(stage_graph_t *graph, int parallel, job_t *parent);
+
+#endif /* RUFUS_STAGES_H */
@@ -0,0 +1,275 @@
+/*
+ * Rufux - Flashing Throttle Implementation
+ * Francesco Lauritano
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ *
+ * The group sits at the top of the unified hierarchy so it does not depend
+ * on delegation from the service manager. io.max only accepts whole disks,
+ * so the write limit is set per stick as writes start and lifted again
+ * (wbps=max) when they end.
+ *
+ * As root the writes run in our own threads, so the process itself has to
+ * be in the group. memory is not a threaded controller, so it cannot be
+ * just the writing threads: the whole process joins while any stick is
+ * being written, GUI threads included, and goes back to its own cgroup
+ * when the last one is done. Page cache stays charged to the group it was
+ * dirtied in.
+ */
+
+#define _GNU_SOURCE
+#include "throttle.h"
+#include "config.h"
+#include "utils.h"
+#include "../platform/platform.h"
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+
+#define CGROUP_ROOT      "/sys/fs/cgroup"
+#define THROTTLE_CGROUP  CGROUP_ROOT "/rufux.flash"
+#define MAX_THROTTLED    64
+
+static pthread_mutex_t throttle_lock = PTHREAD_MUTEX_INITIALIZER;
+static dev_t throttled[MAX_THROTTLED];
+static int throttled_count;
+static dev_t released[MAX_THROTTLED];   /* Limits helpers still have to lift */
+static int released_count;
+static int writing;                     /* throttle_add_device calls not yet removed */
+static char origin[512];                /* Our own cgroup, to go back to */
+static bool ready;                      /* Group set up by us (root) */
+static bool joined;
+
+bool throttle_enabled(void)
+{
+    const rufus_config_t *cfg = config_get();
+    return cfg->write_bps || cfg->memory_high_bytes;
+}
+
+static bool write_cgroup_file(const char *name, const char *value)
+{
+    char path[256];
+    snprintf(path, sizeof(path), "%s/%s", THROTTLE_CGROUP, name);
+
+    FILE *fp = fopen(path, "w");
+    if (!fp)
+        return false;
+    bool ok = fputs(value, fp) >= 0;
+    ok = fclose(fp) == 0 && ok;
+    return ok;
+}
+
+static void format_io_max(char *buf, size_t size, dev_t dev, bool limited)
+{
+    if (limited)
+        snprintf(buf, size, "%u:%u wbps=%llu", major(dev), minor(dev),
+                 (unsigned long long)config_get()->write_bps);
+    else
+        snprintf(buf, size, "%u:%u wbps=max", major(dev), minor(dev));
+}
+
+/* Directory of the cgroup this process is in, from /proc/self/cgroup */
+static bool read_origin(void)
+{
+    FILE *fp = fopen("/proc/self/cgroup", "r");
+    if (!fp)
+        return false;
+
+    char line[512];
+    bool found = false;
+    while (!found && fgets(line, sizeof(line), fp)) {
+        if (strncmp(line, "0::", 3) != 0)
+            continue;
+        line[strcspn(line, "\n")] = '\0';
+        snprintf(origin, sizeof(origin), "%s%s/cgroup.procs", CGROUP_ROOT, line + 3);
+        found = true;
+    }
+    fclose(fp);
+    return found;
+}
+
+/* "0" moves the writing process, with all its threads */
+static bool move_process(const char *procs)
+{
+    FILE *fp = fopen(procs, "w");
+    if (!fp)
+        return false;
+    bool ok = fputs("0", fp) >= 0;
+    ok = fclose(fp) == 0 && ok;
+    return ok;
+}
+
+void throttle_init(void)
+{
+    if (!throttle_enabled() || !is_root())
+        return;
+
+    if (access(CGROUP_ROOT "/cgroup.controllers", F_OK) != 0) {
+        rufus_log("No cgroup v2 hierarchy; flashing is not throttled");
+        return;
+    }
+
+    FILE *fp = fopen(CGROUP_ROOT "/cgroup.subtree_control", "w");
+    if (fp) {
+        fputs("+io +memory", fp);
+        fclose(fp);
+    }
+
+    if (mkdir(THROTTLE_CGROUP, 0755) != 0 && errno != EEXIST) {
+        rufus_log("Cannot create %s: %s", THROTTLE_CGROUP, strerror(errno));
+        return;
+    }
+
+    const rufus_config_t *cfg = config_get();
+    if (cfg->memory_high_bytes) {
+        char value[32];
+        snprintf(value, sizeof(value), "%llu", (unsigned long long)cfg->memory_high_bytes);
+        if (!write_cgroup_file("memory.high", value))
+            rufus_log("Cannot set memory.high: %s", strerror(errno));
+    }
+
+    if (!read_origin()) {
+        rufus_log("Cannot tell which cgroup this process is in; flashing is not throttled");
+        return;
+    }
+
+    pthread_mutex_lock(&throttle_lock);
+    ready = true;
+    pthread_mutex_unlock(&throttle_lock);
+    rufus_log("Flashing throttled through %s", THROTTLE_CGROUP);
+}
+
+static void set_io_max(const char *device_path, dev_t dev, bool limited)
+{
+    char line[64];
+    format_io_max(line, sizeof(line), dev, limited);
+    if (!write_cgroup_file("io.max", line))
+        rufus_log("Cannot %s writes to %s: %s", limited ? "limit" : "unlimit", device_path,
+                  strerror(errno));
+}
+
+void throttle_add_device(const char *device_path)
+{
+    if (!throttle_enabled() || !device_path)
+        return;
+
+    struct stat st;
+    if (stat(device_path, &st) != 0 || !S_ISBLK(st.st_mode))
+        return;
+
+    pthread_mutex_lock(&throttle_lock);
+    bool known = false;
+    for (int i = 0; i < throttled_count; i++)
+        known = known || throttled[i] == st.st_rdev;
+    if (!known && throttled_count < MAX_THROTTLED)
+        throttled[throttled_count++] = st.st_rdev;
+    for (int i = 0; i < released_count; i++) {
+        if (released[i] == st.st_rdev)
+            released[i--] = released[--released_count];
+    }
+
+    writing++;
+    if (ready && !joined) {
+        if (move_process(THROTTLE_CGROUP "/cgroup.procs"))
+            joined = true;
+        else
+            rufus_log("Cannot join %s: %s", THROTTLE_CGROUP, strerror(errno));
+    }
+    bool direct = ready;
+    pthread_mutex_unlock(&throttle_lock);
+
+    if (direct && config_get()->write_bps)
+        set_io_max(device_path, st.st_rdev, true);
+}
+
+void throttle_remove_device(const char *device_path)
+{
+    if (!throttle_enabled() || !device_path)
+        return;
+
+    struct stat st;
+    if (stat(device_path, &st) != 0 || !S_ISBLK(st.st_mode))
+        return;
+
+    pthread_mutex_lock(&throttle_lock);
+    bool known = false;
+    for (int i = 0; i < throttled_count; i++) {
+        if (throttled[i] == st.st_rdev) {
+            throttled[i] = throttled[--throttled_count];
+            known = true;
+            break;
+        }
+    }
+
+    /* Without root the next helper lifts the limit */
+    if (known && !ready && released_count < MAX_THROTTLED)
+        released[released_count++] = st.st_rdev;
+
+    if (writing > 0)
+        writing--;
+    if (writing == 0 && joined) {
+        if (move_process(origin))
+            joined = false;
+        else
+            rufus_log("Cannot leave %s: %s", THROTTLE_CGROUP, strerror(errno));
+    }
+    bool direct = ready;
+    pthread_mutex_unlock(&throttle_lock);
+
+    if (known && direct && config_get()->write_bps)
+        set_io_max(device_path, st.st_rdev, false);
+}
+
+char *throttle_wrap_command(const char *cmd)
+{
+    if (!throttle_enabled() || !cmd)
+        return NULL;
+
+    /* Helpers outside a write run unthrottled, lifting any limits left
+     * behind; inside one as root they inherit the group */
+    pthread_mutex_lock(&throttle_lock);
+    if (joined || (writing == 0 && released_count == 0)) {
+        pthread_mutex_unlock(&throttle_lock);
+        return NULL;
+    }
+
+    /* Every step may fail (no cgroup v2, controllers unavailable); the
+     * helper then runs unthrottled */
+    size_t cap = strlen(cmd) + 512 + (size_t)(throttled_count + released_count) * 96;
+    char *script = malloc(cap);
+    if (!script) {
+        pthread_mutex_unlock(&throttle_lock);
+        return NULL;
+    }
+
+    int len = snprintf(script, cap,
+                       "{ echo +io +memory > %s/cgroup.subtree_control; mkdir -p %s; ",
+                       CGROUP_ROOT, THROTTLE_CGROUP);
+
+    const rufus_config_t *cfg = config_get();
+    if (cfg->memory_high_bytes)
+        len += snprintf(script + len, cap - len, "echo %llu > %s/memory.high; ",
+                        (unsigned long long)cfg->memory_high_bytes, THROTTLE_CGROUP);
+
+    for (int i = 0; cfg->write_bps && i < throttled_count + released_count; i++) {
+        bool limited = i < throttled_count;
+        char line[64];
+        format_io_max(line, sizeof(line), limited ? throttled[i] : released[i - throttled_count],
+                      limited);
+        len += snprintf(script + len, cap - len, "echo %s > %s/io.max; ", line,
+                        THROTTLE_CGROUP);
+    }
+    released_count = 0;
+    bool join = writing > 0;
+    pthread_mutex_unlock(&throttle_lock);
+
+    if (join)
+        len += snprintf(script + len, cap - len, "echo $$ > %s/cgroup.procs; ",
+                        THROTTLE_CGROUP);
+    snprintf(script + len, cap - len, "} 2>/dev/null; %s", cmd);
+    return script;
+}
@@ -0,0 +1,40 @@
+/*
+ * Rufux - Flashing Throttle
+ * Francesco Lauritano
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ *
+ * Keeps batch writes from starving the host: flashing runs in a cgroup v2
+ * group with an io.max write limit on every target stick and a memory.high
+ * limit on the page cache it may dirty. Helpers started through pkexec
+ * join the group themselves, since only root can set it up. As root the
+ * whole process is in the group while a stick is being written.
+ */
+
+#ifndef RUFUS_THROTTLE_H
+#define RUFUS_THROTTLE_H
+
+#include <stdbool.h>
+
+/* True when write_bps or memory_high_bytes is configured */
+bool throttle_enabled(void);
+
+/* Set up the cgroup (root only, after the configuration is final).
+ * Without root this is left to the helpers.
+ */
+void throttle_init(void);
+
+/* A write to device_path (a whole disk) starts: limit writes to it, and as
+ * root move this process into the group. Pair with throttle_remove_device,
+ * which lifts the limit and leaves the group after the last write.
+ */
+void throttle_add_device(const char *device_path);
+void throttle_remove_device(const char *device_path);
+
+/* Shell script for a privileged helper: cmd preceded by joining the group
+ * and applying the limits (caller frees), or NULL when the helper needs no
+ * preamble because throttling is off, no write is running or this process
+ * is already inside.
+ */
+char *throttle_wrap_command(const char *cmd);
+
+#endif /* RUFUS_THROTTLE_H */
@@ -4,12 +4,24 @@
  * SPDX-License-Identifier: GPL-3.0-or-later
  */
 
+#define _GNU_SOURCE
 #include "utils.h"
+#include "throttle.h"
 #include "../platform/platform.h"
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+
+/* From linux/ioprio.h, which older kernels do not install */
+#define IOPRIO_CLASS_SHIFT  13
+#define IOPRIO_WHO_PROCESS  1
 
 bool command_exists(const char *cmd)
 {
@@ -43,21 +55,214 @@ char *run_command(const char *cmd)
     return output;
 }
 
-int run_privileged(const char *cmd)
+static __thread job_token_t *cancel_token;
+
+job_token_t *thread_set_cancel_token(job_token_t *token)
+{
+    job_token_t *prev = cancel_token;
+    cancel_token = token;
+    return prev;
+}
+
+bool thread_cancelled(void)
+{
+    return job_token_is_cancelled(cancel_token);
+}
+
+/* Helpers started by spawn_privileged(), each with the write end of its
+ * control pipe. The read end stays open here too, for the helper to open
+ * through /proc. */
+#define MAX_HELPERS 64
+
+typedef struct {
+    pid_t pid;
+    int ctl[2];
+} helper_t;
+
+static pthread_mutex_t helpers_lock = PTHREAD_MUTEX_INITIALIZER;
+static helper_t helpers[MAX_HELPERS];
+
+static helper_t *find_helper(pid_t pid)
+{
+    for (int i = 0; i < MAX_HELPERS; i++) {
+        if (helpers[i].pid == pid)
+            return &helpers[i];
+    }
+    return NULL;
+}
+
+/* Root side of a helper: a new session of its own, and a watcher that
+ * kills that whole session once the control pipe reports EOF. The command
+ * is passed as $1 so it needs no quoting. */
+#define HELPER_WRAPPER \
+    "exec setsid -w sh -c '" \
+    "( read -r _ <&9; kill -KILL 0 ) 9</proc/%d/fd/%d </dev/null & " \
+    "sh -c \"$1\"; rc=$?; kill $! 2>/dev/null; exit $rc' sh \"$1\""
+
+void kill_privileged(pid_t pid)
 {
-    if (is_root()) {
-        return system(cmd);
+    if (pid <= 0)
+        return;
+
+    /* Closing the control pipe makes the helper kill itself, even once
+     * pkexec has taken it out of our reach */
+    pthread_mutex_lock(&helpers_lock);
+    helper_t *helper = find_helper(pid);
+    if (helper && helper->ctl[1] >= 0) {
+        close(helper->ctl[1]);
+        helper->ctl[1] = -1;
+    }
+    pthread_mutex_unlock(&helpers_lock);
+
+    /* Before pkexec has switched to root, or when we are root, the group
+     * can be killed directly */
+    pid_t target = getpgid(pid) == pid ? -pid : pid;
+    if (kill(target, SIGKILL) != 0 && errno != ESRCH && errno != EPERM)
+        rufus_log("Warning: failed to kill helper %d: %s", (int)pid, strerror(errno));
+}
+
+pid_t poll_privileged(pid_t pid, int *status)
+{
+    pid_t ret;
+    while ((ret = waitpid(pid, status, WNOHANG)) < 0 && errno == EINTR)
+        ;
+    if (ret == 0)
+        return 0;
+
+    pthread_mutex_lock(&helpers_lock);
+    helper_t *helper = find_helper(pid);
+    if (helper) {
+        for (int i = 0; i < 2; i++) {
+            if (helper->ctl[i] >= 0)
+                close(helper->ctl[i]);
+        }
+        helper->pid = 0;
+    }
+    pthread_mutex_unlock(&helpers_lock);
+    return ret;
+}
+
+int wait_privileged(pid_t pid)
+{
+    if (pid <= 0)
+        return -1;
+
+    int status = 0;
+    bool killed = false;
+    for (;;) {
+        pid_t ret = poll_privileged(pid, &status);
+        if (ret == pid)
+            return killed ? -1 : status;
+        if (ret < 0)
+            return -1;
+
+        if (!killed && thread_cancelled()) {
+            rufus_log("Cancelled, killing helper %d", (int)pid);
+            kill_privileged(pid);
+            killed = true;
+        }
+
+        usleep(CANCEL_POLL_MS * 1000);
     }
+}
 
-    const char *pkexec = get_pkexec_path();
-    if (!pkexec) {
-        rufus_error("pkexec not found, cannot run privileged command");
+int run_privileged(const char *cmd)
+{
+    pid_t pid = spawn_privileged(cmd, NULL, NULL);
+    if (pid < 0)
         return -1;
+    return wait_privileged(pid);
+}
+
+pid_t spawn_privileged(const char *cmd, int *in_fd, int *out_fd)
+{
+    const char *pkexec = NULL;
+    if (!is_root()) {
+        pkexec = get_pkexec_path();
+        if (!pkexec) {
+            rufus_error("pkexec not found, cannot run privileged command");
+            return -1;
+        }
+    }
+
+    int in_pipe[2] = { -1, -1 };
+    int out_pipe[2] = { -1, -1 };
+    int ctl_pipe[2] = { -1, -1 };
+    if ((in_fd && pipe2(in_pipe, O_CLOEXEC) != 0) ||
+        (out_fd && pipe2(out_pipe, O_CLOEXEC) != 0) ||
+        pipe2(ctl_pipe, O_CLOEXEC) != 0) {
+        rufus_error("Failed to create pipe");
+        goto fail;
+    }
+
+    /* Helpers join the flashing cgroup before running cmd */
+    char *wrapped = throttle_wrap_command(cmd);
+    if (wrapped)
+        cmd = wrapped;
+
+    char wrapper[512];
+    snprintf(wrapper, sizeof(wrapper), HELPER_WRAPPER, (int)getpid(), ctl_pipe[0]);
+
+    pthread_mutex_lock(&helpers_lock);
+    helper_t *helper = find_helper(0);
+    pid_t pid = helper ? fork() : -1;
+    if (pid < 0) {
+        pthread_mutex_unlock(&helpers_lock);
+        rufus_error(helper ? "Failed to fork" : "Too many helpers running");
+        free(wrapped);
+        goto fail;
+    }
+
+    if (pid == 0) {
+        /* The wrapper gives the command a session of its own; a group of
+         * our own as well lets a cancel before pkexec's switch reach it.
+         * pkexec's text agent needs the terminal, which a background group
+         * cannot read. */
+        if (!pkexec || !isatty(STDIN_FILENO))
+            setpgid(0, 0);
+
+        /* dup2 clears O_CLOEXEC on the new descriptors */
+        if (in_fd)
+            dup2(in_pipe[0], STDIN_FILENO);
+        if (out_fd) {
+            dup2(out_pipe[1], STDOUT_FILENO);
+            dup2(out_pipe[1], STDERR_FILENO);
+        }
+
+        if (pkexec)
+            execl(pkexec, "pkexec", "sh", "-c", wrapper, "sh", cmd, (char *)NULL);
+        else
+            execl("/bin/sh", "sh", "-c", wrapper, "sh", cmd, (char *)NULL);
+        _exit(127);
+    }
+
+    helper->pid = pid;
+    helper->ctl[0] = ctl_pipe[0];
+    helper->ctl[1] = ctl_pipe[1];
+    pthread_mutex_unlock(&helpers_lock);
+    free(wrapped);
+
+    if (in_fd) {
+        close(in_pipe[0]);
+        *in_fd = in_pipe[1];
+    }
+    if (out_fd) {
+        close(out_pipe[1]);
+        *out_fd = out_pipe[0];
     }
 
-    char full_cmd[4096];
-    snprintf(full_cmd, sizeof(full_cmd), "%s %s", pkexec, cmd);
-    return system(full_cmd);
+    return pid;
+
+fail:
+    for (int i = 0; i < 2; i++) {
+        if (in_pipe[i] >= 0)
+            close(in_pipe[i]);
+        if (out_pipe[i] >= 0)
+            close(out_pipe[i]);
+        if (ctl_pipe[i] >= 0)
+            close(ctl_pipe[i]);
+    }
+    return -1;
 }
 
 bool is_root(void)
@@ -80,3 +285,28 @@ const char *get_pkexec_path(void)
 
     return NULL;
 }
+
+int thread_ioprio_set(int io_class, int level)
+{
+    /* With IOPRIO_WHO_PROCESS, who == 0 is the calling thread */
+    int prev = syscall(SYS_ioprio_get, IOPRIO_WHO_PROCESS, 0);
+    if (prev < 0)
+        return -1;
+
+    int prio = io_class << IOPRIO_CLASS_SHIFT | (io_class == IOPRIO_CLASS_IDLE ? 0 : level);
+    if (syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, prio) != 0)
+        return -1;
+
+    return prev;
+}
+
+int thread_ioprio_idle(void)
+{
+    return thread_ioprio_set(IOPRIO_CLASS_IDLE, 0);
+}
+
+void thread_ioprio_restore(int prio)
+{
+    if (prio >= 0)
+        syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, prio);
+}
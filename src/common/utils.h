@@ -7,8 +7,13 @@
 #ifndef RUFUS_UTILS_H
 #define RUFUS_UTILS_H
 
+#include "jobs.h"
 #include <stdbool.h>
 #include <stdint.h>
+#include <sys/types.h>
+
+/* How often waits on helper processes look for cancellation */
+#define CANCEL_POLL_MS 100
 
 /* Check if a command exists in PATH */
 bool command_exists(const char *cmd);
@@ -16,13 +21,63 @@ bool command_exists(const char *cmd);
 /* Run a command and capture output */
 char *run_command(const char *cmd);
 
-/* Run a command with privilege escalation */
+/* Run a command with privilege escalation. Returns the wait status, or -1
+ * if it could not run or the calling thread was cancelled.
+ */
 int run_privileged(const char *cmd);
 
+/* Start a shell script with privilege escalation without waiting for it.
+ * If in_fd is non-NULL it receives the write end of a pipe connected to the
+ * script's stdin. If out_fd is non-NULL it receives the read end of a pipe
+ * carrying the script's stdout and stderr. Returns the child pid or -1.
+ * The script runs in a session of its own and holds a control pipe; it
+ * kills that session once the pipe is closed, so a cancel needs no second
+ * authentication.
+ */
+pid_t spawn_privileged(const char *cmd, int *in_fd, int *out_fd);
+
+/* Wait for a child from spawn_privileged(). If the calling thread is
+ * cancelled first, the child is killed and -1 is returned once it is gone.
+ */
+int wait_privileged(pid_t pid);
+
+/* Reap a child from spawn_privileged() if it has exited: returns pid and
+ * its wait status, 0 while it runs, or -1 on error
+ */
+pid_t poll_privileged(pid_t pid, int *status);
+
+/* Kill a child from spawn_privileged() and everything it started. Reap it
+ * with wait_privileged() or poll_privileged() afterwards.
+ */
+void kill_privileged(pid_t pid);
+
+/* Cancellation token checked by the waits above and by long loops on the
+ * calling thread (NULL = none). Returns the previous token.
+ */
+job_token_t *thread_set_cancel_token(job_token_t *token);
+bool thread_cancelled(void);
+
 /* Check if running as root */
 bool is_root(void);
 
 /* Get the path to pkexec */
 const char *get_pkexec_path(void);
 
+/* I/O scheduling classes (linux/ioprio.h) */
+#define IOPRIO_CLASS_NONE   0
+#define IOPRIO_CLASS_RT     1
+#define IOPRIO_CLASS_BE     2
+#define IOPRIO_CLASS_IDLE   3
+
+/* Set the calling thread's I/O class and level (0 = highest, 7 = lowest;
+ * ignored for idle). Threads and helper processes started afterwards
+ * inherit it. Returns the previous priority for thread_ioprio_restore(),
+ * or -1 if it could not be changed.
+ */
+int thread_ioprio_set(int io_class, int level);
+
+/* Put the calling thread in the idle I/O class, as above */
+int thread_ioprio_idle(void);
+void thread_ioprio_restore(int prio);
+
 #endif /* RUFUS_UTILS_H */
@@ -7,6 +7,8 @@
  */
 
 #include "device.h"
+#include <glib.h>
+#include <glib-unix.h>
 #include <libudev.h>
 #include <blkid/blkid.h>
 #include <stdio.h>
@@ -14,8 +16,8 @@
 #include <string.h>
 #include <dirent.h>
 #include <sys/mount.h>
+#include <sys/stat.h>
 #include <mntent.h>
-#include <pthread.h>
 
 /* Forbidden mountpoints - never allow writing to devices with these */
 static const char *forbidden_mounts[] = {
@@ -26,8 +28,9 @@ static const char *forbidden_mounts[] = {
     NULL
 };
 
+/* Hotplug events are read on the main context when the monitor fd is readable */
 static struct udev_monitor *udev_mon = NULL;
-static pthread_t monitor_thread;
+static guint monitor_source = 0;
 static bool monitor_running = false;
 static device_change_callback_t change_callback = NULL;
 static void *callback_user_data = NULL;
@@ -353,40 +356,84 @@ bool device_is_system_drive(const device_info_t *dev)
     return dev && has_forbidden_mount(dev->mountpoints);
 }
 
+char *device_get_fs_label(const char *node_path)
+{
+    struct stat st;
+    if (!node_path || stat(node_path, &st) != 0 || !S_ISBLK(st.st_mode))
+        return NULL;
+
+    struct udev *udev = udev_new();
+    if (!udev)
+        return NULL;
+
+    char *label = NULL;
+    struct udev_device *dev = udev_device_new_from_devnum(udev, 'b', st.st_rdev);
+    if (dev) {
+        label = safe_strdup_trim(udev_device_get_property_value(dev, "ID_FS_LABEL"));
+        udev_device_unref(dev);
+    }
+
+    udev_unref(udev);
+    return label;
+}
+
+char *device_usb_hub(const device_info_t *dev)
+{
+    if (!dev || !dev->name)
+        return NULL;
+
+    struct udev *udev = udev_new();
+    if (!udev)
+        return NULL;
+
+    char *hub = NULL;
+    struct udev_device *block = udev_device_new_from_subsystem_sysname(udev, "block", dev->name);
+    if (block) {
+        /* Parents are owned by the child device */
+        struct udev_device *usb =
+            udev_device_get_parent_with_subsystem_devtype(block, "usb", "usb_device");
+        struct udev_device *parent = usb ?
+            udev_device_get_parent_with_subsystem_devtype(usb, "usb", "usb_device") : NULL;
+        if (parent)
+            hub = strdup(udev_device_get_syspath(parent));
+        udev_device_unref(block);
+    }
+
+    udev_unref(udev);
+    return hub;
+}
+
 device_list_t *device_refresh(void)
 {
     return device_enumerate();
 }
 
-/* Monitor thread function */
-static void *monitor_thread_func(void *arg)
+/* Drain the pending udev events; the monitor socket is non-blocking */
+static gboolean on_monitor_ready(gint fd, GIOCondition condition, gpointer user_data)
 {
-    (void)arg;
-
-    int fd = udev_monitor_get_fd(udev_mon);
-
-    while (monitor_running) {
-        fd_set fds;
-        FD_ZERO(&fds);
-        FD_SET(fd, &fds);
-
-        struct timeval tv = {.tv_sec = 1, .tv_usec = 0};
-
-        int ret = select(fd + 1, &fds, NULL, NULL, &tv);
-        if (ret > 0 && FD_ISSET(fd, &fds)) {
-            struct udev_device *dev = udev_monitor_receive_device(udev_mon);
-            if (dev) {
-                const char *action = udev_device_get_action(dev);
-                if (action && (strcmp(action, "add") == 0 || strcmp(action, "remove") == 0)) {
-                    if (change_callback)
-                        change_callback(callback_user_data);
-                }
-                udev_device_unref(dev);
-            }
-        }
+    (void)fd;
+    (void)user_data;
+
+    if (condition & (G_IO_ERR | G_IO_HUP)) {
+        rufus_error("Device monitor closed");
+        monitor_source = 0;
+        return G_SOURCE_REMOVE;
+    }
+
+    bool changed = false;
+    struct udev_device *dev;
+    while ((dev = udev_monitor_receive_device(udev_mon)) != NULL) {
+        const char *action = udev_device_get_action(dev);
+        if (action && (strcmp(action, "add") == 0 || strcmp(action, "remove") == 0))
+            changed = true;
+        udev_device_unref(dev);
     }
 
-    return NULL;
+    /* One refresh per batch of events */
+    if (changed && change_callback)
+        change_callback(callback_user_data);
+
+    return G_SOURCE_CONTINUE;
 }
 
 bool device_monitor_start(device_change_callback_t callback, void *user_data)
@@ -409,15 +456,9 @@ bool device_monitor_start(device_change_callback_t callback, void *user_data)
 
     change_callback = callback;
     callback_user_data = user_data;
+    monitor_source = g_unix_fd_add(udev_monitor_get_fd(udev_mon), G_IO_IN | G_IO_ERR | G_IO_HUP,
+                                   on_monitor_ready, NULL);
     monitor_running = true;
-
-    if (pthread_create(&monitor_thread, NULL, monitor_thread_func, NULL) != 0) {
-        monitor_running = false;
-        udev_monitor_unref(udev_mon);
-        udev_mon = NULL;
-        return false;
-    }
-
     return true;
 }
 
@@ -427,7 +468,11 @@ void device_monitor_stop(void)
         return;
 
     monitor_running = false;
-    pthread_join(monitor_thread, NULL);
+
+    if (monitor_source) {
+        g_source_remove(monitor_source);
+        monitor_source = 0;
+    }
 
     if (udev_mon) {
         struct udev *udev = udev_monitor_get_udev(udev_mon);
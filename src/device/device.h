@@ -60,10 +60,17 @@ bool device_unmount(const device_info_t *dev);
 /* Check if device contains system partitions (/, /boot, /home) */
 bool device_is_system_drive(const device_info_t *dev);
 
+/* Get the filesystem label udev recorded for a block node (caller frees) */
+char *device_get_fs_label(const char *node_path);
+
+/* Get the sysfs path of the USB hub a device hangs off (caller frees) */
+char *device_usb_hub(const device_info_t *dev);
+
 /* Refresh device list (call when USB devices change) */
 device_list_t *device_refresh(void);
 
-/* Start device monitoring (calls callback on USB insert/remove) */
+/* Start device monitoring (calls callback on the main context on USB
+ * insert/remove) */
 typedef void (*device_change_callback_t)(void *user_data);
 bool device_monitor_start(device_change_callback_t callback, void *user_data);
 void device_monitor_stop(void);
@@ -0,0 +1,119 @@
+/*
+ * Rufux - Performance Database Implementation
+ * Francesco Lauritano
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ *
+ * One key file group per model with a running mean and sample count per
+ * mode. Writes to several sticks finish concurrently, so the file is read,
+ * updated and saved under a lock.
+ */
+
+#include "perfdb.h"
+#include "../platform/platform.h"
+#include <glib.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Discarding has to beat the plain average by this much to be kept */
+#define PERFDB_MIN_GAIN 1.05
+
+static const char *mode_names[] = {
+    [PERFDB_PLAIN]   = "plain",
+    [PERFDB_DISCARD] = "discard",
+};
+
+static pthread_mutex_t perfdb_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static char *perfdb_path(void)
+{
+    return g_build_filename(g_get_user_data_dir(), "rufux", "perfdb", NULL);
+}
+
+static GKeyFile *perfdb_open(const char *path)
+{
+    GKeyFile *kf = g_key_file_new();
+    g_key_file_load_from_file(kf, path, G_KEY_FILE_NONE, NULL);
+    return kf;
+}
+
+char *perfdb_key(const device_info_t *dev)
+{
+    if (!dev)
+        return NULL;
+
+    /* Same model in another capacity often has different flash */
+    char key[64];
+    snprintf(key, sizeof(key), "%04x:%04x:%lluG", dev->vid, dev->pid,
+             (unsigned long long)((dev->size + 500000000ULL) / 1000000000ULL));
+    return strdup(key);
+}
+
+void perfdb_record(const char *key, perfdb_mode_t mode, uint64_t bytes, double secs)
+{
+    if (!key || mode >= PERFDB_MODE_COUNT || bytes == 0 || secs <= 0)
+        return;
+
+    double mbps = bytes / 1048576.0 / secs;
+    char mean_key[32], count_key[32];
+    snprintf(mean_key, sizeof(mean_key), "%s_mbps", mode_names[mode]);
+    snprintf(count_key, sizeof(count_key), "%s_samples", mode_names[mode]);
+
+    pthread_mutex_lock(&perfdb_lock);
+
+    char *path = perfdb_path();
+    GKeyFile *kf = perfdb_open(path);
+
+    gint count = g_key_file_get_integer(kf, key, count_key, NULL);
+    double mean = g_key_file_get_double(kf, key, mean_key, NULL);
+    mean += (mbps - mean) / (count + 1);
+    g_key_file_set_double(kf, key, mean_key, mean);
+    g_key_file_set_integer(kf, key, count_key, count + 1);
+
+    char *dir = g_path_get_dirname(path);
+    GError *error = NULL;
+    if (g_mkdir_with_parents(dir, 0700) != 0 || !g_key_file_save_to_file(kf, path, &error)) {
+        rufus_log("Cannot save %s: %s", path, error ? error->message : "no directory");
+        g_clear_error(&error);
+    } else {
+        rufus_log("%s: %s write at %.1f MiB/s (average %.1f over %d)", key,
+                  mode_names[mode], mbps, mean, count + 1);
+    }
+
+    g_free(dir);
+    g_key_file_free(kf);
+    g_free(path);
+    pthread_mutex_unlock(&perfdb_lock);
+}
+
+bool perfdb_prefers_discard(const char *key)
+{
+    if (!key)
+        return false;
+
+    pthread_mutex_lock(&perfdb_lock);
+    char *path = perfdb_path();
+    GKeyFile *kf = perfdb_open(path);
+
+    gint plain_count = g_key_file_get_integer(kf, key, "plain_samples", NULL);
+    gint discard_count = g_key_file_get_integer(kf, key, "discard_samples", NULL);
+    double plain = g_key_file_get_double(kf, key, "plain_mbps", NULL);
+    double discard = g_key_file_get_double(kf, key, "discard_mbps", NULL);
+
+    g_key_file_free(kf);
+    g_free(path);
+    pthread_mutex_unlock(&perfdb_lock);
+
+    if (plain_count == 0)
+        return false;
+    if (discard_count == 0) {
+        rufus_log("%s: trying a discard before the write", key);
+        return true;
+    }
+
+    bool prefer = discard > plain * PERFDB_MIN_GAIN;
+    rufus_log("%s: %.1f MiB/s plain, %.1f MiB/s after discard; %s", key, plain, discard,
+              prefer ? "discarding first" : "not discarding");
+    return prefer;
+}
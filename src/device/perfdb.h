@@ -0,0 +1,37 @@
+/*
+ * Rufux - Performance Database
+ * Francesco Lauritano
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ *
+ * Measured raw write throughput per stick model (VID:PID and capacity),
+ * kept separately for each way of preparing the stick, so choices such as
+ * discarding before a write are made from what the model actually did.
+ * Stored in ~/.local/share/rufux/perfdb.
+ */
+
+#ifndef RUFUS_PERFDB_H
+#define RUFUS_PERFDB_H
+
+#include "device.h"
+#include <stdbool.h>
+#include <stdint.h>
+
+typedef enum {
+    PERFDB_PLAIN = 0,       /* Written over the old contents */
+    PERFDB_DISCARD,         /* Written after a whole-device discard */
+    PERFDB_MODE_COUNT
+} perfdb_mode_t;
+
+/* Key for dev's model (caller frees) */
+char *perfdb_key(const device_info_t *dev);
+
+/* Add a full write of bytes in secs to the model's average for mode */
+void perfdb_record(const char *key, perfdb_mode_t mode, uint64_t bytes, double secs);
+
+/* Whether writes to this model should be preceded by a discard: once the
+ * plain baseline and one discarded write are known, only if discarding
+ * was faster. The first write is plain and the second discarded.
+ */
+bool perfdb_prefers_discard(const char *key);
+
+#endif /* RUFUS_PERFDB_H */
@@ -0,0 +1,208 @@
+/*
+ * Rufux - Write Tuning Implementation
+ * Francesco Lauritano
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ *
+ * Settings are restored in reverse order of application. The effect is
+ * measured from the disk's stat counters: the average request size shows
+ * whether larger requests reached the device, the average wait how long
+ * each one took.
+ */
+
+#include "tuning.h"
+#include "../platform/platform.h"
+#include <libudev.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define MAX_TUNED 4
+
+typedef struct {
+    char path[320];
+    char original[64];
+} tuned_attr_t;
+
+typedef struct {
+    uint64_t write_ios;
+    uint64_t write_sectors;
+    uint64_t write_ticks;   /* ms */
+} write_stat_t;
+
+struct tuning_session {
+    char name[64];
+    tuned_attr_t attrs[MAX_TUNED];
+    int count;
+    write_stat_t start;
+    struct timespec start_time;
+};
+
+static bool read_attr(const char *path, char *buf, size_t size)
+{
+    FILE *fp = fopen(path, "r");
+    if (!fp)
+        return false;
+    bool ok = fgets(buf, size, fp) != NULL;
+    fclose(fp);
+    if (ok)
+        buf[strcspn(buf, "\n")] = '\0';
+    return ok;
+}
+
+static bool write_attr(const char *path, const char *value)
+{
+    FILE *fp = fopen(path, "w");
+    if (!fp)
+        return false;
+    bool ok = fputs(value, fp) >= 0;
+    ok = fclose(fp) == 0 && ok;
+    return ok;
+}
+
+/* Set path to value, remembering shown as the value to restore */
+static void apply(tuning_session_t *s, const char *path, const char *what,
+                  const char *shown, const char *value)
+{
+    if (s->count >= MAX_TUNED || strcmp(shown, value) == 0)
+        return;
+
+    if (!write_attr(path, value)) {
+        rufus_log("%s: cannot set %s to %s", s->name, what, value);
+        return;
+    }
+
+    tuned_attr_t *attr = &s->attrs[s->count++];
+    snprintf(attr->path, sizeof(attr->path), "%s", path);
+    snprintf(attr->original, sizeof(attr->original), "%s", shown);
+    rufus_log("%s: %s %s -> %s", s->name, what, shown, value);
+}
+
+/* "mq-deadline kyber [bfq] none" -> "bfq"; false if none is not offered */
+static bool active_scheduler(const char *list, char *active, size_t size)
+{
+    const char *open = strchr(list, '[');
+    const char *close = open ? strchr(open, ']') : NULL;
+    if (!open || !close || !strstr(list, "none"))
+        return false;
+    snprintf(active, size, "%.*s", (int)(close - open - 1), open + 1);
+    return true;
+}
+
+static void tune_queue(tuning_session_t *s)
+{
+    char path[320], value[256], hw[64];
+
+    snprintf(path, sizeof(path), "/sys/block/%s/queue/scheduler", s->name);
+    char active[64];
+    if (read_attr(path, value, sizeof(value)) &&
+        active_scheduler(value, active, sizeof(active)))
+        apply(s, path, "scheduler", active, "none");
+
+    char hw_path[320];
+    snprintf(hw_path, sizeof(hw_path), "/sys/block/%s/queue/max_hw_sectors_kb", s->name);
+    snprintf(path, sizeof(path), "/sys/block/%s/queue/max_sectors_kb", s->name);
+    if (read_attr(hw_path, hw, sizeof(hw)) && read_attr(path, value, sizeof(value)) &&
+        strtoul(value, NULL, 10) < strtoul(hw, NULL, 10))
+        apply(s, path, "max_sectors_kb", value, hw);
+
+    snprintf(path, sizeof(path), "/sys/block/%s/queue/read_ahead_kb", s->name);
+    if (read_attr(path, value, sizeof(value)))
+        apply(s, path, "read_ahead_kb", value, "0");
+}
+
+/* A suspended stick has to wake up between bursts of writes */
+static void tune_autosuspend(tuning_session_t *s)
+{
+    struct udev *udev = udev_new();
+    if (!udev)
+        return;
+
+    struct udev_device *block = udev_device_new_from_subsystem_sysname(udev, "block", s->name);
+    if (block) {
+        /* Parents are owned by the child device */
+        struct udev_device *usb =
+            udev_device_get_parent_with_subsystem_devtype(block, "usb", "usb_device");
+        if (usb) {
+            char path[320], value[64];
+            snprintf(path, sizeof(path), "%s/power/control", udev_device_get_syspath(usb));
+            if (read_attr(path, value, sizeof(value)))
+                apply(s, path, "USB power control", value, "on");
+        }
+        udev_device_unref(block);
+    }
+
+    udev_unref(udev);
+}
+
+static bool read_write_stat(const char *name, write_stat_t *st)
+{
+    char path[320], line[256];
+    snprintf(path, sizeof(path), "/sys/block/%s/stat", name);
+    if (!read_attr(path, line, sizeof(line)))
+        return false;
+
+    unsigned long long v[8];
+    if (sscanf(line, "%llu %llu %llu %llu %llu %llu %llu %llu",
+               &v[0], &v[1], &v[2], &v[3], &v[4], &v[5], &v[6], &v[7]) != 8)
+        return false;
+
+    st->write_ios = v[4];
+    st->write_sectors = v[6];
+    st->write_ticks = v[7];
+    return true;
+}
+
+tuning_session_t *tuning_begin(const char *device_path)
+{
+    if (!device_path)
+        return NULL;
+
+    tuning_session_t *s = calloc(1, sizeof(tuning_session_t));
+    if (!s)
+        return NULL;
+
+    const char *name = strrchr(device_path, '/');
+    snprintf(s->name, sizeof(s->name), "%s", name ? name + 1 : device_path);
+
+    tune_autosuspend(s);
+    tune_queue(s);
+
+    read_write_stat(s->name, &s->start);
+    clock_gettime(CLOCK_MONOTONIC, &s->start_time);
+    return s;
+}
+
+void tuning_end(tuning_session_t *session)
+{
+    if (!session)
+        return;
+
+    write_stat_t end;
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if (read_write_stat(session->name, &end) && end.write_ios > session->start.write_ios) {
+        uint64_t ios = end.write_ios - session->start.write_ios;
+        uint64_t kib = (end.write_sectors - session->start.write_sectors) / 2;
+        double secs = (now.tv_sec - session->start_time.tv_sec) +
+                      (now.tv_nsec - session->start_time.tv_nsec) / 1e9;
+        rufus_log("%s: %llu MiB in %llu writes, %llu KiB per request, "
+                  "%.1f ms average wait, %.1f MiB/s with %d setting(s) tuned",
+                  session->name, (unsigned long long)(kib / 1024),
+                  (unsigned long long)ios, (unsigned long long)(kib / ios),
+                  (double)(end.write_ticks - session->start.write_ticks) / ios,
+                  secs > 0 ? kib / 1024.0 / secs : 0.0, session->count);
+    }
+
+    for (int i = session->count - 1; i >= 0; i--) {
+        tuned_attr_t *attr = &session->attrs[i];
+        if (!write_attr(attr->path, attr->original))
+            rufus_log("%s: failed to restore %s to %s", session->name, attr->path,
+                      attr->original);
+    }
+    if (session->count)
+        rufus_log("%s: restored %d tuned setting(s)", session->name, session->count);
+
+    free(session);
+}
@@ -0,0 +1,29 @@
+/*
+ * Rufux - Write Tuning
+ * Francesco Lauritano
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ *
+ * Defaults for a stick that is only written are often wrong: USB
+ * autosuspend stays on, a reordering scheduler sits in front of a
+ * sequential stream, requests are capped below what the hardware takes,
+ * and readahead is large. A tuning session switches these through sysfs
+ * for the length of a write and puts the originals back afterwards.
+ */
+
+#ifndef RUFUS_TUNING_H
+#define RUFUS_TUNING_H
+
+typedef struct tuning_session tuning_session_t;
+
+/* Apply the write profile to device_path (a whole disk) where sysfs allows
+ * it. Every change is logged. Never fails; settings that cannot be changed
+ * are left alone.
+ */
+tuning_session_t *tuning_begin(const char *device_path);
+
+/* Restore the original settings, log the I/O done during the session and
+ * free it (NULL is ignored)
+ */
+void tuning_end(tuning_session_t *session);
+
+#endif /* RUFUS_TUNING_H */
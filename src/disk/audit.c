@@ -0,0 +1,357 @@
+/*
+ * Rufux - Stick Audit Implementation
+ * Francesco Lauritano
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ *
+ * Every stick is one job. Sticks on the same hub are spread over per_hub
+ * lanes, each lane a chain of dependent jobs, so a hub never has more than
+ * per_hub readers while sticks on other hubs proceed independently.
+ */
+
+#define _GNU_SOURCE
+#include "audit.h"
+#include "disk_io.h"
+#include "manifest.h"
+#include "../common/jobs.h"
+#include "../common/kernels.h"
+#include "../common/membudget.h"
+#include "../common/utils.h"
+#include "../device/device.h"
+#include "../platform/platform.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+typedef struct {
+    const device_info_t *dev;
+    const audit_options_t *opts;
+    audit_entry_t *entry;
+} audit_task_t;
+
+typedef struct {
+    char *hub;
+    job_t **lanes;
+    int next;
+} hub_group_t;
+
+static const char *status_names[] = {
+    [AUDIT_PASS]         = "PASS",
+    [AUDIT_FAIL]         = "FAIL",
+    [AUDIT_NO_REFERENCE] = "UNKNOWN",
+    [AUDIT_ERROR]        = "ERROR",
+};
+
+static double now_sec(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static bool pread_full(int fd, uint8_t *buf, size_t len, uint64_t offset)
+{
+    size_t got = 0;
+    while (got < len) {
+        ssize_t n = pread(fd, buf + got, len - got, offset + got);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        got += n;
+    }
+    return true;
+}
+
+/* Read the image area of a stick and compare it chunk by chunk */
+static void compare_device(const device_info_t *dev, audit_entry_t *entry, bool sampled,
+                           const manifest_t *manifest, int image_fd, uint64_t image_size)
+{
+    uint32_t chunk = MANIFEST_CHUNK_SIZE;
+    uint32_t count = (uint32_t)((image_size + chunk - 1) / chunk);
+    uint8_t *mask = sampled ? manifest_sample_mask(count) : NULL;
+
+    int fd = disk_open(dev->path, false);
+    uint8_t *dev_buf = NULL;
+    uint8_t *image_buf = NULL;
+    if (fd < 0 || !(dev_buf = membudget_alloc(MEM_POOL_VERIFY, chunk)) ||
+        (image_fd >= 0 && !(image_buf = membudget_alloc(MEM_POOL_VERIFY, chunk)))) {
+        entry->status = AUDIT_ERROR;
+        count = 0;
+    }
+
+    for (uint32_t i = 0; i < count; i++) {
+        if (mask && !mask[i])
+            continue;
+
+        uint64_t offset = (uint64_t)i * chunk;
+        size_t image_len = image_size - offset < chunk ? image_size - offset : chunk;
+        size_t dev_len = dev->size - offset < chunk ? dev->size - offset : chunk;
+
+        if (!disk_read(fd, offset, dev_buf, dev_len)) {
+            entry->status = AUDIT_ERROR;
+            entry->bad_offset = offset;
+            break;
+        }
+
+        if (image_buf) {
+            if (!pread_full(image_fd, image_buf, image_len, offset)) {
+                entry->status = AUDIT_ERROR;
+                break;
+            }
+            size_t diff = buf_first_diff(dev_buf, image_buf, image_len);
+            if (diff < image_len) {
+                entry->status = AUDIT_FAIL;
+                entry->bad_offset = offset + diff;
+                break;
+            }
+        } else {
+            uint8_t digest[CHUNK_DIGEST_SIZE];
+            if (!hash_chunk(manifest->digest, dev_buf, image_len, digest) ||
+                memcmp(digest, manifest->chunks[i], CHUNK_DIGEST_SIZE) != 0) {
+                entry->status = AUDIT_FAIL;
+                entry->bad_offset = offset;
+                break;
+            }
+        }
+
+        entry->bytes_checked += image_len;
+    }
+
+    membudget_free(MEM_POOL_VERIFY, image_buf, chunk);
+    membudget_free(MEM_POOL_VERIFY, dev_buf, chunk);
+    free(mask);
+    disk_close(fd);
+}
+
+/* Compare one stick with the image file or its manifest */
+static void audit_device(audit_task_t *task)
+{
+    const device_info_t *dev = task->dev;
+    audit_entry_t *entry = task->entry;
+    manifest_t *manifest = NULL;
+    int image_fd = -1;
+    uint64_t image_size = 0;
+
+    if (task->opts->image_path) {
+        struct stat st;
+        image_fd = open(task->opts->image_path, O_RDONLY);
+        if (image_fd < 0 || fstat(image_fd, &st) != 0) {
+            rufus_error("Cannot open %s: %s", task->opts->image_path, strerror(errno));
+            entry->status = AUDIT_ERROR;
+            if (image_fd >= 0)
+                close(image_fd);
+            return;
+        }
+        image_size = st.st_size;
+        posix_fadvise(image_fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+        const char *base = strrchr(task->opts->image_path, '/');
+        entry->expected = strdup(base ? base + 1 : task->opts->image_path);
+    } else {
+        char *path = manifest_path_for(dev);
+        manifest = manifest_load(path);
+        free(path);
+        if (!manifest) {
+            entry->status = AUDIT_NO_REFERENCE;
+            return;
+        }
+        image_size = manifest->image_size;
+        entry->expected = strdup(manifest->image_name);
+    }
+
+    entry->status = AUDIT_PASS;
+    if (image_size > dev->size) {
+        entry->status = AUDIT_FAIL;
+        entry->bad_offset = dev->size;
+    } else {
+        compare_device(dev, entry, task->opts->sampled, manifest, image_fd, image_size);
+    }
+
+    if (image_fd >= 0)
+        close(image_fd);
+    manifest_free(manifest);
+}
+
+static bool audit_job(job_t *job, void *data)
+{
+    (void)job;
+    audit_task_t *task = data;
+
+    char name[128];
+    snprintf(name, sizeof(name), "Audit %s", task->dev->path);
+    membudget_job_t *budget = membudget_job_new(name);
+    membudget_job_t *prev = membudget_set_thread_job(budget);
+
+    double start = now_sec();
+    audit_device(task);
+    task->entry->seconds = now_sec() - start;
+
+    membudget_set_thread_job(prev);
+    membudget_job_free(budget);
+
+    rufus_log("Audit %s: %s", task->dev->path, status_names[task->entry->status]);
+
+    /* A bad stick must not cancel the rest of its lane */
+    return true;
+}
+
+/* Slot holding the tail of the lane the next stick on hub queues behind */
+static job_t **hub_lane(hub_group_t *groups, int *group_count, const char *hub, int per_hub)
+{
+    hub_group_t *group = NULL;
+    for (int i = 0; i < *group_count && hub; i++) {
+        if (strcmp(groups[i].hub, hub) == 0) {
+            group = &groups[i];
+            break;
+        }
+    }
+
+    if (!group) {
+        group = &groups[(*group_count)++];
+        group->hub = hub ? strdup(hub) : NULL;
+        group->lanes = calloc(per_hub, sizeof(job_t *));
+        if (!group->lanes)
+            return NULL;
+    }
+
+    return &group->lanes[group->next++ % per_hub];
+}
+
+audit_report_t *audit_run(const audit_options_t *opts)
+{
+    if (!opts)
+        return NULL;
+
+    if (!is_root()) {
+        rufus_error("Auditing needs root to read the devices");
+        return NULL;
+    }
+
+    device_list_t *list = device_enumerate();
+    if (!list)
+        return NULL;
+
+    audit_report_t *report = calloc(1, sizeof(audit_report_t));
+    audit_task_t *tasks = calloc(list->count ? list->count : 1, sizeof(audit_task_t));
+    job_t **jobs = calloc(list->count ? list->count : 1, sizeof(job_t *));
+    hub_group_t *groups = calloc(list->count ? list->count : 1, sizeof(hub_group_t));
+    if (report)
+        report->entries = calloc(list->count ? list->count : 1, sizeof(audit_entry_t));
+
+    if (!report || !report->entries || !tasks || !jobs || !groups) {
+        audit_report_free(report);
+        free(tasks);
+        free(jobs);
+        free(groups);
+        device_list_free(list);
+        return NULL;
+    }
+
+    int per_hub = opts->per_hub > 0 ? opts->per_hub : AUDIT_DEFAULT_PER_HUB;
+    int group_count = 0;
+    double start = now_sec();
+
+    for (int i = 0; i < list->count; i++) {
+        const device_info_t *dev = &list->devices[i];
+        audit_entry_t *entry = &report->entries[report->count++];
+
+        entry->device_path = strdup(dev->path);
+        entry->display_name = device_display_name(dev);
+
+        char *hub = device_usb_hub(dev);
+        if (hub) {
+            const char *base = strrchr(hub, '/');
+            entry->hub = strdup(base ? base + 1 : hub);
+        }
+
+        tasks[i].dev = dev;
+        tasks[i].opts = opts;
+        tasks[i].entry = entry;
+
+        job_t *job = job_new(audit_job, &tasks[i], JOB_PRIO_WRITE);
+        job_t **lane = hub_lane(groups, &group_count, hub, per_hub);
+        free(hub);
+
+        if (lane) {
+            job_depends_on(job, *lane);
+            *lane = job;
+        }
+
+        jobs[i] = job_ref(job);
+        job_submit(job);
+    }
+
+    for (int i = 0; i < list->count; i++) {
+        job_wait(jobs[i]);
+        job_unref(jobs[i]);
+    }
+
+    rufus_log("Audited %d devices on %d hubs in %.1fs", report->count, group_count,
+              now_sec() - start);
+    membudget_log();
+
+    for (int i = 0; i < group_count; i++) {
+        free(groups[i].hub);
+        free(groups[i].lanes);
+    }
+    free(groups);
+    free(jobs);
+    free(tasks);
+    device_list_free(list);
+    return report;
+}
+
+void audit_report_print(const audit_report_t *report, FILE *out)
+{
+    if (!report || !out)
+        return;
+
+    fprintf(out, "%-12s %-10s %-32s %-8s %10s %8s  %s\n",
+            "DEVICE", "HUB", "EXPECTED", "RESULT", "CHECKED", "TIME", "FIRST BAD");
+
+    for (int i = 0; i < report->count; i++) {
+        const audit_entry_t *entry = &report->entries[i];
+        char *checked = format_size(entry->bytes_checked);
+        char bad[32] = "-";
+        if (entry->status == AUDIT_FAIL || (entry->status == AUDIT_ERROR && entry->bad_offset))
+            snprintf(bad, sizeof(bad), "%llu", (unsigned long long)entry->bad_offset);
+
+        fprintf(out, "%-12s %-10s %-32.32s %-8s %10s %7.1fs  %s\n",
+                entry->device_path, entry->hub ? entry->hub : "-",
+                entry->expected ? entry->expected : "-",
+                status_names[entry->status], checked, entry->seconds, bad);
+        free(checked);
+    }
+}
+
+bool audit_report_passed(const audit_report_t *report)
+{
+    if (!report)
+        return false;
+
+    for (int i = 0; i < report->count; i++) {
+        if (report->entries[i].status != AUDIT_PASS)
+            return false;
+    }
+    return true;
+}
+
+void audit_report_free(audit_report_t *report)
+{
+    if (!report)
+        return;
+
+    for (int i = 0; i < report->count; i++) {
+        free(report->entries[i].device_path);
+        free(report->entries[i].display_name);
+        free(report->entries[i].hub);
+        free(report->entries[i].expected);
+    }
+    free(report->entries);
+    free(report);
+}
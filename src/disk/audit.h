@@ -0,0 +1,61 @@
+/*
+ * Rufux - Stick Audit
+ * Francesco Lauritano
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ *
+ * Verify-only pass over every attached stick. Each stick is compared with
+ * its manifest or with a given image, all sticks at once, with a limited
+ * number of readers per USB hub.
+ */
+
+#ifndef RUFUS_AUDIT_H
+#define RUFUS_AUDIT_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+typedef enum {
+    AUDIT_PASS = 0,
+    AUDIT_FAIL,
+    AUDIT_NO_REFERENCE,     /* No manifest and no image given */
+    AUDIT_ERROR,            /* Could not be read */
+} audit_status_t;
+
+typedef struct {
+    char *device_path;
+    char *display_name;
+    char *hub;              /* Hub name, NULL if unknown */
+    char *expected;         /* Image the stick should hold */
+    audit_status_t status;
+    uint64_t bad_offset;    /* First bad byte (image) or chunk (manifest) */
+    uint64_t bytes_checked;
+    double seconds;
+} audit_entry_t;
+
+typedef struct {
+    audit_entry_t *entries;
+    int count;
+} audit_report_t;
+
+typedef struct {
+    const char *image_path; /* Expected image for all sticks (NULL = manifests) */
+    bool sampled;           /* Only first, last and random chunks */
+    int per_hub;            /* Concurrent readers per hub */
+} audit_options_t;
+
+#define AUDIT_DEFAULT_PER_HUB 4
+
+/* Audit all attached sticks (blocking, needs root). Returns NULL if the
+ * audit could not start. */
+audit_report_t *audit_run(const audit_options_t *opts);
+
+/* Print a pass/fail table */
+void audit_report_print(const audit_report_t *report, FILE *out);
+
+/* True if every stick passed */
+bool audit_report_passed(const audit_report_t *report);
+
+void audit_report_free(audit_report_t *report);
+
+#endif /* RUFUS_AUDIT_H */
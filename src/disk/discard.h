@@ -0,0 +1,35 @@
+/*
+ * Rufux - Pre-Write Discard
+ * Francesco Lauritano
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ *
+ * Many sticks and SD cards write faster into erased blocks. Discarding the
+ * device before a raw write hands their FTL clean blocks instead of making
+ * it merge the new data with whatever was there.
+ */
+
+#ifndef RUFUS_DISCARD_H
+#define RUFUS_DISCARD_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* When writes are preceded by a discard */
+typedef enum {
+    DISCARD_AUTO = 0,       /* Where the performance database says it helps */
+    DISCARD_ALWAYS,
+    DISCARD_NEVER,
+} discard_policy_t;
+
+/* Parse "auto", "always" or "never"; false if unknown */
+bool discard_policy_parse(const char *name, discard_policy_t *policy);
+
+/* Largest discard the device accepts in one request, 0 if it has none */
+uint64_t discard_max_bytes(const char *device_path);
+
+/* Discard the whole device in discard_max_bytes() batches, checking for
+ * cancellation between them. Uses blkdiscard through pkexec when not root.
+ */
+bool discard_device(const char *device_path);
+
+#endif /* RUFUS_DISCARD_H */
@@ -11,6 +11,7 @@
 #include <sys/ioctl.h>
 #include <sys/file.h>
 #include <linux/fs.h>
+#include <linux/blkpg.h>
 #include <errno.h>
 #include <string.h>
 
@@ -140,15 +141,39 @@ bool disk_unlock(int fd)
     return true;
 }
 
-bool disk_reread_partitions(int fd)
+static int blkpg(int fd, int op, int number, uint64_t start, uint64_t length)
 {
-    /* BLKRRPART tells the kernel to re-read the partition table */
-    if (ioctl(fd, BLKRRPART) < 0) {
-        /* This can fail if partitions are mounted, which is expected */
-        if (errno != EBUSY) {
-            rufus_error("Failed to re-read partition table: %s", strerror(errno));
-            return false;
-        }
+    struct blkpg_partition part = {
+        .start = (long long)start,
+        .length = (long long)length,
+        .pno = number,
+    };
+    struct blkpg_ioctl_arg arg = {
+        .op = op,
+        .datalen = sizeof(part),
+        .data = &part,
+    };
+
+    return ioctl(fd, BLKPG, &arg);
+}
+
+bool disk_add_partition(int fd, int number, uint64_t start, uint64_t length)
+{
+    if (blkpg(fd, BLKPG_ADD_PARTITION, number, start, length) < 0) {
+        /* EBUSY: an overlapping partition is still registered, possibly
+         * by a concurrent re-read; the caller checks the result */
+        if (errno != EBUSY)
+            rufus_error("Failed to register partition %d: %s", number, strerror(errno));
+        return false;
+    }
+    return true;
+}
+
+bool disk_del_partition(int fd, int number)
+{
+    if (blkpg(fd, BLKPG_DEL_PARTITION, number, 0, 0) < 0 && errno != ENXIO) {
+        rufus_error("Failed to unregister partition %d: %s", number, strerror(errno));
+        return false;
     }
     return true;
 }
@@ -38,7 +38,10 @@ bool disk_lock(int fd);
 /* Unlock device */
 bool disk_unlock(int fd);
 
-/* Force kernel to re-read partition table */
-bool disk_reread_partitions(int fd);
+/* Register or drop a single partition with the kernel (BLKPG). Start and
+ * length are in bytes; this works while the disk is held open.
+ */
+bool disk_add_partition(int fd, int number, uint64_t start, uint64_t length);
+bool disk_del_partition(int fd, int number);
 
 #endif /* RUFUS_DISK_IO_H */
@@ -0,0 +1,646 @@
+/*
+ * Rufux - Write Manifests Implementation
+ * Francesco Lauritano
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ *
+ * Manifests are key files named <vid>-<pid>-<serial>-<capacity>.manifest.
+ * Chunk digests cover the image bytes of each chunk only, so the tail
+ * chunk ignores whatever follows the image on the device.
+ */
+
+#define _GNU_SOURCE
+#include "manifest.h"
+#include "disk_io.h"
+#include "../common/config.h"
+#include "../common/membudget.h"
+#include "../common/utils.h"
+#include "../platform/platform.h"
+#include <glib.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#define MANIFEST_GROUP_DEVICE "device"
+#define MANIFEST_GROUP_IMAGE  "image"
+
+/* Called for each chunk read back; return false to stop */
+typedef bool (*chunk_func_t)(uint32_t index, const uint8_t *data, size_t len, void *user_data);
+
+char *manifest_path_for(const device_info_t *dev)
+{
+    if (!dev || !dev->serial)
+        return NULL;
+
+    char serial[64];
+    size_t n = 0;
+    for (const char *p = dev->serial; *p && n < sizeof(serial) - 1; p++) {
+        if (isalnum((unsigned char)*p) || *p == '-' || *p == '_')
+            serial[n++] = *p;
+    }
+    serial[n] = '\0';
+    if (n == 0)
+        return NULL;
+
+    char name[128];
+    snprintf(name, sizeof(name), "%04x-%04x-%s-%llu.manifest",
+             dev->vid, dev->pid, serial, (unsigned long long)dev->size);
+
+    char *path = g_build_filename(g_get_user_data_dir(), "rufux", "manifests", name, NULL);
+    char *result = strdup(path);
+    g_free(path);
+    return result;
+}
+
+static uint32_t chunk_count_for(uint64_t image_size, uint32_t chunk_size)
+{
+    return (uint32_t)((image_size + chunk_size - 1) / chunk_size);
+}
+
+/* Image bytes covered by a chunk */
+static size_t chunk_length(const manifest_t *m, uint32_t index)
+{
+    uint64_t offset = (uint64_t)index * m->chunk_size;
+    if (offset >= m->image_size)
+        return 0;
+    return m->image_size - offset < m->chunk_size ? m->image_size - offset : m->chunk_size;
+}
+
+static manifest_t *manifest_alloc(uint64_t image_size, uint32_t chunk_size)
+{
+    manifest_t *m = calloc(1, sizeof(manifest_t));
+    if (!m)
+        return NULL;
+
+    m->image_size = image_size;
+    m->chunk_size = chunk_size;
+    m->chunk_count = chunk_count_for(image_size, chunk_size);
+    m->chunks = calloc(m->chunk_count ? m->chunk_count : 1, CHUNK_DIGEST_SIZE);
+    if (!m->chunks) {
+        free(m);
+        return NULL;
+    }
+    return m;
+}
+
+manifest_t *manifest_new(const device_info_t *dev, const char *image_path, uint64_t image_size)
+{
+    if (!image_path)
+        return NULL;
+
+    manifest_t *m = manifest_alloc(image_size, MANIFEST_CHUNK_SIZE);
+    if (!m)
+        return NULL;
+    m->digest = config_get()->chunk_digest;
+
+    if (dev) {
+        m->vid = dev->vid;
+        m->pid = dev->pid;
+        m->serial = dev->serial ? strdup(dev->serial) : NULL;
+        m->capacity = dev->size;
+    }
+
+    const char *base = strrchr(image_path, '/');
+    m->image_name = strdup(base ? base + 1 : image_path);
+    return m;
+}
+
+void manifest_free(manifest_t *m)
+{
+    if (!m)
+        return;
+
+    free(m->serial);
+    free(m->image_name);
+    free(m->chunks);
+    free(m);
+}
+
+bool manifest_set_chunk(manifest_t *m, uint32_t index, const void *data, size_t len)
+{
+    if (!m || index >= m->chunk_count || len != chunk_length(m, index))
+        return false;
+
+    return hash_chunk(m->digest, data, len, m->chunks[index]);
+}
+
+void manifest_finish(manifest_t *m)
+{
+    if (!m)
+        return;
+
+    m->written = time(NULL);
+
+    if (m->chunk_count == 0) {
+        hash_buffer(HASH_SHA256, "", 0, m->root, sizeof(m->root));
+        return;
+    }
+
+    /* Leaves are the zero padded chunk digests */
+    uint8_t (*level)[SHA256_DIGEST_SIZE] = malloc((size_t)m->chunk_count * SHA256_DIGEST_SIZE);
+    if (!level)
+        return;
+    memcpy(level, m->chunks, (size_t)m->chunk_count * SHA256_DIGEST_SIZE);
+
+    /* Hash pairs upwards; an odd node is carried to the next level */
+    uint32_t n = m->chunk_count;
+    while (n > 1) {
+        uint32_t out = 0;
+        for (uint32_t i = 0; i < n; i += 2) {
+            if (i + 1 < n)
+                hash_buffer(HASH_SHA256, level[i], 2 * SHA256_DIGEST_SIZE,
+                            level[out], SHA256_DIGEST_SIZE);
+            else if (out != i)
+                memcpy(level[out], level[i], SHA256_DIGEST_SIZE);
+            out++;
+        }
+        n = out;
+    }
+
+    memcpy(m->root, level[0], SHA256_DIGEST_SIZE);
+    free(level);
+}
+
+void manifest_root_hex(const manifest_t *m, char *hex)
+{
+    hash_digest_to_hex(m->root, SHA256_DIGEST_SIZE, hex);
+}
+
+static bool parse_hex(const char *hex, uint8_t *out, size_t len)
+{
+    if (!hex || strlen(hex) != len * 2)
+        return false;
+
+    for (size_t i = 0; i < len; i++) {
+        unsigned int byte;
+        if (sscanf(hex + i * 2, "%2x", &byte) != 1)
+            return false;
+        out[i] = (uint8_t)byte;
+    }
+    return true;
+}
+
+manifest_t *manifest_load(const char *path)
+{
+    if (!path || !g_file_test(path, G_FILE_TEST_EXISTS))
+        return NULL;
+
+    GKeyFile *kf = g_key_file_new();
+    GError *error = NULL;
+
+    if (!g_key_file_load_from_file(kf, path, G_KEY_FILE_NONE, &error)) {
+        rufus_error("Failed to load manifest %s: %s", path, error->message);
+        g_error_free(error);
+        g_key_file_free(kf);
+        return NULL;
+    }
+
+    uint64_t image_size = g_key_file_get_uint64(kf, MANIFEST_GROUP_IMAGE, "size", NULL);
+    uint32_t chunk_size = (uint32_t)g_key_file_get_integer(kf, MANIFEST_GROUP_IMAGE,
+                                                           "chunk_size", NULL);
+    char *root = g_key_file_get_string(kf, MANIFEST_GROUP_IMAGE, "root", NULL);
+    gsize count = 0;
+    char **chunks = g_key_file_get_string_list(kf, MANIFEST_GROUP_IMAGE, "chunks", &count, NULL);
+
+    /* Manifests from before chunk digests were selectable are SHA-256 */
+    char *digest_name = g_key_file_get_string(kf, MANIFEST_GROUP_IMAGE, "digest", NULL);
+    chunk_digest_t digest = CHUNK_DIGEST_SHA256;
+    bool known = !digest_name || chunk_digest_parse(digest_name, &digest);
+    g_free(digest_name);
+
+    manifest_t *m = NULL;
+    bool ok = known && chunk_size > 0 && chunks &&
+              (m = manifest_alloc(image_size, chunk_size)) &&
+              count == m->chunk_count && parse_hex(root, m->root, SHA256_DIGEST_SIZE);
+
+    for (gsize i = 0; ok && i < count; i++)
+        ok = parse_hex(chunks[i], m->chunks[i], chunk_digest_size(digest));
+
+    if (ok) {
+        m->digest = digest;
+        m->vid = (uint16_t)g_key_file_get_integer(kf, MANIFEST_GROUP_DEVICE, "vid", NULL);
+        m->pid = (uint16_t)g_key_file_get_integer(kf, MANIFEST_GROUP_DEVICE, "pid", NULL);
+        m->capacity = g_key_file_get_uint64(kf, MANIFEST_GROUP_DEVICE, "capacity", NULL);
+        m->written = (time_t)g_key_file_get_int64(kf, MANIFEST_GROUP_IMAGE, "written", NULL);
+
+        char *serial = g_key_file_get_string(kf, MANIFEST_GROUP_DEVICE, "serial", NULL);
+        char *name = g_key_file_get_string(kf, MANIFEST_GROUP_IMAGE, "name", NULL);
+        m->serial = serial ? strdup(serial) : NULL;
+        m->image_name = strdup(name ? name : "");
+        g_free(serial);
+        g_free(name);
+    } else {
+        rufus_error("Ignoring malformed manifest %s", path);
+        manifest_free(m);
+        m = NULL;
+    }
+
+    g_strfreev(chunks);
+    g_free(root);
+    g_key_file_free(kf);
+    return m;
+}
+
+bool manifest_save(manifest_t *m, const char *path)
+{
+    if (!m || !path)
+        return false;
+
+    char *dir = g_path_get_dirname(path);
+    if (g_mkdir_with_parents(dir, 0700) != 0) {
+        rufus_error("Cannot create %s: %s", dir, strerror(errno));
+        g_free(dir);
+        return false;
+    }
+    g_free(dir);
+
+    char root[SHA256_DIGEST_SIZE * 2 + 1];
+    manifest_root_hex(m, root);
+
+    size_t digest_size = chunk_digest_size(m->digest);
+    char **chunks = g_new0(char *, m->chunk_count + 1);
+    for (uint32_t i = 0; i < m->chunk_count; i++) {
+        chunks[i] = g_malloc(digest_size * 2 + 1);
+        hash_digest_to_hex(m->chunks[i], digest_size, chunks[i]);
+    }
+
+    GKeyFile *kf = g_key_file_new();
+    g_key_file_set_integer(kf, MANIFEST_GROUP_DEVICE, "vid", m->vid);
+    g_key_file_set_integer(kf, MANIFEST_GROUP_DEVICE, "pid", m->pid);
+    g_key_file_set_string(kf, MANIFEST_GROUP_DEVICE, "serial", m->serial ? m->serial : "");
+    g_key_file_set_uint64(kf, MANIFEST_GROUP_DEVICE, "capacity", m->capacity);
+    g_key_file_set_string(kf, MANIFEST_GROUP_IMAGE, "name", m->image_name ? m->image_name : "");
+    g_key_file_set_uint64(kf, MANIFEST_GROUP_IMAGE, "size", m->image_size);
+    g_key_file_set_string(kf, MANIFEST_GROUP_IMAGE, "root", root);
+    g_key_file_set_int64(kf, MANIFEST_GROUP_IMAGE, "written", (gint64)m->written);
+    g_key_file_set_integer(kf, MANIFEST_GROUP_IMAGE, "chunk_size", (gint)m->chunk_size);
+    g_key_file_set_string(kf, MANIFEST_GROUP_IMAGE, "digest", chunk_digest_name(m->digest));
+    g_key_file_set_string_list(kf, MANIFEST_GROUP_IMAGE, "chunks",
+                               (const char * const *)chunks, m->chunk_count);
+
+    GError *error = NULL;
+    bool ok = g_key_file_save_to_file(kf, path, &error);
+    if (!ok) {
+        rufus_error("Failed to save manifest %s: %s", path, error->message);
+        g_error_free(error);
+    } else {
+        rufus_log("Recorded manifest for %s: %s (root %.16s...)", m->serial, m->image_name, root);
+    }
+
+    g_key_file_free(kf);
+    g_strfreev(chunks);
+    return ok;
+}
+
+void manifest_forget(const char *path)
+{
+    if (path && unlink(path) == 0)
+        rufus_log("Dropped manifest %s", path);
+}
+
+bool manifest_chunk_equal(const manifest_t *a, const manifest_t *b, uint32_t index)
+{
+    if (!a || !b || a->chunk_size != b->chunk_size || a->digest != b->digest)
+        return false;
+    if (index >= a->chunk_count || index >= b->chunk_count)
+        return false;
+    if (chunk_length(a, index) != chunk_length(b, index))
+        return false;
+    return memcmp(a->chunks[index], b->chunks[index], CHUNK_DIGEST_SIZE) == 0;
+}
+
+/* ============== Readback ============== */
+
+static bool read_full(int fd, uint8_t *buf, size_t len)
+{
+    size_t got = 0;
+    while (got < len) {
+        ssize_t n = read(fd, buf + got, len - got);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        got += n;
+    }
+    return true;
+}
+
+/* Bytes of the device in a chunk (the last one may be short) */
+static size_t device_chunk_length(const manifest_t *m, uint32_t index)
+{
+    uint64_t offset = (uint64_t)index * m->chunk_size;
+    return m->capacity - offset < m->chunk_size ? m->capacity - offset : m->chunk_size;
+}
+
+static bool read_chunks_direct(const manifest_t *m, const char *device_path, const uint8_t *mask,
+                               chunk_func_t func, void *user_data)
+{
+    int fd = disk_open(device_path, false);
+    if (fd < 0)
+        return false;
+
+    uint8_t *buf = membudget_alloc(MEM_POOL_VERIFY, m->chunk_size);
+    if (!buf) {
+        disk_close(fd);
+        return false;
+    }
+
+    bool ok = true;
+    for (uint32_t i = 0; ok && i < m->chunk_count; i++) {
+        if (mask && !mask[i])
+            continue;
+        size_t len = device_chunk_length(m, i);
+        ok = !thread_cancelled() && disk_read(fd, (uint64_t)i * m->chunk_size, buf, len) &&
+             func(i, buf, len, user_data);
+    }
+
+    membudget_free(MEM_POOL_VERIFY, buf, m->chunk_size);
+    disk_close(fd);
+    return ok;
+}
+
+/* One privileged dd per run of selected chunks, all in a single script */
+static bool read_chunks_piped(const manifest_t *m, const char *device_path, const uint8_t *mask,
+                              chunk_func_t func, void *user_data)
+{
+    GString *ranges = g_string_new(NULL);
+    for (uint32_t i = 0; i < m->chunk_count; ) {
+        if (mask && !mask[i]) {
+            i++;
+            continue;
+        }
+        uint32_t start = i;
+        while (i < m->chunk_count && (!mask || mask[i]))
+            i++;
+        g_string_append_printf(ranges, " %u:%u", start, i - start);
+    }
+
+    char *cmd = g_strdup_printf(
+        "for r in%s; do dd if=%s bs=%u skip=${r%%:*} count=${r#*:} "
+        "iflag=direct,fullblock status=none 2>/dev/null || exit 1; done",
+        ranges->str, device_path, m->chunk_size);
+    g_string_free(ranges, TRUE);
+
+    int out_fd = -1;
+    pid_t pid = spawn_privileged(cmd, NULL, &out_fd);
+    g_free(cmd);
+    if (pid < 0)
+        return false;
+
+    uint8_t *buf = membudget_alloc(MEM_POOL_VERIFY, m->chunk_size);
+    bool ok = buf != NULL;
+
+    for (uint32_t i = 0; ok && i < m->chunk_count; i++) {
+        if (mask && !mask[i])
+            continue;
+        size_t len = device_chunk_length(m, i);
+        if (thread_cancelled()) {
+            ok = false;
+            break;
+        }
+        if (!read_full(out_fd, buf, len)) {
+            rufus_error("Short read from %s at chunk %u", device_path, i);
+            ok = false;
+            break;
+        }
+        ok = func(i, buf, len, user_data);
+    }
+
+    membudget_free(MEM_POOL_VERIFY, buf, m->chunk_size);
+    close(out_fd);
+
+    if (!ok)
+        kill_privileged(pid);
+    int wstatus = wait_privileged(pid);
+    if (ok && (wstatus < 0 || !WIFEXITED(wstatus) || WEXITSTATUS(wstatus) != 0)) {
+        rufus_error("Readback of %s failed", device_path);
+        ok = false;
+    }
+
+    return ok;
+}
+
+static bool read_chunks(const manifest_t *m, const char *device_path, const uint8_t *mask,
+                        chunk_func_t func, void *user_data)
+{
+    if (is_root())
+        return read_chunks_direct(m, device_path, mask, func, user_data);
+    return read_chunks_piped(m, device_path, mask, func, user_data);
+}
+
+typedef struct {
+    const manifest_t *m;
+    uint64_t done;
+    uint64_t total;
+    manifest_progress_t progress;
+    void *user_data;
+} verify_ctx_t;
+
+static bool verify_chunk(uint32_t index, const uint8_t *data, size_t len, void *user_data)
+{
+    verify_ctx_t *ctx = user_data;
+    size_t image_len = chunk_length(ctx->m, index);
+    uint8_t digest[CHUNK_DIGEST_SIZE];
+
+    if (image_len > len ||
+        !hash_chunk(ctx->m->digest, data, image_len, digest) ||
+        memcmp(digest, ctx->m->chunks[index], CHUNK_DIGEST_SIZE) != 0) {
+        rufus_log("Chunk %u of %s does not match", index, ctx->m->image_name);
+        return false;
+    }
+
+    ctx->done += image_len;
+    if (ctx->progress)
+        ctx->progress(ctx->done, ctx->total, ctx->user_data);
+    return true;
+}
+
+bool manifest_verify_device(const manifest_t *m, const char *device_path, const uint8_t *mask,
+                            manifest_progress_t progress, void *user_data)
+{
+    if (!m || !device_path || m->image_size > m->capacity)
+        return false;
+
+    verify_ctx_t ctx = { .m = m, .progress = progress, .user_data = user_data };
+    for (uint32_t i = 0; i < m->chunk_count; i++) {
+        if (!mask || mask[i])
+            ctx.total += chunk_length(m, i);
+    }
+
+    if (ctx.total == 0)
+        return true;
+
+    return read_chunks(m, device_path, mask, verify_chunk, &ctx);
+}
+
+/* ============== Rolling Readback ============== */
+
+struct manifest_verifier {
+    const manifest_t *m;
+    int fd;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    uint32_t *queue;            /* Pushed chunk indices, in write order */
+    uint32_t pushed;
+    uint32_t checked;
+    bool closed;
+    bool failed;
+};
+
+static bool readback_chunk(manifest_verifier_t *v, uint32_t index, uint8_t *buf)
+{
+    uint64_t offset = (uint64_t)index * v->m->chunk_size;
+    size_t len = device_chunk_length(v->m, index);
+
+    /* Only matters when the device refused O_DIRECT */
+    posix_fadvise(v->fd, offset, len, POSIX_FADV_DONTNEED);
+
+    verify_ctx_t ctx = { .m = v->m };
+    return disk_read(v->fd, offset, buf, len) && verify_chunk(index, buf, len, &ctx);
+}
+
+static void *verifier_thread(void *data)
+{
+    manifest_verifier_t *v = data;
+
+    uint8_t *buf = membudget_alloc(MEM_POOL_VERIFY, v->m->chunk_size);
+
+    pthread_mutex_lock(&v->lock);
+    if (!buf)
+        v->failed = true;
+
+    /* Trail the writer so a chunk is read from flash, not from the
+     * controller's cache of what was just written */
+    while (!v->failed) {
+        uint32_t lag = v->closed ? 0 : MANIFEST_VERIFY_LAG;
+        if (v->pushed - v->checked <= lag) {
+            if (v->closed)
+                break;
+            pthread_cond_wait(&v->cond, &v->lock);
+            continue;
+        }
+
+        uint32_t index = v->queue[v->checked];
+        pthread_mutex_unlock(&v->lock);
+        bool ok = readback_chunk(v, index, buf);
+        pthread_mutex_lock(&v->lock);
+
+        v->checked++;
+        if (!ok)
+            v->failed = true;
+    }
+    pthread_mutex_unlock(&v->lock);
+
+    membudget_free(MEM_POOL_VERIFY, buf, v->m->chunk_size);
+    return NULL;
+}
+
+manifest_verifier_t *manifest_verifier_start(const manifest_t *m, const char *device_path)
+{
+    if (!m || !device_path || !is_root() || m->image_size > m->capacity)
+        return NULL;
+
+    manifest_verifier_t *v = calloc(1, sizeof(manifest_verifier_t));
+    if (!v)
+        return NULL;
+
+    v->m = m;
+    v->queue = calloc(m->chunk_count ? m->chunk_count : 1, sizeof(uint32_t));
+    v->fd = v->queue ? disk_open(device_path, false) : -1;
+    if (v->fd < 0) {
+        free(v->queue);
+        free(v);
+        return NULL;
+    }
+
+    pthread_mutex_init(&v->lock, NULL);
+    pthread_cond_init(&v->cond, NULL);
+    if (pthread_create(&v->thread, NULL, verifier_thread, v) != 0) {
+        pthread_cond_destroy(&v->cond);
+        pthread_mutex_destroy(&v->lock);
+        disk_close(v->fd);
+        free(v->queue);
+        free(v);
+        return NULL;
+    }
+
+    return v;
+}
+
+bool manifest_verifier_push(manifest_verifier_t *v, uint32_t index)
+{
+    if (!v)
+        return false;
+
+    pthread_mutex_lock(&v->lock);
+    if (v->pushed < v->m->chunk_count && index < v->m->chunk_count) {
+        v->queue[v->pushed++] = index;
+        pthread_cond_signal(&v->cond);
+    }
+    bool ok = !v->failed;
+    pthread_mutex_unlock(&v->lock);
+    return ok;
+}
+
+bool manifest_verifier_finish(manifest_verifier_t *v)
+{
+    if (!v)
+        return false;
+
+    pthread_mutex_lock(&v->lock);
+    v->closed = true;
+    pthread_cond_signal(&v->cond);
+    pthread_mutex_unlock(&v->lock);
+    pthread_join(v->thread, NULL);
+
+    bool ok = !v->failed;
+    rufus_log("Read back %u chunks of %s during the write: %s", v->checked,
+              v->m->image_name, ok ? "match" : "mismatch");
+
+    pthread_cond_destroy(&v->cond);
+    pthread_mutex_destroy(&v->lock);
+    disk_close(v->fd);
+    free(v->queue);
+    free(v);
+    return ok;
+}
+
+uint8_t *manifest_sample_mask(uint32_t count)
+{
+    if (count == 0)
+        return NULL;
+
+    uint8_t *mask = calloc(count, 1);
+    if (!mask)
+        return NULL;
+
+    mask[0] = 1;
+    mask[count - 1] = 1;
+    for (int i = 2; i < MANIFEST_SAMPLES && (uint32_t)i < count; i++)
+        mask[g_random_int_range(0, (gint32)count)] = 1;
+
+    return mask;
+}
+
+bool manifest_sample_check(const manifest_t *m, const char *device_path)
+{
+    if (!m)
+        return false;
+
+    uint8_t *mask = manifest_sample_mask(m->chunk_count);
+    if (!mask)
+        return false;
+
+    bool ok = manifest_verify_device(m, device_path, mask, NULL, NULL);
+    free(mask);
+
+    rufus_log("Sampled %s for %s: %s", device_path, m->image_name, ok ? "match" : "mismatch");
+    return ok;
+}
@@ -0,0 +1,102 @@
+/*
+ * Rufux - Write Manifests
+ * Francesco Lauritano
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ *
+ * After a verified raw write, the chunk digests of the image and their
+ * Merkle root are stored per stick (VID/PID/serial/capacity) under
+ * ~/.local/share/rufux/manifests. A few sampled chunks are then enough to
+ * tell what a stick holds, and a newer image only needs its changed chunks
+ * written.
+ */
+
+#ifndef RUFUS_MANIFEST_H
+#define RUFUS_MANIFEST_H
+
+#include "../common/hash.h"
+#include "../device/device.h"
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+
+#define MANIFEST_CHUNK_SIZE  (4 * 1024 * 1024)
+#define MANIFEST_SAMPLES     8
+
+typedef struct {
+    /* Device identity */
+    uint16_t vid;
+    uint16_t pid;
+    char *serial;
+    uint64_t capacity;
+
+    /* Image identity */
+    char *image_name;
+    uint64_t image_size;
+    uint8_t root[SHA256_DIGEST_SIZE];
+    time_t written;
+
+    uint32_t chunk_size;
+    uint32_t chunk_count;
+    chunk_digest_t digest;      /* Set before the first chunk is recorded */
+    uint8_t (*chunks)[CHUNK_DIGEST_SIZE];
+} manifest_t;
+
+/* Progress callback for readback verification */
+typedef void (*manifest_progress_t)(uint64_t bytes_done, uint64_t total_bytes, void *user_data);
+
+/* Path of the manifest for a device, NULL if the device has no serial to
+ * tell it apart from others (caller frees) */
+char *manifest_path_for(const device_info_t *dev);
+
+/* Empty manifest for writing image_path to dev (NULL for the image alone),
+ * with the configured chunk digest */
+manifest_t *manifest_new(const device_info_t *dev, const char *image_path, uint64_t image_size);
+void manifest_free(manifest_t *m);
+
+/* Record the digest of chunk index from its data */
+bool manifest_set_chunk(manifest_t *m, uint32_t index, const void *data, size_t len);
+
+/* Compute the Merkle root once all chunks are set */
+void manifest_finish(manifest_t *m);
+
+/* Load, store or drop the manifest at path */
+manifest_t *manifest_load(const char *path);
+bool manifest_save(manifest_t *m, const char *path);
+void manifest_forget(const char *path);
+
+/* Whether chunk index holds the same bytes in both manifests */
+bool manifest_chunk_equal(const manifest_t *a, const manifest_t *b, uint32_t index);
+
+/* Read chunks back from the device and compare them with the manifest.
+ * mask selects chunks (NULL = all). Uses a privileged dd when not root.
+ */
+bool manifest_verify_device(const manifest_t *m, const char *device_path, const uint8_t *mask,
+                            manifest_progress_t progress, void *user_data);
+
+/* Readback running alongside a raw write (root only). Chunks pushed once
+ * they are durable on the device are read back with O_DIRECT and compared
+ * with m while later chunks are still being written.
+ */
+typedef struct manifest_verifier manifest_verifier_t;
+
+/* Chunks the readback trails the write by */
+#define MANIFEST_VERIFY_LAG  4
+
+manifest_verifier_t *manifest_verifier_start(const manifest_t *m, const char *device_path);
+
+/* Queue chunk index for readback; false once a chunk failed to match */
+bool manifest_verifier_push(manifest_verifier_t *v, uint32_t index);
+
+/* Check the remaining chunks and free the verifier; true if all matched */
+bool manifest_verifier_finish(manifest_verifier_t *v);
+
+/* Mask selecting the first, last and a few random of count chunks */
+uint8_t *manifest_sample_mask(uint32_t count);
+
+/* Compare the chunks of manifest_sample_mask() with the device */
+bool manifest_sample_check(const manifest_t *m, const char *device_path);
+
+/* Hex Merkle root (caller provides SHA256_DIGEST_SIZE * 2 + 1 bytes) */
+void manifest_root_hex(const manifest_t *m, char *hex);
+
+#endif /* RUFUS_MANIFEST_H */
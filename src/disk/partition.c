@@ -3,7 +3,9 @@
  * Francesco Lauritano
  * SPDX-License-Identifier: GPL-3.0-or-later
  *
- * Uses libfdisk for partition operations
+ * Uses libfdisk for partition operations. New layouts are registered with
+ * the kernel partition by partition (BLKPG) rather than by a whole-table
+ * re-read, which is refused while anything holds the disk open.
  */
 
 #include "partition.h"
@@ -15,6 +17,12 @@
 #include <string.h>
 #include <stdio.h>
 #include <unistd.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
 
 /* MBR partition type codes */
 #define MBR_TYPE_FAT16     0x06
@@ -29,6 +37,16 @@
 #define GPT_TYPE_LINUX     "0FC63DAF-8483-4772-8E79-3D69D8477DE4"
 #define GPT_TYPE_MSDATA    "EBD0A0A2-B9E5-4433-87C0-68B6B72699C7"
 
+#define MAX_KERNEL_PARTS   128
+#define PARTITION_LOCK_TIMEOUT_MS 5000
+
+/* A partition as the kernel has it registered, in 512-byte sectors */
+typedef struct {
+    int number;
+    uint64_t start;
+    uint64_t size;
+} kernel_part_t;
+
 static int get_mbr_type(fs_type_t fs)
 {
     switch (fs) {
@@ -60,6 +78,20 @@ static const char *get_gpt_type(fs_type_t fs)
     }
 }
 
+/* With partx available, sfdisk skips its whole-table re-read and partx
+ * registers the partitions one by one instead (BLKPG); a partx failure
+ * fails the command. partition_wait_for_node then polls for the nodes, so
+ * nothing waits on udev here. Sets the sfdisk flag and the command tail. */
+static void partx_update(const char *device, const char **flag, char *tail, size_t size)
+{
+    bool have_partx = command_exists("partx");
+    *flag = have_partx ? "--no-reread " : "";
+    if (have_partx)
+        snprintf(tail, size, " && partx -u %s", device);
+    else
+        tail[0] = '\0';
+}
+
 static bool partition_create_single_privileged(const char *device, partition_style_t style,
                                                fs_type_t fs_type)
 {
@@ -78,11 +110,15 @@ static bool partition_create_single_privileged(const char *device, partition_sty
         snprintf(type, sizeof(type), "%02X", get_mbr_type(fs_type));
     }
 
-    char cmd[1024];
+    const char *no_reread;
+    char reread[512];
+    partx_update(device, &no_reread, reread, sizeof(reread));
+
+    char cmd[2048];
     snprintf(cmd, sizeof(cmd),
              "sh -c 'printf \"label: %s\\n, , %s%s\\n\" | "
-             "sfdisk --wipe always --wipe-partitions always --lock %s'",
-             label, type, boot_flag, device);
+             "sfdisk --wipe always --wipe-partitions always %s--lock %s%s'",
+             label, type, boot_flag, no_reread, device, reread);
 
     int rc = run_privileged(cmd);
     if (rc != 0) {
@@ -103,11 +139,15 @@ static bool partition_create_single_efi_privileged(const char *device, partition
     const char *label = (style == PARTITION_STYLE_GPT) ? "gpt" : "dos";
     const char *boot_flag = (style == PARTITION_STYLE_MBR) ? ", *" : "";
 
-    char cmd[1024];
+    const char *no_reread;
+    char reread[512];
+    partx_update(device, &no_reread, reread, sizeof(reread));
+
+    char cmd[2048];
     snprintf(cmd, sizeof(cmd),
              "sh -c 'printf \"label: %s\\n, , U%s\\n\" | "
-             "sfdisk --wipe always --wipe-partitions always --lock %s'",
-             label, boot_flag, device);
+             "sfdisk --wipe always --wipe-partitions always %s--lock %s%s'",
+             label, boot_flag, no_reread, device, reread);
 
     int rc = run_privileged(cmd);
     if (rc != 0) {
@@ -132,11 +172,15 @@ static bool partition_create_bootable_privileged(const char *device, partition_s
 
     const char *data_type = get_gpt_type(fs_type);
 
-    char cmd[1024];
+    const char *no_reread;
+    char reread[512];
+    partx_update(device, &no_reread, reread, sizeof(reread));
+
+    char cmd[2048];
     snprintf(cmd, sizeof(cmd),
              "sh -c 'printf \"label: gpt\\n, 256M, U\\n, , %s\\n\" | "
-             "sfdisk --wipe always --wipe-partitions always --lock %s'",
-             data_type, device);
+             "sfdisk --wipe always --wipe-partitions always %s--lock %s%s'",
+             data_type, no_reread, device, reread);
 
     int rc = run_privileged(cmd);
     if (rc != 0) {
@@ -147,6 +191,204 @@ static bool partition_create_bootable_privileged(const char *device, partition_s
     return true;
 }
 
+/* The partitions in cxt's table, as written or as read from the disk */
+static partition_layout_t *read_layout(struct fdisk_context *cxt)
+{
+    partition_layout_t *layout = calloc(1, sizeof(partition_layout_t));
+    if (!layout)
+        return NULL;
+
+    if (fdisk_is_label(cxt, GPT))
+        layout->style = PARTITION_STYLE_GPT;
+    else
+        layout->style = PARTITION_STYLE_MBR;
+
+    struct fdisk_table *tb = NULL;
+    if (fdisk_get_partitions(cxt, &tb) == 0 && tb) {
+        size_t n = fdisk_table_get_nents(tb);
+        if (n > 0) {
+            layout->parts = calloc(n, sizeof(partition_entry_t));
+            layout->part_count = 0;
+
+            struct fdisk_iter *itr = fdisk_new_iter(FDISK_ITER_FORWARD);
+            struct fdisk_partition *pa = NULL;
+
+            while (fdisk_table_next_partition(tb, itr, &pa) == 0) {
+                if (fdisk_partition_has_start(pa) && fdisk_partition_has_size(pa)) {
+                    uint64_t sector_size = fdisk_get_sector_size(cxt);
+                    layout->parts[layout->part_count].start =
+                        fdisk_partition_get_start(pa) * sector_size;
+                    layout->parts[layout->part_count].size =
+                        fdisk_partition_get_size(pa) * sector_size;
+                    layout->parts[layout->part_count].number =
+                        (int)fdisk_partition_get_partno(pa) + 1;
+                    layout->part_count++;
+                }
+            }
+            fdisk_free_iter(itr);
+        }
+        fdisk_unref_table(tb);
+    }
+
+    return layout;
+}
+
+static bool read_sysfs_u64(const char *path, uint64_t *value)
+{
+    FILE *fp = fopen(path, "r");
+    if (!fp)
+        return false;
+
+    unsigned long long v = 0;
+    int ok = fscanf(fp, "%llu", &v);
+    fclose(fp);
+
+    *value = v;
+    return ok == 1;
+}
+
+/* Partitions the kernel has registered for disk, from /sys/class/block */
+static int kernel_partitions(const char *disk, kernel_part_t *parts, int max)
+{
+    char dirpath[256];
+    snprintf(dirpath, sizeof(dirpath), "/sys/class/block/%s", disk);
+
+    DIR *dir = opendir(dirpath);
+    if (!dir)
+        return 0;
+
+    int count = 0;
+    struct dirent *ent;
+    while ((ent = readdir(dir)) != NULL && count < max) {
+        if (strncmp(ent->d_name, disk, strlen(disk)) != 0)
+            continue;
+
+        char path[512];
+        uint64_t number, start, size;
+        snprintf(path, sizeof(path), "%s/%s/partition", dirpath, ent->d_name);
+        if (!read_sysfs_u64(path, &number))
+            continue;
+        snprintf(path, sizeof(path), "%s/%s/start", dirpath, ent->d_name);
+        if (!read_sysfs_u64(path, &start))
+            continue;
+        snprintf(path, sizeof(path), "%s/%s/size", dirpath, ent->d_name);
+        if (!read_sysfs_u64(path, &size))
+            continue;
+
+        parts[count++] = (kernel_part_t){ (int)number, start, size };
+    }
+
+    closedir(dir);
+    return count;
+}
+
+static const partition_entry_t *layout_find(const partition_layout_t *layout, int number)
+{
+    for (int i = 0; i < layout->part_count; i++) {
+        if (layout->parts[i].number == number)
+            return &layout->parts[i];
+    }
+    return NULL;
+}
+
+static bool kernel_part_matches(const kernel_part_t *kp, const partition_entry_t *part)
+{
+    return part && kp->start * 512 == part->start && kp->size * 512 == part->size;
+}
+
+int partition_lock_disk(const char *device)
+{
+    /* The sfdisk helpers take the lock themselves and would wait on ours */
+    if (!is_root())
+        return -1;
+
+    int fd = open(device, O_RDONLY | O_CLOEXEC | O_NONBLOCK);
+    if (fd < 0) {
+        rufus_error("Cannot open %s to lock it: %s", device, strerror(errno));
+        return -1;
+    }
+
+    /* udevd holds a shared lock while it handles an event for the disk */
+    for (int waited = 0; waited <= PARTITION_LOCK_TIMEOUT_MS; waited += 50) {
+        if (flock(fd, LOCK_EX | LOCK_NB) == 0)
+            return fd;
+        if (errno != EWOULDBLOCK)
+            break;
+        usleep(50000);
+    }
+
+    rufus_error("Cannot lock %s: %s", device, strerror(errno));
+    close(fd);
+    return -1;
+}
+
+void partition_unlock_disk(int fd)
+{
+    if (fd < 0)
+        return;
+
+    flock(fd, LOCK_UN);
+    close(fd);
+}
+
+/* Bring the kernel's partitions in line with the table just written to
+ * cxt's device: changed and removed partitions are dropped, new ones
+ * added, and unchanged ones left alone so their nodes stay put. The nodes
+ * exist as soon as this returns, busy disk or not.
+ */
+static bool register_partitions(struct fdisk_context *cxt, const char *device)
+{
+    const char *disk = strrchr(device, '/');
+    disk = disk ? disk + 1 : device;
+
+    partition_layout_t *layout = read_layout(cxt);
+    if (!layout)
+        return false;
+
+    int fd = fdisk_get_devfd(cxt);
+    kernel_part_t current[MAX_KERNEL_PARTS];
+    int count = kernel_partitions(disk, current, MAX_KERNEL_PARTS);
+    int removed = 0, added = 0;
+
+    /* Drop first so the new ranges are free to register */
+    bool ok = true;
+    for (int i = 0; i < count; i++) {
+        if (kernel_part_matches(&current[i], layout_find(layout, current[i].number)))
+            continue;
+        ok = disk_del_partition(fd, current[i].number) && ok;
+        current[i].number = 0;
+        removed++;
+    }
+
+    for (int i = 0; i < layout->part_count; i++) {
+        const partition_entry_t *part = &layout->parts[i];
+        bool registered = false;
+        for (int k = 0; k < count && !registered; k++)
+            registered = current[k].number == part->number;
+        if (registered)
+            continue;
+        ok = disk_add_partition(fd, part->number, part->start, part->size) && ok;
+        added++;
+    }
+
+    /* A re-read by udev racing with us may have done part of the work;
+     * what counts is that the kernel now has the new table */
+    if (!ok) {
+        count = kernel_partitions(disk, current, MAX_KERNEL_PARTS);
+        ok = count == layout->part_count;
+        for (int i = 0; ok && i < count; i++)
+            ok = kernel_part_matches(&current[i], layout_find(layout, current[i].number));
+        if (!ok)
+            rufus_error("Kernel partitions on %s do not match the new table", device);
+    }
+
+    if (ok && (added || removed))
+        rufus_log("Registered %d and removed %d partition(s) on %s", added, removed, device);
+
+    partition_layout_free(layout);
+    return ok;
+}
+
 bool partition_create_table(const char *device, partition_style_t style)
 {
     struct fdisk_context *cxt = fdisk_new_context();
@@ -186,11 +428,13 @@ bool partition_create_table(const char *device, partition_style_t style)
         return false;
     }
 
+    bool ok = register_partitions(cxt, device);
     fdisk_deassign_device(cxt, 1); /* 1 = sync */
     fdisk_unref_context(cxt);
 
-    rufus_log("Created %s partition table on %s", label_type, device);
-    return true;
+    if (ok)
+        rufus_log("Created %s partition table on %s", label_type, device);
+    return ok;
 }
 
 bool partition_add(const char *device, const partition_entry_t *part, int part_number)
@@ -268,12 +512,14 @@ bool partition_add(const char *device, const partition_entry_t *part, int part_n
         return false;
     }
 
+    bool ok = register_partitions(cxt, device);
     fdisk_unref_partition(pa);
     fdisk_deassign_device(cxt, 1);
     fdisk_unref_context(cxt);
 
-    rufus_log("Added partition %d to %s", part_number, device);
-    return true;
+    if (ok)
+        rufus_log("Added partition %d to %s", part_number, device);
+    return ok;
 }
 
 static bool partition_add_efi(const char *device, const partition_entry_t *part, int part_number)
@@ -342,12 +588,14 @@ static bool partition_add_efi(const char *device, const partition_entry_t *part,
         return false;
     }
 
+    bool ok = register_partitions(cxt, device);
     fdisk_unref_partition(pa);
     fdisk_deassign_device(cxt, 1);
     fdisk_unref_context(cxt);
 
-    rufus_log("Added EFI partition %d to %s", part_number, device);
-    return true;
+    if (ok)
+        rufus_log("Added EFI partition %d to %s", part_number, device);
+    return ok;
 }
 
 bool partition_create_single(const char *device, partition_style_t style,
@@ -361,9 +609,6 @@ bool partition_create_single(const char *device, partition_style_t style,
     if (!partition_create_table(device, style))
         return false;
 
-    /* Wait for kernel to recognize new partition table */
-    usleep(500000);
-
     partition_entry_t part = {
         .start = 0,
         .size = 0, /* Use all space */
@@ -386,8 +631,6 @@ bool partition_create_single_efi(const char *device, partition_style_t style,
     if (!partition_create_table(device, style))
         return false;
 
-    usleep(500000);
-
     partition_entry_t part = {
         .start = 0,
         .size = 0,
@@ -415,8 +658,6 @@ bool partition_create_bootable(const char *device, partition_style_t style,
             if (!partition_create_table(device, style))
                 return false;
 
-            usleep(500000);
-
             /* EFI System Partition (256 MB) */
             partition_entry_t esp = {
                 .start = 0,
@@ -429,8 +670,6 @@ bool partition_create_bootable(const char *device, partition_style_t style,
             if (!partition_add(device, &esp, 1))
                 return false;
 
-            usleep(200000);
-
             /* Main partition */
             partition_entry_t main_part = {
                 .start = 0, /* Auto after ESP */
@@ -448,6 +687,39 @@ bool partition_create_bootable(const char *device, partition_style_t style,
     return partition_create_single(device, style, fs_type, label);
 }
 
+bool partition_create_boot_data(const char *device, uint64_t boot_size,
+                                fs_type_t data_fs)
+{
+    if (!command_exists("sfdisk")) {
+        rufus_error("sfdisk not found; cannot create partitions");
+        return false;
+    }
+
+    unsigned long long boot_start = 2048;
+    unsigned long long boot_sectors = boot_size / 512;
+
+    const char *no_reread;
+    char reread[512];
+    partx_update(device, &no_reread, reread, sizeof(reread));
+
+    char cmd[2048];
+    snprintf(cmd, sizeof(cmd),
+             "sh -c 'printf \"label: dos\\n"
+             "start=%llu, size=%llu, type=%02X, bootable\\n"
+             "start=%llu, type=%02X\\n\" | "
+             "sfdisk --wipe always --wipe-partitions always %s--lock %s%s'",
+             boot_start, boot_sectors, MBR_TYPE_FAT32_LBA,
+             boot_start + boot_sectors, get_mbr_type(data_fs), no_reread, device, reread);
+
+    int rc = run_privileged(cmd);
+    if (rc != 0) {
+        rufus_error("sfdisk failed to partition %s", device);
+        return false;
+    }
+
+    return true;
+}
+
 bool partition_delete_all(const char *device)
 {
     /* Just create a new empty partition table */
@@ -471,6 +743,32 @@ bool partition_delete_all(const char *device)
     return partition_create_table(device, style);
 }
 
+bool partition_wipe_signatures(const char *device)
+{
+    /* A killed extract script leaves its mount behind; lazy unmounts
+     * return at once. --flushbufs (BLKFLSBUF) drops the cached blocks so
+     * the wiped table is what gets read next. partx -d unregisters the old
+     * partitions one by one, so all but a still-held one go away where a
+     * re-read would drop none. */
+    char cmd[1024];
+    snprintf(cmd, sizeof(cmd),
+             "sh -c 'for p in %s?*; do umount -l \"$p\" 2>/dev/null; done; "
+             "wipefs -a -f -q %s || "
+             "dd if=/dev/zero of=%s bs=1M count=1 oflag=direct status=none || exit 1; "
+             "blockdev --flushbufs %s; "
+             "partx -d %s 2>/dev/null || blockdev --rereadpt %s 2>/dev/null; exit 0'",
+             device, device, device, device, device, device);
+
+    int rc = run_privileged(cmd);
+    if (rc != 0) {
+        rufus_error("Failed to wipe signatures on %s", device);
+        return false;
+    }
+
+    rufus_log("Wiped signatures on %s", device);
+    return true;
+}
+
 partition_layout_t *partition_get_layout(const char *device)
 {
     struct fdisk_context *cxt = fdisk_new_context();
@@ -482,42 +780,7 @@ partition_layout_t *partition_get_layout(const char *device)
         return NULL;
     }
 
-    partition_layout_t *layout = calloc(1, sizeof(partition_layout_t));
-    if (!layout) {
-        fdisk_deassign_device(cxt, 0);
-        fdisk_unref_context(cxt);
-        return NULL;
-    }
-
-    if (fdisk_is_label(cxt, GPT))
-        layout->style = PARTITION_STYLE_GPT;
-    else
-        layout->style = PARTITION_STYLE_MBR;
-
-    struct fdisk_table *tb = NULL;
-    if (fdisk_get_partitions(cxt, &tb) == 0 && tb) {
-        size_t n = fdisk_table_get_nents(tb);
-        if (n > 0) {
-            layout->parts = calloc(n, sizeof(partition_entry_t));
-            layout->part_count = 0;
-
-            struct fdisk_iter *itr = fdisk_new_iter(FDISK_ITER_FORWARD);
-            struct fdisk_partition *pa = NULL;
-
-            while (fdisk_table_next_partition(tb, itr, &pa) == 0) {
-                if (fdisk_partition_has_start(pa) && fdisk_partition_has_size(pa)) {
-                    uint64_t sector_size = fdisk_get_sector_size(cxt);
-                    layout->parts[layout->part_count].start =
-                        fdisk_partition_get_start(pa) * sector_size;
-                    layout->parts[layout->part_count].size =
-                        fdisk_partition_get_size(pa) * sector_size;
-                    layout->part_count++;
-                }
-            }
-            fdisk_free_iter(itr);
-        }
-        fdisk_unref_table(tb);
-    }
+    partition_layout_t *layout = read_layout(cxt);
 
     fdisk_deassign_device(cxt, 0);
     fdisk_unref_context(cxt);
@@ -533,6 +796,160 @@ void partition_layout_free(partition_layout_t *layout)
     free(layout);
 }
 
+bool partition_append(const char *device, partition_style_t style,
+                      uint64_t start, fs_type_t fs_type)
+{
+    if (!command_exists("sfdisk")) {
+        rufus_error("sfdisk not found; cannot append partition");
+        return false;
+    }
+
+    /* sfdisk takes the start in 512-byte sectors */
+    unsigned long long start_sector = start / 512;
+
+    char type[64];
+    if (style == PARTITION_STYLE_GPT) {
+        snprintf(type, sizeof(type), "%s", get_gpt_type(fs_type));
+    } else {
+        snprintf(type, sizeof(type), "%02X", get_mbr_type(fs_type));
+    }
+
+    /* gpt-bak-std moves the backup header (and last usable LBA) to the
+     * device end */
+    char relocate[512] = "";
+    if (style == PARTITION_STYLE_GPT)
+        snprintf(relocate, sizeof(relocate), "sfdisk --relocate gpt-bak-std %s && ", device);
+
+    const char *no_reread;
+    char reread[512];
+    partx_update(device, &no_reread, reread, sizeof(reread));
+
+    char cmd[2048];
+    snprintf(cmd, sizeof(cmd),
+             "sh -c '%s"
+             "printf \"start=%llu, type=%s\\n\" | "
+             "sfdisk --append %s--lock %s%s'",
+             relocate, start_sector, type, no_reread, device, reread);
+
+    int rc = run_privileged(cmd);
+    if (rc != 0) {
+        rufus_error("sfdisk failed to append partition on %s", device);
+        return false;
+    }
+
+    rufus_log("Appended partition at %llu on %s", start_sector, device);
+    return true;
+}
+
+bool partition_grow(const char *device, partition_style_t style, int part_number)
+{
+    if (!command_exists("sfdisk")) {
+        rufus_error("sfdisk not found; cannot grow partition");
+        return false;
+    }
+
+    char relocate[512] = "";
+    if (style == PARTITION_STYLE_GPT)
+        snprintf(relocate, sizeof(relocate), "sfdisk --relocate gpt-bak-std %s && ", device);
+
+    const char *no_reread;
+    char reread[512];
+    partx_update(device, &no_reread, reread, sizeof(reread));
+
+    /* ", +" keeps the start and takes all space up to the next partition
+     * or the end of the device */
+    char cmd[2048];
+    snprintf(cmd, sizeof(cmd),
+             "sh -c '%s"
+             "echo \", +\" | sfdisk -N %d %s--lock %s%s'",
+             relocate, part_number, no_reread, device, reread);
+
+    int rc = run_privileged(cmd);
+    if (rc != 0) {
+        rufus_error("sfdisk failed to grow partition %d on %s", part_number, device);
+        return false;
+    }
+
+    rufus_log("Grew partition %d on %s to the end of the device", part_number, device);
+    return true;
+}
+
+/* The kernel partition of disk starting at 'start_sector', or -1 */
+static int find_partition_by_start(const char *disk, uint64_t start_sector)
+{
+    kernel_part_t parts[MAX_KERNEL_PARTS];
+    int count = kernel_partitions(disk, parts, MAX_KERNEL_PARTS);
+
+    for (int i = 0; i < count; i++) {
+        if (parts[i].start == start_sector)
+            return parts[i].number;
+    }
+    return -1;
+}
+
+int partition_wait_for_start(const char *device, uint64_t start, int timeout_ms)
+{
+    const char *disk = strrchr(device, '/');
+    disk = disk ? disk + 1 : device;
+
+    /* sysfs always reports partition start in 512-byte units */
+    for (int waited = 0; waited <= timeout_ms; waited += 100) {
+        int part_number = find_partition_by_start(disk, start / 512);
+        if (part_number > 0) {
+            char *path = partition_get_path(device, part_number);
+            bool ready = path && access(path, F_OK) == 0;
+            free(path);
+            if (ready)
+                return part_number;
+        }
+        usleep(100000);
+    }
+
+    rufus_error("Timed out waiting for new partition on %s", device);
+    return -1;
+}
+
+/* The node must exist and carry the device number the kernel currently
+ * assigns to the partition; a stale node can linger while udev catches up */
+static bool partition_node_ready(const char *path)
+{
+    struct stat st;
+    if (stat(path, &st) != 0 || !S_ISBLK(st.st_mode))
+        return false;
+
+    const char *name = strrchr(path, '/');
+    name = name ? name + 1 : path;
+
+    char sysfs[256];
+    snprintf(sysfs, sizeof(sysfs), "/sys/class/block/%s/dev", name);
+    FILE *fp = fopen(sysfs, "r");
+    if (!fp)
+        return false;
+
+    unsigned int maj = 0, min = 0;
+    int ok = fscanf(fp, "%u:%u", &maj, &min);
+    fclose(fp);
+
+    return ok == 2 && major(st.st_rdev) == maj && minor(st.st_rdev) == min;
+}
+
+char *partition_wait_for_node(const char *device, int part_number, int timeout_ms)
+{
+    char *path = partition_get_path(device, part_number);
+    if (!path)
+        return NULL;
+
+    for (int waited = 0; waited <= timeout_ms; waited += 50) {
+        if (partition_node_ready(path))
+            return path;
+        usleep(50000);
+    }
+
+    rufus_error("Timed out waiting for %s", path);
+    free(path);
+    return NULL;
+}
+
 char *partition_get_path(const char *device, int part_number)
 {
     char *path = malloc(strlen(device) + 16);
@@ -18,6 +18,7 @@ typedef struct {
     fs_type_t fs_type;    /* Filesystem type */
     bool bootable;        /* Set bootable flag (MBR only) */
     const char *label;    /* Partition label (GPT only) */
+    int number;           /* Partition number (set by partition_get_layout) */
 } partition_entry_t;
 
 /* Partition layout */
@@ -48,15 +49,58 @@ bool partition_create_bootable(const char *device, partition_style_t style,
                                target_type_t target, fs_type_t fs_type,
                                const char *label);
 
+/* Create an MBR layout with a bootable FAT32 partition of boot_size bytes at
+ * 1 MiB followed by a data partition filling the rest of the device.
+ */
+bool partition_create_boot_data(const char *device, uint64_t boot_size,
+                                fs_type_t data_fs);
+
 /* Delete all partitions on device */
 bool partition_delete_all(const char *device);
 
+/* Leave the device blank after an interrupted write: unmount anything on
+ * it and wipe the partition table and filesystem signatures, so no half
+ * written layout is recognized.
+ */
+bool partition_wipe_signatures(const char *device);
+
 /* Get current partition layout */
 partition_layout_t *partition_get_layout(const char *device);
 
 /* Free partition layout */
 void partition_layout_free(partition_layout_t *layout);
 
+/* Append a partition from 'start' (bytes) to the end of the device, keeping
+ * existing partitions. On GPT the backup header is first relocated to the
+ * real end of the device (it sits at the image end after a dd write).
+ */
+bool partition_append(const char *device, partition_style_t style,
+                      uint64_t start, fs_type_t fs_type);
+
+/* Grow partition part_number to the end of the device, keeping its start.
+ * On GPT the backup header is first relocated to the real end of the device.
+ */
+bool partition_grow(const char *device, partition_style_t style, int part_number);
+
+/* Take the whole-disk lock udevd honours (flock LOCK_EX). Until it is
+ * released udevd neither re-reads the table when the disk is closed after
+ * a write nor handles the disk's events, so registered partition nodes
+ * stay put while they are formatted. Only taken as root, where tables are
+ * written in process. Returns the descriptor holding it, or -1.
+ */
+int partition_lock_disk(const char *device);
+void partition_unlock_disk(int fd);
+
+/* Wait for the kernel to register the partition starting at 'start' (bytes).
+ * Returns the partition number, or -1 on timeout.
+ */
+int partition_wait_for_start(const char *device, uint64_t start, int timeout_ms);
+
+/* Wait until the device node for a partition is usable.
+ * Returns its path (caller frees), or NULL on timeout.
+ */
+char *partition_wait_for_node(const char *device, int part_number, int timeout_ms);
+
 /* Get the path to a partition (e.g., "/dev/sda1") */
 char *partition_get_path(const char *device, int part_number);
 
@@ -7,11 +7,16 @@
  */
 
 #include "format.h"
+#include "../common/utils.h"
+#include <glib.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <sys/ioctl.h>
 #include <sys/wait.h>
+#include <linux/fs.h>
 #include <errno.h>
 
 /* mkfs command info structure */
@@ -92,6 +97,25 @@ static char **build_mkfs_args(const char *partition_path, const format_options_t
         args[n++] = strdup("-Q");
     }
 
+    /* ext*: lazy init and discard keep mkfs from zero-filling the partition */
+    bool is_ext = (opts->fs_type == FS_EXT2 || opts->fs_type == FS_EXT3 ||
+                   opts->fs_type == FS_EXT4);
+    if (is_ext && (opts->lazy_init || opts->discard)) {
+        char ext_opts[96] = "";
+        if (opts->lazy_init)
+            strcat(ext_opts, "lazy_itable_init=1,lazy_journal_init=1");
+        if (opts->discard)
+            strcat(ext_opts, ext_opts[0] ? ",discard" : "discard");
+        args[n++] = strdup("-E");
+        args[n++] = strdup(ext_opts);
+    }
+
+    /* ext*: populate from a directory without mounting */
+    if (is_ext && opts->populate_dir) {
+        args[n++] = strdup("-d");
+        args[n++] = strdup(opts->populate_dir);
+    }
+
     /* Label */
     if (opts->label && opts->label[0] && info->label_opt) {
         args[n++] = strdup(info->label_opt);
@@ -152,56 +176,36 @@ bool format_partition(const char *partition_path, const format_options_t *option
         return false;
     }
 
-    /* Log the command */
-    char cmd_str[1024] = "";
+    /* Quoted for the helper's shell; labels may hold spaces */
+    GString *cmd = g_string_new(NULL);
     for (int i = 0; args[i]; i++) {
-        if (i > 0)
-            strcat(cmd_str, " ");
-        strcat(cmd_str, args[i]);
+        char *quoted = g_shell_quote(args[i]);
+        g_string_append_printf(cmd, "%s%s", i > 0 ? " " : "", quoted);
+        g_free(quoted);
     }
-    rufus_log("Running: %s", cmd_str);
+    free_args(args);
+    rufus_log("Running: %s", cmd->str);
 
     if (progress)
         progress(0.0, "Starting format...", user_data);
 
-    /* Fork and exec */
-    pid_t pid = fork();
-    if (pid < 0) {
-        rufus_error("Failed to fork: %s", strerror(errno));
-        free_args(args);
+    /* Output is dropped for clean logs */
+    g_string_append(cmd, " >/dev/null 2>&1");
+    pid_t pid = spawn_privileged(cmd->str, NULL, NULL);
+    g_string_free(cmd, TRUE);
+    if (pid < 0)
         return false;
-    }
-
-    if (pid == 0) {
-        /* Child process */
-        /* Redirect stdout/stderr to /dev/null for clean output */
-        freopen("/dev/null", "w", stdout);
-        freopen("/dev/null", "w", stderr);
-
-        /* If not root, use pkexec for privilege escalation */
-        if (geteuid() != 0) {
-            /* Rebuild args with pkexec prepended */
-            char **new_args = calloc(argc + 2, sizeof(char *));
-            new_args[0] = "pkexec";
-            for (int i = 0; i < argc; i++) {
-                new_args[i + 1] = args[i];
-            }
-            new_args[argc + 1] = NULL;
-            execvp("pkexec", new_args);
-        } else {
-            execvp(args[0], args);
-        }
-        _exit(127);
-    }
-
-    /* Parent process */
-    free_args(args);
 
     /* Wait for completion with simulated progress */
-    int status;
+    int status = -1;
     int elapsed = 0;
-    while (waitpid(pid, &status, WNOHANG) == 0) {
-        usleep(100000); /* 100ms */
+    while (poll_privileged(pid, &status) == 0) {
+        if (thread_cancelled()) {
+            rufus_log("Format of %s cancelled", partition_path);
+            wait_privileged(pid);
+            return false;
+        }
+        usleep(CANCEL_POLL_MS * 1000);
         elapsed++;
         if (progress) {
             /* Simulate progress (formatting is usually fast) */
@@ -223,6 +227,190 @@ bool format_partition(const char *partition_path, const format_options_t *option
     return false;
 }
 
+/* ============== Growing ============== */
+
+/* Largest valid FAT32 cluster count (entries 0x0FFFFFF6 and up are reserved) */
+#define FAT32_MAX_CLUSTERS 0x0FFFFFF4U
+
+static uint16_t get_le16(const uint8_t *p)
+{
+    return p[0] | p[1] << 8;
+}
+
+static uint32_t get_le32(const uint8_t *p)
+{
+    return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static void put_le32(uint8_t *p, uint32_t v)
+{
+    p[0] = v;
+    p[1] = v >> 8;
+    p[2] = v >> 16;
+    p[3] = v >> 24;
+}
+
+/* Point the boot sector at sector 'sector' to the new size, and credit the
+ * added clusters to the FSInfo sector that follows it */
+static bool fat32_update_boot(int fd, uint64_t sector, uint32_t bps, uint16_t fsinfo,
+                              uint32_t total, uint32_t added)
+{
+    uint8_t buf[512];
+    if (pread(fd, buf, sizeof(buf), sector * bps) != (ssize_t)sizeof(buf))
+        return false;
+    put_le32(buf + 32, total);
+    if (pwrite(fd, buf, sizeof(buf), sector * bps) != (ssize_t)sizeof(buf))
+        return false;
+
+    if (!fsinfo || fsinfo == 0xFFFF)
+        return true;
+
+    uint64_t info = (sector + fsinfo) * bps;
+    if (pread(fd, buf, sizeof(buf), info) != (ssize_t)sizeof(buf) ||
+        get_le32(buf) != 0x41615252 || get_le32(buf + 484) != 0x61417272)
+        return true;
+
+    uint32_t free_count = get_le32(buf + 488);
+    if (free_count != 0xFFFFFFFF) {
+        put_le32(buf + 488, free_count + added);
+        if (pwrite(fd, buf, sizeof(buf), info) != (ssize_t)sizeof(buf))
+            return false;
+    }
+    return true;
+}
+
+/* Extend a FAT32 volume over its grown partition without moving anything.
+ * The FATs keep their size, so the volume grows as far as they can address
+ * (images meant to be grown should be made with FATs sized for the
+ * largest stick). */
+static bool fat32_grow_in_place(const char *partition_path)
+{
+    int fd = open(partition_path, O_RDWR | O_CLOEXEC);
+    if (fd < 0) {
+        rufus_error("Cannot open %s: %s", partition_path, strerror(errno));
+        return false;
+    }
+
+    uint8_t bs[512];
+    uint64_t part_bytes = 0;
+    if (pread(fd, bs, sizeof(bs), 0) != (ssize_t)sizeof(bs) ||
+        memcmp(bs + 82, "FAT32   ", 8) != 0 || bs[510] != 0x55 || bs[511] != 0xAA ||
+        ioctl(fd, BLKGETSIZE64, &part_bytes) != 0) {
+        close(fd);
+        return false;
+    }
+
+    uint32_t bps = get_le16(bs + 11);
+    uint32_t spc = bs[13];
+    uint32_t reserved = get_le16(bs + 14);
+    uint32_t fats = bs[16];
+    uint32_t total = get_le32(bs + 32);
+    uint32_t fat_sectors = get_le32(bs + 36);
+    uint16_t fsinfo = get_le16(bs + 48);
+    uint16_t backup = get_le16(bs + 50);
+    if (!bps || !spc || !fats || !fat_sectors) {
+        close(fd);
+        return false;
+    }
+
+    uint64_t data_start = reserved + (uint64_t)fats * fat_sectors;
+    uint64_t part_sectors = part_bytes / bps;
+    if (part_sectors > UINT32_MAX)
+        part_sectors = UINT32_MAX;
+    if (part_sectors <= data_start || total <= data_start) {
+        close(fd);
+        return false;
+    }
+
+    uint32_t old_clusters = (total - data_start) / spc;
+    uint64_t fat_capacity = (uint64_t)fat_sectors * bps / 4 - 2;
+    uint64_t new_clusters = (part_sectors - data_start) / spc;
+    if (new_clusters > fat_capacity)
+        new_clusters = fat_capacity;
+    if (new_clusters > FAT32_MAX_CLUSTERS)
+        new_clusters = FAT32_MAX_CLUSTERS;
+
+    if (new_clusters <= old_clusters) {
+        rufus_log("FAT on %s has no room for more clusters", partition_path);
+        close(fd);
+        return false;
+    }
+
+    /* Entries past the old end may hold anything; mark them free first */
+    bool ok = true;
+    uint64_t first = ((uint64_t)old_clusters + 2) * 4;
+    uint64_t end = (new_clusters + 2) * 4;
+    uint8_t *zero = calloc(1, 65536);
+    for (uint32_t i = 0; ok && zero && i < fats; i++) {
+        uint64_t base = (reserved + (uint64_t)i * fat_sectors) * bps;
+        for (uint64_t off = first; ok && off < end; ) {
+            size_t len = end - off < 65536 ? end - off : 65536;
+            ok = pwrite(fd, zero, len, base + off) == (ssize_t)len;
+            off += len;
+        }
+    }
+    free(zero);
+
+    uint32_t new_total = data_start + new_clusters * spc;
+    uint32_t added = new_clusters - old_clusters;
+    ok = ok && fat32_update_boot(fd, 0, bps, fsinfo, new_total, added);
+    if (ok && backup && backup != 0xFFFF)
+        ok = fat32_update_boot(fd, backup, bps, fsinfo, new_total, added);
+    ok = ok && fsync(fd) == 0;
+    close(fd);
+
+    if (ok)
+        rufus_log("Grew FAT32 on %s from %u to %llu clusters", partition_path,
+                  old_clusters, (unsigned long long)new_clusters);
+    else
+        rufus_error("Failed to grow FAT32 on %s", partition_path);
+    return ok;
+}
+
+bool format_grow(const char *partition_path, fs_type_t fs_type)
+{
+    if (!partition_path)
+        return false;
+
+    char cmd[1024];
+    switch (fs_type) {
+    case FS_EXT2:
+    case FS_EXT3:
+    case FS_EXT4:
+        /* resize2fs wants a freshly checked filesystem; e2fsck -p exits 1
+         * when it fixed something */
+        snprintf(cmd, sizeof(cmd), "sh -c 'e2fsck -f -p %s; [ $? -le 1 ] && resize2fs %s'",
+                 partition_path, partition_path);
+        break;
+    case FS_FAT32:
+        if (is_root() && fat32_grow_in_place(partition_path))
+            return true;
+        if (!command_exists("fatresize")) {
+            rufus_error("Growing FAT32 beyond its FAT needs fatresize");
+            return false;
+        }
+        snprintf(cmd, sizeof(cmd), "fatresize -f -s max %s", partition_path);
+        break;
+    case FS_NTFS:
+        if (!command_exists("ntfsresize")) {
+            rufus_error("Growing NTFS needs ntfsresize");
+            return false;
+        }
+        snprintf(cmd, sizeof(cmd), "ntfsresize -f %s", partition_path);
+        break;
+    default:
+        rufus_error("Cannot grow %s in place", fs_type_name(fs_type));
+        return false;
+    }
+
+    rufus_log("Growing %s on %s", fs_type_name(fs_type), partition_path);
+    if (run_privileged(cmd) != 0) {
+        rufus_error("Failed to grow %s on %s", fs_type_name(fs_type), partition_path);
+        return false;
+    }
+    return true;
+}
+
 bool format_sync(const char *partition_path, fs_type_t fs_type,
                  const char *label, uint32_t cluster_size)
 {
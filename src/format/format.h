@@ -17,6 +17,9 @@ typedef struct {
     const char *label;       /* Volume label */
     uint32_t cluster_size;   /* Cluster size (0 = default) */
     bool quick_format;       /* Quick format (no bad block check) */
+    bool lazy_init;          /* ext*: defer inode table/journal zeroing */
+    bool discard;            /* ext*: discard blocks instead of zero-filling */
+    const char *populate_dir; /* ext*: copy this directory into the new fs (mke2fs -d) */
 } format_options_t;
 
 /* Format progress callback */
@@ -37,6 +40,13 @@ bool format_is_supported(fs_type_t fs_type);
 /* Get the mkfs command for a filesystem */
 const char *format_get_mkfs_command(fs_type_t fs_type);
 
+/* Grow the filesystem on a partition to fill it, touching only metadata.
+ * ext2/3/4 use resize2fs and NTFS ntfsresize. FAT32 is extended in place
+ * as far as its FATs reach, with fatresize as the fallback. exFAT is not
+ * supported.
+ */
+bool format_grow(const char *partition_path, fs_type_t fs_type);
+
 /* Synchronous format with optional label setting */
 bool format_sync(const char *partition_path, fs_type_t fs_type,
                  const char *label, uint32_t cluster_size);
@@ -0,0 +1,50 @@
+/*
+ * Rufux - Image Catalog
+ * Francesco Lauritano
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ *
+ * Watches image directories with inotify and analyzes new or changed
+ * images in the background at idle I/O priority: ISO metadata, SHA-256 and
+ * the Merkle root of their chunks. Results persist in an index under
+ * ~/.cache/rufux so picking a known image needs no analysis at all.
+ */
+
+#ifndef RUFUS_CATALOG_H
+#define RUFUS_CATALOG_H
+
+#include "iso_analyzer.h"
+#include "../common/hash.h"
+#include <stdbool.h>
+#include <stdint.h>
+
+typedef struct {
+    char *path;
+    char *name;               /* File name for display */
+    uint64_t size;
+    int64_t mtime;
+    iso_info_t *info;         /* NULL until analyzed */
+    char sha256[SHA256_DIGEST_SIZE * 2 + 1];
+    char root[SHA256_DIGEST_SIZE * 2 + 1];  /* Merkle root of the image chunks */
+} catalog_entry_t;
+
+typedef struct {
+    catalog_entry_t *entries;
+    int count;
+} catalog_list_t;
+
+/* Called from a worker thread or the main context whenever entries were
+ * added, analyzed or removed */
+typedef void (*catalog_change_callback_t)(void *user_data);
+
+/* Load the index and start watching dirs (NULL-terminated) */
+bool catalog_start(char *const *dirs, catalog_change_callback_t callback, void *user_data);
+void catalog_stop(void);
+
+/* Snapshot of all images sorted by name (free with catalog_list_free) */
+catalog_list_t *catalog_list(void);
+void catalog_list_free(catalog_list_t *list);
+
+/* Copy of the analysis of an image that is still current, or NULL */
+iso_info_t *catalog_entry_info(const catalog_entry_t *entry);
+
+#endif /* RUFUS_CATALOG_H */
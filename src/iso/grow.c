@@ -0,0 +1,123 @@
+/*
+ * Rufux - Compact Image Growing Implementation
+ * Francesco Lauritano
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ *
+ * The image's own partition table tells which partition is last; its boot
+ * sector or superblock tells what filesystem it holds. The device is then
+ * handled like persistence: sfdisk moves the backup GPT to the real end of
+ * the stick, and the partition and filesystem are grown into the space.
+ */
+
+#define _GNU_SOURCE
+#include "grow.h"
+#include "http_source.h"
+#include "../disk/partition.h"
+#include "../format/format.h"
+#include "../common/utils.h"
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define PARTITION_WAIT_MS 10000
+
+/* Index of the partition with the highest start, or -1 */
+static int last_partition(const partition_layout_t *layout)
+{
+    int last = -1;
+    for (int i = 0; layout && i < layout->part_count; i++) {
+        if (last < 0 || layout->parts[i].start > layout->parts[last].start)
+            last = i;
+    }
+    return last;
+}
+
+static fs_type_t probe_filesystem(int fd, uint64_t offset)
+{
+    uint8_t buf[2048];
+    if (pread(fd, buf, sizeof(buf), offset) != (ssize_t)sizeof(buf))
+        return FS_UNKNOWN;
+
+    if (buf[0x438] == 0x53 && buf[0x439] == 0xEF)
+        return FS_EXT4;
+    if (memcmp(buf + 3, "NTFS    ", 8) == 0)
+        return FS_NTFS;
+    /* exFAT has no in-place grow tool, so it stays FS_UNKNOWN and the
+     * image is written as is */
+    if (memcmp(buf + 82, "FAT32   ", 8) == 0 && buf[510] == 0x55 && buf[511] == 0xAA)
+        return FS_FAT32;
+    return FS_UNKNOWN;
+}
+
+fs_type_t grow_probe(const char *image_path)
+{
+    if (!image_path || http_source_is_url(image_path))
+        return FS_UNKNOWN;
+
+    int fd = open(image_path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return FS_UNKNOWN;
+
+    /* Hybrid ISOs map their partitions onto the ISO9660 filesystem; moving
+     * anything there breaks the image */
+    char cd[5];
+    if (pread(fd, cd, sizeof(cd), 0x8001) == (ssize_t)sizeof(cd) &&
+        memcmp(cd, "CD001", 5) == 0) {
+        close(fd);
+        return FS_UNKNOWN;
+    }
+
+    fs_type_t fs = FS_UNKNOWN;
+    partition_layout_t *layout = partition_get_layout(image_path);
+    int last = last_partition(layout);
+    if (last >= 0)
+        fs = probe_filesystem(fd, layout->parts[last].start);
+
+    partition_layout_free(layout);
+    close(fd);
+    return fs;
+}
+
+bool grow_after_write(const char *device_path, const char *image_path,
+                      iso_extract_progress_t progress, void *user_data)
+{
+    if (!device_path || !image_path) {
+        rufus_error("Invalid arguments to grow_after_write");
+        return false;
+    }
+
+    fs_type_t fs = grow_probe(image_path);
+    partition_layout_t *layout = partition_get_layout(image_path);
+    int last = last_partition(layout);
+    if (fs == FS_UNKNOWN || last < 0) {
+        rufus_error("%s has no partition that can be grown", image_path);
+        partition_layout_free(layout);
+        return false;
+    }
+
+    partition_style_t style = layout->style;
+    int part_number = layout->parts[last].number;
+    partition_layout_free(layout);
+
+    if (progress)
+        progress(0.0, "Growing partition...", user_data);
+
+    if (!partition_grow(device_path, style, part_number))
+        return false;
+
+    char *part_path = partition_wait_for_node(device_path, part_number, PARTITION_WAIT_MS);
+    if (!part_path)
+        return false;
+
+    if (progress)
+        progress(0.5, "Growing filesystem...", user_data);
+
+    bool ok = format_grow(part_path, fs);
+    free(part_path);
+
+    if (progress)
+        progress(ok ? 1.0 : 0.0, ok ? "Complete" : "Failed", user_data);
+    return ok;
+}
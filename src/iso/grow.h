@@ -0,0 +1,29 @@
+/*
+ * Rufux - Compact Image Growing
+ * Francesco Lauritano
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ *
+ * Stretch a compact disk image over the whole stick after it has been
+ * written raw: the last partition is grown to the end of the device and its
+ * filesystem is grown in place, touching only metadata.
+ */
+
+#ifndef RUFUS_GROW_H
+#define RUFUS_GROW_H
+
+#include "iso_extract.h"
+#include "../platform/platform.h"
+#include <stdbool.h>
+
+/* Filesystem of the image's last partition when it can be grown after a
+ * raw write, FS_UNKNOWN otherwise (hybrid ISOs, URLs, unsupported types).
+ */
+fs_type_t grow_probe(const char *image_path);
+
+/* Grow the last partition of the image written to device_path, and its
+ * filesystem, to the end of the device.
+ */
+bool grow_after_write(const char *device_path, const char *image_path,
+                      iso_extract_progress_t progress, void *user_data);
+
+#endif /* RUFUS_GROW_H */
@@ -0,0 +1,492 @@
+/*
+ * Rufux - HTTP Image Source Implementation
+ * Francesco Lauritano
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ *
+ * Every read is one Range request on a pooled curl handle, so reader
+ * threads keep their connections alive. A request that drops or stalls is
+ * reissued for the bytes still missing; If-Range makes sure the resumed
+ * bytes come from the same version of the image. http_source_abort ends
+ * transfers in flight from curl's progress callback, which runs at least
+ * once a second even on a stalled connection, and stops further retries.
+ */
+
+#define _GNU_SOURCE
+#include "http_source.h"
+#include "../platform/platform.h"
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#ifdef HAVE_LIBCURL
+#include <curl/curl.h>
+#endif
+
+#define FETCH_RETRIES       5
+#define FETCH_RETRY_US      500000
+#define ABORT_POLL_US       50000
+#define CONNECT_TIMEOUT_S   15
+#define STALL_SPEED         1024    /* Bytes/s below which a request is stalled */
+#define STALL_TIME_S        30
+#define SIDECAR_MAX_SIZE    (1024 * 1024)
+
+bool http_source_is_url(const char *path)
+{
+    return path && (strncasecmp(path, "http://", 7) == 0 ||
+                    strncasecmp(path, "https://", 8) == 0);
+}
+
+#ifdef HAVE_LIBCURL
+
+struct http_source {
+    char *url;              /* After redirects */
+    char *validator;        /* Strong ETag or Last-Modified for If-Range */
+    uint64_t size;
+    atomic_bool aborted;
+
+    pthread_mutex_t lock;
+    CURL **idle;
+    int idle_count;
+    int idle_cap;
+};
+
+typedef struct {
+    uint8_t *buf;
+    size_t len;
+    size_t got;
+} range_t;
+
+typedef struct {
+    char *etag;
+    char *last_modified;
+} probe_t;
+
+static pthread_once_t curl_once = PTHREAD_ONCE_INIT;
+
+static void curl_init_once(void)
+{
+    curl_global_init(CURL_GLOBAL_DEFAULT);
+}
+
+static size_t range_write(char *data, size_t size, size_t nmemb, void *user_data)
+{
+    range_t *r = user_data;
+    size_t n = size * nmemb;
+
+    /* More than asked for: the server ignored the Range header */
+    if (n > r->len - r->got)
+        return 0;
+
+    memcpy(r->buf + r->got, data, n);
+    r->got += n;
+    return n;
+}
+
+static size_t text_write(char *data, size_t size, size_t nmemb, void *user_data)
+{
+    range_t *r = user_data;
+    size_t n = size * nmemb;
+
+    if (r->got + n > SIDECAR_MAX_SIZE)
+        return 0;
+
+    if (r->got + n + 1 > r->len) {
+        size_t cap = (r->got + n + 1) * 2;
+        uint8_t *buf = realloc(r->buf, cap);
+        if (!buf)
+            return 0;
+        r->buf = buf;
+        r->len = cap;
+    }
+
+    memcpy(r->buf + r->got, data, n);
+    r->got += n;
+    r->buf[r->got] = '\0';
+    return n;
+}
+
+static char *header_value(const char *line, size_t len, const char *name)
+{
+    size_t name_len = strlen(name);
+    if (len <= name_len || strncasecmp(line, name, name_len) != 0)
+        return NULL;
+
+    const char *start = line + name_len;
+    const char *end = line + len;
+    while (start < end && (*start == ' ' || *start == '\t'))
+        start++;
+    while (end > start && (end[-1] == '\r' || end[-1] == '\n' || end[-1] == ' '))
+        end--;
+    return strndup(start, end - start);
+}
+
+static size_t probe_header(char *data, size_t size, size_t nmemb, void *user_data)
+{
+    probe_t *probe = user_data;
+    size_t n = size * nmemb;
+    char *value;
+
+    /* Only the headers of the final response after redirects count */
+    if (n > 5 && strncmp(data, "HTTP/", 5) == 0) {
+        safe_free(probe->etag);
+        safe_free(probe->last_modified);
+    } else if ((value = header_value(data, n, "ETag:"))) {
+        free(probe->etag);
+        probe->etag = value;
+    } else if ((value = header_value(data, n, "Last-Modified:"))) {
+        free(probe->last_modified);
+        probe->last_modified = value;
+    }
+
+    return n;
+}
+
+static int abort_check(void *user_data, curl_off_t dltotal, curl_off_t dlnow,
+                       curl_off_t ultotal, curl_off_t ulnow)
+{
+    (void)dltotal;
+    (void)dlnow;
+    (void)ultotal;
+    (void)ulnow;
+    http_source_t *http = user_data;
+    return http && atomic_load(&http->aborted);
+}
+
+/* http may be NULL while probing */
+static void setup_handle(CURL *curl, http_source_t *http, const char *url)
+{
+    curl_easy_reset(curl);
+    curl_easy_setopt(curl, CURLOPT_URL, url);
+    curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1L);
+    curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1L);
+    curl_easy_setopt(curl, CURLOPT_FAILONERROR, 1L);
+    curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT, (long)CONNECT_TIMEOUT_S);
+    curl_easy_setopt(curl, CURLOPT_LOW_SPEED_LIMIT, (long)STALL_SPEED);
+    curl_easy_setopt(curl, CURLOPT_LOW_SPEED_TIME, (long)STALL_TIME_S);
+    curl_easy_setopt(curl, CURLOPT_USERAGENT, "rufux");
+    curl_easy_setopt(curl, CURLOPT_NOPROGRESS, 0L);
+    curl_easy_setopt(curl, CURLOPT_XFERINFOFUNCTION, abort_check);
+    curl_easy_setopt(curl, CURLOPT_XFERINFODATA, http);
+}
+
+static CURL *handle_get(http_source_t *http)
+{
+    CURL *curl = NULL;
+
+    pthread_mutex_lock(&http->lock);
+    if (http->idle_count > 0)
+        curl = http->idle[--http->idle_count];
+    pthread_mutex_unlock(&http->lock);
+
+    return curl ? curl : curl_easy_init();
+}
+
+static void handle_put(http_source_t *http, CURL *curl)
+{
+    pthread_mutex_lock(&http->lock);
+    if (http->idle_count == http->idle_cap) {
+        int cap = http->idle_cap ? http->idle_cap * 2 : HTTP_SOURCE_MIN_CONNECTIONS;
+        CURL **idle = realloc(http->idle, cap * sizeof(CURL *));
+        if (!idle) {
+            pthread_mutex_unlock(&http->lock);
+            curl_easy_cleanup(curl);
+            return;
+        }
+        http->idle = idle;
+        http->idle_cap = cap;
+    }
+    http->idle[http->idle_count++] = curl;
+    pthread_mutex_unlock(&http->lock);
+}
+
+http_source_t *http_source_open(const char *url)
+{
+    if (!http_source_is_url(url))
+        return NULL;
+
+    pthread_once(&curl_once, curl_init_once);
+
+    CURL *curl = curl_easy_init();
+    if (!curl)
+        return NULL;
+
+    probe_t probe = { 0 };
+    setup_handle(curl, NULL, url);
+    curl_easy_setopt(curl, CURLOPT_NOBODY, 1L);
+    curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, probe_header);
+    curl_easy_setopt(curl, CURLOPT_HEADERDATA, &probe);
+
+    CURLcode res = curl_easy_perform(curl);
+    curl_off_t length = -1;
+    const char *effective = NULL;
+    if (res == CURLE_OK) {
+        curl_easy_getinfo(curl, CURLINFO_CONTENT_LENGTH_DOWNLOAD_T, &length);
+        curl_easy_getinfo(curl, CURLINFO_EFFECTIVE_URL, &effective);
+    }
+
+    http_source_t *http = NULL;
+    if (res != CURLE_OK) {
+        rufus_error("Cannot reach %s: %s", url, curl_easy_strerror(res));
+    } else if (length <= 0) {
+        rufus_error("Server did not report the size of %s", url);
+    } else if ((http = calloc(1, sizeof(http_source_t)))) {
+        pthread_mutex_init(&http->lock, NULL);
+        http->url = strdup(effective ? effective : url);
+        http->size = (uint64_t)length;
+
+        /* Weak ETags cannot be used with If-Range */
+        if (probe.etag && strncmp(probe.etag, "W/", 2) != 0) {
+            http->validator = probe.etag;
+            probe.etag = NULL;
+        } else if (probe.last_modified) {
+            http->validator = probe.last_modified;
+            probe.last_modified = NULL;
+        }
+
+        rufus_log("Streaming %s (%llu bytes) with Range requests", http->url,
+                  (unsigned long long)http->size);
+        handle_put(http, curl);
+        curl = NULL;
+    }
+
+    free(probe.etag);
+    free(probe.last_modified);
+    if (curl)
+        curl_easy_cleanup(curl);
+    return http;
+}
+
+uint64_t http_source_size(http_source_t *http)
+{
+    return http ? http->size : 0;
+}
+
+bool http_source_pread(http_source_t *http, void *buf, size_t len, uint64_t offset)
+{
+    if (!http || !buf || offset + len > http->size)
+        return false;
+    if (len == 0)
+        return true;
+
+    CURL *curl = handle_get(http);
+    if (!curl)
+        return false;
+
+    struct curl_slist *headers = NULL;
+    if (http->validator) {
+        char *if_range = NULL;
+        if (asprintf(&if_range, "If-Range: %s", http->validator) >= 0) {
+            headers = curl_slist_append(headers, if_range);
+            free(if_range);
+        }
+    }
+
+    range_t r = { .buf = buf, .len = len };
+    bool whole = offset == 0 && len == http->size;
+    bool ok = false;
+    int retries = 0;
+
+    for (;;) {
+        char range[64];
+        snprintf(range, sizeof(range), "%llu-%llu",
+                 (unsigned long long)(offset + r.got),
+                 (unsigned long long)(offset + len - 1));
+
+        size_t before = r.got;
+        setup_handle(curl, http, http->url);
+        curl_easy_setopt(curl, CURLOPT_RANGE, range);
+        curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
+        curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, range_write);
+        curl_easy_setopt(curl, CURLOPT_WRITEDATA, &r);
+
+        CURLcode res = curl_easy_perform(curl);
+        long code = 0;
+        curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &code);
+
+        if (r.got == len && (code == 206 || (code == 200 && whole && before == 0))) {
+            ok = true;
+            break;
+        }
+
+        if (atomic_load(&http->aborted))
+            break;
+
+        if (code == 200) {
+            rufus_error("Server ignored the range request for %s (image changed?)", http->url);
+            break;
+        }
+
+        if (code >= 400 && code < 500) {
+            rufus_error("Failed to fetch %s: HTTP %ld", http->url, code);
+            break;
+        }
+
+        /* Progress since the last attempt means the connection works */
+        if (r.got > before)
+            retries = 0;
+
+        if (++retries > FETCH_RETRIES) {
+            rufus_error("Failed to fetch %s at %llu: %s", http->url,
+                        (unsigned long long)(offset + r.got), curl_easy_strerror(res));
+            break;
+        }
+
+        rufus_log("Connection to %s dropped at %llu, resuming", http->url,
+                  (unsigned long long)(offset + r.got));
+        for (long slept = 0; slept < (long)FETCH_RETRY_US * retries &&
+                             !atomic_load(&http->aborted); slept += ABORT_POLL_US)
+            usleep(ABORT_POLL_US);
+    }
+
+    curl_slist_free_all(headers);
+    handle_put(http, curl);
+    return ok;
+}
+
+/* Small text file next to the image, NULL if missing */
+static char *fetch_text(http_source_t *http, const char *url, size_t *len)
+{
+    CURL *curl = handle_get(http);
+    if (!curl)
+        return NULL;
+
+    range_t r = { 0 };
+    setup_handle(curl, http, url);
+    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, text_write);
+    curl_easy_setopt(curl, CURLOPT_WRITEDATA, &r);
+    CURLcode res = curl_easy_perform(curl);
+    handle_put(http, curl);
+
+    if (res != CURLE_OK || !r.got) {
+        free(r.buf);
+        return NULL;
+    }
+
+    *len = r.got;
+    return (char *)r.buf;
+}
+
+hash_sidecar_t *http_source_sidecar(http_source_t *http)
+{
+    if (!http)
+        return NULL;
+
+    /* Checksum files sit next to the image, not next to its query string */
+    char *base = strndup(http->url, strcspn(http->url, "?#"));
+    if (!base)
+        return NULL;
+
+    char *slash = strrchr(base, '/');
+    const char *image = slash ? slash + 1 : base;
+    int dir_len = slash ? (int)(slash - base) : 0;
+
+    /* Per-image files first, then lists for the whole directory */
+    static const char *image_exts[] = { "sha512", "sha256", "sha1", "md5" };
+    static const char *dir_lists[] = {
+        "SHA512SUMS", "SHA256SUMS", "sha256sum.txt", "CHECKSUM", "SHA1SUMS", "MD5SUMS"
+    };
+
+    char *names[sizeof(image_exts) / sizeof(image_exts[0]) +
+                sizeof(dir_lists) / sizeof(dir_lists[0])];
+    int count = 0;
+    for (size_t i = 0; i < sizeof(image_exts) / sizeof(image_exts[0]); i++) {
+        if (asprintf(&names[count], "%s.%s", image, image_exts[i]) >= 0)
+            count++;
+    }
+    for (size_t i = 0; i < sizeof(dir_lists) / sizeof(dir_lists[0]); i++)
+        names[count++] = strdup(dir_lists[i]);
+
+    hash_sidecar_t best = { 0 };
+    for (int i = 0; i < count && !best.source; i++) {
+        char *url = NULL;
+        if (!names[i] || asprintf(&url, "%.*s/%s", dir_len, base, names[i]) < 0)
+            continue;
+
+        size_t len = 0;
+        char *text = fetch_text(http, url, &len);
+        if (text && hash_sidecar_parse(text, len, names[i], image, &best))
+            rufus_log("Found %s checksum for %s in %s", hash_type_name(best.type), image, url);
+
+        free(text);
+        free(url);
+    }
+
+    for (int i = 0; i < count; i++)
+        free(names[i]);
+    free(base);
+    if (!best.source)
+        return NULL;
+
+    hash_sidecar_t *sidecar = malloc(sizeof(hash_sidecar_t));
+    if (!sidecar) {
+        free(best.source);
+        return NULL;
+    }
+    *sidecar = best;
+    return sidecar;
+}
+
+void http_source_abort(http_source_t *http)
+{
+    if (http)
+        atomic_store(&http->aborted, true);
+}
+
+void http_source_close(http_source_t *http)
+{
+    if (!http)
+        return;
+
+    for (int i = 0; i < http->idle_count; i++)
+        curl_easy_cleanup(http->idle[i]);
+
+    pthread_mutex_destroy(&http->lock);
+    free(http->idle);
+    free(http->validator);
+    free(http->url);
+    free(http);
+}
+
+#else /* !HAVE_LIBCURL */
+
+http_source_t *http_source_open(const char *url)
+{
+    rufus_error("Cannot stream %s: built without libcurl", url);
+    return NULL;
+}
+
+uint64_t http_source_size(http_source_t *http)
+{
+    (void)http;
+    return 0;
+}
+
+bool http_source_pread(http_source_t *http, void *buf, size_t len, uint64_t offset)
+{
+    (void)http;
+    (void)buf;
+    (void)len;
+    (void)offset;
+    return false;
+}
+
+hash_sidecar_t *http_source_sidecar(http_source_t *http)
+{
+    (void)http;
+    return NULL;
+}
+
+void http_source_abort(http_source_t *http)
+{
+    (void)http;
+}
+
+void http_source_close(http_source_t *http)
+{
+    (void)http;
+}
+
+#endif /* HAVE_LIBCURL */
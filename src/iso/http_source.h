@@ -0,0 +1,47 @@
+/*
+ * Rufux - HTTP Image Source
+ * Francesco Lauritano
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ *
+ * Random access to images on HTTP(S) servers through Range requests, so
+ * the readahead ring can fetch several chunks at once and write straight
+ * to the stick without a local download. Needs libcurl (HAVE_LIBCURL).
+ */
+
+#ifndef RUFUS_HTTP_SOURCE_H
+#define RUFUS_HTTP_SOURCE_H
+
+#include "../common/hash.h"
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+
+/* Parallel Range requests used when fewer reader threads are configured */
+#define HTTP_SOURCE_MIN_CONNECTIONS 4
+
+typedef struct http_source http_source_t;
+
+/* True for http:// and https:// URLs */
+bool http_source_is_url(const char *path);
+
+/* Probe the image size and validator (NULL on error) */
+http_source_t *http_source_open(const char *url);
+
+/* Image size in bytes */
+uint64_t http_source_size(http_source_t *http);
+
+/* Read len bytes at offset (thread-safe). A dropped connection resumes
+ * from the last byte received. */
+bool http_source_pread(http_source_t *http, void *buf, size_t len, uint64_t offset);
+
+/* Published digest for the image from <url>.sha256, SHA256SUMS and similar
+ * files next to it, or NULL */
+hash_sidecar_t *http_source_sidecar(http_source_t *http);
+
+/* Make reads in progress and from now on fail within about a second
+ * (thread-safe), for cancelling before http_source_close */
+void http_source_abort(http_source_t *http);
+
+void http_source_close(http_source_t *http);
+
+#endif /* RUFUS_HTTP_SOURCE_H */
@@ -0,0 +1,417 @@
+/*
+ * Rufux - Image Staging Cache Implementation
+ * Francesco Lauritano
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ *
+ * Layout of the cache directory:
+ *   <key>.img          committed image, mtime is the last use
+ *   <key>.sha256       sha256sum-style digest of the image
+ *   <key>.<pid>.part   entry being filled, flock()ed by its writer
+ *   .lock              serializes eviction between processes
+ *
+ * /dev/shm is world-writable, so the directory is only used when it is a
+ * real directory owned by us with mode 0700, and every entry is hashed
+ * again before it is served: a .sha256 file is a claim, not a proof.
+ */
+
+#define _GNU_SOURCE
+#include "image_cache.h"
+#include "../common/hash.h"
+#include "../platform/platform.h"
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#define CACHE_ROOT "/dev/shm"
+
+struct image_cache_entry {
+    char *img_path;
+    char *part_path;
+    char *digest_path;
+    int fd;
+    uint8_t *data;
+    uint64_t size;
+    bool filling;
+    char digest[SHA256_DIGEST_SIZE * 2 + 1];
+};
+
+typedef struct {
+    char *name;
+    uint64_t size;
+    time_t mtime;
+} cache_file_t;
+
+static char *cache_dir(void)
+{
+    char *dir = malloc(64);
+    if (!dir)
+        return NULL;
+    snprintf(dir, 64, CACHE_ROOT "/rufux-cache-%u", (unsigned)getuid());
+
+    if (mkdir(dir, 0700) != 0 && errno != EEXIST) {
+        rufus_error("Cannot create image cache %s: %s", dir, strerror(errno));
+        free(dir);
+        return NULL;
+    }
+
+    /* Someone else may have created it first */
+    struct stat st;
+    if (lstat(dir, &st) != 0 || !S_ISDIR(st.st_mode) || st.st_uid != getuid() ||
+        (st.st_mode & 07777) != 0700) {
+        rufus_error("Not using image cache %s: not a private directory of ours", dir);
+        free(dir);
+        return NULL;
+    }
+
+    return dir;
+}
+
+char *image_cache_key(const char *path, const struct stat *st)
+{
+    char identity[4096 + 128];
+    int len = snprintf(identity, sizeof(identity), "%s|%lu|%lu|%llu|%lld",
+                       path, (unsigned long)st->st_dev, (unsigned long)st->st_ino,
+                       (unsigned long long)st->st_size, (long long)st->st_mtime);
+
+    uint8_t digest[SHA256_DIGEST_SIZE];
+    if (!hash_buffer(HASH_SHA256, identity, len, digest, sizeof(digest)))
+        return NULL;
+
+    char hex[SHA256_DIGEST_SIZE * 2 + 1];
+    hash_digest_to_hex(digest, 16, hex);
+    return strdup(hex);
+}
+
+static image_cache_entry_t *entry_new(const char *path, const struct stat *st)
+{
+    char *dir = cache_dir();
+    char *key = image_cache_key(path, st);
+    image_cache_entry_t *entry = calloc(1, sizeof(image_cache_entry_t));
+
+    if (!dir || !key || !entry) {
+        free(dir);
+        free(key);
+        free(entry);
+        return NULL;
+    }
+
+    size_t len = strlen(dir) + strlen(key) + 32;
+    entry->img_path = malloc(len);
+    entry->part_path = malloc(len);
+    entry->digest_path = malloc(len);
+    if (entry->img_path && entry->part_path && entry->digest_path) {
+        snprintf(entry->img_path, len, "%s/%s.img", dir, key);
+        snprintf(entry->part_path, len, "%s/%s.%d.part", dir, key, (int)getpid());
+        snprintf(entry->digest_path, len, "%s/%s.sha256", dir, key);
+    }
+
+    entry->fd = -1;
+    entry->size = st->st_size;
+
+    free(dir);
+    free(key);
+
+    if (!entry->img_path || !entry->part_path || !entry->digest_path) {
+        image_cache_release(entry);
+        return NULL;
+    }
+
+    return entry;
+}
+
+static bool map_entry(image_cache_entry_t *entry, bool writable)
+{
+    int prot = PROT_READ | (writable ? PROT_WRITE : 0);
+    void *data = mmap(NULL, entry->size, prot, MAP_SHARED, entry->fd, 0);
+    if (data == MAP_FAILED)
+        return false;
+
+    /* Only effective with shmem_enabled=advise; harmless otherwise */
+    madvise(data, entry->size, MADV_HUGEPAGE);
+
+    entry->data = data;
+    return true;
+}
+
+static int compare_mtime(const void *a, const void *b)
+{
+    const cache_file_t *fa = a;
+    const cache_file_t *fb = b;
+    return (fa->mtime > fb->mtime) - (fa->mtime < fb->mtime);
+}
+
+/* Evict least recently used images until at most limit bytes are in use.
+ * Must be called with the directory lock held.
+ */
+static void evict(const char *dir, uint64_t limit)
+{
+    DIR *d = opendir(dir);
+    if (!d)
+        return;
+
+    cache_file_t *files = NULL;
+    size_t count = 0, capacity = 0;
+    uint64_t used = 0;
+    struct dirent *de;
+
+    while ((de = readdir(d)) != NULL) {
+        const char *ext = strrchr(de->d_name, '.');
+        if (!ext || de->d_name[0] == '.')
+            continue;
+
+        struct stat st;
+        if (fstatat(dirfd(d), de->d_name, &st, 0) != 0)
+            continue;
+
+        if (strcmp(ext, ".part") == 0) {
+            /* A part file nobody holds a lock on is left over from a crash */
+            int fd = openat(dirfd(d), de->d_name, O_RDONLY | O_CLOEXEC);
+            if (fd >= 0 && flock(fd, LOCK_EX | LOCK_NB) == 0)
+                unlinkat(dirfd(d), de->d_name, 0);
+            else
+                used += st.st_size;
+            if (fd >= 0)
+                close(fd);
+            continue;
+        }
+
+        if (strcmp(ext, ".img") != 0)
+            continue;
+
+        if (count == capacity) {
+            capacity = capacity ? capacity * 2 : 16;
+            cache_file_t *grown = realloc(files, capacity * sizeof(cache_file_t));
+            if (!grown)
+                break;
+            files = grown;
+        }
+
+        files[count].name = strdup(de->d_name);
+        files[count].size = st.st_size;
+        files[count].mtime = st.st_mtime;
+        used += st.st_size;
+        count++;
+    }
+
+    qsort(files, count, sizeof(cache_file_t), compare_mtime);
+
+    for (size_t i = 0; i < count && used > limit; i++) {
+        if (!files[i].name || unlinkat(dirfd(d), files[i].name, 0) != 0)
+            continue;
+
+        /* Drop the digest alongside the image */
+        char digest_name[256];
+        snprintf(digest_name, sizeof(digest_name), "%.*s.sha256",
+                 (int)(strlen(files[i].name) - 4), files[i].name);
+        unlinkat(dirfd(d), digest_name, 0);
+
+        rufus_log("Image cache: evicted %s (%llu MB)", files[i].name,
+                  (unsigned long long)(files[i].size >> 20));
+        used -= files[i].size;
+    }
+
+    for (size_t i = 0; i < count; i++)
+        free(files[i].name);
+    free(files);
+    closedir(d);
+}
+
+/* Regular file of ours, opened without following links (-1 otherwise) */
+static int open_owned(const char *path)
+{
+    int fd = open(path, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+    if (fd < 0)
+        return -1;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_uid != getuid()) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static bool read_digest(image_cache_entry_t *entry)
+{
+    int fd = open_owned(entry->digest_path);
+    FILE *fp = fd >= 0 ? fdopen(fd, "r") : NULL;
+    if (!fp) {
+        if (fd >= 0)
+            close(fd);
+        return false;
+    }
+
+    bool ok = fscanf(fp, "%64s", entry->digest) == 1 &&
+              strlen(entry->digest) == SHA256_DIGEST_SIZE * 2;
+    fclose(fp);
+    return ok;
+}
+
+image_cache_entry_t *image_cache_lookup(const char *path, const struct stat *st)
+{
+    if (!path || !st || st->st_size == 0)
+        return NULL;
+
+    image_cache_entry_t *entry = entry_new(path, st);
+    if (!entry)
+        return NULL;
+
+    entry->fd = open_owned(entry->img_path);
+    if (entry->fd < 0) {
+        image_cache_release(entry);
+        return NULL;
+    }
+
+    struct stat cst;
+    if (fstat(entry->fd, &cst) != 0 || (uint64_t)cst.st_size != entry->size ||
+        !read_digest(entry) || !map_entry(entry, false)) {
+        image_cache_release(entry);
+        return NULL;
+    }
+
+    /* Only serve bytes that still match the digest they were stored under */
+    uint8_t digest[SHA256_DIGEST_SIZE];
+    if (!hash_buffer(HASH_SHA256, entry->data, entry->size, digest, sizeof(digest)) ||
+        !hash_verify_hex(digest, sizeof(digest), entry->digest)) {
+        rufus_error("Image cache: %s does not match its digest, dropping it", entry->img_path);
+        unlink(entry->img_path);
+        unlink(entry->digest_path);
+        image_cache_release(entry);
+        return NULL;
+    }
+
+    /* Bump the entry to most recently used */
+    futimens(entry->fd, NULL);
+
+    rufus_log("Image cache: %s is resident (sha256 %s)", path, entry->digest);
+    return entry;
+}
+
+image_cache_entry_t *image_cache_begin(const char *path, const struct stat *st,
+                                       uint64_t budget)
+{
+    if (!path || !st || st->st_size == 0 || (uint64_t)st->st_size > budget)
+        return NULL;
+
+    image_cache_entry_t *entry = entry_new(path, st);
+    if (!entry)
+        return NULL;
+
+    char *dir = cache_dir();
+    char lock_path[128];
+    snprintf(lock_path, sizeof(lock_path), "%s/.lock", dir ? dir : CACHE_ROOT);
+
+    int lock_fd = dir ? open(lock_path, O_RDWR | O_CREAT | O_CLOEXEC, 0600) : -1;
+    if (lock_fd < 0 || flock(lock_fd, LOCK_EX) != 0) {
+        if (lock_fd >= 0)
+            close(lock_fd);
+        free(dir);
+        image_cache_release(entry);
+        return NULL;
+    }
+
+    evict(dir, budget - entry->size);
+
+    entry->fd = open(entry->part_path, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+    bool ok = entry->fd >= 0 && flock(entry->fd, LOCK_EX | LOCK_NB) == 0;
+    if (ok) {
+        entry->filling = true;
+        /* Reserve the memory now so a full tmpfs fails before the write */
+        int err = posix_fallocate(entry->fd, 0, entry->size);
+        if (err != 0) {
+            rufus_log("Image cache: no room for %s: %s", path, strerror(err));
+            ok = false;
+        }
+    }
+
+    close(lock_fd);
+    free(dir);
+
+    if (!ok || !map_entry(entry, true)) {
+        image_cache_release(entry);
+        return NULL;
+    }
+
+    rufus_log("Image cache: staging %s (%llu MB)", path,
+              (unsigned long long)(entry->size >> 20));
+    return entry;
+}
+
+bool image_cache_commit(image_cache_entry_t *entry, const uint8_t *sha256)
+{
+    if (!entry || !entry->filling)
+        return false;
+
+    hash_digest_to_hex(sha256, SHA256_DIGEST_SIZE, entry->digest);
+
+    bool ok = false;
+    FILE *fp = fopen(entry->digest_path, "w");
+    if (fp) {
+        ok = fprintf(fp, "%s  %s\n", entry->digest, entry->img_path) > 0;
+        ok = (fclose(fp) == 0) && ok;
+    }
+
+    if (ok && rename(entry->part_path, entry->img_path) == 0) {
+        entry->filling = false;
+        rufus_log("Image cache: stored %s", entry->img_path);
+    } else {
+        unlink(entry->digest_path);
+        ok = false;
+    }
+
+    image_cache_release(entry);
+    return ok;
+}
+
+void image_cache_release(image_cache_entry_t *entry)
+{
+    if (!entry)
+        return;
+
+    if (entry->data)
+        munmap(entry->data, entry->size);
+    if (entry->filling)
+        unlink(entry->part_path);
+    if (entry->fd >= 0)
+        close(entry->fd);
+
+    free(entry->img_path);
+    free(entry->part_path);
+    free(entry->digest_path);
+    free(entry);
+}
+
+uint8_t *image_cache_data(image_cache_entry_t *entry)
+{
+    return entry ? entry->data : NULL;
+}
+
+const char *image_cache_digest(image_cache_entry_t *entry)
+{
+    if (!entry || entry->filling || !entry->digest[0])
+        return NULL;
+    return entry->digest;
+}
+
+void image_cache_clear(void)
+{
+    char *dir = cache_dir();
+    if (!dir)
+        return;
+
+    char lock_path[128];
+    snprintf(lock_path, sizeof(lock_path), "%s/.lock", dir);
+    int lock_fd = open(lock_path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (lock_fd >= 0 && flock(lock_fd, LOCK_EX) == 0)
+        evict(dir, 0);
+
+    if (lock_fd >= 0)
+        close(lock_fd);
+    free(dir);
+}
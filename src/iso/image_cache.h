@@ -0,0 +1,52 @@
+/*
+ * Rufux - Image Staging Cache
+ * Francesco Lauritano
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ *
+ * Keeps recently written images resident in memory (tmpfs files under
+ * /dev/shm, mapped with hugepages where available) so repeat jobs stream
+ * from RAM. Entries outlive the process and are evicted least recently
+ * used first when the budget is exceeded.
+ */
+
+#ifndef RUFUS_IMAGE_CACHE_H
+#define RUFUS_IMAGE_CACHE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/stat.h>
+
+typedef struct image_cache_entry image_cache_entry_t;
+
+/* Identity key for an image: path, device, inode, size and mtime, so a
+ * changed image never matches an old entry (caller frees)
+ */
+char *image_cache_key(const char *path, const struct stat *st);
+
+/* Map a cached copy of an image, hashed again to check it against its
+ * digest (NULL if not cached or it does not match) */
+image_cache_entry_t *image_cache_lookup(const char *path, const struct stat *st);
+
+/* Reserve a new entry for an image, evicting older entries to fit the
+ * budget. Returns NULL if the image does not fit.
+ */
+image_cache_entry_t *image_cache_begin(const char *path, const struct stat *st,
+                                       uint64_t budget);
+
+/* Publish a filled entry under its SHA-256 and release it */
+bool image_cache_commit(image_cache_entry_t *entry, const uint8_t *sha256);
+
+/* Release an entry (an unfinished entry is discarded) */
+void image_cache_release(image_cache_entry_t *entry);
+
+/* Mapped image data (writable while filling) */
+uint8_t *image_cache_data(image_cache_entry_t *entry);
+
+/* SHA-256 of a committed entry as hex (NULL while filling) */
+const char *image_cache_digest(image_cache_entry_t *entry);
+
+/* Remove all entries */
+void image_cache_clear(void);
+
+#endif /* RUFUS_IMAGE_CACHE_H */
@@ -0,0 +1,667 @@
+/*
+ * Rufux - Image Source Implementation
+ * Francesco Lauritano
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ *
+ * The readahead backend keeps a ring of IMAGE_SOURCE_CHUNK slots. Reader
+ * threads claim chunks in order and fill free slots with pread(), so several
+ * reads are in flight while the consumer drains completed slots in order.
+ * A stall on the source only reaches the consumer once the ring is empty.
+ * Slot buffers come from the memory budget as readers claim them; the
+ * depth kept in flight follows the ring's share of the budget, and buffers
+ * above it are released as the consumer drains them.
+ *
+ * Images resident in the staging cache are served straight from memory; a
+ * cache miss fills a new entry from the consumer side, in order, so the
+ * entry's digest is computed on the same pass.
+ *
+ * HTTP(S) URLs are read with Range requests instead of pread(), one per
+ * reader thread, and checked against a digest published next to them as
+ * they are consumed.
+ */
+
+#define _GNU_SOURCE
+#include "image_source.h"
+#include "image_cache.h"
+#include "http_source.h"
+#include "../common/hash.h"
+#include "../common/membudget.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/vfs.h>
+#include <unistd.h>
+
+/* statfs f_type values for filesystems that can stall on the network */
+#define NFS_MAGIC   0x6969
+#define SMB_MAGIC   0x517B
+#define CIFS_MAGIC  0xFF534D42
+#define SMB2_MAGIC  0xFE534D42
+#define FUSE_MAGIC  0x65735546
+#define V9FS_MAGIC  0x01021997
+#define CEPH_MAGIC  0x00C36400
+
+#define READ_RETRIES      5
+#define READ_RETRY_US     200000
+
+/* Chunks consumed between checks of the ring's budget share */
+#define RING_RETUNE_CHUNKS 16
+
+typedef enum {
+    SLOT_EMPTY = 0,
+    SLOT_READING,
+    SLOT_READY,
+    SLOT_ERROR,
+} slot_state_t;
+
+typedef struct {
+    uint8_t *data;
+    size_t len;
+    uint64_t index;
+    slot_state_t state;
+} ra_slot_t;
+
+struct image_source {
+    char *path;
+    int fd;
+    http_source_t *http;
+    uint64_t size;
+    uint64_t offset;
+
+    /* Readahead ring (slot_count == 0 means synchronous reads) */
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    ra_slot_t *slots;
+    int slot_count;
+    int depth;                  /* Chunks in flight, at most slot_count */
+    int allocated;              /* Slot buffers held, in slots or spare */
+    uint8_t **spare;
+    int spare_count;
+    pthread_t *threads;
+    int thread_count;
+    uint64_t chunk_count;
+    uint64_t next_chunk;
+    uint64_t consume_chunk;
+    size_t consume_pos;
+    bool stop;
+    membudget_job_t *budget;    /* Job the slot buffers are charged to */
+
+    /* Spool */
+    bool from_spool;
+    bool spool_failed;
+    int spool_fd;
+    char *spool_part;
+    char *spool_final;
+
+    /* Staging cache: mem is set when serving from a resident entry,
+     * cache_hash while filling a new one */
+    image_cache_entry_t *cache;
+    const uint8_t *mem;
+    hash_ctx_t *cache_hash;
+
+    /* Published digest checked while streaming a URL */
+    hash_sidecar_t *sidecar;
+    hash_ctx_t *verify_hash;
+};
+
+bool image_source_is_slow(const char *path)
+{
+    if (http_source_is_url(path))
+        return true;
+
+    struct statfs sfs;
+    if (statfs(path, &sfs) != 0)
+        return false;
+
+    switch ((unsigned long)sfs.f_type & 0xFFFFFFFFUL) {
+    case NFS_MAGIC:
+    case SMB_MAGIC:
+    case CIFS_MAGIC:
+    case SMB2_MAGIC:
+    case FUSE_MAGIC:
+    case V9FS_MAGIC:
+    case CEPH_MAGIC:
+        return true;
+    default:
+        return false;
+    }
+}
+
+static bool pread_full(int fd, void *buf, size_t len, uint64_t offset)
+{
+    size_t done = 0;
+    int retries = 0;
+
+    while (done < len) {
+        ssize_t r = pread(fd, (uint8_t *)buf + done, len - done, offset + done);
+        if (r > 0) {
+            done += r;
+            retries = 0;
+            continue;
+        }
+        if (r < 0 && errno == EINTR)
+            continue;
+        /* Network filesystems report transient errors; back off and retry */
+        if (++retries > READ_RETRIES) {
+            rufus_error("Failed to read image at %llu: %s",
+                        (unsigned long long)(offset + done),
+                        r < 0 ? strerror(errno) : "unexpected end of file");
+            return false;
+        }
+        usleep(READ_RETRY_US * retries);
+    }
+
+    return true;
+}
+
+static bool source_pread(image_source_t *src, void *buf, size_t len, uint64_t offset)
+{
+    if (src->http)
+        return http_source_pread(src->http, buf, len, offset);
+    return pread_full(src->fd, buf, len, offset);
+}
+
+static void *reader_thread(void *arg)
+{
+    image_source_t *src = arg;
+    membudget_set_thread_job(src->budget);
+
+    pthread_mutex_lock(&src->lock);
+    while (!src->stop && src->next_chunk < src->chunk_count) {
+        uint64_t idx = src->next_chunk;
+
+        /* The slot for idx is free once the consumer has passed idx - depth */
+        if (idx >= src->consume_chunk + (uint64_t)src->depth) {
+            pthread_cond_wait(&src->cond, &src->lock);
+            continue;
+        }
+
+        src->next_chunk++;
+        ra_slot_t *slot = &src->slots[idx % src->slot_count];
+        slot->index = idx;
+        slot->state = SLOT_READING;
+        if (src->spare_count > 0)
+            slot->data = src->spare[--src->spare_count];
+        else
+            src->allocated++;
+        pthread_mutex_unlock(&src->lock);
+
+        if (!slot->data)
+            slot->data = membudget_alloc(MEM_POOL_READAHEAD, IMAGE_SOURCE_CHUNK);
+
+        uint64_t offset = idx * IMAGE_SOURCE_CHUNK;
+        size_t len = IMAGE_SOURCE_CHUNK;
+        if (offset + len > src->size)
+            len = src->size - offset;
+
+        bool ok = slot->data && source_pread(src, slot->data, len, offset);
+
+        if (ok && src->spool_fd >= 0 &&
+            pwrite(src->spool_fd, slot->data, len, offset) != (ssize_t)len) {
+            pthread_mutex_lock(&src->lock);
+            src->spool_failed = true;
+            pthread_mutex_unlock(&src->lock);
+        }
+
+        pthread_mutex_lock(&src->lock);
+        if (!slot->data)
+            src->allocated--;
+        slot->len = len;
+        slot->state = ok ? SLOT_READY : SLOT_ERROR;
+        pthread_cond_broadcast(&src->cond);
+    }
+    pthread_mutex_unlock(&src->lock);
+
+    return NULL;
+}
+
+/* Slot buffers are freed by the consumer, which may not be working for the
+ * job that allocated them */
+static void ring_free(image_source_t *src, uint8_t *data)
+{
+    membudget_job_t *prev = membudget_set_thread_job(src->budget);
+    membudget_free(MEM_POOL_READAHEAD, data, IMAGE_SOURCE_CHUNK);
+    membudget_set_thread_job(prev);
+}
+
+/* Set the depth from the ring's current share of the memory budget; one
+ * chunk per reader thread is always allowed */
+static void retune_ring(image_source_t *src)
+{
+    uint64_t share = membudget_ring_share(src->budget,
+                                          (uint64_t)src->slot_count * IMAGE_SOURCE_CHUNK);
+
+    int floor = src->thread_count < src->slot_count ? src->thread_count : src->slot_count;
+    if (floor < 2)
+        floor = 2;
+    int depth = (int)(share / IMAGE_SOURCE_CHUNK);
+    if (depth < floor)
+        depth = floor;
+
+    pthread_mutex_lock(&src->lock);
+    if (depth > src->depth)
+        pthread_cond_broadcast(&src->cond);
+    src->depth = depth;
+    pthread_mutex_unlock(&src->lock);
+}
+
+static bool start_readahead(image_source_t *src, const image_source_options_t *opts)
+{
+    uint64_t depth = opts->readahead_bytes;
+    if (depth > IMAGE_SOURCE_MAX_READAHEAD)
+        depth = IMAGE_SOURCE_MAX_READAHEAD;
+
+    src->slot_count = depth / IMAGE_SOURCE_CHUNK;
+    if (src->slot_count < 2)
+        src->slot_count = 2;
+    src->chunk_count = (src->size + IMAGE_SOURCE_CHUNK - 1) / IMAGE_SOURCE_CHUNK;
+
+    src->slots = calloc(src->slot_count, sizeof(ra_slot_t));
+    src->spare = calloc(src->slot_count, sizeof(uint8_t *));
+    if (src->spare)
+        membudget_ring_open(src->budget);
+    if (!src->slots || !src->spare)
+        return false;
+
+    for (int i = 0; i < src->slot_count; i++)
+        src->slots[i].index = UINT64_MAX;
+
+    src->thread_count = opts->reader_threads > 0 ? opts->reader_threads : 1;
+    src->threads = calloc(src->thread_count, sizeof(pthread_t));
+    if (!src->threads)
+        return false;
+
+    retune_ring(src);
+
+    for (int i = 0; i < src->thread_count; i++) {
+        if (pthread_create(&src->threads[i], NULL, reader_thread, src) != 0) {
+            src->thread_count = i;
+            return false;
+        }
+    }
+
+    rufus_log("Readahead: %d MB in %d slots (%d MB within budget), %d reader threads",
+              (int)(((uint64_t)src->slot_count * IMAGE_SOURCE_CHUNK) >> 20),
+              src->slot_count, (int)(((uint64_t)src->depth * IMAGE_SOURCE_CHUNK) >> 20),
+              src->thread_count);
+    return true;
+}
+
+/* Open the completed spool if present, or start a new partial spool */
+static void setup_spool(image_source_t *src, const char *spool_dir, const struct stat *st)
+{
+    char *key = image_cache_key(src->path, st);
+    if (!key)
+        return;
+
+    src->spool_final = malloc(strlen(spool_dir) + strlen(key) + 16);
+    src->spool_part = malloc(strlen(spool_dir) + strlen(key) + 16);
+    if (!src->spool_final || !src->spool_part) {
+        free(key);
+        return;
+    }
+    sprintf(src->spool_final, "%s/%s.spool", spool_dir, key);
+    sprintf(src->spool_part, "%s/%s.part", spool_dir, key);
+    free(key);
+
+    struct stat sst;
+    if (stat(src->spool_final, &sst) == 0 && (uint64_t)sst.st_size == src->size) {
+        int fd = open(src->spool_final, O_RDONLY | O_CLOEXEC);
+        if (fd >= 0) {
+            rufus_log("Reading %s from spool %s", src->path, src->spool_final);
+            close(src->fd);
+            src->fd = fd;
+            src->from_spool = true;
+            safe_free(src->spool_final);
+            safe_free(src->spool_part);
+            return;
+        }
+    }
+
+    src->spool_fd = open(src->spool_part, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (src->spool_fd < 0) {
+        rufus_error("Cannot create spool %s: %s", src->spool_part, strerror(errno));
+        safe_free(src->spool_final);
+        safe_free(src->spool_part);
+        return;
+    }
+
+    /* Reserve space up front so a full spool disk fails early */
+    if (posix_fallocate(src->spool_fd, 0, src->size) != 0) {
+        rufus_error("Not enough space to spool %s", src->path);
+        close(src->spool_fd);
+        src->spool_fd = -1;
+        unlink(src->spool_part);
+        safe_free(src->spool_final);
+        safe_free(src->spool_part);
+    }
+}
+
+/* Serve from a resident cache entry, or start filling a new one */
+static void setup_cache(image_source_t *src, uint64_t budget, const struct stat *st)
+{
+    src->cache = image_cache_lookup(src->path, st);
+    if (src->cache) {
+        src->mem = image_cache_data(src->cache);
+        return;
+    }
+
+    src->cache = image_cache_begin(src->path, st, budget);
+    if (!src->cache)
+        return;
+
+    src->cache_hash = hash_ctx_new(HASH_SHA256);
+    if (!src->cache_hash) {
+        image_cache_release(src->cache);
+        src->cache = NULL;
+    }
+}
+
+/* Stream a URL through the ring; the spool and RAM cache are keyed on a
+ * local file and stay off */
+static image_source_t *open_url(image_source_t *src, const image_source_options_t *opts)
+{
+    src->http = http_source_open(src->path);
+    if (!src->http) {
+        image_source_close(src);
+        return NULL;
+    }
+    src->size = http_source_size(src->http);
+
+    src->sidecar = http_source_sidecar(src->http);
+    if (src->sidecar) {
+        src->verify_hash = hash_ctx_new(src->sidecar->type);
+    } else {
+        rufus_log("No published checksum found for %s", src->path);
+    }
+
+    image_source_options_t ra = {
+        .readahead_bytes = opts && opts->readahead_bytes ? opts->readahead_bytes
+                                                         : 2ULL * IMAGE_SOURCE_CHUNK *
+                                                           HTTP_SOURCE_MIN_CONNECTIONS,
+        .reader_threads = opts ? opts->reader_threads : 0,
+    };
+    if (ra.reader_threads < HTTP_SOURCE_MIN_CONNECTIONS)
+        ra.reader_threads = HTTP_SOURCE_MIN_CONNECTIONS;
+
+    if (!start_readahead(src, &ra)) {
+        rufus_error("Failed to start readahead");
+        image_source_close(src);
+        return NULL;
+    }
+
+    return src;
+}
+
+/* Check the streamed image once its last byte has been consumed */
+static bool verify_complete(image_source_t *src)
+{
+    uint8_t digest[MAX_DIGEST_SIZE];
+    size_t len = hash_digest_size(src->sidecar->type);
+    bool ok = hash_ctx_final(src->verify_hash, digest, sizeof(digest)) &&
+              hash_verify_hex(digest, len, src->sidecar->expected);
+
+    hash_ctx_free(src->verify_hash);
+    src->verify_hash = NULL;
+
+    if (!ok) {
+        rufus_error("%s does not match the %s in %s", src->path,
+                    hash_type_name(src->sidecar->type), src->sidecar->source);
+        return false;
+    }
+
+    rufus_log("%s verified against %s", src->path, src->sidecar->source);
+    return true;
+}
+
+image_source_t *image_source_open(const char *path, const image_source_options_t *opts)
+{
+    if (!path)
+        return NULL;
+
+    image_source_t *src = calloc(1, sizeof(image_source_t));
+    if (!src)
+        return NULL;
+
+    pthread_mutex_init(&src->lock, NULL);
+    pthread_cond_init(&src->cond, NULL);
+    src->spool_fd = -1;
+    src->fd = -1;
+    src->path = strdup(path);
+    src->budget = membudget_thread_job();
+
+    if (http_source_is_url(path))
+        return open_url(src, opts);
+
+    src->fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (src->fd < 0) {
+        rufus_error("Failed to open image %s: %s", path, strerror(errno));
+        image_source_close(src);
+        return NULL;
+    }
+
+    struct stat st;
+    if (fstat(src->fd, &st) != 0) {
+        image_source_close(src);
+        return NULL;
+    }
+    src->size = st.st_size;
+
+    if (opts && opts->cache_budget > 0)
+        setup_cache(src, opts->cache_budget, &st);
+
+    if (opts && opts->spool_dir && !src->mem)
+        setup_spool(src, opts->spool_dir, &st);
+
+    posix_fadvise(src->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    /* A completed spool or cached image is local; no readahead needed */
+    if (opts && opts->readahead_bytes > 0 && !src->from_spool && !src->mem &&
+        src->size > 0) {
+        if (!start_readahead(src, opts)) {
+            rufus_error("Failed to start readahead");
+            image_source_close(src);
+            return NULL;
+        }
+    }
+
+    return src;
+}
+
+static ssize_t read_sync(image_source_t *src, void *buf, size_t len)
+{
+    if (src->offset + len > src->size)
+        len = src->size - src->offset;
+    if (len == 0)
+        return 0;
+
+    if (!source_pread(src, buf, len, src->offset))
+        return -1;
+
+    if (src->spool_fd >= 0 &&
+        pwrite(src->spool_fd, buf, len, src->offset) != (ssize_t)len)
+        src->spool_failed = true;
+
+    src->offset += len;
+    return len;
+}
+
+static ssize_t read_ring(image_source_t *src, void *buf, size_t len)
+{
+    size_t copied = 0;
+    while (copied < len && src->offset < src->size) {
+        uint64_t idx = src->consume_chunk;
+        ra_slot_t *slot = &src->slots[idx % src->slot_count];
+
+        pthread_mutex_lock(&src->lock);
+        while (slot->index != idx ||
+               (slot->state != SLOT_READY && slot->state != SLOT_ERROR))
+            pthread_cond_wait(&src->cond, &src->lock);
+        slot_state_t state = slot->state;
+        pthread_mutex_unlock(&src->lock);
+
+        if (state == SLOT_ERROR)
+            return -1;
+
+        size_t n = slot->len - src->consume_pos;
+        if (n > len - copied)
+            n = len - copied;
+
+        memcpy((uint8_t *)buf + copied, slot->data + src->consume_pos, n);
+        copied += n;
+        src->offset += n;
+        src->consume_pos += n;
+
+        if (src->consume_pos == slot->len) {
+            /* Keep the buffer for the next claim unless the ring has shrunk */
+            uint8_t *drop = NULL;
+            pthread_mutex_lock(&src->lock);
+            if (src->allocated > src->depth) {
+                drop = slot->data;
+                src->allocated--;
+            } else {
+                src->spare[src->spare_count++] = slot->data;
+            }
+            slot->data = NULL;
+            slot->state = SLOT_EMPTY;
+            src->consume_chunk++;
+            src->consume_pos = 0;
+            pthread_cond_broadcast(&src->cond);
+            pthread_mutex_unlock(&src->lock);
+
+            ring_free(src, drop);
+            if (src->consume_chunk % RING_RETUNE_CHUNKS == 0)
+                retune_ring(src);
+        }
+    }
+
+    return copied;
+}
+
+ssize_t image_source_read(image_source_t *src, void *buf, size_t len)
+{
+    if (!src)
+        return -1;
+
+    if (src->mem) {
+        if (len > src->size - src->offset)
+            len = src->size - src->offset;
+        memcpy(buf, src->mem + src->offset, len);
+        src->offset += len;
+        return len;
+    }
+
+    uint64_t start = src->offset;
+    ssize_t n = src->slot_count ? read_ring(src, buf, len) : read_sync(src, buf, len);
+
+    if (n > 0 && src->cache_hash) {
+        memcpy(image_cache_data(src->cache) + start, buf, n);
+        hash_ctx_update(src->cache_hash, buf, n);
+    }
+
+    /* Fail the final read if the image does not match its checksum */
+    if (n > 0 && src->verify_hash) {
+        hash_ctx_update(src->verify_hash, buf, n);
+        if (src->offset == src->size && !verify_complete(src))
+            return -1;
+    }
+
+    return n;
+}
+
+const uint8_t *image_source_data(image_source_t *src)
+{
+    return src ? src->mem : NULL;
+}
+
+int image_source_file_fd(image_source_t *src)
+{
+    if (!src || src->http || src->slot_count || src->mem || src->spool_fd >= 0 ||
+        src->cache_hash || src->verify_hash)
+        return -1;
+    return src->fd;
+}
+
+void image_source_skip(image_source_t *src, uint64_t len)
+{
+    if (!src)
+        return;
+    src->offset = len > src->size - src->offset ? src->size : src->offset + len;
+}
+
+uint64_t image_source_size(image_source_t *src)
+{
+    return src ? src->size : 0;
+}
+
+void image_source_close(image_source_t *src)
+{
+    if (!src)
+        return;
+
+    pthread_mutex_lock(&src->lock);
+    src->stop = true;
+    pthread_cond_broadcast(&src->cond);
+    pthread_mutex_unlock(&src->lock);
+
+    /* Readers blocked in a transfer would otherwise sit out its retries */
+    http_source_abort(src->http);
+    for (int i = 0; i < src->thread_count; i++)
+        pthread_join(src->threads[i], NULL);
+
+    if (src->spool_fd >= 0) {
+        bool complete = !src->spool_failed && src->offset == src->size &&
+                        fsync(src->spool_fd) == 0;
+        close(src->spool_fd);
+        if (complete && rename(src->spool_part, src->spool_final) == 0) {
+            rufus_log("Spooled %s to %s", src->path, src->spool_final);
+        } else {
+            if (src->spool_failed)
+                rufus_error("Spool write failed, discarding %s", src->spool_part);
+            unlink(src->spool_part);
+        }
+    }
+
+    if (src->cache_hash) {
+        uint8_t digest[SHA256_DIGEST_SIZE];
+        if (src->offset == src->size &&
+            hash_ctx_final(src->cache_hash, digest, sizeof(digest)))
+            image_cache_commit(src->cache, digest);
+        else
+            image_cache_release(src->cache);
+        hash_ctx_free(src->cache_hash);
+    } else if (src->cache) {
+        image_cache_release(src->cache);
+    }
+
+    if (src->slots) {
+        for (int i = 0; i < src->slot_count; i++)
+            ring_free(src, src->slots[i].data);
+        free(src->slots);
+    }
+    if (src->spare) {
+        for (int i = 0; i < src->spare_count; i++)
+            ring_free(src, src->spare[i]);
+        free(src->spare);
+        membudget_ring_close(src->budget);
+    }
+
+    if (src->fd >= 0)
+        close(src->fd);
+
+    hash_ctx_free(src->verify_hash);
+    hash_sidecar_free(src->sidecar);
+    http_source_close(src->http);
+
+    pthread_mutex_destroy(&src->lock);
+    pthread_cond_destroy(&src->cond);
+    free(src->threads);
+    free(src->spool_part);
+    free(src->spool_final);
+    free(src->path);
+    free(src);
+}
@@ -0,0 +1,64 @@
+/*
+ * Rufux - Image Source
+ * Francesco Lauritano
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ *
+ * Sequential reader for image files. Slow sources (NFS, SMB, FUSE) can be
+ * read through a deep asynchronous readahead ring, optionally spooled to a
+ * local file for later jobs. HTTP(S) URLs are streamed the same way.
+ */
+
+#ifndef RUFUS_IMAGE_SOURCE_H
+#define RUFUS_IMAGE_SOURCE_H
+
+#include "../platform/platform.h"
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/* Readahead slot size */
+#define IMAGE_SOURCE_CHUNK   (4 * 1024 * 1024)
+
+/* Upper bound for the readahead depth */
+#define IMAGE_SOURCE_MAX_READAHEAD (2ULL * 1024 * 1024 * 1024)
+
+typedef struct {
+    uint64_t readahead_bytes;  /* 0 = plain synchronous reads */
+    int reader_threads;        /* Concurrent outstanding reads */
+    const char *spool_dir;     /* Keep a local copy here (NULL = off) */
+    uint64_t cache_budget;     /* RAM staging cache budget (0 = off) */
+} image_source_options_t;
+
+typedef struct image_source image_source_t;
+
+/* Check whether a path lives on a network or FUSE filesystem, or is a URL */
+bool image_source_is_slow(const char *path);
+
+/* Open an image file or URL for sequential reading (opts may be NULL) */
+image_source_t *image_source_open(const char *path, const image_source_options_t *opts);
+
+/* Read up to len bytes. Only returns short at end of image.
+ * Returns bytes read, 0 at end, -1 on error.
+ */
+ssize_t image_source_read(image_source_t *src, void *buf, size_t len);
+
+/* Whole image in memory for cache-resident sources, else NULL.
+ * Valid until image_source_close().
+ */
+const uint8_t *image_source_data(image_source_t *src);
+
+/* Descriptor of the image file when it is read synchronously and nothing
+ * else watches the data (no spool, cache fill or checksum), so the kernel
+ * can move it without a user-space copy; -1 otherwise. Data moved that way
+ * is accounted with image_source_skip().
+ */
+int image_source_file_fd(image_source_t *src);
+void image_source_skip(image_source_t *src, uint64_t len);
+
+/* Total image size in bytes */
+uint64_t image_source_size(image_source_t *src);
+
+/* Close the source (completes the spool file if the image was fully read) */
+void image_source_close(image_source_t *src);
+
+#endif /* RUFUS_IMAGE_SOURCE_H */
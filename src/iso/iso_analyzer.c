@@ -3,11 +3,13 @@
  * Francesco Lauritano
  * SPDX-License-Identifier: GPL-3.0-or-later
  *
- * Uses external tools (isoinfo/file/xorriso/bsdtar/7z) for analysis
+ * Uses external tools (isoinfo/file/xorriso/bsdtar/7z) for analysis.
+ * Images on HTTP servers are judged from their first sectors instead.
  */
 
 #define _GNU_SOURCE
 #include "iso_analyzer.h"
+#include "http_source.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -243,11 +245,76 @@ static bool detect_linux(const char *path)
     return system(cmd) == 0;
 }
 
+/* ISO 9660 volume descriptors start at sector 16 */
+#define ISO_SECTOR          2048
+#define ISO_PVD_OFFSET      (16 * ISO_SECTOR)
+#define ISO_BOOT_OFFSET     (17 * ISO_SECTOR)
+#define ISO_HEAD_SIZE       (18 * ISO_SECTOR)
+
+/* Analyze a remote image from its MBR, GPT header and volume descriptors
+ * without downloading it */
+static iso_info_t *analyze_url(const char *url)
+{
+    http_source_t *http = http_source_open(url);
+    if (!http)
+        return NULL;
+
+    uint64_t size = http_source_size(http);
+    uint8_t *head = calloc(1, ISO_HEAD_SIZE);
+    iso_info_t *info = calloc(1, sizeof(iso_info_t));
+    if (!head || !info || size < ISO_HEAD_SIZE ||
+        !http_source_pread(http, head, ISO_HEAD_SIZE, 0)) {
+        free(head);
+        free(info);
+        http_source_close(http);
+        return NULL;
+    }
+
+    info->path = strdup(url);
+    info->size = size;
+
+    const uint8_t *pvd = head + ISO_PVD_OFFSET;
+    if (pvd[0] == 1 && memcmp(pvd + 1, "CD001", 5) == 0) {
+        char label[33];
+        memcpy(label, pvd + 40, 32);
+        label[32] = '\0';
+        for (int i = 31; i >= 0 && isspace((unsigned char)label[i]); i--)
+            label[i] = '\0';
+        if (label[0])
+            info->label = strdup(label);
+    }
+
+    const uint8_t *boot = head + ISO_BOOT_OFFSET;
+    info->has_eltorito = boot[0] == 0 && memcmp(boot + 1, "CD001", 5) == 0 &&
+                         memcmp(boot + 7, "EL TORITO SPECIFICATION", 23) == 0;
+
+    /* Hybrid images carry an MBR, and a GPT when they boot on UEFI */
+    info->is_hybrid = head[510] == 0x55 && head[511] == 0xAA;
+    info->has_efi = memcmp(head + 512, "EFI PART", 8) == 0;
+
+    if (info->has_eltorito && info->has_efi)
+        info->boot_type = BOOT_TYPE_HYBRID;
+    else if (info->has_efi)
+        info->boot_type = BOOT_TYPE_UEFI;
+    else if (info->has_eltorito)
+        info->boot_type = BOOT_TYPE_BIOS;
+    else if (info->is_hybrid)
+        info->boot_type = BOOT_TYPE_HYBRID;
+    info->is_bootable = info->boot_type != BOOT_TYPE_UNKNOWN;
+
+    free(head);
+    http_source_close(http);
+    return info;
+}
+
 iso_info_t *iso_analyze(const char *path)
 {
     if (!path)
         return NULL;
 
+    if (http_source_is_url(path))
+        return analyze_url(path);
+
     /* Check file exists and get size */
     struct stat st;
     if (stat(path, &st) != 0)
@@ -6,6 +6,10 @@
 
 #define _GNU_SOURCE
 #include "iso_extract.h"
+#include "image_source.h"
+#include "ntfs_extract.h"
+#include "../common/config.h"
+#include "../common/membudget.h"
 #include "../common/utils.h"
 #include "../platform/platform.h"
 #include <glib.h>
@@ -14,8 +18,18 @@
 #include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
+#include <sys/wait.h>
+#include <fcntl.h>
 #include <unistd.h>
 
+#define PREFETCH_STEP (8 * 1024 * 1024)
+
+/* First e2fsprogs release whose mke2fs -d accepts a tarball */
+#define MKE2FS_TAR_VERSION ((1 << 16) | (47 << 8) | 1)
+
+/* Helper exit status when mke2fs succeeded but bsdtar did not */
+#define EXT_TAR_FAILED 100
+
 static const char *select_extract_tool(void)
 {
     if (command_exists("xorriso"))
@@ -37,6 +51,54 @@ bool iso_extract_is_supported(void)
     return select_extract_tool() != NULL;
 }
 
+/* MemAvailable from /proc/meminfo in bytes, 0 if unknown */
+static uint64_t mem_available(void)
+{
+    FILE *fp = fopen("/proc/meminfo", "r");
+    if (!fp)
+        return 0;
+
+    char line[128];
+    unsigned long long kb = 0;
+    while (fgets(line, sizeof(line), fp)) {
+        if (sscanf(line, "MemAvailable: %llu kB", &kb) == 1)
+            break;
+    }
+    fclose(fp);
+
+    return (uint64_t)kb * 1024;
+}
+
+bool iso_extract_prefetch(const char *iso_path, const volatile int *stop)
+{
+    int fd = open(iso_path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return false;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        return false;
+    }
+
+    /* Never push more than half of the free memory out of the cache */
+    uint64_t limit = mem_available() / 2;
+    if (limit > (uint64_t)st.st_size)
+        limit = st.st_size;
+
+    uint64_t offset = 0;
+    while (offset < limit && !*stop) {
+        size_t len = limit - offset < PREFETCH_STEP ? limit - offset : PREFETCH_STEP;
+        if (readahead(fd, offset, len) != 0)
+            break;
+        offset += len;
+    }
+
+    close(fd);
+    rufus_log("Prefetched %llu MB of %s", (unsigned long long)(offset >> 20), iso_path);
+    return true;
+}
+
 static char *build_extract_command(const char *tool, const char *iso_path, const char *mount_dir)
 {
     char *q_iso = g_shell_quote(iso_path);
@@ -96,8 +158,8 @@ bool iso_extract_to_partition(const char *iso_path, const char *partition_path,
         "mount %s %s; "
         "trap 'umount %s' EXIT; "
         "%s; "
-        "sync",
-        partition_path, mount_dir, mount_dir, extract_cmd);
+        "sync -f %s",
+        partition_path, mount_dir, mount_dir, extract_cmd, mount_dir);
 
     char *cmd = g_strdup_printf("sh -c \"%s\"", script);
 
@@ -119,3 +181,150 @@ bool iso_extract_to_partition(const char *iso_path, const char *partition_path,
 
     return rc == 0;
 }
+
+bool iso_extract_to_ntfs(const char *iso_path, const char *partition_path,
+                         iso_extract_progress_t progress, void *user_data)
+{
+    if (ntfs_extract_is_supported())
+        return ntfs_extract_from_iso(iso_path, partition_path, progress, user_data);
+
+    /* Without libntfs-3g the kernel or FUSE driver does the writing */
+    return iso_extract_to_partition(iso_path, partition_path, progress, user_data);
+}
+
+/* mke2fs version as (major << 16 | minor << 8 | patch), 0 if unknown */
+static int mke2fs_version(void)
+{
+    FILE *fp = popen("mke2fs -V 2>&1", "r");
+    if (!fp)
+        return 0;
+
+    int major = 0, minor = 0, patch = 0;
+    char line[128];
+    if (fgets(line, sizeof(line), fp))
+        sscanf(line, "mke2fs %d.%d.%d", &major, &minor, &patch);
+    pclose(fp);
+
+    return (major << 16) | (minor << 8) | patch;
+}
+
+bool iso_extract_ext_is_supported(void)
+{
+    return command_exists("bsdtar") && mke2fs_version() >= MKE2FS_TAR_VERSION;
+}
+
+static bool write_all(int fd, const uint8_t *buf, size_t len)
+{
+    while (len > 0) {
+        ssize_t n = write(fd, buf, len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        buf += n;
+        len -= n;
+    }
+    return true;
+}
+
+bool iso_extract_to_ext(const char *iso_path, const char *partition_path,
+                        fs_type_t fs_type, const char *label,
+                        iso_extract_progress_t progress, void *user_data)
+{
+    if (!iso_path || !partition_path ||
+        (fs_type != FS_EXT2 && fs_type != FS_EXT3 && fs_type != FS_EXT4)) {
+        rufus_error("Invalid arguments to iso_extract_to_ext");
+        return false;
+    }
+
+    if (!iso_extract_ext_is_supported()) {
+        rufus_error("Populating ext filesystems needs bsdtar and e2fsprogs 1.47.1 or newer");
+        return false;
+    }
+
+    /* Read through the image source so slow and remote images get readahead */
+    const rufus_config_t *cfg = config_get();
+    image_source_options_t opts = {
+        .readahead_bytes = cfg->readahead_bytes,
+        .reader_threads = cfg->readahead_threads,
+    };
+    image_source_t *src = image_source_open(iso_path, &opts);
+    if (!src)
+        return false;
+
+    /* bsdtar turns the ISO on stdin into a tar stream that mke2fs lays out
+     * in one pass; lazy init leaves inode tables and journal unwritten, so
+     * the device sees little more than the file data, in order. A pipeline
+     * only reports mke2fs, and a tar stream cut short still makes a valid
+     * filesystem, so bsdtar's status comes back on fd 3. */
+    char *q_label = g_shell_quote(label && *label ? label : "");
+    char *q_part = g_shell_quote(partition_path);
+    char *cmd = g_strdup_printf(
+        "tar_rc=$( { { bsdtar -cf - --format=pax @- 3>&-; echo $? >&3; } | "
+        "mke2fs -F -q -t %s -E lazy_itable_init=1,lazy_journal_init=1 %s%s -d /dev/stdin %s "
+        "3>&- >&2; } 3>&1 ) || exit $?; [ \"$tar_rc\" = 0 ] || exit %d",
+        fs_type == FS_EXT2 ? "ext2" : fs_type == FS_EXT3 ? "ext3" : "ext4",
+        label && *label ? "-L " : "", label && *label ? q_label : "", q_part, EXT_TAR_FAILED);
+    g_free(q_label);
+    g_free(q_part);
+
+    rufus_log("Populating %s from %s without mounting", partition_path, iso_path);
+
+    int in_fd = -1;
+    pid_t pid = spawn_privileged(cmd, &in_fd, NULL);
+    g_free(cmd);
+    if (pid < 0) {
+        image_source_close(src);
+        return false;
+    }
+
+    uint8_t *buf = membudget_alloc(MEM_POOL_EXTRACT, IMAGE_SOURCE_CHUNK);
+    uint64_t total = image_source_size(src);
+    uint64_t done = 0;
+    bool ok = buf != NULL;
+
+    if (progress)
+        progress(0.0, "Copying files...", user_data);
+
+    while (ok && done < total) {
+        if (thread_cancelled()) {
+            ok = false;
+            break;
+        }
+
+        ssize_t n = image_source_read(src, buf, IMAGE_SOURCE_CHUNK);
+        if (n <= 0) {
+            ok = false;
+            break;
+        }
+
+        /* bsdtar stops reading once it has seen the last file */
+        if (!write_all(in_fd, buf, n))
+            break;
+
+        done += n;
+        if (progress)
+            progress((double)done / total, "Copying files...", user_data);
+    }
+
+    membudget_free(MEM_POOL_EXTRACT, buf, IMAGE_SOURCE_CHUNK);
+    if (thread_cancelled())
+        kill_privileged(pid);
+    close(in_fd);
+    image_source_close(src);
+
+    int wstatus = wait_privileged(pid);
+    int status = wstatus >= 0 && WIFEXITED(wstatus) ? WEXITSTATUS(wstatus) : -1;
+    if (status == EXT_TAR_FAILED) {
+        rufus_error("bsdtar could not read all files from %s", iso_path);
+        ok = false;
+    } else if (status != 0) {
+        rufus_error("mke2fs exited with status %d", status);
+        ok = false;
+    }
+
+    if (progress)
+        progress(ok ? 1.0 : 0.0, ok ? "Complete" : "Failed", user_data);
+
+    return ok;
+}
@@ -3,12 +3,14 @@
  * Francesco Lauritano
  * SPDX-License-Identifier: GPL-3.0-or-later
  *
- * Extract ISO contents to a mounted partition using external tools.
+ * Extract ISO contents to a mounted partition using external tools, or
+ * build an ext* filesystem straight from the ISO without mounting it.
  */
 
 #ifndef RUFUS_ISO_EXTRACT_H
 #define RUFUS_ISO_EXTRACT_H
 
+#include "../platform/platform.h"
 #include <stdbool.h>
 
 typedef void (*iso_extract_progress_t)(double fraction, const char *message, void *user_data);
@@ -19,8 +21,29 @@ const char *iso_extract_tool_name(void);
 /* Check if ISO extraction is available */
 bool iso_extract_is_supported(void);
 
+/* Pull the ISO into the page cache ahead of extraction (bounded by free
+ * memory). Stops early once *stop becomes non-zero.
+ */
+bool iso_extract_prefetch(const char *iso_path, const volatile int *stop);
+
 /* Extract ISO contents to a mounted partition */
 bool iso_extract_to_partition(const char *iso_path, const char *partition_path,
                               iso_extract_progress_t progress, void *user_data);
 
+/* Check if mke2fs can populate a filesystem from a tar stream (e2fsprogs
+ * 1.47.1 or newer) and bsdtar is there to produce one */
+bool iso_extract_ext_is_supported(void);
+
+/* Create an ext2/3/4 filesystem on partition_path holding the ISO contents.
+ * The image is streamed through bsdtar into mke2fs -d; nothing is mounted
+ * and no staging copy is made. */
+bool iso_extract_to_ext(const char *iso_path, const char *partition_path,
+                        fs_type_t fs_type, const char *label,
+                        iso_extract_progress_t progress, void *user_data);
+
+/* Copy the ISO contents onto a formatted NTFS partition: directly through
+ * libntfs-3g when available, else by mounting it */
+bool iso_extract_to_ntfs(const char *iso_path, const char *partition_path,
+                         iso_extract_progress_t progress, void *user_data);
+
 #endif /* RUFUS_ISO_EXTRACT_H */
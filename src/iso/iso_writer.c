@@ -8,6 +8,11 @@
 
 #define _GNU_SOURCE
 #include "iso_writer.h"
+#include "../common/config.h"
+#include "../common/jobs.h"
+#include "../common/membudget.h"
+#include "../common/utils.h"
+#include "../disk/disk_io.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -25,8 +30,11 @@
 #define DD_BLOCK_SIZE "4M"
 #define PROGRESS_POLL_MS 250
 
+/* Written chunks map one to one onto manifest chunks */
+_Static_assert(IMAGE_SOURCE_CHUNK == MANIFEST_CHUNK_SIZE, "chunk sizes differ");
+
 struct iso_writer {
-    pthread_t thread;
+    job_t *job;
     pthread_mutex_t mutex;
 
     /* Operation parameters */
@@ -64,9 +72,10 @@ void iso_writer_free(iso_writer_t *writer)
     if (!writer)
         return;
 
-    if (writer->thread_running) {
+    if (writer->job) {
         iso_writer_cancel(writer);
-        pthread_join(writer->thread, NULL);
+        job_wait(writer->job);
+        job_unref(writer->job);
     }
 
     pthread_mutex_destroy(&writer->mutex);
@@ -108,8 +117,32 @@ static uint64_t get_device_sectors_written(const char *device_path)
     return sectors;
 }
 
-static void *writer_thread(void *arg)
+/* dd command for a raw write with its output redirected (caller frees);
+ * spawn_privileged() joins it to the flashing cgroup when throttled */
+static char *dd_script(const char *iso_path, const char *device_path, const char *redirect)
+{
+    char dd_cmd[1024];
+    snprintf(dd_cmd, sizeof(dd_cmd),
+             "dd bs=%s if=\"%s\" of=\"%s\" oflag=direct conv=fsync %s",
+             DD_BLOCK_SIZE, iso_path, device_path, redirect);
+    return strdup(dd_cmd);
+}
+
+/* Flush what is cached for one device, rather than every filesystem on the
+ * host with sync() */
+static void sync_device(const char *device_path)
 {
+    int fd = open(device_path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return;     /* dd already ran with conv=fsync */
+    if (fsync(fd) != 0)
+        rufus_log("Warning: failed to flush %s: %s", device_path, strerror(errno));
+    close(fd);
+}
+
+static bool writer_job(job_t *job, void *arg)
+{
+    (void)job;
     iso_writer_t *writer = arg;
 
     pthread_mutex_lock(&writer->mutex);
@@ -120,43 +153,17 @@ static void *writer_thread(void *arg)
     uint64_t baseline_sectors = get_device_sectors_written(writer->device_path);
     rufus_log("Baseline sectors written: %lu", (unsigned long)baseline_sectors);
 
-    /* Create pipe for dd output (we don't parse it, but need to drain it) */
-    int pipefd[2];
-    if (pipe(pipefd) == -1) {
-        rufus_error("Failed to create pipe: %s", strerror(errno));
+    /* dd's output is not parsed, but the pipe has to be drained */
+    int out_fd = -1;
+    char *dd_cmd = dd_script(writer->iso_path, writer->device_path, "2>&1");
+    pid_t pid = dd_cmd ? spawn_privileged(dd_cmd, NULL, &out_fd) : -1;
+    free(dd_cmd);
+    if (pid < 0)
         goto error;
-    }
-
-    pid_t pid = fork();
-    if (pid == -1) {
-        rufus_error("Failed to fork: %s", strerror(errno));
-        close(pipefd[0]);
-        close(pipefd[1]);
-        goto error;
-    }
-
-    if (pid == 0) {
-        /* Child: exec pkexec dd */
-        close(pipefd[0]);
-        dup2(pipefd[1], STDOUT_FILENO);
-        dup2(pipefd[1], STDERR_FILENO);
-        close(pipefd[1]);
-
-        char dd_cmd[1024];
-        snprintf(dd_cmd, sizeof(dd_cmd),
-                 "dd bs=%s if=\"%s\" of=\"%s\" conv=fsync 2>&1",
-                 DD_BLOCK_SIZE, writer->iso_path, writer->device_path);
-
-        execlp("pkexec", "pkexec", "sh", "-c", dd_cmd, NULL);
-        _exit(127);
-    }
-
-    /* Parent */
-    close(pipefd[1]);
 
     /* Make pipe non-blocking so we can drain without stalling */
-    int flags = fcntl(pipefd[0], F_GETFL, 0);
-    fcntl(pipefd[0], F_SETFL, flags | O_NONBLOCK);
+    int flags = fcntl(out_fd, F_GETFL, 0);
+    fcntl(out_fd, F_SETFL, flags | O_NONBLOCK);
 
     pthread_mutex_lock(&writer->mutex);
     writer->dd_pid = pid;
@@ -176,20 +183,20 @@ static void *writer_thread(void *arg)
         pthread_mutex_unlock(&writer->mutex);
 
         if (cancelled) {
-            kill(pid, SIGTERM);
+            kill_privileged(pid);
             break;
         }
 
         /* Drain pipe to prevent dd from blocking */
         char drain[1024];
-        while (read(pipefd[0], drain, sizeof(drain)) > 0)
+        while (read(out_fd, drain, sizeof(drain)) > 0)
             ;
 
         /* Check if dd finished */
         int wstatus;
-        pid_t ret = waitpid(pid, &wstatus, WNOHANG);
+        pid_t ret = poll_privileged(pid, &wstatus);
         if (ret == pid) {
-            close(pipefd[0]);
+            close(out_fd);
 
             if (WIFEXITED(wstatus) && WEXITSTATUS(wstatus) == 0) {
                 goto success;
@@ -197,9 +204,9 @@ static void *writer_thread(void *arg)
                 rufus_error("dd exited with status %d", WEXITSTATUS(wstatus));
                 goto error;
             }
-        } else if (ret == -1 && errno != EINTR) {
+        } else if (ret < 0) {
             rufus_error("waitpid failed: %s", strerror(errno));
-            close(pipefd[0]);
+            close(out_fd);
             goto error;
         }
 
@@ -232,8 +239,8 @@ static void *writer_thread(void *arg)
     }
 
     /* Cancelled path */
-    close(pipefd[0]);
-    waitpid(pid, NULL, 0);
+    close(out_fd);
+    wait_privileged(pid);
 
     pthread_mutex_lock(&writer->mutex);
     writer->state = WRITE_STATE_CANCELLED;
@@ -244,7 +251,7 @@ static void *writer_thread(void *arg)
         writer->complete_cb(WRITE_STATE_CANCELLED, "Write cancelled", writer->user_data);
 
     writer->thread_running = false;
-    return NULL;
+    return false;
 
 success:
     pthread_mutex_lock(&writer->mutex);
@@ -252,7 +259,7 @@ success:
     writer->dd_pid = -1;
     pthread_mutex_unlock(&writer->mutex);
 
-    sync();
+    sync_device(writer->device_path);
 
     pthread_mutex_lock(&writer->mutex);
     writer->state = WRITE_STATE_COMPLETE;
@@ -265,7 +272,7 @@ success:
         writer->complete_cb(WRITE_STATE_COMPLETE, "Write complete", writer->user_data);
 
     writer->thread_running = false;
-    return NULL;
+    return true;
 
 error:
     pthread_mutex_lock(&writer->mutex);
@@ -277,7 +284,7 @@ error:
         writer->complete_cb(WRITE_STATE_ERROR, "Write failed", writer->user_data);
 
     writer->thread_running = false;
-    return NULL;
+    return false;
 }
 
 bool iso_writer_start(iso_writer_t *writer,
@@ -315,13 +322,18 @@ bool iso_writer_start(iso_writer_t *writer,
     writer->cancel_requested = false;
     writer->thread_running = true;
 
-    if (pthread_create(&writer->thread, NULL, writer_thread, writer) != 0) {
-        rufus_error("Failed to create writer thread");
+    if (writer->job)
+        job_unref(writer->job);
+
+    job_t *job = job_new(writer_job, writer, JOB_PRIO_WRITE);
+    if (!job) {
+        rufus_error("Failed to create writer job");
         writer->thread_running = false;
         return false;
     }
 
-    pthread_detach(writer->thread);
+    writer->job = job_ref(job);
+    job_submit(job);
     return true;
 }
 
@@ -332,8 +344,9 @@ void iso_writer_cancel(iso_writer_t *writer)
 
     pthread_mutex_lock(&writer->mutex);
     writer->cancel_requested = true;
+    job_cancel(writer->job);
     if (writer->dd_pid > 0) {
-        kill(writer->dd_pid, SIGTERM);
+        kill_privileged(writer->dd_pid);
     }
     pthread_mutex_unlock(&writer->mutex);
 }
@@ -362,9 +375,451 @@ write_state_t iso_writer_get_state(iso_writer_t *writer)
     return state;
 }
 
+/* Report progress at most every PROGRESS_POLL_MS */
+typedef struct {
+    struct timespec last_time;
+    uint64_t last_bytes;
+    double speed;
+} speed_tracker_t;
+
+static void report_progress(speed_tracker_t *tracker, uint64_t bytes, uint64_t total,
+                            write_progress_callback_t progress_cb, void *user_data)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    double elapsed = (now.tv_sec - tracker->last_time.tv_sec) +
+                     (now.tv_nsec - tracker->last_time.tv_nsec) / 1e9;
+
+    if (elapsed < PROGRESS_POLL_MS / 1000.0 && bytes < total)
+        return;
+
+    if (elapsed > 0 && bytes > tracker->last_bytes)
+        tracker->speed = (double)(bytes - tracker->last_bytes) / elapsed / (1024.0 * 1024.0);
+    tracker->last_bytes = bytes;
+    tracker->last_time = now;
+
+    if (progress_cb)
+        progress_cb(bytes, total, tracker->speed, user_data);
+}
+
+/* Fill buf from the source; only short at the end of the image */
+static ssize_t read_chunk(image_source_t *src, uint8_t *buf, size_t len)
+{
+    size_t got = 0;
+    while (got < len) {
+        ssize_t n = image_source_read(src, buf + got, len - got);
+        if (n < 0)
+            return -1;
+        if (n == 0)
+            break;
+        got += n;
+    }
+    return got;
+}
+
+/* Move len bytes at offset from a file to the device through pipefd.
+ * Returns the bytes moved, or -1. */
+static ssize_t splice_chunk(int in_fd, int out_fd, const int pipefd[2],
+                            uint64_t offset, size_t len)
+{
+    loff_t in_off = offset;
+    ssize_t filled = splice(in_fd, &in_off, pipefd[1], NULL, len, SPLICE_F_MOVE);
+    if (filled <= 0)
+        return filled < 0 ? -1 : 0;
+
+    loff_t out_off = offset;
+    for (ssize_t drained = 0; drained < filled; ) {
+        ssize_t n = splice(pipefd[0], NULL, out_fd, &out_off, filled - drained,
+                           SPLICE_F_MOVE);
+        if (n <= 0)
+            return -1;
+        drained += n;
+    }
+    return filled;
+}
+
+/* Buffered copy without the user-space pass: copy_file_range where both
+ * ends are files the kernel can copy between (loop-backed targets), else
+ * splice through a pipe. Returns 1 on success, 0 on failure and -1 if
+ * neither is supported and nothing was written. */
+static int write_source_zero_copy(image_source_t *src, int in_fd, int out_fd,
+                                  write_progress_callback_t progress_cb, void *user_data)
+{
+    uint64_t total = image_source_size(src);
+    uint64_t offset = 0;
+    speed_tracker_t tracker = { .last_bytes = 0 };
+    clock_gettime(CLOCK_MONOTONIC, &tracker.last_time);
+
+    bool use_cfr = true;
+    int pipefd[2] = { -1, -1 };
+    int rc = 1;
+
+    while (offset < total) {
+        if (thread_cancelled()) {
+            rc = 0;
+            break;
+        }
+
+        size_t len = total - offset < IMAGE_SOURCE_CHUNK ? total - offset : IMAGE_SOURCE_CHUNK;
+        ssize_t n;
+        if (use_cfr) {
+            loff_t in_off = offset, out_off = offset;
+            n = copy_file_range(in_fd, &in_off, out_fd, &out_off, len, 0);
+            if (n < 0 && (errno == EINVAL || errno == EXDEV || errno == EOPNOTSUPP ||
+                          errno == ENOSYS)) {
+                use_cfr = false;
+                if (pipe2(pipefd, O_CLOEXEC) != 0) {
+                    rc = offset ? 0 : -1;
+                    break;
+                }
+                /* Larger pipes mean fewer round trips; the default 64 KiB
+                 * still works */
+                fcntl(pipefd[1], F_SETPIPE_SZ, 1024 * 1024);
+                continue;
+            }
+        } else {
+            n = splice_chunk(in_fd, out_fd, pipefd, offset, len);
+            if (n < 0 && offset == 0 && errno == EINVAL) {
+                rc = -1;
+                break;
+            }
+        }
+
+        if (n <= 0) {
+            rufus_error("Zero-copy write failed at %llu: %s", (unsigned long long)offset,
+                        n < 0 ? strerror(errno) : "unexpected end of image");
+            rc = 0;
+            break;
+        }
+
+        offset += n;
+        image_source_skip(src, n);
+        report_progress(&tracker, offset, total, progress_cb, user_data);
+    }
+
+    if (pipefd[0] >= 0) {
+        close(pipefd[0]);
+        close(pipefd[1]);
+    }
+    return rc;
+}
+
+/* Record the chunk and tell whether the device already holds it */
+static bool track_chunk(const manifest_t *previous, manifest_t *record,
+                        uint64_t offset, const uint8_t *data, size_t len)
+{
+    if (!record)
+        return false;
+
+    uint32_t index = offset / MANIFEST_CHUNK_SIZE;
+    manifest_set_chunk(record, index, data, len);
+    return manifest_chunk_equal(previous, record, index);
+}
+
+/* With a verifier, every written chunk is handed to it once disk_write()
+ * returns; the device is opened O_SYNC, so the chunk is on the stick by
+ * then and the readback overlaps the rest of the write */
+static bool write_source_direct(image_source_t *src, const char *device_path,
+                                const manifest_t *previous, manifest_t *record,
+                                manifest_verifier_t *verifier,
+                                write_progress_callback_t progress_cb, void *user_data)
+{
+    int fd = disk_open(device_path, true);
+
+    /* disk_open() falls back to buffered I/O when the device refuses
+     * O_DIRECT; then the page cache copies anyway and buf would only add a
+     * second pass, unless the data must be seen for the manifest */
+    int in_fd = image_source_file_fd(src);
+    if (fd >= 0 && in_fd >= 0 && !previous && !record && !verifier &&
+        !(fcntl(fd, F_GETFL) & O_DIRECT)) {
+        int rc = write_source_zero_copy(src, in_fd, fd, progress_cb, user_data);
+        if (rc >= 0) {
+            bool ok = rc && disk_sync(fd);
+            disk_close(fd);
+            return ok;
+        }
+        rufus_log("Zero-copy not supported for %s, copying through memory", device_path);
+    }
+
+    uint8_t *buf = fd >= 0 ? membudget_alloc(MEM_POOL_WRITE, IMAGE_SOURCE_CHUNK) : NULL;
+    if (!buf) {
+        disk_close(fd);
+        if (verifier)
+            manifest_verifier_finish(verifier);
+        return false;
+    }
+
+    uint32_t sector = disk_get_sector_size(fd);
+
+    uint64_t total = image_source_size(src);
+    uint64_t offset = 0;
+    speed_tracker_t tracker = { .last_bytes = 0 };
+    clock_gettime(CLOCK_MONOTONIC, &tracker.last_time);
+    bool ok = true;
+
+    /* Cache-resident images are written straight from the mapping */
+    const uint8_t *mem = image_source_data(src);
+
+    while (offset < total) {
+        if (thread_cancelled()) {
+            ok = false;
+            break;
+        }
+
+        const uint8_t *data = buf;
+        ssize_t n;
+        if (mem) {
+            n = total - offset < IMAGE_SOURCE_CHUNK ? total - offset : IMAGE_SOURCE_CHUNK;
+            data = mem + offset;
+        } else {
+            n = read_chunk(src, buf, IMAGE_SOURCE_CHUNK);
+        }
+        if (n <= 0) {
+            ok = (n == 0 && offset == total);
+            break;
+        }
+
+        if (track_chunk(previous, record, offset, data, n)) {
+            offset += n;
+            report_progress(&tracker, offset, total, progress_cb, user_data);
+            continue;
+        }
+
+        /* O_DIRECT needs whole sectors; pad the tail of the image */
+        size_t len = n;
+        if (len % sector) {
+            size_t padded = (len + sector - 1) / sector * sector;
+            if (data != buf)
+                memcpy(buf, data, len);
+            memset(buf + len, 0, padded - len);
+            data = buf;
+            len = padded;
+        }
+
+        if (!disk_write(fd, offset, data, len)) {
+            ok = false;
+            break;
+        }
+
+        if (verifier && !manifest_verifier_push(verifier, offset / MANIFEST_CHUNK_SIZE)) {
+            rufus_error("Readback of %s failed while writing", device_path);
+            ok = false;
+            break;
+        }
+
+        offset += n;
+        report_progress(&tracker, offset, total, progress_cb, user_data);
+    }
+
+    if (ok)
+        ok = disk_sync(fd);
+
+    membudget_free(MEM_POOL_WRITE, buf, IMAGE_SOURCE_CHUNK);
+    disk_close(fd);
+
+    if (verifier && !manifest_verifier_finish(verifier) && ok) {
+        rufus_error("Verification of %s failed", device_path);
+        ok = false;
+    }
+    return ok;
+}
+
+static bool feed_all(int fd, const uint8_t *data, size_t len)
+{
+    for (size_t done = 0; done < len; ) {
+        ssize_t w = write(fd, data + done, len - done);
+        if (w < 0) {
+            if (errno == EINTR)
+                continue;
+            rufus_error("Failed to feed dd: %s", strerror(errno));
+            return false;
+        }
+        done += w;
+    }
+    return true;
+}
+
+static bool write_source_piped(image_source_t *src, const char *device_path,
+                               const manifest_t *previous, manifest_t *record,
+                               write_progress_callback_t progress_cb, void *user_data)
+{
+    char *cmd = malloc(strlen(device_path) + 256);
+    if (!cmd)
+        return false;
+
+    /* With a previous manifest only changed chunks are sent, each behind an
+     * "offset length" header line that the script hands to its own dd */
+    if (previous) {
+        sprintf(cmd, "while read off len; do dd of=%s bs=" DD_BLOCK_SIZE " "
+                     "iflag=fullblock,count_bytes count=$len oflag=seek_bytes seek=$off "
+                     "conv=notrunc,fsync status=none || exit 1; done", device_path);
+    } else {
+        sprintf(cmd, "exec dd of=%s bs=" DD_BLOCK_SIZE " iflag=fullblock oflag=direct "
+                     "conv=fsync status=none", device_path);
+    }
+
+    int in_fd = -1;
+    pid_t pid = spawn_privileged(cmd, &in_fd, NULL);
+    free(cmd);
+    if (pid < 0)
+        return false;
+
+    uint8_t *buf = membudget_alloc(MEM_POOL_WRITE, IMAGE_SOURCE_CHUNK);
+    if (!buf) {
+        close(in_fd);
+        wait_privileged(pid);
+        return false;
+    }
+
+    uint64_t total = image_source_size(src);
+    uint64_t offset = 0;
+    speed_tracker_t tracker = { .last_bytes = 0 };
+    clock_gettime(CLOCK_MONOTONIC, &tracker.last_time);
+    bool ok = true;
+
+    const uint8_t *mem = image_source_data(src);
+
+    while (ok && offset < total && !thread_cancelled()) {
+        const uint8_t *data = buf;
+        ssize_t n;
+        if (mem) {
+            n = total - offset < IMAGE_SOURCE_CHUNK ? total - offset : IMAGE_SOURCE_CHUNK;
+            data = mem + offset;
+        } else {
+            n = read_chunk(src, buf, IMAGE_SOURCE_CHUNK);
+        }
+        if (n <= 0) {
+            ok = (n == 0 && offset == total);
+            break;
+        }
+
+        if (!track_chunk(previous, record, offset, data, n)) {
+            if (previous) {
+                char header[64];
+                int len = snprintf(header, sizeof(header), "%llu %zd\n",
+                                   (unsigned long long)offset, n);
+                ok = feed_all(in_fd, (const uint8_t *)header, len);
+            }
+            ok = ok && feed_all(in_fd, data, n);
+        }
+
+        offset += n;
+        report_progress(&tracker, offset, total, progress_cb, user_data);
+    }
+
+    membudget_free(MEM_POOL_WRITE, buf, IMAGE_SOURCE_CHUNK);
+
+    /* Kill dd before it sees EOF and flushes what it holds */
+    if (thread_cancelled())
+        kill_privileged(pid);
+    close(in_fd);
+
+    int wstatus = wait_privileged(pid);
+    if (wstatus < 0 || !WIFEXITED(wstatus) || WEXITSTATUS(wstatus) != 0) {
+        rufus_error("dd exited with status %d", WIFEXITED(wstatus) ? WEXITSTATUS(wstatus) : -1);
+        ok = false;
+    }
+
+    return ok;
+}
+
+bool iso_write_source_sync(image_source_t *src, const char *device_path,
+                           write_progress_callback_t progress_cb, void *user_data)
+{
+    if (!src || !device_path)
+        return false;
+
+    if (is_root())
+        return write_source_direct(src, device_path, NULL, NULL, NULL, progress_cb, user_data);
+
+    return write_source_piped(src, device_path, NULL, NULL, progress_cb, user_data);
+}
+
+static image_source_t *open_configured_source(const char *iso_path)
+{
+    const rufus_config_t *cfg = config_get();
+    image_source_options_t opts = {
+        .readahead_bytes = cfg->readahead_bytes ? cfg->readahead_bytes
+                                                : CONFIG_DEFAULT_READAHEAD,
+        .reader_threads = cfg->readahead_threads,
+        .spool_dir = cfg->spool_dir,
+        .cache_budget = cfg->cache_bytes,
+    };
+
+    return image_source_open(iso_path, &opts);
+}
+
+bool iso_write_tracked_sync(const char *iso_path, const char *device_path,
+                            const manifest_t *previous, manifest_t *record, bool *verified,
+                            write_progress_callback_t progress_cb, void *user_data)
+{
+    if (verified)
+        *verified = false;
+
+    if (!iso_path || !device_path)
+        return false;
+
+    /* Skipping chunks needs digests of the new image */
+    if (previous && !record)
+        previous = NULL;
+
+    image_source_t *src = open_configured_source(iso_path);
+    if (!src)
+        return false;
+
+    if (record && image_source_size(src) != record->image_size) {
+        rufus_error("Image size changed since the write was prepared");
+        image_source_close(src);
+        return false;
+    }
+
+    if (previous)
+        rufus_log("Writing only chunks of %s that differ from %s", iso_path, previous->image_name);
+
+    if (!is_root()) {
+        bool ok = write_source_piped(src, device_path, previous, record, progress_cb, user_data);
+        image_source_close(src);
+        return ok;
+    }
+
+    manifest_verifier_t *verifier = NULL;
+    if (verified && record) {
+        verifier = manifest_verifier_start(record, device_path);
+        if (!verifier)
+            rufus_log("Cannot read %s back during the write, verifying afterwards", device_path);
+    }
+
+    bool ok = write_source_direct(src, device_path, previous, record, verifier,
+                                  progress_cb, user_data);
+    image_source_close(src);
+
+    if (verified)
+        *verified = ok && verifier;
+    return ok;
+}
+
 bool iso_write_sync(const char *iso_path, const char *device_path,
                     write_progress_callback_t progress_cb, void *user_data)
 {
+    const rufus_config_t *cfg = config_get();
+    bool configured = cfg->readahead_bytes > 0 || cfg->cache_bytes > 0 ||
+                      image_source_is_slow(iso_path);
+
+    /* As root the image is written in process; a plain file is read
+     * synchronously so the zero-copy fallback can take it */
+    if (configured || is_root()) {
+        image_source_t *src = configured ? open_configured_source(iso_path) :
+                              image_source_open(iso_path, NULL);
+        if (!src)
+            return false;
+
+        if (configured)
+            rufus_log("Streaming %s through image source", iso_path);
+        bool ok = iso_write_source_sync(src, device_path, progress_cb, user_data);
+        image_source_close(src);
+        return ok;
+    }
+
     struct stat st;
     if (stat(iso_path, &st) != 0) {
         rufus_error("Cannot stat ISO file: %s", strerror(errno));
@@ -376,44 +831,33 @@ bool iso_write_sync(const char *iso_path, const char *device_path,
     /* Capture baseline before starting */
     uint64_t baseline_sectors = get_device_sectors_written(device_path);
 
-    pid_t pid = fork();
-    if (pid == -1)
+    char *dd_cmd = dd_script(iso_path, device_path, ">/dev/null 2>&1");
+    pid_t pid = dd_cmd ? spawn_privileged(dd_cmd, NULL, NULL) : -1;
+    free(dd_cmd);
+    if (pid < 0)
         return false;
 
-    if (pid == 0) {
-        /* Redirect output to /dev/null */
-        int devnull = open("/dev/null", O_WRONLY);
-        if (devnull >= 0) {
-            dup2(devnull, STDOUT_FILENO);
-            dup2(devnull, STDERR_FILENO);
-            close(devnull);
-        }
-
-        char if_arg[1024], of_arg[1024];
-        snprintf(if_arg, sizeof(if_arg), "if=%s", iso_path);
-        snprintf(of_arg, sizeof(of_arg), "of=%s", device_path);
-
-        execlp("pkexec", "pkexec", "dd",
-               "bs=" DD_BLOCK_SIZE,
-               if_arg, of_arg,
-               "conv=fsync", NULL);
-        _exit(127);
-    }
-
     struct timespec last_time;
     clock_gettime(CLOCK_MONOTONIC, &last_time);
     uint64_t last_bytes = 0;
 
     while (1) {
         int wstatus;
-        pid_t ret = waitpid(pid, &wstatus, WNOHANG);
+        pid_t ret = poll_privileged(pid, &wstatus);
+        if (ret < 0)
+            return false;
         if (ret == pid) {
-            sync();
+            sync_device(device_path);
             if (progress_cb)
                 progress_cb(iso_size, iso_size, 0, user_data);
             return WIFEXITED(wstatus) && WEXITSTATUS(wstatus) == 0;
         }
 
+        if (thread_cancelled()) {
+            wait_privileged(pid);
+            return false;
+        }
+
         uint64_t current_sectors = get_device_sectors_written(device_path);
         uint64_t bytes_written = (current_sectors - baseline_sectors) * 512ULL;
         if (bytes_written > iso_size)
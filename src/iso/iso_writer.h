@@ -10,6 +10,8 @@
 #define RUFUS_ISO_WRITER_H
 
 #include "../platform/platform.h"
+#include "image_source.h"
+#include "../disk/manifest.h"
 #include <stdbool.h>
 #include <stdint.h>
 
@@ -70,8 +72,28 @@ bool iso_writer_is_running(iso_writer_t *writer);
 /* Get current state */
 write_state_t iso_writer_get_state(iso_writer_t *writer);
 
-/* Synchronous write (blocking) */
+/* Synchronous write (blocking)
+ * Slow (network/FUSE) sources, or any source when readahead or the RAM
+ * cache is configured, are streamed through an image_source instead of dd.
+ */
 bool iso_write_sync(const char *iso_path, const char *device_path,
                     write_progress_callback_t progress_cb, void *user_data);
 
+/* Write an open image source to a device (blocking). Writes the device
+ * directly when running as root, otherwise streams into a privileged dd.
+ */
+bool iso_write_source_sync(image_source_t *src, const char *device_path,
+                           write_progress_callback_t progress_cb, void *user_data);
+
+/* Write an image, recording the digest of every chunk in record (may be
+ * NULL). Chunks matching the same chunk of previous, the manifest of what
+ * the device already holds, are not written.
+ * With verified set and a direct (root) write, written chunks are read
+ * back while later ones are still being written, and *verified tells
+ * whether that happened; a mismatch fails the write.
+ */
+bool iso_write_tracked_sync(const char *iso_path, const char *device_path,
+                            const manifest_t *previous, manifest_t *record, bool *verified,
+                            write_progress_callback_t progress_cb, void *user_data);
+
 #endif /* RUFUS_ISO_WRITER_H */
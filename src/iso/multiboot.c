@@ -0,0 +1,539 @@
+/*
+ * Rufux - Multi-Image Boot Stick Implementation
+ * Francesco Lauritano
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ *
+ * Layout: MBR, partition 1 FAT32 with GRUB (BIOS and/or UEFI), partition 2
+ * exFAT with ISO files under /images. Each menu entry loopback-mounts its
+ * ISO and hands over to the ISO's own loopback.cfg or EFI loader.
+ */
+
+#define _GNU_SOURCE
+#include "multiboot.h"
+#include "../device/device.h"
+#include "../disk/partition.h"
+#include "../format/format.h"
+#include "../common/utils.h"
+#include <glib.h>
+#include <ctype.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#define GRUB_LIB_DIR      "/usr/lib/grub"
+#define PARTITION_WAIT_MS 10000
+#define LIST_MARKER       "@@RUFUX_IMAGES"
+
+static const char *grub_install_command(void)
+{
+    if (command_exists("grub-install"))
+        return "grub-install";
+    if (command_exists("grub2-install"))
+        return "grub2-install";
+    return NULL;
+}
+
+static bool grub_has_target(const char *target)
+{
+    char path[256];
+    snprintf(path, sizeof(path), "%s/%s", GRUB_LIB_DIR, target);
+    return access(path, F_OK) == 0;
+}
+
+bool multiboot_is_supported(void)
+{
+    return grub_install_command() &&
+           (grub_has_target("x86_64-efi") || grub_has_target("i386-pc")) &&
+           command_exists("sfdisk") &&
+           format_is_supported(FS_FAT32) &&
+           format_is_supported(FS_EXFAT);
+}
+
+bool multiboot_is_initialized(const char *device_path)
+{
+    char *data_path = partition_get_path(device_path, 2);
+    char *label = device_get_fs_label(data_path);
+    bool result = label && strcmp(label, MULTIBOOT_DATA_LABEL) == 0;
+    free(label);
+    free(data_path);
+    return result;
+}
+
+static bool is_image_name(const char *name)
+{
+    size_t len = strlen(name);
+    if (len < 5 || name[0] == '.')
+        return false;
+    return strcasecmp(name + len - 4, ".iso") == 0 ||
+           strcasecmp(name + len - 4, ".img") == 0;
+}
+
+/* Image names end up in shell scripts and grub.cfg: keep them plain. A
+ * name without .iso or .img gets .img, or the image list would skip it. */
+static char *sanitize_image_name(const char *iso_path)
+{
+    const char *base = strrchr(iso_path, '/');
+    base = base ? base + 1 : iso_path;
+
+    size_t len = strlen(base);
+    char *name = malloc(len + sizeof(".img"));
+    if (!name)
+        return NULL;
+    memcpy(name, base, len + 1);
+
+    for (char *p = name; *p; p++) {
+        if (!isalnum((unsigned char)*p) && *p != '.' && *p != '-' && *p != '_')
+            *p = '_';
+    }
+    if (name[0] == '.')
+        name[0] = '_';
+    if (!is_image_name(name))
+        strcpy(name + len, ".img");
+
+    return name;
+}
+
+/* Run a privileged script and collect its output. dd progress lines
+ * ("<bytes> bytes ... copied") before LIST_MARKER are reported through
+ * progress; lines after it are returned as the image list.
+ */
+static bool run_script(const char *script, uint64_t total_bytes,
+                       multiboot_progress_t progress, void *user_data,
+                       char ***images_out, int *count_out)
+{
+    int out_fd = -1;
+    pid_t pid = spawn_privileged(script, NULL, &out_fd);
+    if (pid < 0)
+        return false;
+
+    GString *output = g_string_new(NULL);
+    size_t scanned = 0;
+    char buf[4096];
+    ssize_t n;
+
+    while ((n = read(out_fd, buf, sizeof(buf))) != 0) {
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+        g_string_append_len(output, buf, n);
+
+        if (!progress || total_bytes == 0 || strstr(output->str, LIST_MARKER))
+            continue;
+
+        /* dd separates progress updates with '\r' */
+        for (size_t i = scanned; i < output->len; i++) {
+            if (output->str[i] != '\r' && output->str[i] != '\n')
+                continue;
+            unsigned long long bytes = strtoull(output->str + scanned, NULL, 10);
+            if (bytes > 0) {
+                char msg[64];
+                snprintf(msg, sizeof(msg), "Copying image... %llu MB",
+                         bytes / (1024 * 1024));
+                progress((double)bytes / total_bytes, msg, user_data);
+            }
+            scanned = i + 1;
+        }
+    }
+    close(out_fd);
+
+    int status = wait_privileged(pid);
+    bool ok = status >= 0 && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+
+    if (!ok) {
+        rufus_error("Multi-image script failed: %s", output->str);
+    } else if (images_out) {
+        char **images = NULL;
+        int count = 0;
+        char *list = strstr(output->str, LIST_MARKER);
+        if (list) {
+            char **lines = g_strsplit(list + strlen(LIST_MARKER), "\n", -1);
+            for (int i = 0; lines[i]; i++) {
+                g_strstrip(lines[i]);
+                if (!is_image_name(lines[i]))
+                    continue;
+                char **grown = realloc(images, (count + 2) * sizeof(char *));
+                if (grown) {
+                    images = grown;
+                    images[count] = NULL;
+                }
+                char *name = grown ? strdup(lines[i]) : NULL;
+                if (!name) {
+                    rufus_error("Out of memory reading the image list");
+                    ok = false;
+                    break;
+                }
+                images[count++] = name;
+                images[count] = NULL;
+            }
+            g_strfreev(lines);
+        }
+        if (ok) {
+            *images_out = images;
+            if (count_out)
+                *count_out = count;
+        } else {
+            multiboot_image_list_free(images);
+        }
+    }
+
+    g_string_free(output, TRUE);
+    return ok;
+}
+
+static char *make_mount_dir(void)
+{
+    char template[] = "/tmp/rufus-multi-XXXXXX";
+    char *dir = mkdtemp(template);
+    if (!dir) {
+        rufus_error("Failed to create mount directory: %s", strerror(errno));
+        return NULL;
+    }
+    return strdup(dir);
+}
+
+/* name inside a grub double-quoted string, where \\, \" and $ are special */
+static char *grub_escape(const char *name)
+{
+    GString *out = g_string_new(NULL);
+    for (const char *p = name; *p; p++) {
+        if (*p == '\\' || *p == '"' || *p == '$')
+            g_string_append_c(out, '\\');
+        g_string_append_c(out, *p);
+    }
+    return g_string_free(out, FALSE);
+}
+
+static char *build_menu(char **images)
+{
+    GString *cfg = g_string_new(
+        "# Generated by Rufux from the image directory; regenerated on every change\n"
+        "insmod part_msdos\n"
+        "insmod exfat\n"
+        "insmod iso9660\n"
+        "insmod loopback\n"
+        "search --no-floppy --set=isopart --label " MULTIBOOT_DATA_LABEL "\n"
+        "set timeout=10\n");
+
+    /* Without loopback.cfg the ISO's EFI loader is chainloaded from (loop);
+     * it looks for its config on the boot device, not the ISO, so this only
+     * works for loaders that carry their config or search for it */
+    for (int i = 0; images && images[i]; i++) {
+        char *name = grub_escape(images[i]);
+        g_string_append_printf(cfg,
+            "\nmenuentry \"%s\" {\n"
+            "    set iso_path=\"/" MULTIBOOT_IMAGE_DIR "/%s\"\n"
+            "    export iso_path\n"
+            "    loopback loop ($isopart)$iso_path\n"
+            "    set root=(loop)\n"
+            "    if [ -f /boot/grub/loopback.cfg ]; then\n"
+            "        configfile /boot/grub/loopback.cfg\n"
+            "    elif [ -f /EFI/BOOT/BOOTX64.EFI ]; then\n"
+            "        echo \"No loopback.cfg; chainloading the EFI loader (best effort)\"\n"
+            "        chainloader /EFI/BOOT/BOOTX64.EFI\n"
+            "    else\n"
+            "        echo \"No loopback.cfg or EFI loader in $iso_path\"\n"
+            "        sleep 5\n"
+            "    fi\n"
+            "}\n",
+            name, name);
+        g_free(name);
+    }
+    if (images && images[0])
+        rufus_log("Images without /boot/grub/loopback.cfg are chainloaded on a best-effort basis");
+
+    if (!images || !images[0])
+        g_string_append(cfg, "\nmenuentry \"No images on this stick\" {\n    reboot\n}\n");
+
+    return g_string_free(cfg, FALSE);
+}
+
+static bool write_menu(const char *device_path, char **images)
+{
+    char *menu = build_menu(images);
+
+    char cfg_template[] = "/tmp/rufus-grub-XXXXXX";
+    int fd = mkstemp(cfg_template);
+    if (fd < 0) {
+        rufus_error("Failed to create menu file: %s", strerror(errno));
+        g_free(menu);
+        return false;
+    }
+    bool written = write(fd, menu, strlen(menu)) == (ssize_t)strlen(menu);
+    close(fd);
+    g_free(menu);
+    chmod(cfg_template, 0644);
+
+    char *mount_dir = make_mount_dir();
+    char *boot_path = partition_get_path(device_path, 1);
+    bool ok = false;
+
+    if (written && mount_dir && boot_path) {
+        char *q_cfg = g_shell_quote(cfg_template);
+        char *script = g_strdup_printf(
+            "set -e; "
+            "mount %s %s; "
+            "trap 'umount %s' EXIT; "
+            "for d in %s/boot/grub %s/boot/grub2; do "
+            "[ -d $d ] && install -m 0644 %s $d/grub.cfg; "
+            "done; "
+            "sync -f %s",
+            boot_path, mount_dir, mount_dir, mount_dir, mount_dir, q_cfg, mount_dir);
+
+        ok = run_script(script, 0, NULL, NULL, NULL, NULL);
+        g_free(script);
+        g_free(q_cfg);
+    }
+
+    if (mount_dir)
+        rmdir(mount_dir);
+    free(mount_dir);
+    free(boot_path);
+    unlink(cfg_template);
+
+    if (ok)
+        rufus_log("Regenerated multi-image menu on %s", device_path);
+    return ok;
+}
+
+bool multiboot_init(const char *device_path,
+                    multiboot_progress_t progress, void *user_data)
+{
+    if (!multiboot_is_supported()) {
+        rufus_error("Multi-image mode needs grub-install, sfdisk, mkfs.fat and mkfs.exfat");
+        return false;
+    }
+
+    if (progress)
+        progress(0.0, "Partitioning...", user_data);
+
+    if (!partition_create_boot_data(device_path, MULTIBOOT_BOOT_SIZE, FS_EXFAT))
+        return false;
+
+    const uint64_t boot_start = 1024 * 1024;
+    if (partition_wait_for_start(device_path, boot_start, PARTITION_WAIT_MS) != 1 ||
+        partition_wait_for_start(device_path, boot_start + MULTIBOOT_BOOT_SIZE,
+                                 PARTITION_WAIT_MS) != 2)
+        return false;
+
+    char *boot_path = partition_get_path(device_path, 1);
+    char *data_path = partition_get_path(device_path, 2);
+    char *mount_dir = make_mount_dir();
+    bool ok = boot_path && data_path && mount_dir;
+
+    if (ok) {
+        if (progress)
+            progress(0.2, "Formatting boot partition...", user_data);
+        ok = format_sync(boot_path, FS_FAT32, MULTIBOOT_BOOT_LABEL, 0);
+    }
+
+    if (ok) {
+        if (progress)
+            progress(0.4, "Formatting image partition...", user_data);
+        ok = format_sync(data_path, FS_EXFAT, MULTIBOOT_DATA_LABEL, 0);
+    }
+
+    if (ok) {
+        if (progress)
+            progress(0.6, "Installing boot loader...", user_data);
+
+        const char *grub = grub_install_command();
+        char *efi = grub_has_target("x86_64-efi") ?
+            g_strdup_printf("%s --target=x86_64-efi --removable --no-nvram "
+                            "--efi-directory=%s --boot-directory=%s/boot; ",
+                            grub, mount_dir, mount_dir) : g_strdup("");
+        char *bios = grub_has_target("i386-pc") ?
+            g_strdup_printf("%s --target=i386-pc --boot-directory=%s/boot %s; ",
+                            grub, mount_dir, device_path) : g_strdup("");
+
+        char *script = g_strdup_printf(
+            "set -e; "
+            "mount %s %s; "
+            "%s%s"
+            "umount %s; "
+            "mount %s %s; "
+            "mkdir -p %s/" MULTIBOOT_IMAGE_DIR "; "
+            "umount %s",
+            boot_path, mount_dir, efi, bios, mount_dir,
+            data_path, mount_dir, mount_dir, mount_dir);
+
+        ok = run_script(script, 0, NULL, NULL, NULL, NULL);
+
+        g_free(script);
+        g_free(efi);
+        g_free(bios);
+    }
+
+    if (mount_dir)
+        rmdir(mount_dir);
+    free(mount_dir);
+    free(boot_path);
+    free(data_path);
+
+    if (ok)
+        ok = write_menu(device_path, NULL);
+
+    if (progress)
+        progress(ok ? 1.0 : 0.0, ok ? "Complete" : "Failed", user_data);
+
+    return ok;
+}
+
+bool multiboot_add_image(const char *device_path, const char *iso_path,
+                         multiboot_progress_t progress, void *user_data)
+{
+    struct stat st;
+    if (stat(iso_path, &st) != 0) {
+        rufus_error("Cannot stat image: %s", strerror(errno));
+        return false;
+    }
+
+    char *name = sanitize_image_name(iso_path);
+    char *data_path = partition_get_path(device_path, 2);
+    char *mount_dir = make_mount_dir();
+    if (!name || !data_path || !mount_dir) {
+        free(name);
+        free(data_path);
+        if (mount_dir)
+            rmdir(mount_dir);
+        free(mount_dir);
+        return false;
+    }
+
+    unsigned long long size = (unsigned long long)st.st_size;
+    char *q_iso = g_shell_quote(iso_path);
+
+    /* Preallocate so the copy lands in one contiguous run, copy with large
+     * sequential blocks, then rename into place so the menu never lists a
+     * partial image */
+    char *script = g_strdup_printf(
+        "set -e; "
+        "mount %s %s; "
+        "trap 'umount %s' EXIT; "
+        "mkdir -p %s/" MULTIBOOT_IMAGE_DIR "; "
+        "dst=%s/" MULTIBOOT_IMAGE_DIR "/.%s.part; "
+        "avail=$(df -B1 --output=avail %s | tail -n 1); "
+        "[ \"$avail\" -ge %llu ] || { echo 'Not enough space on stick'; exit 3; }; "
+        "fallocate -l %llu \"$dst\" 2>/dev/null || true; "
+        "dd if=%s of=\"$dst\" bs=16M iflag=fullblock conv=notrunc,fsync status=progress; "
+        "mv \"$dst\" %s/" MULTIBOOT_IMAGE_DIR "/%s; "
+        "echo " LIST_MARKER "; "
+        "ls -1 %s/" MULTIBOOT_IMAGE_DIR,
+        data_path, mount_dir, mount_dir, mount_dir,
+        mount_dir, name, mount_dir, size, size,
+        q_iso, mount_dir, name, mount_dir);
+
+    rufus_log("Adding %s to multi-image stick %s", name, device_path);
+
+    char **images = NULL;
+    bool ok = run_script(script, size, progress, user_data, &images, NULL);
+
+    g_free(script);
+    g_free(q_iso);
+    rmdir(mount_dir);
+    free(mount_dir);
+    free(data_path);
+    free(name);
+
+    if (ok) {
+        if (progress)
+            progress(1.0, "Updating boot menu...", user_data);
+        ok = write_menu(device_path, images);
+    }
+
+    multiboot_image_list_free(images);
+    return ok;
+}
+
+bool multiboot_remove_image(const char *device_path, const char *name)
+{
+    if (!name || !is_image_name(name) || strchr(name, '/')) {
+        rufus_error("Invalid image name");
+        return false;
+    }
+
+    char *data_path = partition_get_path(device_path, 2);
+    char *mount_dir = make_mount_dir();
+    if (!data_path || !mount_dir) {
+        free(data_path);
+        if (mount_dir)
+            rmdir(mount_dir);
+        free(mount_dir);
+        return false;
+    }
+
+    char *q_name = g_shell_quote(name);
+    char *script = g_strdup_printf(
+        "set -e; "
+        "mount %s %s; "
+        "trap 'umount %s' EXIT; "
+        "rm -f %s/" MULTIBOOT_IMAGE_DIR "/%s; "
+        "echo " LIST_MARKER "; "
+        "ls -1 %s/" MULTIBOOT_IMAGE_DIR,
+        data_path, mount_dir, mount_dir, mount_dir, q_name, mount_dir);
+
+    rufus_log("Removing %s from multi-image stick %s", name, device_path);
+
+    char **images = NULL;
+    bool ok = run_script(script, 0, NULL, NULL, &images, NULL);
+
+    g_free(script);
+    g_free(q_name);
+    rmdir(mount_dir);
+    free(mount_dir);
+    free(data_path);
+
+    if (ok)
+        ok = write_menu(device_path, images);
+
+    multiboot_image_list_free(images);
+    return ok;
+}
+
+char **multiboot_list_images(const char *device_path, int *count)
+{
+    if (count)
+        *count = 0;
+
+    char *data_path = partition_get_path(device_path, 2);
+    char *mount_dir = make_mount_dir();
+    if (!data_path || !mount_dir) {
+        free(data_path);
+        if (mount_dir)
+            rmdir(mount_dir);
+        free(mount_dir);
+        return NULL;
+    }
+
+    char *script = g_strdup_printf(
+        "set -e; "
+        "mount -o ro %s %s; "
+        "trap 'umount %s' EXIT; "
+        "echo " LIST_MARKER "; "
+        "ls -1 %s/" MULTIBOOT_IMAGE_DIR,
+        data_path, mount_dir, mount_dir, mount_dir);
+
+    char **images = NULL;
+    run_script(script, 0, NULL, NULL, &images, count);
+
+    g_free(script);
+    rmdir(mount_dir);
+    free(mount_dir);
+    free(data_path);
+
+    return images;
+}
+
+void multiboot_image_list_free(char **images)
+{
+    if (!images)
+        return;
+    for (int i = 0; images[i]; i++)
+        free(images[i]);
+    free(images);
+}
@@ -0,0 +1,50 @@
+/*
+ * Rufux - Multi-Image Boot Stick
+ * Francesco Lauritano
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ *
+ * A small GRUB boot partition plus a large data partition holding ISO
+ * files. Images are added or removed as plain files; the boot menu is
+ * regenerated from the image directory each time.
+ */
+
+#ifndef RUFUS_MULTIBOOT_H
+#define RUFUS_MULTIBOOT_H
+
+#include "../platform/platform.h"
+#include <stdbool.h>
+#include <stdint.h>
+
+#define MULTIBOOT_BOOT_LABEL "RUFUX_BOOT"
+#define MULTIBOOT_DATA_LABEL "RUFUX_ISO"
+#define MULTIBOOT_BOOT_SIZE  (256ULL * 1024 * 1024)
+#define MULTIBOOT_IMAGE_DIR  "images"
+
+typedef void (*multiboot_progress_t)(double fraction, const char *message, void *user_data);
+
+/* Check that GRUB, sfdisk and the mkfs tools needed are installed */
+bool multiboot_is_supported(void);
+
+/* Check whether the device already carries a multi-image layout */
+bool multiboot_is_initialized(const char *device_path);
+
+/* Partition and format the device and install the GRUB menu (erases it) */
+bool multiboot_init(const char *device_path,
+                    multiboot_progress_t progress, void *user_data);
+
+/* Copy one image onto the data partition and regenerate the menu */
+bool multiboot_add_image(const char *device_path, const char *iso_path,
+                         multiboot_progress_t progress, void *user_data);
+
+/* Delete one image (by file name) and regenerate the menu */
+bool multiboot_remove_image(const char *device_path, const char *name);
+
+/* List image file names on the stick (NULL-terminated, free with
+ * multiboot_image_list_free)
+ */
+char **multiboot_list_images(const char *device_path, int *count);
+
+/* Free a list returned by multiboot_list_images */
+void multiboot_image_list_free(char **images);
+
+#endif /* RUFUS_MULTIBOOT_H */
@@ -0,0 +1,259 @@
+/*
+ * Rufux - Direct NTFS Population Implementation
+ * Francesco Lauritano
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ *
+ * libarchive walks the ISO as it streams out of the image source, and each
+ * entry is created on the volume with libntfs-3g as it arrives. Files are
+ * sized before their data is written so each one gets a single contiguous
+ * run, and nothing passes through FUSE.
+ */
+
+#define _GNU_SOURCE
+#include "ntfs_extract.h"
+#include "image_source.h"
+#include "../common/config.h"
+#include "../common/membudget.h"
+#include "../common/utils.h"
+#include "../platform/platform.h"
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#ifdef HAVE_NTFS3G
+#include <archive.h>
+#include <archive_entry.h>
+#include <ntfs-3g/types.h>
+#include <ntfs-3g/attrib.h>
+#include <ntfs-3g/dir.h>
+#include <ntfs-3g/inode.h>
+#include <ntfs-3g/unistr.h>
+#include <ntfs-3g/volume.h>
+#endif
+
+#ifdef HAVE_NTFS3G
+
+typedef struct {
+    image_source_t *src;
+    uint8_t *buf;
+    uint64_t done;
+    uint64_t total;
+    iso_extract_progress_t progress;
+    void *user_data;
+} iso_reader_t;
+
+bool ntfs_extract_is_supported(void)
+{
+    return is_root();
+}
+
+static la_ssize_t iso_read(struct archive *a, void *data, const void **buf)
+{
+    iso_reader_t *r = data;
+
+    ssize_t n = image_source_read(r->src, r->buf, IMAGE_SOURCE_CHUNK);
+    if (n < 0) {
+        archive_set_error(a, EIO, "Failed to read image");
+        return -1;
+    }
+
+    *buf = r->buf;
+    r->done += n;
+    if (r->progress && r->total)
+        r->progress((double)r->done / r->total, "Copying files...", r->user_data);
+    return n;
+}
+
+/* Create name in dir; returns the new inode, open */
+static ntfs_inode *create_child(ntfs_inode *dir, const char *name, mode_t type)
+{
+    ntfschar *uname = NULL;
+    int len = ntfs_mbstoucs(name, &uname);
+    if (len <= 0)
+        return NULL;
+
+    ntfs_inode *ni = ntfs_create(dir, const_cpu_to_le32(0), uname, len, type);
+    free(uname);
+    return ni;
+}
+
+/* Open the directory holding path and point *leaf at the last component.
+ * Missing levels are created, although ISO entries normally arrive parents
+ * first. */
+static ntfs_inode *open_parent(ntfs_volume *vol, char *path, char **leaf)
+{
+    char *slash = strrchr(path, '/');
+    if (!slash) {
+        *leaf = path;
+        return ntfs_inode_open(vol, FILE_root);
+    }
+
+    *leaf = slash + 1;
+    *slash = '\0';
+
+    ntfs_inode *dir = ntfs_pathname_to_inode(vol, NULL, path);
+    if (!dir) {
+        char *name;
+        ntfs_inode *parent = open_parent(vol, path, &name);
+        if (parent) {
+            dir = create_child(parent, name, S_IFDIR);
+            ntfs_inode_close(parent);
+        }
+    }
+
+    *slash = '/';
+    return dir;
+}
+
+static bool copy_data(ntfs_inode *ni, struct archive *a, int64_t size)
+{
+    ntfs_attr *na = ntfs_attr_open(ni, AT_DATA, AT_UNNAMED, 0);
+    if (!na)
+        return false;
+
+    /* Allocating the full size first gives the file one run; plain
+     * ntfs_attr_truncate would leave a hole to be filled write by write */
+    bool ok = ntfs_attr_truncate_solid(na, size) == 0;
+
+    const void *block;
+    size_t len;
+    la_int64_t offset;
+    int rc = ARCHIVE_EOF;
+    while (ok && (rc = archive_read_data_block(a, &block, &len, &offset)) == ARCHIVE_OK)
+        ok = !thread_cancelled() && ntfs_attr_pwrite(na, offset, len, block) == (s64)len;
+
+    ntfs_attr_close(na);
+    return ok && rc == ARCHIVE_EOF;
+}
+
+static bool copy_entry(ntfs_volume *vol, struct archive *a, struct archive_entry *entry)
+{
+    /* "./EFI/BOOT/" -> "EFI/BOOT" */
+    const char *name = archive_entry_pathname(entry);
+    while (name && (*name == '/' || (name[0] == '.' && name[1] == '/')))
+        name += *name == '/' ? 1 : 2;
+    if (!name || !*name || strcmp(name, ".") == 0)
+        return true;
+
+    char *path = strdup(name);
+    if (!path)
+        return false;
+    size_t path_len = strlen(path);
+    while (path_len > 0 && path[path_len - 1] == '/')
+        path[--path_len] = '\0';
+
+    mode_t type = archive_entry_filetype(entry);
+    if (type != AE_IFDIR && type != AE_IFREG) {
+        rufus_log("Skipping %s (not a file or directory)", path);
+        free(path);
+        return true;
+    }
+
+    bool ok = false;
+    char *leaf;
+    ntfs_inode *dir = open_parent(vol, path, &leaf);
+    if (dir) {
+        ntfs_inode *ni = ntfs_pathname_to_inode(vol, NULL, path);
+        if (!ni)
+            ni = create_child(dir, leaf, type == AE_IFDIR ? S_IFDIR : S_IFREG);
+
+        if (ni) {
+            ok = type == AE_IFDIR || copy_data(ni, a, archive_entry_size(entry));
+            ntfs_inode_close(ni);
+        }
+        ntfs_inode_close(dir);
+    }
+
+    if (!ok)
+        rufus_error("Failed to copy %s: %s", path, strerror(errno));
+    free(path);
+    return ok;
+}
+
+bool ntfs_extract_from_iso(const char *iso_path, const char *partition_path,
+                           iso_extract_progress_t progress, void *user_data)
+{
+    if (!iso_path || !partition_path)
+        return false;
+
+    const rufus_config_t *cfg = config_get();
+    image_source_options_t opts = {
+        .readahead_bytes = cfg->readahead_bytes,
+        .reader_threads = cfg->readahead_threads,
+    };
+
+    iso_reader_t reader = {
+        .progress = progress,
+        .user_data = user_data,
+    };
+    reader.src = image_source_open(iso_path, &opts);
+    if (!reader.src)
+        return false;
+    reader.total = image_source_size(reader.src);
+    reader.buf = membudget_alloc(MEM_POOL_EXTRACT, IMAGE_SOURCE_CHUNK);
+
+    struct archive *a = archive_read_new();
+    if (!reader.buf || !a) {
+        archive_read_free(a);
+        membudget_free(MEM_POOL_EXTRACT, reader.buf, IMAGE_SOURCE_CHUNK);
+        image_source_close(reader.src);
+        return false;
+    }
+
+    archive_read_support_format_iso9660(a);
+
+    bool ok = false;
+    ntfs_volume *vol = NULL;
+    if (archive_read_open(a, &reader, NULL, iso_read, NULL) != ARCHIVE_OK) {
+        rufus_error("Cannot read %s: %s", iso_path, archive_error_string(a));
+    } else if (!(vol = ntfs_mount(partition_path, NTFS_MNT_EXCLUSIVE))) {
+        rufus_error("Cannot open NTFS volume %s: %s", partition_path, strerror(errno));
+    } else {
+        rufus_log("Copying %s to %s through libntfs-3g", iso_path, partition_path);
+
+        struct archive_entry *entry;
+        int rc = ARCHIVE_EOF;
+        ok = true;
+        while (ok && (rc = archive_read_next_header(a, &entry)) == ARCHIVE_OK)
+            ok = !thread_cancelled() && copy_entry(vol, a, entry);
+
+        if (ok && rc != ARCHIVE_EOF) {
+            rufus_error("Cannot read %s: %s", iso_path, archive_error_string(a));
+            ok = false;
+        }
+
+        /* Unmounting flushes the MFT and bitmaps */
+        if (ntfs_umount(vol, FALSE) != 0) {
+            rufus_error("Failed to close NTFS volume %s: %s", partition_path, strerror(errno));
+            ok = false;
+        }
+    }
+
+    archive_read_free(a);
+    membudget_free(MEM_POOL_EXTRACT, reader.buf, IMAGE_SOURCE_CHUNK);
+    image_source_close(reader.src);
+
+    if (progress)
+        progress(ok ? 1.0 : 0.0, ok ? "Complete" : "Failed", user_data);
+    return ok;
+}
+
+#else /* !HAVE_NTFS3G */
+
+bool ntfs_extract_is_supported(void)
+{
+    return false;
+}
+
+bool ntfs_extract_from_iso(const char *iso_path, const char *partition_path,
+                           iso_extract_progress_t progress, void *user_data)
+{
+    (void)iso_path;
+    (void)partition_path;
+    (void)progress;
+    (void)user_data;
+    rufus_error("Built without libntfs-3g");
+    return false;
+}
+
+#endif /* HAVE_NTFS3G */
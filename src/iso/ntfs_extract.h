@@ -0,0 +1,24 @@
+/*
+ * Rufux - Direct NTFS Population
+ * Francesco Lauritano
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ *
+ * Copies ISO contents onto an unmounted NTFS volume through libntfs-3g,
+ * reading the ISO in process with libarchive. Needs HAVE_NTFS3G and raw
+ * access to the partition (root).
+ */
+
+#ifndef RUFUS_NTFS_EXTRACT_H
+#define RUFUS_NTFS_EXTRACT_H
+
+#include "iso_extract.h"
+#include <stdbool.h>
+
+/* True when built with libntfs-3g and the partition can be opened directly */
+bool ntfs_extract_is_supported(void);
+
+/* Copy every file of the ISO onto the freshly formatted NTFS partition */
+bool ntfs_extract_from_iso(const char *iso_path, const char *partition_path,
+                           iso_extract_progress_t progress, void *user_data);
+
+#endif /* RUFUS_NTFS_EXTRACT_H */
@@ -0,0 +1,219 @@
+/*
+ * Rufux - Live Persistence Implementation
+ * Francesco Lauritano
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ *
+ * Relocates the image's backup GPT (or reuses its MBR), appends a partition
+ * in the unused space behind the image and formats it with lazy init.
+ */
+
+#define _GNU_SOURCE
+#include "persistence.h"
+#include "../disk/partition.h"
+#include "../format/format.h"
+#include "../common/utils.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/stat.h>
+
+#define PERSISTENCE_ALIGN (1024ULL * 1024)
+#define PARTITION_WAIT_MS 10000
+
+static const char *persistence_names[] = {
+    [PERSISTENCE_NONE]     = "None",
+    [PERSISTENCE_WRITABLE] = "Ubuntu (writable)",
+    [PERSISTENCE_CASPER]   = "Ubuntu legacy (casper-rw)",
+    [PERSISTENCE_DEBIAN]   = "Debian (persistence)",
+    [PERSISTENCE_FEDORA]   = "Fedora (overlay)",
+};
+
+static const char *persistence_labels[] = {
+    [PERSISTENCE_NONE]     = NULL,
+    [PERSISTENCE_WRITABLE] = "writable",
+    [PERSISTENCE_CASPER]   = "casper-rw",
+    [PERSISTENCE_DEBIAN]   = "persistence",
+    [PERSISTENCE_FEDORA]   = "fedora-overlay",
+};
+
+const char *persistence_type_name(persistence_type_t type)
+{
+    if (type >= PERSISTENCE_COUNT)
+        return "Unknown";
+    return persistence_names[type];
+}
+
+const char *persistence_type_label(persistence_type_t type)
+{
+    if (type >= PERSISTENCE_COUNT)
+        return NULL;
+    return persistence_labels[type];
+}
+
+bool persistence_is_supported(void)
+{
+    return command_exists("sfdisk") && format_is_supported(FS_EXT4);
+}
+
+/* Hybrid ISOs carry a GPT header at LBA 1 when they have one */
+static bool image_has_gpt(const char *image_path)
+{
+    FILE *fp = fopen(image_path, "rb");
+    if (!fp)
+        return false;
+
+    char sig[8];
+    bool gpt = fseek(fp, 512, SEEK_SET) == 0 &&
+               fread(sig, 1, sizeof(sig), fp) == sizeof(sig) &&
+               memcmp(sig, "EFI PART", 8) == 0;
+    fclose(fp);
+    return gpt;
+}
+
+/* Whole-device size from /sys/block/<dev>/size (512-byte units) */
+static uint64_t device_size_bytes(const char *device_path)
+{
+    const char *name = strrchr(device_path, '/');
+    name = name ? name + 1 : device_path;
+
+    char path[256];
+    snprintf(path, sizeof(path), "/sys/block/%s/size", name);
+
+    FILE *fp = fopen(path, "r");
+    if (!fp)
+        return 0;
+
+    unsigned long long sectors = 0;
+    if (fscanf(fp, "%llu", &sectors) != 1)
+        sectors = 0;
+    fclose(fp);
+
+    return (uint64_t)sectors * 512;
+}
+
+/* Debian live-boot only uses a persistence volume that has a persistence.conf */
+static char *make_debian_conf_dir(void)
+{
+    char template[] = "/tmp/rufus-persist-XXXXXX";
+    char *dir = mkdtemp(template);
+    if (!dir) {
+        rufus_error("Failed to create staging directory: %s", strerror(errno));
+        return NULL;
+    }
+
+    char conf[512];
+    snprintf(conf, sizeof(conf), "%s/persistence.conf", dir);
+    FILE *fp = fopen(conf, "w");
+    if (!fp) {
+        rufus_error("Failed to write persistence.conf: %s", strerror(errno));
+        rmdir(dir);
+        return NULL;
+    }
+    fputs("/ union\n", fp);
+    fclose(fp);
+
+    /* mke2fs may run as root through pkexec; make sure it can read this */
+    chmod(dir, 0755);
+    chmod(conf, 0644);
+
+    return strdup(dir);
+}
+
+static void remove_debian_conf_dir(char *dir)
+{
+    if (!dir)
+        return;
+
+    char conf[512];
+    snprintf(conf, sizeof(conf), "%s/persistence.conf", dir);
+    unlink(conf);
+    rmdir(dir);
+    free(dir);
+}
+
+bool persistence_create(const char *device_path, const char *image_path,
+                        persistence_type_t type,
+                        persistence_progress_t progress, void *user_data)
+{
+    if (!device_path || !image_path || type == PERSISTENCE_NONE) {
+        rufus_error("Invalid arguments to persistence_create");
+        return false;
+    }
+
+    if (!persistence_is_supported()) {
+        rufus_error("Persistence needs sfdisk and mkfs.ext4");
+        return false;
+    }
+
+    struct stat st;
+    if (stat(image_path, &st) != 0) {
+        rufus_error("Cannot stat image: %s", strerror(errno));
+        return false;
+    }
+
+    uint64_t device_size = device_size_bytes(device_path);
+    uint64_t start = ((uint64_t)st.st_size + PERSISTENCE_ALIGN - 1) &
+                     ~(PERSISTENCE_ALIGN - 1);
+
+    if (device_size <= start || device_size - start < PERSISTENCE_MIN_SIZE) {
+        rufus_error("Not enough space behind the image for persistence");
+        return false;
+    }
+
+    partition_style_t style = image_has_gpt(image_path) ?
+                              PARTITION_STYLE_GPT : PARTITION_STYLE_MBR;
+
+    if (progress)
+        progress(0.0, "Adding persistence partition...", user_data);
+
+    if (!partition_append(device_path, style, start, FS_EXT4))
+        return false;
+
+    int part_number = partition_wait_for_start(device_path, start, PARTITION_WAIT_MS);
+    if (part_number < 0)
+        return false;
+
+    char *part_path = partition_get_path(device_path, part_number);
+    if (!part_path)
+        return false;
+
+    char *conf_dir = NULL;
+    if (type == PERSISTENCE_DEBIAN) {
+        conf_dir = make_debian_conf_dir();
+        if (!conf_dir) {
+            free(part_path);
+            return false;
+        }
+    }
+
+    if (progress)
+        progress(0.5, "Formatting persistence partition...", user_data);
+
+    format_options_t opts = {
+        .fs_type = FS_EXT4,
+        .label = persistence_type_label(type),
+        .cluster_size = 0,
+        .quick_format = true,
+        .lazy_init = true,
+        .discard = true,
+        .populate_dir = conf_dir,
+    };
+
+    rufus_log("Creating %s persistence on %s", persistence_type_name(type), part_path);
+    bool ok = format_partition(part_path, &opts, NULL, NULL);
+
+    if (ok && type == PERSISTENCE_FEDORA)
+        rufus_log("Fedora persistence needs 'rd.live.overlay=LABEL=%s "
+                  "rd.live.overlay.overlayfs' on the kernel command line",
+                  persistence_type_label(type));
+
+    remove_debian_conf_dir(conf_dir);
+    free(part_path);
+
+    if (progress)
+        progress(ok ? 1.0 : 0.0, ok ? "Complete" : "Failed", user_data);
+
+    return ok;
+}
@@ -0,0 +1,47 @@
+/*
+ * Rufux - Live Persistence
+ * Francesco Lauritano
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ *
+ * Add a persistence partition after a hybrid ISO has been written raw.
+ */
+
+#ifndef RUFUS_PERSISTENCE_H
+#define RUFUS_PERSISTENCE_H
+
+#include "../platform/platform.h"
+#include <stdbool.h>
+#include <stdint.h>
+
+/* Persistence flavours (selects the filesystem label live systems look for) */
+typedef enum {
+    PERSISTENCE_NONE = 0,
+    PERSISTENCE_WRITABLE,   /* Ubuntu 19.10+ casper: "writable" */
+    PERSISTENCE_CASPER,     /* Older Ubuntu casper: "casper-rw" */
+    PERSISTENCE_DEBIAN,     /* Debian live-boot: "persistence" + persistence.conf */
+    PERSISTENCE_FEDORA,     /* Fedora dracut overlay (rd.live.overlay=LABEL=...) */
+    PERSISTENCE_COUNT,
+} persistence_type_t;
+
+/* Smallest persistence partition worth creating */
+#define PERSISTENCE_MIN_SIZE (256ULL * 1024 * 1024)
+
+typedef void (*persistence_progress_t)(double fraction, const char *message, void *user_data);
+
+/* Get display name for a persistence type */
+const char *persistence_type_name(persistence_type_t type);
+
+/* Get the filesystem label used for a persistence type */
+const char *persistence_type_label(persistence_type_t type);
+
+/* Check that the tools needed for persistence are available */
+bool persistence_is_supported(void);
+
+/* Append and format a persistence partition behind an image already written
+ * to device_path. Existing image partitions are left untouched.
+ */
+bool persistence_create(const char *device_path, const char *image_path,
+                        persistence_type_t type,
+                        persistence_progress_t progress, void *user_data);
+
+#endif /* RUFUS_PERSISTENCE_H */
@@ -0,0 +1,601 @@
+/*
+ * Rufux - Prebuilt File-Copy Images Implementation
+ * Francesco Lauritano
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ *
+ * Layout of the build directory:
+ *   <key>.img          finished image, as large as the stick and sparse
+ *   <key>.<pid>.part   image being built
+ *
+ * The key covers the ISO identity and everything that shapes the layout,
+ * so a changed label or a stick of another size gets a new build.
+ */
+
+#define _GNU_SOURCE
+#include "prebuilt.h"
+#include "image_cache.h"
+#include "image_source.h"
+#include "../common/hash.h"
+#include "../common/membudget.h"
+#include "../common/utils.h"
+#include "../disk/disk_io.h"
+#include "../disk/partition.h"
+#include "../format/format.h"
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <glib.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+/* Time allowed for the loop partition node to appear */
+#define LOOP_NODE_TIMEOUT_MS 10000
+
+#define DD_BLOCK_SIZE "4M"
+
+bool prebuilt_is_supported(void)
+{
+    return command_exists("losetup") && iso_extract_is_supported() &&
+           format_is_supported(FS_FAT32);
+}
+
+static char *build_key(const prebuilt_spec_t *spec)
+{
+    struct stat st;
+    if (stat(spec->iso_path, &st) != 0)
+        return NULL;
+
+    char *iso_key = image_cache_key(spec->iso_path, &st);
+    if (!iso_key)
+        return NULL;
+
+    char identity[512];
+    int len = snprintf(identity, sizeof(identity), "%s|%llu|%d|%u|%s", iso_key,
+                       (unsigned long long)spec->size, (int)spec->style,
+                       (unsigned)spec->cluster_size, spec->label ? spec->label : "");
+    free(iso_key);
+
+    uint8_t digest[SHA256_DIGEST_SIZE];
+    if (!hash_buffer(HASH_SHA256, identity, len, digest, sizeof(digest)))
+        return NULL;
+
+    char hex[SHA256_DIGEST_SIZE * 2 + 1];
+    hash_digest_to_hex(digest, 16, hex);
+    return strdup(hex);
+}
+
+/* Attach path to a free loop device with partition scanning on */
+static char *loop_attach(const char *path)
+{
+    char *q_path = g_shell_quote(path);
+    char *cmd = g_strdup_printf("exec losetup -f --show -P %s", q_path);
+    g_free(q_path);
+
+    int out_fd = -1;
+    pid_t pid = spawn_privileged(cmd, NULL, &out_fd);
+    g_free(cmd);
+    if (pid < 0)
+        return NULL;
+
+    char line[256];
+    size_t got = 0;
+    while (got < sizeof(line) - 1) {
+        ssize_t n = read(out_fd, line + got, sizeof(line) - 1 - got);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            break;
+        got += n;
+    }
+    line[got] = '\0';
+    close(out_fd);
+
+    int wstatus = wait_privileged(pid);
+
+    line[strcspn(line, "\n")] = '\0';
+    if (wstatus < 0 || !WIFEXITED(wstatus) || WEXITSTATUS(wstatus) != 0 ||
+        strncmp(line, "/dev/loop", 9) != 0) {
+        rufus_error("Failed to set up a loop device for %s: %s", path, line);
+        return NULL;
+    }
+
+    return strdup(line);
+}
+
+static void loop_detach(const char *loop)
+{
+    char cmd[128];
+    snprintf(cmd, sizeof(cmd), "losetup -d %s", loop);
+    if (run_privileged(cmd) != 0)
+        rufus_log("Warning: failed to detach %s", loop);
+}
+
+static bool build_image(const char *path, const prebuilt_spec_t *spec,
+                        iso_extract_progress_t progress, void *user_data)
+{
+    int fd = open(path, O_CREAT | O_TRUNC | O_WRONLY | O_CLOEXEC, 0600);
+    if (fd < 0) {
+        rufus_error("Cannot create %s: %s", path, strerror(errno));
+        return false;
+    }
+    bool ok = ftruncate(fd, spec->size) == 0;
+    close(fd);
+    if (!ok) {
+        rufus_error("Cannot size %s: %s", path, strerror(errno));
+        return false;
+    }
+
+    char *loop = loop_attach(path);
+    if (!loop)
+        return false;
+
+    rufus_log("Building %s for %s on %s", path, spec->iso_path, loop);
+
+    char *part = NULL;
+    ok = partition_create_single_efi(loop, spec->style, spec->label) &&
+         (part = partition_wait_for_node(loop, 1, LOOP_NODE_TIMEOUT_MS)) != NULL;
+
+    if (ok) {
+        format_options_t opts = {
+            .fs_type = FS_FAT32,
+            .label = spec->label,
+            .cluster_size = spec->cluster_size,
+            .quick_format = true,
+        };
+        ok = format_partition(part, &opts, NULL, NULL) &&
+             iso_extract_to_partition(spec->iso_path, part, progress, user_data);
+    }
+
+    free(part);
+    loop_detach(loop);
+    free(loop);
+    return ok;
+}
+
+/* Drop finished images of other keys and stale parts of dead builds */
+static void remove_other_builds(const char *dir, const char *key)
+{
+    DIR *d = opendir(dir);
+    if (!d)
+        return;
+
+    size_t key_len = strlen(key);
+    struct dirent *ent;
+    while ((ent = readdir(d)) != NULL) {
+        const char *name = ent->d_name;
+        const char *ext = strrchr(name, '.');
+        if (!ext || (strcmp(ext, ".img") != 0 && strcmp(ext, ".part") != 0))
+            continue;
+        if (strncmp(name, key, key_len) == 0 && strcmp(ext, ".img") == 0)
+            continue;
+
+        /* <key>.<pid>.part of a live build stays */
+        if (strcmp(ext, ".part") == 0) {
+            const char *dot = memchr(name, '.', ext - name);
+            int pid = dot ? atoi(dot + 1) : 0;
+            if (pid > 0 && kill(pid, 0) == 0)
+                continue;
+        }
+
+        char *path = g_build_filename(dir, name, NULL);
+        if (unlink(path) == 0)
+            rufus_log("Removed old build %s", path);
+        g_free(path);
+    }
+    closedir(d);
+}
+
+char *prebuilt_get(const char *dir, const prebuilt_spec_t *spec,
+                   iso_extract_progress_t progress, void *user_data)
+{
+    if (!dir || !spec || !spec->iso_path || !spec->size)
+        return NULL;
+
+    if (g_mkdir_with_parents(dir, 0700) != 0) {
+        rufus_error("Cannot create build directory %s: %s", dir, strerror(errno));
+        return NULL;
+    }
+
+    char *key = build_key(spec);
+    if (!key) {
+        rufus_error("Cannot identify %s", spec->iso_path);
+        return NULL;
+    }
+
+    char *name = g_strdup_printf("%s.img", key);
+    char *img = g_build_filename(dir, name, NULL);
+    g_free(name);
+
+    if (access(img, R_OK) == 0) {
+        rufus_log("Reusing built image %s", img);
+        free(key);
+        char *path = strdup(img);
+        g_free(img);
+        return path;
+    }
+
+    remove_other_builds(dir, key);
+
+    name = g_strdup_printf("%s.%d.part", key, (int)getpid());
+    char *part = g_build_filename(dir, name, NULL);
+    g_free(name);
+    free(key);
+
+    char *path = NULL;
+    if (build_image(part, spec, progress, user_data)) {
+        if (rename(part, img) == 0)
+            path = strdup(img);
+        else
+            rufus_error("Cannot commit %s: %s", img, strerror(errno));
+    }
+    if (!path)
+        unlink(part);
+
+    g_free(part);
+    g_free(img);
+    return path;
+}
+
+static uint32_t le32(const uint8_t *p)
+{
+    return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+/* Find the region of the image that only holds FAT32 clusters. Everything
+ * before *data_start (tables, boot sector, FATs) and after *data_end
+ * (backup GPT) must reach the stick even where the image is a hole. */
+static bool fat_data_region(int fd, const char *image_path,
+                            uint64_t *data_start, uint64_t *data_end)
+{
+    partition_layout_t *layout = partition_get_layout(image_path);
+    if (!layout || layout->part_count < 1) {
+        partition_layout_free(layout);
+        return false;
+    }
+    uint64_t start = layout->parts[0].start;
+    uint64_t size = layout->parts[0].size;
+    partition_layout_free(layout);
+
+    uint8_t bpb[512];
+    if (pread(fd, bpb, sizeof(bpb), start) != (ssize_t)sizeof(bpb) ||
+        bpb[510] != 0x55 || bpb[511] != 0xAA)
+        return false;
+
+    uint32_t sector = bpb[11] | bpb[12] << 8;
+    uint32_t reserved = bpb[14] | bpb[15] << 8;
+    uint32_t fats = bpb[16];
+    uint32_t fat_sectors = le32(bpb + 36);
+    if (!sector || !fats || !fat_sectors)
+        return false;
+
+    *data_start = start + ((uint64_t)reserved + (uint64_t)fats * fat_sectors) * sector;
+    *data_end = start + size;
+    return *data_start < *data_end;
+}
+
+/* True when [offset, offset + len) was never written in the image */
+static bool is_hole(int fd, uint64_t offset, size_t len)
+{
+    off_t data = lseek(fd, offset, SEEK_DATA);
+    if (data < 0)
+        return errno == ENXIO;
+    return (uint64_t)data >= offset + len;
+}
+
+/* Chunks read ahead of the slowest stick */
+#define FLASH_RING_SLOTS 8
+
+/* The image is read once into the ring; every stick has its own writer
+ * thread, and a slot is refilled once all sticks still writing are past it */
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    uint8_t *buf[FLASH_RING_SLOTS];
+    uint64_t offset[FLASH_RING_SLOTS];
+    size_t len[FLASH_RING_SLOTS];
+    bool hole[FLASH_RING_SLOTS];    /* Free space, nothing to write */
+    uint64_t produced;              /* Chunks filled so far */
+    bool done;                      /* No more chunks will come */
+    bool stop;                      /* Cancelled or the read failed */
+} flash_ring_t;
+
+typedef struct {
+    const char *device;
+    int fd;
+    pid_t pid;
+    flash_ring_t *ring;
+    pthread_t thread;
+    bool started;
+    uint64_t next;                  /* Next chunk to write */
+    bool failed;
+} flash_target_t;
+
+static bool feed_all(int fd, const void *data, size_t len)
+{
+    const uint8_t *p = data;
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        p += n;
+        len -= n;
+    }
+    return true;
+}
+
+static bool target_open(flash_target_t *t)
+{
+    if (is_root()) {
+        t->fd = disk_open(t->device, true);
+        return t->fd >= 0;
+    }
+
+    /* Each written chunk arrives behind an "offset length" header */
+    char *cmd = g_strdup_printf("while read off len; do dd of=%s bs=" DD_BLOCK_SIZE " "
+                                "iflag=fullblock,count_bytes count=$len oflag=seek_bytes "
+                                "seek=$off conv=notrunc,fsync status=none || exit 1; done",
+                                t->device);
+    t->pid = spawn_privileged(cmd, &t->fd, NULL);
+    g_free(cmd);
+    return t->pid > 0;
+}
+
+static bool target_write(flash_target_t *t, uint64_t offset, const uint8_t *data, size_t len)
+{
+    if (is_root())
+        return disk_write(t->fd, offset, data, len);
+
+    char header[64];
+    int n = snprintf(header, sizeof(header), "%llu %zu\n", (unsigned long long)offset, len);
+    return feed_all(t->fd, header, n) && feed_all(t->fd, data, len);
+}
+
+static bool target_close(flash_target_t *t, bool ok)
+{
+    if (t->fd < 0)
+        return false;
+
+    if (is_root()) {
+        ok = ok && disk_sync(t->fd);
+        disk_close(t->fd);
+        return ok;
+    }
+
+    if (thread_cancelled())
+        kill_privileged(t->pid);
+    close(t->fd);
+    int wstatus = wait_privileged(t->pid);
+    return ok && wstatus >= 0 && WIFEXITED(wstatus) && WEXITSTATUS(wstatus) == 0;
+}
+
+static void *target_thread(void *arg)
+{
+    flash_target_t *t = arg;
+    flash_ring_t *ring = t->ring;
+
+    pthread_mutex_lock(&ring->lock);
+    for (;;) {
+        while (!ring->stop && !ring->done && t->next == ring->produced)
+            pthread_cond_wait(&ring->cond, &ring->lock);
+        if (ring->stop || t->next == ring->produced)
+            break;
+
+        int slot = t->next % FLASH_RING_SLOTS;
+        pthread_mutex_unlock(&ring->lock);
+
+        bool ok = ring->hole[slot] ||
+                  target_write(t, ring->offset[slot], ring->buf[slot], ring->len[slot]);
+
+        pthread_mutex_lock(&ring->lock);
+        if (!ok) {
+            /* The other sticks carry on without this one */
+            rufus_error("Failed to write %s, dropping it", t->device);
+            t->failed = true;
+            pthread_cond_broadcast(&ring->cond);
+            break;
+        }
+        t->next++;
+        pthread_cond_broadcast(&ring->cond);
+    }
+    pthread_mutex_unlock(&ring->lock);
+    return NULL;
+}
+
+/* Position of the slowest stick still writing, or UINT64_MAX when none is
+ * left (caller holds ring->lock) */
+static uint64_t slowest_target(const flash_target_t *targets, int count)
+{
+    uint64_t min = UINT64_MAX;
+    for (int i = 0; i < count; i++) {
+        if (!targets[i].failed && targets[i].next < min)
+            min = targets[i].next;
+    }
+    return min;
+}
+
+/* Wait on the ring for a writer, waking regularly to look for a cancel
+ * (caller holds ring->lock). Returns false once the flash is stopped. */
+static bool ring_wait(flash_ring_t *ring)
+{
+    if (thread_cancelled() && !ring->stop) {
+        ring->stop = true;
+        pthread_cond_broadcast(&ring->cond);
+    }
+    if (ring->stop)
+        return false;
+
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_nsec += CANCEL_POLL_MS * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+    }
+    pthread_cond_timedwait(&ring->cond, &ring->lock, &deadline);
+    return true;
+}
+
+bool prebuilt_flash(const char *image_path, const char *const *devices, int count,
+                    bool *results, write_progress_callback_t progress_cb, void *user_data)
+{
+    if (!image_path || !devices || count < 1)
+        return false;
+
+    for (int i = 0; results && i < count; i++)
+        results[i] = false;
+
+    int fd = open(image_path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        rufus_error("Cannot open %s: %s", image_path, strerror(errno));
+        return false;
+    }
+
+    struct stat st;
+    fstat(fd, &st);
+    uint64_t total = st.st_size;
+
+    uint64_t data_start = total, data_end = total;
+    if (!fat_data_region(fd, image_path, &data_start, &data_end))
+        rufus_log("No FAT32 data region in %s, writing it in full", image_path);
+
+    flash_ring_t ring = { .produced = 0 };
+    flash_target_t *targets = calloc(count, sizeof(flash_target_t));
+    bool ok = targets != NULL;
+    for (int i = 0; ok && i < FLASH_RING_SLOTS; i++)
+        ok = (ring.buf[i] = membudget_alloc(MEM_POOL_WRITE, IMAGE_SOURCE_CHUNK)) != NULL;
+    if (!ok) {
+        for (int i = 0; i < FLASH_RING_SLOTS; i++)
+            membudget_free(MEM_POOL_WRITE, ring.buf[i], IMAGE_SOURCE_CHUNK);
+        free(targets);
+        close(fd);
+        return false;
+    }
+
+    pthread_mutex_init(&ring.lock, NULL);
+    pthread_cond_init(&ring.cond, NULL);
+
+    int live = 0;
+    for (int i = 0; i < count; i++) {
+        flash_target_t *t = &targets[i];
+        t->device = devices[i];
+        t->fd = -1;
+        t->ring = &ring;
+        t->failed = !target_open(t);
+        if (!t->failed) {
+            t->started = pthread_create(&t->thread, NULL, target_thread, t) == 0;
+            t->failed = !t->started;
+        }
+        if (t->failed)
+            rufus_error("Cannot write %s, leaving it out", t->device);
+        else
+            live++;
+    }
+
+    struct timespec begin;
+    clock_gettime(CLOCK_MONOTONIC, &begin);
+    uint64_t skipped = 0;
+    uint64_t chunks = (total + IMAGE_SOURCE_CHUNK - 1) / IMAGE_SOURCE_CHUNK;
+
+    pthread_mutex_lock(&ring.lock);
+    while (live > 0 && !ring.stop) {
+        uint64_t slowest = slowest_target(targets, count);
+        if (slowest == UINT64_MAX)
+            break;
+
+        if (ring.produced < chunks && ring.produced - slowest < FLASH_RING_SLOTS) {
+            /* The slot's last reader is past it; fill it outside the lock */
+            uint64_t idx = ring.produced;
+            int slot = idx % FLASH_RING_SLOTS;
+            pthread_mutex_unlock(&ring.lock);
+
+            uint64_t offset = idx * IMAGE_SOURCE_CHUNK;
+            size_t len = total - offset < IMAGE_SOURCE_CHUNK ? total - offset : IMAGE_SOURCE_CHUNK;
+
+            /* Unallocated clusters are free in the FAT; their old contents
+             * on the stick do not matter */
+            bool hole = offset >= data_start && offset + len <= data_end &&
+                        is_hole(fd, offset, len);
+            bool read_ok = hole || pread(fd, ring.buf[slot], len, offset) == (ssize_t)len;
+            if (hole)
+                skipped += len;
+
+            pthread_mutex_lock(&ring.lock);
+            if (!read_ok) {
+                rufus_error("Cannot read %s: %s", image_path, strerror(errno));
+                ring.stop = true;
+                pthread_cond_broadcast(&ring.cond);
+                break;
+            }
+            ring.offset[slot] = offset;
+            ring.len[slot] = len;
+            ring.hole[slot] = hole;
+            ring.produced++;
+            if (ring.produced == chunks)
+                ring.done = true;
+            pthread_cond_broadcast(&ring.cond);
+        } else if (slowest >= chunks) {
+            break;
+        } else if (!ring_wait(&ring)) {
+            break;
+        }
+
+        if (progress_cb) {
+            uint64_t written = slowest_target(targets, count);
+            uint64_t bytes = written == UINT64_MAX ? 0 :
+                             written * IMAGE_SOURCE_CHUNK < total ? written * IMAGE_SOURCE_CHUNK : total;
+            struct timespec now;
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            double elapsed = (now.tv_sec - begin.tv_sec) + (now.tv_nsec - begin.tv_nsec) / 1e9;
+            double speed = elapsed > 0 ? bytes / elapsed / (1024.0 * 1024.0) : 0;
+            pthread_mutex_unlock(&ring.lock);
+            progress_cb(bytes, total, speed, user_data);
+            pthread_mutex_lock(&ring.lock);
+        }
+    }
+    ring.done = true;
+    bool stopped = ring.stop;
+    pthread_cond_broadcast(&ring.cond);
+    pthread_mutex_unlock(&ring.lock);
+
+    /* A writer may be blocked on a helper's pipe */
+    for (int i = 0; stopped && i < count; i++) {
+        if (targets[i].pid > 0)
+            kill_privileged(targets[i].pid);
+    }
+
+    int written = 0;
+    for (int i = 0; i < count; i++) {
+        flash_target_t *t = &targets[i];
+        if (t->started)
+            pthread_join(t->thread, NULL);
+
+        bool target_ok = !stopped && !t->failed && t->next == chunks;
+        target_ok = target_close(t, target_ok) && target_ok;
+        if (!target_ok && !t->failed && !stopped)
+            rufus_error("Failed to write %s", t->device);
+        if (results)
+            results[i] = target_ok;
+        written += target_ok;
+    }
+
+    if (written > 0)
+        rufus_log("Wrote %s to %d of %d device(s), skipped %llu MiB of free space",
+                  image_path, written, count, (unsigned long long)(skipped >> 20));
+
+    for (int i = 0; i < FLASH_RING_SLOTS; i++)
+        membudget_free(MEM_POOL_WRITE, ring.buf[i], IMAGE_SOURCE_CHUNK);
+    pthread_cond_destroy(&ring.cond);
+    pthread_mutex_destroy(&ring.lock);
+    free(targets);
+    close(fd);
+    return written == count;
+}
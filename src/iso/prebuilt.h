@@ -0,0 +1,50 @@
+/*
+ * Rufux - Prebuilt File-Copy Images
+ * Francesco Lauritano
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ *
+ * A FAT32 file-copy stick is built once into a sparse image file through a
+ * loop device, with the same partition, format and extract steps as a
+ * direct write. Every stick of the same size is then given a raw
+ * sequential copy of that image instead of its own format and file-by-file
+ * extraction, which is what makes small-file ISOs slow on cheap flash.
+ */
+
+#ifndef RUFUS_PREBUILT_H
+#define RUFUS_PREBUILT_H
+
+#include "iso_extract.h"
+#include "iso_writer.h"
+#include "../platform/platform.h"
+#include <stdbool.h>
+#include <stdint.h>
+
+/* What the image is built from; sticks must be exactly size bytes */
+typedef struct {
+    const char *iso_path;
+    uint64_t size;
+    partition_style_t style;
+    uint32_t cluster_size;      /* 0 = default */
+    const char *label;
+} prebuilt_spec_t;
+
+/* True when loop devices can be set up and the ISO can be extracted */
+bool prebuilt_is_supported(void);
+
+/* Path of the image built for spec in dir, building it first when missing
+ * (caller frees, NULL on error). Builds for other specs are removed so the
+ * directory holds a single image.
+ */
+char *prebuilt_get(const char *dir, const prebuilt_spec_t *spec,
+                   iso_extract_progress_t progress, void *user_data);
+
+/* Write a built image to every device at once, reading it once. The
+ * partition table and FAT metadata are always written; chunks of the
+ * filesystem that were never allocated in the image are skipped. A device
+ * that fails is dropped and the others carry on. results (may be NULL)
+ * receives each device's outcome; returns true if all succeeded.
+ */
+bool prebuilt_flash(const char *image_path, const char *const *devices, int count,
+                    bool *results, write_progress_callback_t progress_cb, void *user_data);
+
+#endif /* RUFUS_PREBUILT_H */
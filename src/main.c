@@ -10,6 +10,7 @@
 
 #include <gtk/gtk.h>
 #include <locale.h>
+#include <signal.h>
 #include "ui/app.h"
 #include "platform/platform.h"
 
@@ -18,6 +19,9 @@ int main(int argc, char *argv[])
     /* Set up locale */
     setlocale(LC_ALL, "");
 
+    /* Writes into a dd pipe report EPIPE instead of killing us */
+    signal(SIGPIPE, SIG_IGN);
+
     rufus_log("Rufux starting...");
 
     /* Create and run application */
@@ -6,6 +6,24 @@
 
 #include "app.h"
 #include "window.h"
+#include "../common/config.h"
+#include "../common/hash.h"
+#include "../common/jobs.h"
+#include "../common/kernels.h"
+#include "../common/membudget.h"
+#include "../common/throttle.h"
+#include "../common/utils.h"
+#include "../device/device.h"
+#include "../device/tuning.h"
+#include "../disk/audit.h"
+#include "../disk/manifest.h"
+#include "../iso/image_cache.h"
+#include "../iso/iso_analyzer.h"
+#include "../iso/prebuilt.h"
+#include "../platform/platform.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 
 #define RUFUS_VERSION "0.1.0"
 
@@ -59,6 +77,8 @@ static void rufus_app_startup(GApplication *app)
 {
     G_APPLICATION_CLASS(rufus_app_parent_class)->startup(app);
 
+    jobs_init(config_get()->worker_threads);
+
     /* Register actions */
     static const GActionEntry app_actions[] = {
         { "about", on_about_action, NULL, NULL, NULL, { 0 } },
@@ -80,17 +100,464 @@ static void rufus_app_startup(GApplication *app)
     g_object_unref(provider);
 }
 
+static void rufus_app_shutdown(GApplication *app)
+{
+    jobs_shutdown();
+
+    G_APPLICATION_CLASS(rufus_app_parent_class)->shutdown(app);
+}
+
+/* Print the SHA-256 of an image and its published checksum verdict */
+static gint check_image(const char *path)
+{
+    hash_sidecar_t *sidecar = hash_sidecar_find(path);
+    hash_check_t check;
+    char *hash = hash_file_checked(path, sidecar, &check, NULL, NULL);
+    if (!hash) {
+        hash_sidecar_free(sidecar);
+        return 2;
+    }
+
+    printf("SHA-256: %s\n", hash);
+    if (check == HASH_CHECK_VERIFIED)
+        printf("%s: verified by %s\n", hash_type_name(sidecar->type), sidecar->source);
+    else if (check == HASH_CHECK_MISMATCH)
+        printf("%s: MISMATCH with %s (expected %s)\n", hash_type_name(sidecar->type),
+               sidecar->source, sidecar->expected);
+    else
+        printf("No checksum file lists this image\n");
+
+    free(hash);
+    hash_sidecar_free(sidecar);
+    return check == HASH_CHECK_MISMATCH ? 1 : 0;
+}
+
+/* Time each chunk digest over the same chunks on one thread */
+static gint bench_digests(void)
+{
+    enum { CHUNKS = 64 };
+    uint8_t *data = malloc(MANIFEST_CHUNK_SIZE);
+    if (!data)
+        return 2;
+    for (size_t i = 0; i < MANIFEST_CHUNK_SIZE; i++)
+        data[i] = (uint8_t)g_random_int();
+
+    printf("CRC32C implementation: %s\n", hash_crc32c_impl());
+    for (int t = 0; t < CHUNK_DIGEST_COUNT; t++) {
+        uint8_t digest[CHUNK_DIGEST_SIZE];
+        gint64 start = g_get_monotonic_time();
+        for (int i = 0; i < CHUNKS; i++)
+            hash_chunk((chunk_digest_t)t, data, MANIFEST_CHUNK_SIZE, digest);
+        double secs = (g_get_monotonic_time() - start) / 1e6;
+
+        printf("%-8s %8.0f MiB/s per thread\n", chunk_digest_name((chunk_digest_t)t),
+               secs > 0 ? CHUNKS * (MANIFEST_CHUNK_SIZE / 1048576.0) / secs : 0.0);
+    }
+
+    free(data);
+    return 0;
+}
+
+/* Time each buffer kernel at every level the CPU supports, one thread */
+static gint bench_kernels(void)
+{
+    enum { SIZE = 16 * 1024 * 1024, ROUNDS = 16 };
+    uint8_t *a = calloc(1, SIZE);
+    uint8_t *b = calloc(1, SIZE);
+    if (!a || !b) {
+        free(a);
+        free(b);
+        return 2;
+    }
+
+    static const char *names[] = { "is_zero", "first_diff", "pattern_fill", "pattern_check" };
+    printf("%-8s", "level");
+    for (size_t k = 0; k < G_N_ELEMENTS(names); k++)
+        printf(" %14s", names[k]);
+    printf("   (MiB/s per thread)\n");
+
+    kernel_level_t best = kernels_level();
+    volatile size_t sink = 0;
+    for (int level = 0; level < KERNEL_LEVEL_COUNT; level++) {
+        if (!kernels_set_level((kernel_level_t)level))
+            continue;
+
+        printf("%-8s", kernels_level_name((kernel_level_t)level));
+        for (size_t k = 0; k < G_N_ELEMENTS(names); k++) {
+            /* Both compares scan the whole buffer: zeros, equal buffers,
+             * a matching pattern */
+            if (k == 3)
+                pattern_fill(a, SIZE, 1, 0);
+            else if (k == 0)
+                memset(a, 0, SIZE);
+
+            gint64 start = g_get_monotonic_time();
+            for (int r = 0; r < ROUNDS; r++) {
+                switch (k) {
+                case 0: sink += buf_is_zero(a, SIZE); break;
+                case 1: sink += buf_first_diff(a, b, SIZE); break;
+                case 2: pattern_fill(b, SIZE, r, 0); break;
+                case 3: sink += pattern_check(a, SIZE, 1, 0); break;
+                }
+            }
+            double secs = (g_get_monotonic_time() - start) / 1e6;
+            printf(" %14.0f", secs > 0 ? ROUNDS * (SIZE / 1048576.0) / secs : 0.0);
+
+            /* pattern_fill left b patterned; first_diff needs a == b */
+            if (k == 2)
+                memset(b, 0, SIZE);
+        }
+        printf("\n");
+    }
+    kernels_set_level(best);
+
+    (void)sink;
+    free(a);
+    free(b);
+    return 0;
+}
+
+/* Copy an ISO onto the attached sticks as FAT32 files: those named in
+ * targets, or every one when targets is NULL and yes confirms it. The stick
+ * image is built once per stick size and then written to all sticks of that
+ * size. */
+static gint flash_all(const char *iso_path, const char *const *targets, gboolean yes)
+{
+    if (!prebuilt_is_supported()) {
+        fprintf(stderr, "File copy needs losetup, mkfs.fat and xorriso, bsdtar or 7z\n");
+        return 2;
+    }
+
+    iso_info_t *info = iso_analyze(iso_path);
+    if (!info || !info->has_efi) {
+        fprintf(stderr, "%s has no UEFI boot files\n", iso_path);
+        iso_info_free(info);
+        return 2;
+    }
+
+    device_list_t *list = device_enumerate();
+    if (!list || list->count == 0) {
+        fprintf(stderr, "No sticks attached\n");
+        device_list_free(list);
+        iso_info_free(info);
+        return 2;
+    }
+
+    /* Sticks left out start as taken */
+    gboolean *taken = g_new0(gboolean, list->count);
+    for (int t = 0; targets && targets[t]; t++) {
+        gboolean found = FALSE;
+        for (int i = 0; i < list->count; i++)
+            found = found || g_strcmp0(list->devices[i].path, targets[t]) == 0;
+        if (!found) {
+            fprintf(stderr, "%s is not an attached stick\n", targets[t]);
+            g_free(taken);
+            device_list_free(list);
+            iso_info_free(info);
+            return 2;
+        }
+    }
+
+    printf("Erasing and writing %s to:\n", iso_path);
+    for (int i = 0; i < list->count; i++) {
+        const device_info_t *dev = &list->devices[i];
+        gboolean named = !targets;
+        for (int t = 0; targets && targets[t]; t++)
+            named = named || g_strcmp0(dev->path, targets[t]) == 0;
+        taken[i] = !named;
+        if (!named)
+            continue;
+
+        char *size_str = format_size(dev->size);
+        printf("  %s  %s  %s %s\n", dev->path, size_str, dev->vendor ? dev->vendor : "",
+               dev->model ? dev->model : "");
+        free(size_str);
+    }
+
+    /* The GUI always asks; here naming the sticks or --yes is the answer */
+    if (!targets && !yes) {
+        fprintf(stderr, "Pass --yes to erase all of them, or name sticks with --device\n");
+        g_free(taken);
+        device_list_free(list);
+        iso_info_free(info);
+        return 2;
+    }
+
+    const rufus_config_t *cfg = config_get();
+    char *dir = cfg->prebuild_dir ? g_strdup(cfg->prebuild_dir) :
+                g_build_filename(g_get_user_cache_dir(), "rufux", "builds", NULL);
+
+    /* No stage graph here; the whole run is the write */
+    if (cfg->ioprio_class != IOPRIO_CLASS_NONE)
+        thread_ioprio_set(cfg->ioprio_class, cfg->ioprio_level);
+
+    /* FAT volume labels hold 11 characters */
+    char *label = g_strndup(info->label ? info->label : "", 11);
+    const char **devices = g_new0(const char *, list->count);
+    gint failed = 0;
+
+    for (int i = 0; i < list->count; i++) {
+        if (taken[i])
+            continue;
+
+        uint64_t size = list->devices[i].size;
+        int count = 0;
+        for (int j = i; j < list->count; j++) {
+            const device_info_t *dev = &list->devices[j];
+            if (taken[j] || dev->size != size)
+                continue;
+            taken[j] = TRUE;
+            if (device_is_mounted(dev) && !device_unmount(dev)) {
+                printf("%s: still mounted, skipped\n", dev->path);
+                failed++;
+                continue;
+            }
+            devices[count++] = dev->path;
+        }
+        if (count == 0)
+            continue;
+
+        char *size_str = format_size(size);
+        printf("Building %s image for %d stick(s)\n", size_str, count);
+        char *grant = g_strdup_printf("Flash %s", size_str);
+        free(size_str);
+
+        prebuilt_spec_t spec = {
+            .iso_path = iso_path,
+            .size = size,
+            .style = PARTITION_STYLE_GPT,
+            .label = label,
+        };
+        membudget_job_t *budget = membudget_job_new(grant);
+        g_free(grant);
+        membudget_job_t *prev_budget = membudget_set_thread_job(budget);
+        char *image = prebuilt_get(dir, &spec, NULL, NULL);
+        tuning_session_t **tuning = g_new0(tuning_session_t *, count);
+        for (int k = 0; k < count; k++) {
+            throttle_add_device(devices[k]);
+            tuning[k] = image ? tuning_begin(devices[k]) : NULL;
+        }
+        bool *results = g_new0(bool, count);
+        if (image)
+            prebuilt_flash(image, devices, count, results, NULL, NULL);
+        for (int k = 0; k < count; k++) {
+            tuning_end(tuning[k]);
+            throttle_remove_device(devices[k]);
+        }
+        g_free(tuning);
+        free(image);
+        membudget_set_thread_job(prev_budget);
+        membudget_job_free(budget);
+
+        for (int k = 0; k < count; k++) {
+            printf("%s: %s\n", devices[k], results[k] ? "OK" : "FAILED");
+            if (!results[k])
+                failed++;
+        }
+        g_free(results);
+    }
+    membudget_log();
+
+    g_free(taken);
+    g_free(devices);
+    g_free(label);
+    g_free(dir);
+    device_list_free(list);
+    iso_info_free(info);
+    return failed ? 1 : 0;
+}
+
+static gint rufus_app_handle_local_options(GApplication *app, GVariantDict *options)
+{
+    (void)app;
+
+    const char *config_path = NULL;
+    g_variant_dict_lookup(options, "config", "&s", &config_path);
+    if (!config_load(config_path))
+        return 1;
+
+    /* Command line overrides the config file */
+    rufus_config_t *cfg = config_get();
+    gint readahead_mb;
+    if (g_variant_dict_lookup(options, "readahead", "i", &readahead_mb) && readahead_mb >= 0)
+        cfg->readahead_bytes = (uint64_t)readahead_mb * 1024 * 1024;
+
+    gint threads;
+    if (g_variant_dict_lookup(options, "readahead-threads", "i", &threads) && threads > 0)
+        cfg->readahead_threads = threads;
+
+    gint budget_mb;
+    if (g_variant_dict_lookup(options, "memory-budget-mb", "i", &budget_mb) && budget_mb >= 0)
+        cfg->memory_budget_bytes = (uint64_t)budget_mb * 1024 * 1024;
+
+    const char *spool_dir;
+    if (g_variant_dict_lookup(options, "spool-dir", "&s", &spool_dir)) {
+        free(cfg->spool_dir);
+        cfg->spool_dir = strdup(spool_dir);
+    }
+
+    gint workers;
+    if (g_variant_dict_lookup(options, "workers", "i", &workers) && workers >= 0)
+        cfg->worker_threads = workers;
+
+    gint cache_mb;
+    if (g_variant_dict_lookup(options, "cache-mb", "i", &cache_mb) && cache_mb >= 0)
+        cfg->cache_bytes = (uint64_t)cache_mb * 1024 * 1024;
+
+    if (g_variant_dict_contains(options, "clear-cache"))
+        image_cache_clear();
+
+    const char *catalog_dir;
+    if (g_variant_dict_lookup(options, "catalog", "&s", &catalog_dir)) {
+        g_strfreev(cfg->catalog_dirs);
+        cfg->catalog_dirs = g_new0(char *, 2);
+        cfg->catalog_dirs[0] = g_strdup(catalog_dir);
+    }
+
+    if (g_variant_dict_contains(options, "no-verify"))
+        cfg->verify_writes = false;
+
+    const char *chunk_digest;
+    if (g_variant_dict_lookup(options, "chunk-digest", "&s", &chunk_digest) &&
+        !chunk_digest_parse(chunk_digest, &cfg->chunk_digest)) {
+        fprintf(stderr, "Unknown chunk digest '%s' (sha256, crc32c)\n", chunk_digest);
+        return 1;
+    }
+
+    const char *prediscard;
+    if (g_variant_dict_lookup(options, "prediscard", "&s", &prediscard) &&
+        !discard_policy_parse(prediscard, &cfg->prediscard)) {
+        fprintf(stderr, "Unknown prediscard setting '%s' (auto, always, never)\n", prediscard);
+        return 1;
+    }
+
+    if (g_variant_dict_contains(options, "grow"))
+        cfg->grow_images = true;
+
+    const char *ioprio;
+    if (g_variant_dict_lookup(options, "ioprio", "&s", &ioprio) && !config_set_ioprio(ioprio))
+        return 1;
+
+    gint write_mbps;
+    if (g_variant_dict_lookup(options, "write-mbps", "i", &write_mbps) && write_mbps >= 0)
+        cfg->write_bps = (uint64_t)write_mbps * 1024 * 1024;
+
+    gint memory_high_mb;
+    if (g_variant_dict_lookup(options, "memory-high-mb", "i", &memory_high_mb) &&
+        memory_high_mb >= 0)
+        cfg->memory_high_bytes = (uint64_t)memory_high_mb * 1024 * 1024;
+
+    throttle_init();
+
+    if (g_variant_dict_contains(options, "bench-digests"))
+        return bench_digests();
+
+    if (g_variant_dict_contains(options, "bench-kernels"))
+        return bench_kernels();
+
+    const char *checksum_path;
+    if (g_variant_dict_lookup(options, "checksum", "&s", &checksum_path))
+        return check_image(checksum_path);
+
+    const char *flash_path;
+    if (g_variant_dict_lookup(options, "flash-all", "&s", &flash_path)) {
+        const char **targets = NULL;
+        g_variant_dict_lookup(options, "device", "^a&s", &targets);
+        gint status = flash_all(flash_path, targets, g_variant_dict_contains(options, "yes"));
+        g_free(targets);
+        return status;
+    }
+
+    if (g_variant_dict_contains(options, "audit")) {
+        audit_options_t audit = {
+            .sampled = g_variant_dict_contains(options, "audit-sampled"),
+            .per_hub = cfg->audit_per_hub,
+        };
+        g_variant_dict_lookup(options, "audit-image", "&s", &audit.image_path);
+
+        /* Readers mostly wait on the sticks; allow one per device */
+        jobs_init(cfg->worker_threads > 0 ? cfg->worker_threads : MAX_DEVICES);
+        audit_report_t *report = audit_run(&audit);
+        jobs_shutdown();
+        if (!report)
+            return 2;
+
+        audit_report_print(report, stdout);
+        gint status = audit_report_passed(report) ? 0 : 1;
+        audit_report_free(report);
+        return status;
+    }
+
+    return -1;
+}
+
 static void rufus_app_class_init(RufusAppClass *klass)
 {
     GApplicationClass *app_class = G_APPLICATION_CLASS(klass);
 
     app_class->activate = rufus_app_activate;
     app_class->startup = rufus_app_startup;
+    app_class->shutdown = rufus_app_shutdown;
+    app_class->handle_local_options = rufus_app_handle_local_options;
 }
 
 static void rufus_app_init(RufusApp *app)
 {
-    (void)app;
+    static const GOptionEntry options[] = {
+        { "config", 0, 0, G_OPTION_ARG_STRING, NULL,
+          "Load settings from FILE", "FILE" },
+        { "readahead", 0, 0, G_OPTION_ARG_INT, NULL,
+          "Image readahead depth in MiB (0 = network/FUSE sources only)", "MIB" },
+        { "readahead-threads", 0, 0, G_OPTION_ARG_INT, NULL,
+          "Concurrent image reads", "N" },
+        { "memory-budget-mb", 0, 0, G_OPTION_ARG_INT, NULL,
+          "Memory for I/O buffers and readahead (0 = half of RAM)", "MIB" },
+        { "spool-dir", 0, 0, G_OPTION_ARG_STRING, NULL,
+          "Keep local copies of slow images in DIR", "DIR" },
+        { "workers", 0, 0, G_OPTION_ARG_INT, NULL,
+          "Background worker threads (0 = one per CPU)", "N" },
+        { "cache-mb", 0, 0, G_OPTION_ARG_INT, NULL,
+          "Keep recently written images in RAM, up to MIB", "MIB" },
+        { "clear-cache", 0, 0, G_OPTION_ARG_NONE, NULL,
+          "Drop all images from the RAM cache", NULL },
+        { "catalog", 0, 0, G_OPTION_ARG_STRING, NULL,
+          "Watch DIR for images and list them in the library", "DIR" },
+        { "no-verify", 0, 0, G_OPTION_ARG_NONE, NULL,
+          "Skip readback of raw writes (no stick manifest is recorded)", NULL },
+        { "chunk-digest", 0, 0, G_OPTION_ARG_STRING, NULL,
+          "Digest for chunk readback and manifests: sha256 or crc32c", "NAME" },
+        { "bench-digests", 0, 0, G_OPTION_ARG_NONE, NULL,
+          "Measure chunk digest throughput on this CPU and exit", NULL },
+        { "bench-kernels", 0, 0, G_OPTION_ARG_NONE, NULL,
+          "Measure buffer kernel throughput at each CPU level and exit", NULL },
+        { "prediscard", 0, 0, G_OPTION_ARG_STRING, NULL,
+          "Discard sticks before raw writes: auto, always or never", "WHEN" },
+        { "grow", 0, 0, G_OPTION_ARG_NONE, NULL,
+          "Grow compact disk images to fill the stick after a raw write", NULL },
+        { "ioprio", 0, 0, G_OPTION_ARG_STRING, NULL,
+          "I/O class for writes: idle, best-effort[:0-7] or realtime[:0-7]", "CLASS" },
+        { "write-mbps", 0, 0, G_OPTION_ARG_INT, NULL,
+          "Limit writes to each stick to MIB per second (cgroup v2)", "MIB" },
+        { "memory-high-mb", 0, 0, G_OPTION_ARG_INT, NULL,
+          "Limit the page cache used while flashing to MIB (cgroup v2)", "MIB" },
+        { "audit", 0, 0, G_OPTION_ARG_NONE, NULL,
+          "Verify all attached sticks against their manifests and exit", NULL },
+        { "audit-image", 0, 0, G_OPTION_ARG_STRING, NULL,
+          "Audit against FILE instead of the manifests", "FILE" },
+        { "audit-sampled", 0, 0, G_OPTION_ARG_NONE, NULL,
+          "Audit only the first, last and a few random chunks", NULL },
+        { "checksum", 0, 0, G_OPTION_ARG_STRING, NULL,
+          "Hash FILE, check it against SHA256SUMS or similar beside it and exit", "FILE" },
+        { "flash-all", 0, 0, G_OPTION_ARG_STRING, NULL,
+          "Copy ISO FILE onto attached sticks as FAT32 files and exit", "FILE" },
+        { "device", 0, 0, G_OPTION_ARG_STRING_ARRAY, NULL,
+          "Stick for --flash-all to write (repeatable)", "PATH" },
+        { "yes", 0, 0, G_OPTION_ARG_NONE, NULL,
+          "Let --flash-all erase every attached stick without naming them", NULL },
+        { NULL }
+    };
+
+    g_application_add_main_option_entries(G_APPLICATION(app), options);
 }
 
 RufusApp *rufus_app_new(void)
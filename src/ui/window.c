@@ -7,15 +7,32 @@
 #include "window.h"
 #include "widgets.h"
 #include "../device/device.h"
+#include "../device/perfdb.h"
+#include "../device/tuning.h"
+#include "../disk/discard.h"
+#include "../disk/manifest.h"
 #include "../disk/partition.h"
 #include "../format/format.h"
+#include "../iso/catalog.h"
+#include "../iso/http_source.h"
 #include "../iso/iso_analyzer.h"
 #include "../iso/iso_extract.h"
+#include "../iso/ntfs_extract.h"
 #include "../iso/iso_writer.h"
+#include "../iso/persistence.h"
+#include "../iso/grow.h"
+#include "../iso/multiboot.h"
+#include "../iso/prebuilt.h"
+#include "../common/config.h"
 #include "../common/hash.h"
-#include <pthread.h>
+#include "../common/jobs.h"
+#include "../common/membudget.h"
+#include "../common/stages.h"
+#include "../common/throttle.h"
+#include "../common/utils.h"
 #include <stdio.h>
 #include <stdlib.h>
+#include <sys/stat.h>
 
 struct _RufusWindow {
     GtkApplicationWindow parent_instance;
@@ -25,8 +42,11 @@ struct _RufusWindow {
     GtkButton *refresh_button;
     GtkDropDown *boot_dropdown;
     GtkEntry *iso_entry;
+    GtkDropDown *library_dropdown;
     GtkButton *select_button;
     GtkDropDown *write_mode_dropdown;
+    GtkDropDown *persistence_dropdown;
+    GtkButton *remove_image_button;
     GtkDropDown *partition_dropdown;
     GtkDropDown *target_dropdown;
     GtkEntry *label_entry;
@@ -42,16 +62,23 @@ struct _RufusWindow {
     device_list_t *devices;
     char *iso_path;
     iso_info_t *iso_info;
+    catalog_list_t *catalog;
     iso_writer_t *iso_writer;
     gboolean operation_running;
-    gboolean hash_in_progress;
+    job_t *analysis_job;
+    job_t *hash_job;
+    job_t *manifest_job;
+    job_t *write_job;
     char *iso_hash;
+    gboolean disposed;          /* Widgets are gone; jobs only clean up */
 };
 
 G_DEFINE_TYPE(RufusWindow, rufus_window, GTK_TYPE_APPLICATION_WINDOW)
 
 static const char *boot_options[] = { "Disk or ISO image", "Non bootable", NULL };
-static const char *write_mode_options[] = { "DD image (raw)", "ISO file copy (UEFI only)", NULL };
+static const char *write_mode_options[] = {
+    "DD image (raw)", "ISO file copy (UEFI only)", "Multi-image stick (add ISO)", NULL
+};
 static const char *fs_options[] = { "FAT32", "NTFS", "exFAT", "ext4", NULL };
 static const char *partition_options[] = { "MBR", "GPT", NULL };
 static const char *target_options[] = { "BIOS", "UEFI", "BIOS+UEFI", NULL };
@@ -138,7 +165,8 @@ static void update_start_sensitivity(RufusWindow *self)
     gboolean can_start;
     if (boot_mode == 0) {
         /* ISO mode - need device AND ISO */
-        can_start = has_device && self->iso_path && !self->operation_running;
+        can_start = has_device && self->iso_path && !self->analysis_job &&
+                    !self->operation_running;
     } else {
         /* Non-bootable - just need device */
         can_start = has_device && !self->operation_running;
@@ -147,68 +175,419 @@ static void update_start_sensitivity(RufusWindow *self)
     gtk_widget_set_sensitive(GTK_WIDGET(self->start_button), can_start);
 }
 
+/* ============== Stick Manifest ============== */
+
+typedef struct {
+    RufusWindow *window;
+    char *device_path;
+    manifest_t *manifest;
+    gboolean checked;
+    gboolean match;
+} manifest_check_op_t;
+
+static void manifest_check_job_done(job_t *job, void *data)
+{
+    manifest_check_op_t *op = data;
+    RufusWindow *self = op->window;
+
+    if (job == self->manifest_job) {
+        g_clear_pointer(&self->manifest_job, job_unref);
+
+        if (!self->operation_running) {
+            char date[32];
+            struct tm tm;
+            localtime_r(&op->manifest->written, &tm);
+            strftime(date, sizeof(date), "%Y-%m-%d", &tm);
+
+            char *text;
+            if (!op->checked)
+                text = g_strdup_printf("Last written with %s on %s", op->manifest->image_name, date);
+            else if (op->match)
+                text = g_strdup_printf("Stick holds %s (written %s)", op->manifest->image_name, date);
+            else
+                text = g_strdup_printf("Stick changed since %s was written", op->manifest->image_name);
+
+            set_status(self, text, "status-ready");
+            g_free(text);
+        }
+    }
+
+    g_object_unref(self);
+    manifest_free(op->manifest);
+    g_free(op->device_path);
+    g_free(op);
+}
+
+static bool manifest_check_job_func(job_t *job, void *data)
+{
+    manifest_check_op_t *op = data;
+
+    if (job_is_cancelled(job))
+        return false;
+
+    /* Sampling without root would raise a password prompt on selection */
+    if (is_root()) {
+        op->checked = TRUE;
+        op->match = manifest_sample_check(op->manifest, op->device_path);
+    }
+    return true;
+}
+
+/* Tell what a known stick holds from its manifest and a few sampled chunks */
+static void start_manifest_check(RufusWindow *self)
+{
+    if (self->manifest_job) {
+        job_cancel(self->manifest_job);
+        g_clear_pointer(&self->manifest_job, job_unref);
+    }
+
+    guint device_idx = gtk_drop_down_get_selected(self->device_dropdown);
+    if (self->operation_running || !self->devices || device_idx >= (guint)self->devices->count)
+        return;
+
+    const device_info_t *dev = &self->devices->devices[device_idx];
+    char *path = manifest_path_for(dev);
+    manifest_t *manifest = manifest_load(path);
+    free(path);
+    if (!manifest)
+        return;
+
+    manifest_check_op_t *op = g_new0(manifest_check_op_t, 1);
+    op->window = g_object_ref(self);
+    op->device_path = g_strdup(dev->path);
+    op->manifest = manifest;
+
+    job_t *job = job_new(manifest_check_job_func, op, JOB_PRIO_BACKGROUND);
+    job_set_done(job, manifest_check_job_done);
+
+    self->manifest_job = job_ref(job);
+    job_submit(job);
+}
+
+static void on_device_selected(GObject *object, GParamSpec *pspec, RufusWindow *self)
+{
+    on_param_changed(object, pspec, self);
+
+    if (self->status_label)
+        start_manifest_check(self);
+}
+
 /* ============== Hash Calculation ============== */
 
 typedef struct {
     RufusWindow *window;
     char *path;
     char *hash;
+    hash_sidecar_t *sidecar;
+    hash_check_t check;
 } hash_op_t;
 
-static gboolean hash_complete_idle(gpointer data)
+/* Show the digest and, if a checksum file lists the image, its verdict */
+static void show_iso_hash(RufusWindow *self, const char *hash,
+                          const hash_sidecar_t *sidecar, hash_check_t check)
+{
+    g_free(self->iso_hash);
+    self->iso_hash = g_strdup(hash);
+
+    /* Show truncated hash in label */
+    char display[128];
+    if (check == HASH_CHECK_VERIFIED) {
+        snprintf(display, sizeof(display), "SHA-256: %.16s... (verified by %s)",
+                 hash, sidecar->source);
+    } else if (check == HASH_CHECK_MISMATCH) {
+        snprintf(display, sizeof(display), "SHA-256: %.16s... (MISMATCH with %s)",
+                 hash, sidecar->source);
+    } else {
+        snprintf(display, sizeof(display), "SHA-256: %.16s...", hash);
+    }
+    gtk_label_set_text(self->hash_label, display);
+
+    char *tooltip = sidecar ? g_strdup_printf("%s\nExpected %s: %s", hash,
+                                              hash_type_name(sidecar->type),
+                                              sidecar->expected)
+                            : g_strdup(hash);
+    gtk_widget_set_tooltip_text(GTK_WIDGET(self->hash_label), tooltip);
+    g_free(tooltip);
+
+    if (check == HASH_CHECK_MISMATCH)
+        gtk_widget_add_css_class(GTK_WIDGET(self->hash_label), "status-error");
+    else
+        gtk_widget_remove_css_class(GTK_WIDGET(self->hash_label), "status-error");
+}
+
+static void hash_job_done(job_t *job, void *data)
 {
     hash_op_t *op = data;
     RufusWindow *self = op->window;
 
-    self->hash_in_progress = FALSE;
-
-    if (op->hash) {
-        g_free(self->iso_hash);
-        self->iso_hash = g_strdup(op->hash);
+    /* A newer selection replaced this job; drop the result */
+    if (job == self->hash_job) {
+        g_clear_pointer(&self->hash_job, job_unref);
 
-        /* Show truncated hash in label */
-        char display[32];
-        snprintf(display, sizeof(display), "SHA-256: %.16s...", op->hash);
-        gtk_label_set_text(self->hash_label, display);
-        gtk_widget_set_tooltip_text(GTK_WIDGET(self->hash_label), op->hash);
-    } else {
-        gtk_label_set_text(self->hash_label, "SHA-256: (error)");
+        if (op->hash) {
+            show_iso_hash(self, op->hash, op->sidecar, op->check);
+        } else {
+            gtk_label_set_text(self->hash_label, "SHA-256: (error)");
+        }
     }
 
+    g_object_unref(self);
     free(op->path);
     free(op->hash);
+    hash_sidecar_free(op->sidecar);
     g_free(op);
-
-    return G_SOURCE_REMOVE;
 }
 
-static void *hash_thread_func(void *data)
+static bool hash_job_func(job_t *job, void *data)
 {
     hash_op_t *op = data;
 
-    op->hash = hash_file_hex(HASH_SHA256, op->path, NULL, NULL);
+    if (job_is_cancelled(job))
+        return false;
 
-    g_idle_add(hash_complete_idle, op);
-    return NULL;
+    /* Check against a published checksum in the same read */
+    op->sidecar = hash_sidecar_find(op->path);
+    op->hash = hash_file_checked(op->path, op->sidecar, &op->check, NULL, NULL);
+
+    if (op->hash && op->check == HASH_CHECK_VERIFIED)
+        rufus_log("%s checksum verified against %s", hash_type_name(op->sidecar->type),
+                  op->sidecar->source);
+    else if (op->hash && op->check == HASH_CHECK_MISMATCH)
+        rufus_error("%s checksum does not match %s", hash_type_name(op->sidecar->type),
+                    op->sidecar->source);
+
+    return op->hash != NULL;
 }
 
-static void start_hash_calculation(RufusWindow *self, const char *path)
+/* Hash after dep (if any) so analysis gets the disk first */
+static void start_hash_calculation(RufusWindow *self, const char *path, job_t *dep)
 {
-    if (self->hash_in_progress)
+    if (self->hash_job) {
+        job_cancel(self->hash_job);
+        g_clear_pointer(&self->hash_job, job_unref);
+    }
+
+    gtk_widget_set_tooltip_text(GTK_WIDGET(self->hash_label), NULL);
+    gtk_widget_remove_css_class(GTK_WIDGET(self->hash_label), "status-error");
+
+    /* Downloading a URL just to hash it would defeat streaming it */
+    if (http_source_is_url(path)) {
+        gtk_label_set_text(self->hash_label, "SHA-256: checked against the published checksum while writing");
         return;
+    }
 
     gtk_label_set_text(self->hash_label, "SHA-256: calculating...");
-    gtk_widget_set_tooltip_text(GTK_WIDGET(self->hash_label), NULL);
 
     hash_op_t *op = g_new0(hash_op_t, 1);
-    op->window = self;
+    op->window = g_object_ref(self);
+    op->path = strdup(path);
+
+    job_t *job = job_new(hash_job_func, op, JOB_PRIO_BACKGROUND);
+    job_set_done(job, hash_job_done);
+    job_depends_on(job, dep);
+
+    self->hash_job = job_ref(job);
+    job_submit(job);
+}
+
+/* ============== ISO Analysis ============== */
+
+typedef struct {
+    RufusWindow *window;
+    char *path;
+    iso_info_t *info;
+} analysis_op_t;
+
+/* Take ownership of the analysis of the selected image and adapt the UI */
+static void apply_iso_info(RufusWindow *self, iso_info_t *info)
+{
+    if (self->iso_info)
+        iso_info_free(self->iso_info);
+    self->iso_info = info;
+
+    gboolean keep_mode = gtk_drop_down_get_selected(self->write_mode_dropdown) == 2;
+
+    if (self->iso_info) {
+        if (self->iso_info->label) {
+            gtk_editable_set_text(GTK_EDITABLE(self->label_entry), self->iso_info->label);
+        }
+
+        if (keep_mode) {
+            /* Stay in multi-image mode; the ISO is added as a file */
+        } else if (self->iso_info->is_windows || http_source_is_url(self->iso_info->path)) {
+            gtk_drop_down_set_selected(self->write_mode_dropdown, 0);
+        } else if (!self->iso_info->is_hybrid && self->iso_info->has_efi) {
+            gtk_drop_down_set_selected(self->write_mode_dropdown, 1);
+        } else {
+            gtk_drop_down_set_selected(self->write_mode_dropdown, 0);
+        }
+    }
+
+    reset_status_ready(self);
+    update_start_sensitivity(self);
+}
+
+static void analysis_job_done(job_t *job, void *data)
+{
+    analysis_op_t *op = data;
+    RufusWindow *self = op->window;
+
+    if (job == self->analysis_job) {
+        g_clear_pointer(&self->analysis_job, job_unref);
+
+        apply_iso_info(self, op->info);
+        op->info = NULL;
+    }
+
+    if (op->info)
+        iso_info_free(op->info);
+    g_object_unref(self);
+    free(op->path);
+    g_free(op);
+}
+
+static bool analysis_job_func(job_t *job, void *data)
+{
+    analysis_op_t *op = data;
+
+    if (job_is_cancelled(job))
+        return false;
+
+    op->info = iso_analyze(op->path);
+    return true;
+}
+
+static void start_analysis(RufusWindow *self, const char *path)
+{
+    if (self->analysis_job) {
+        job_cancel(self->analysis_job);
+        g_clear_pointer(&self->analysis_job, job_unref);
+    }
+
+    analysis_op_t *op = g_new0(analysis_op_t, 1);
+    op->window = g_object_ref(self);
     op->path = strdup(path);
 
-    self->hash_in_progress = TRUE;
+    job_t *job = job_new(analysis_job_func, op, JOB_PRIO_ANALYSIS);
+    job_set_done(job, analysis_job_done);
+    self->analysis_job = job_ref(job);
+
+    start_hash_calculation(self, path, job);
+    job_submit(job);
+}
+
+/* ============== Image Library ============== */
+
+static const catalog_entry_t *find_catalog_entry(RufusWindow *self, const char *path)
+{
+    for (int i = 0; self->catalog && i < self->catalog->count; i++) {
+        if (strcmp(self->catalog->entries[i].path, path) == 0)
+            return &self->catalog->entries[i];
+    }
+    return NULL;
+}
+
+/* Use the indexed analysis and digest of a catalog image if still current */
+static bool select_catalog_image(RufusWindow *self, const catalog_entry_t *entry)
+{
+    iso_info_t *info = catalog_entry_info(entry);
+    if (!info)
+        return false;
+
+    if (self->analysis_job) {
+        job_cancel(self->analysis_job);
+        g_clear_pointer(&self->analysis_job, job_unref);
+    }
+    if (self->hash_job) {
+        job_cancel(self->hash_job);
+        g_clear_pointer(&self->hash_job, job_unref);
+    }
 
-    pthread_t thread;
-    pthread_create(&thread, NULL, hash_thread_func, op);
-    pthread_detach(thread);
+    /* A published SHA-256 can be checked against the indexed digest without
+     * reading the image again; other algorithms are left unchecked */
+    hash_sidecar_t *sidecar = hash_sidecar_find(entry->path);
+    hash_check_t check = HASH_CHECK_NONE;
+    if (sidecar && sidecar->type == HASH_SHA256)
+        check = strcmp(sidecar->expected, entry->sha256) == 0 ? HASH_CHECK_VERIFIED
+                                                              : HASH_CHECK_MISMATCH;
+    show_iso_hash(self, entry->sha256, check != HASH_CHECK_NONE ? sidecar : NULL, check);
+    hash_sidecar_free(sidecar);
+    apply_iso_info(self, info);
+    return true;
+}
+
+static void refresh_library(RufusWindow *self)
+{
+    catalog_list_free(self->catalog);
+    self->catalog = catalog_list();
+
+    GtkStringList *model = gtk_string_list_new(NULL);
+    gtk_string_list_append(model, "Library");
+    for (int i = 0; self->catalog && i < self->catalog->count; i++) {
+        const catalog_entry_t *entry = &self->catalog->entries[i];
+        if (entry->info) {
+            gtk_string_list_append(model, entry->name);
+        } else {
+            char *name = g_strdup_printf("%s (analyzing)", entry->name);
+            gtk_string_list_append(model, name);
+            g_free(name);
+        }
+    }
+
+    /* Swapping the model resets the selection; keep it on the placeholder */
+    gtk_drop_down_set_model(self->library_dropdown, G_LIST_MODEL(model));
+    gtk_drop_down_set_selected(self->library_dropdown, 0);
+    g_object_unref(model);
+}
+
+static void on_library_selected(GtkDropDown *dropdown, GParamSpec *pspec, RufusWindow *self)
+{
+    (void)pspec;
+    guint idx = gtk_drop_down_get_selected(dropdown);
+    if (idx == 0 || idx == GTK_INVALID_LIST_POSITION || !self->catalog ||
+        idx > (guint)self->catalog->count || self->operation_running)
+        return;
+
+    const catalog_entry_t *entry = &self->catalog->entries[idx - 1];
+
+    g_free(self->iso_path);
+    self->iso_path = g_strdup(entry->path);
+    gtk_editable_set_text(GTK_EDITABLE(self->iso_entry), self->iso_path);
+
+    if (!select_catalog_image(self, entry)) {
+        if (self->iso_info) {
+            iso_info_free(self->iso_info);
+            self->iso_info = NULL;
+        }
+        start_analysis(self, self->iso_path);
+        reset_status_ready(self);
+        update_start_sensitivity(self);
+    }
+}
+
+/* A path or http(s) URL typed into the image entry */
+static void on_iso_entry_activate(GtkEntry *entry, RufusWindow *self)
+{
+    const char *text = gtk_editable_get_text(GTK_EDITABLE(entry));
+    if (!text || !*text || self->operation_running)
+        return;
+
+    if (!http_source_is_url(text) && !g_file_test(text, G_FILE_TEST_IS_REGULAR)) {
+        set_status(self, "Image not found", "status-error");
+        return;
+    }
+
+    g_free(self->iso_path);
+    self->iso_path = g_strdup(text);
+
+    if (self->iso_info) {
+        iso_info_free(self->iso_info);
+        self->iso_info = NULL;
+    }
+    start_analysis(self, self->iso_path);
+
+    reset_status_ready(self);
+    update_start_sensitivity(self);
 }
 
 /* ISO file selection callback */
@@ -225,32 +604,20 @@ static void on_iso_file_selected(GObject *source, GAsyncResult *result, gpointer
         /* Update entry */
         gtk_editable_set_text(GTK_EDITABLE(self->iso_entry), self->iso_path);
 
-        /* Analyze ISO */
-        if (self->iso_info) {
-            iso_info_free(self->iso_info);
-        }
-        self->iso_info = iso_analyze(self->iso_path);
-
-        if (self->iso_info) {
-            if (self->iso_info->label) {
-                gtk_editable_set_text(GTK_EDITABLE(self->label_entry), self->iso_info->label);
-            }
-
-            if (self->iso_info->is_windows) {
-                gtk_drop_down_set_selected(self->write_mode_dropdown, 0);
-            } else if (!self->iso_info->is_hybrid && self->iso_info->has_efi) {
-                gtk_drop_down_set_selected(self->write_mode_dropdown, 1);
-            } else {
-                gtk_drop_down_set_selected(self->write_mode_dropdown, 0);
+        /* Analyze ISO, then hash it in the background, unless the catalog
+         * already did */
+        const catalog_entry_t *entry = find_catalog_entry(self, self->iso_path);
+        if (!entry || !select_catalog_image(self, entry)) {
+            if (self->iso_info) {
+                iso_info_free(self->iso_info);
+                self->iso_info = NULL;
             }
+            start_analysis(self, self->iso_path);
+            reset_status_ready(self);
+            update_start_sensitivity(self);
         }
 
-        /* Start background hash calculation */
-        start_hash_calculation(self, self->iso_path);
-
         g_object_unref(file);
-        reset_status_ready(self);
-        update_start_sensitivity(self);
     }
 }
 
@@ -296,6 +663,8 @@ static void on_boot_mode_changed(GtkDropDown *dropdown, GParamSpec *pspec, Rufus
     gtk_widget_set_sensitive(GTK_WIDGET(self->iso_entry), iso_mode);
     gtk_widget_set_sensitive(GTK_WIDGET(self->select_button), iso_mode);
     gtk_widget_set_sensitive(GTK_WIDGET(self->write_mode_dropdown), iso_mode);
+    gtk_widget_set_sensitive(GTK_WIDGET(self->persistence_dropdown),
+                             iso_mode && gtk_drop_down_get_selected(self->write_mode_dropdown) == 0);
 
     reset_status_ready(self);
     update_start_sensitivity(self);
@@ -309,7 +678,10 @@ static void on_write_mode_changed(GtkDropDown *dropdown, GParamSpec *pspec, Rufu
     if (mode == 1) {
         gtk_drop_down_set_selected(self->fs_dropdown, 0);
         gtk_drop_down_set_selected(self->target_dropdown, 1);
+        gtk_drop_down_set_selected(self->persistence_dropdown, 0);
     }
+    gtk_widget_set_sensitive(GTK_WIDGET(self->persistence_dropdown), mode == 0);
+    gtk_widget_set_visible(GTK_WIDGET(self->remove_image_button), mode == 2);
 
     reset_status_ready(self);
     update_start_sensitivity(self);
@@ -329,38 +701,70 @@ typedef struct {
     char *label;
     gboolean write_iso;
     gboolean iso_extract;
+    persistence_type_t persistence;
+    gboolean multiboot;
+    gboolean multiboot_ready;
+    char *esp_path;
+    uint64_t device_size;
+    int disk_lock;              /* Held from partitioning to the end of the job */
+    char *prebuilt_path;
+    volatile int prefetch_stop;
+    char *manifest_path;
+    manifest_t *manifest;
+    uint8_t *verify_mask;
+    bool verified;
+    gboolean grow;
+    char *perf_key;
+    gboolean prediscard;
+    gboolean discarded;
     gboolean success;
 } write_op_t;
 
-static gboolean write_complete_idle(gpointer data)
+static void write_job_done(job_t *job, void *data)
 {
     write_op_t *op = data;
     RufusWindow *self = op->window;
 
     self->operation_running = FALSE;
+    g_clear_pointer(&self->write_job, job_unref);
+    if (self->disposed)
+        goto out;
+
+    gtk_button_set_label(self->close_button, "Close");
     gtk_widget_set_sensitive(GTK_WIDGET(self->device_dropdown), TRUE);
     gtk_widget_set_sensitive(GTK_WIDGET(self->refresh_button), TRUE);
     gtk_widget_set_sensitive(GTK_WIDGET(self->close_button), TRUE);
     gtk_widget_set_sensitive(GTK_WIDGET(self->select_button), TRUE);
     gtk_widget_set_sensitive(GTK_WIDGET(self->write_mode_dropdown),
                              gtk_drop_down_get_selected(self->boot_dropdown) == 0);
+    gtk_widget_set_sensitive(GTK_WIDGET(self->persistence_dropdown),
+                             gtk_drop_down_get_selected(self->boot_dropdown) == 0 &&
+                             gtk_drop_down_get_selected(self->write_mode_dropdown) == 0);
     update_start_sensitivity(self);
 
     if (op->success) {
         gtk_progress_bar_set_fraction(self->progress_bar, 1.0);
         gtk_progress_bar_set_text(self->progress_bar, "100%");
         set_status(self, "Completed", "status-ready");
+    } else if (job_is_cancelled(job)) {
+        set_status(self, "Cancelled, device left blank", "status-error");
     } else {
         set_status(self, "Operation failed", "status-error");
     }
 
+out:
+    g_object_unref(self);
     g_free(op->device_path);
     g_free(op->iso_path);
     g_free(op->partition_path);
+    g_free(op->esp_path);
     g_free(op->label);
+    free(op->prebuilt_path);
+    free(op->manifest_path);
+    free(op->perf_key);
+    manifest_free(op->manifest);
+    free(op->verify_mask);
     g_free(op);
-
-    return G_SOURCE_REMOVE;
 }
 
 typedef struct {
@@ -373,9 +777,12 @@ static gboolean progress_update_idle(gpointer data)
 {
     progress_update_t *update = data;
 
-    gtk_progress_bar_set_fraction(update->window->progress_bar, update->fraction);
-    gtk_progress_bar_set_text(update->window->progress_bar, update->text);
+    if (!update->window->disposed) {
+        gtk_progress_bar_set_fraction(update->window->progress_bar, update->fraction);
+        gtk_progress_bar_set_text(update->window->progress_bar, update->text);
+    }
 
+    g_object_unref(update->window);
     g_free(update);
     return G_SOURCE_REMOVE;
 }
@@ -385,7 +792,7 @@ static void iso_write_progress(uint64_t bytes, uint64_t total, double speed, voi
     write_op_t *op = user_data;
 
     progress_update_t *update = g_new0(progress_update_t, 1);
-    update->window = op->window;
+    update->window = g_object_ref(op->window);
     update->fraction = total > 0 ? (double)bytes / total : 0.0;
 
     char *size_done = format_size(bytes);
@@ -403,7 +810,7 @@ static void iso_extract_progress(double fraction, const char *message, void *use
     write_op_t *op = user_data;
 
     progress_update_t *update = g_new0(progress_update_t, 1);
-    update->window = op->window;
+    update->window = g_object_ref(op->window);
     update->fraction = fraction;
 
     if (message)
@@ -414,122 +821,420 @@ static void iso_extract_progress(double fraction, const char *message, void *use
     g_idle_add(progress_update_idle, update);
 }
 
-static void *write_thread_func(void *data)
+/* ============== Write Stages ============== */
+
+/* Time allowed for udev to create partition nodes */
+#define PARTITION_NODE_TIMEOUT_MS 10000
+
+/* Stages of one operation running at once */
+#define WRITE_STAGE_PARALLEL 3
+
+static bool stage_partition_efi(void *data)
 {
     write_op_t *op = data;
 
-    if (op->write_iso) {
-        if (op->iso_extract) {
-            rufus_log("Extracting ISO %s to %s", op->iso_path, op->device_path);
+    op->disk_lock = partition_lock_disk(op->device_path);
+    if (!partition_create_single_efi(op->device_path, op->part_style, op->label))
+        return false;
 
-            if (!partition_create_single_efi(op->device_path, op->part_style, op->label)) {
-                op->success = FALSE;
-                g_idle_add(write_complete_idle, op);
-                return NULL;
-            }
+    op->partition_path = partition_wait_for_node(op->device_path, 1, PARTITION_NODE_TIMEOUT_MS);
+    return op->partition_path != NULL;
+}
 
-            usleep(1000000);
+static bool stage_partition_bootable(void *data)
+{
+    write_op_t *op = data;
 
-            op->partition_path = partition_get_path(op->device_path, 1);
-            if (!op->partition_path) {
-                op->success = FALSE;
-                g_idle_add(write_complete_idle, op);
-                return NULL;
-            }
+    op->disk_lock = partition_lock_disk(op->device_path);
+    if (!partition_create_bootable(op->device_path, op->part_style,
+                                   op->target, op->fs_type, op->label))
+        return false;
 
-            format_options_t fmt_opts = {
-                .fs_type = FS_FAT32,
-                .label = op->label,
-                .cluster_size = op->cluster_size,
-                .quick_format = TRUE,
-            };
-
-            if (!format_partition(op->partition_path, &fmt_opts, NULL, NULL)) {
-                op->success = FALSE;
-                g_idle_add(write_complete_idle, op);
-                return NULL;
-            }
+    op->esp_path = partition_wait_for_node(op->device_path, 1, PARTITION_NODE_TIMEOUT_MS);
+    op->partition_path = partition_wait_for_node(op->device_path, 2, PARTITION_NODE_TIMEOUT_MS);
+    return op->esp_path && op->partition_path;
+}
 
-            op->success = iso_extract_to_partition(op->iso_path, op->partition_path,
-                                                   iso_extract_progress, op);
-        } else {
-            /* ISO write mode - just dd the ISO */
-            rufus_log("Writing ISO %s to %s", op->iso_path, op->device_path);
+static bool stage_partition_single(void *data)
+{
+    write_op_t *op = data;
+
+    op->disk_lock = partition_lock_disk(op->device_path);
+    if (!partition_create_single(op->device_path, op->part_style,
+                                 op->fs_type, op->label))
+        return false;
+
+    op->partition_path = partition_wait_for_node(op->device_path, 1, PARTITION_NODE_TIMEOUT_MS);
+    return op->partition_path != NULL;
+}
+
+static bool stage_format_esp(void *data)
+{
+    write_op_t *op = data;
 
-            op->success = iso_write_sync(op->iso_path, op->device_path,
-                                         iso_write_progress, op);
+    format_options_t esp_opts = {
+        .fs_type = FS_FAT32,
+        .label = "EFI",
+        .cluster_size = 0,
+        .quick_format = TRUE,
+    };
+
+    return format_partition(op->esp_path, &esp_opts, NULL, NULL);
+}
+
+static bool stage_format_data(void *data)
+{
+    write_op_t *op = data;
+
+    format_options_t fmt_opts = {
+        .fs_type = op->fs_type,
+        .label = op->label,
+        .cluster_size = op->cluster_size,
+        .quick_format = TRUE,
+    };
+
+    return format_partition(op->partition_path, &fmt_opts, NULL, NULL);
+}
+
+static bool stage_prefetch(void *data)
+{
+    write_op_t *op = data;
+    return iso_extract_prefetch(op->iso_path, &op->prefetch_stop);
+}
+
+static bool stage_extract(void *data)
+{
+    write_op_t *op = data;
+
+    /* The extractor reads the rest itself */
+    g_atomic_int_set(&op->prefetch_stop, 1);
+
+    return iso_extract_to_partition(op->iso_path, op->partition_path,
+                                    iso_extract_progress, op);
+}
+
+static bool stage_extract_ntfs(void *data)
+{
+    write_op_t *op = data;
+    return iso_extract_to_ntfs(op->iso_path, op->partition_path, iso_extract_progress, op);
+}
+
+static bool stage_populate_ext(void *data)
+{
+    write_op_t *op = data;
+    return iso_extract_to_ext(op->iso_path, op->partition_path, op->fs_type, op->label,
+                              iso_extract_progress, op);
+}
+
+static bool stage_prebuild(void *data)
+{
+    write_op_t *op = data;
+
+    prebuilt_spec_t spec = {
+        .iso_path = op->iso_path,
+        .size = op->device_size,
+        .style = op->part_style,
+        .cluster_size = op->cluster_size,
+        .label = op->label,
+    };
+
+    op->prebuilt_path = prebuilt_get(config_get()->prebuild_dir, &spec,
+                                     iso_extract_progress, op);
+    return op->prebuilt_path != NULL;
+}
+
+static bool stage_flash(void *data)
+{
+    write_op_t *op = data;
+    const char *devices[] = { op->device_path };
+    return prebuilt_flash(op->prebuilt_path, devices, 1, NULL, iso_write_progress, op);
+}
+
+static void verify_progress(uint64_t bytes, uint64_t total, void *user_data)
+{
+    iso_write_progress(bytes, total, 0, user_data);
+}
+
+/* Keep the model's throughput for full writes of a local image */
+static void record_write_speed(write_op_t *op, gint64 start)
+{
+    struct stat st;
+    if (op->perf_key && stat(op->iso_path, &st) == 0)
+        perfdb_record(op->perf_key, op->discarded ? PERFDB_DISCARD : PERFDB_PLAIN,
+                      st.st_size, (g_get_monotonic_time() - start) / 1e6);
+}
+
+static bool stage_discard(void *data)
+{
+    write_op_t *op = data;
+
+    /* A stick the tracked write may update in place keeps its contents */
+    if (op->manifest && op->manifest_path && g_file_test(op->manifest_path, G_FILE_TEST_EXISTS)) {
+        rufus_log("Not discarding %s, it may only need changed chunks", op->device_path);
+        return true;
+    }
+
+    op->discarded = discard_device(op->device_path);
+    return op->discarded;
+}
+
+static bool stage_dd(void *data)
+{
+    write_op_t *op = data;
+    gint64 start = g_get_monotonic_time();
+
+    if (!op->manifest) {
+        bool ok = iso_write_sync(op->iso_path, op->device_path, iso_write_progress, op);
+        if (ok)
+            record_write_speed(op, start);
+        return ok;
+    }
+
+    /* Trust the old manifest only if the stick still matches it; it no
+     * longer describes the stick once writing starts */
+    manifest_t *previous = manifest_load(op->manifest_path);
+    manifest_forget(op->manifest_path);
+    if (previous && !manifest_sample_check(previous, op->device_path)) {
+        manifest_free(previous);
+        previous = NULL;
+    }
+
+    start = g_get_monotonic_time();
+    bool ok = iso_write_tracked_sync(op->iso_path, op->device_path, previous, op->manifest,
+                                     &op->verified, iso_write_progress, op);
+    if (ok && !previous)
+        record_write_speed(op, start);
+
+    /* Unchanged chunks were sampled above; read back only what was written */
+    if (ok && previous) {
+        op->verify_mask = calloc(op->manifest->chunk_count ? op->manifest->chunk_count : 1, 1);
+        for (uint32_t i = 0; op->verify_mask && i < op->manifest->chunk_count; i++)
+            op->verify_mask[i] = !manifest_chunk_equal(previous, op->manifest, i);
+    }
+
+    manifest_free(previous);
+    return ok;
+}
+
+static bool stage_verify(void *data)
+{
+    write_op_t *op = data;
+
+    /* A direct write reads its chunks back as it goes */
+    if (!op->verified) {
+        rufus_log("Verifying %s", op->device_path);
+        if (!manifest_verify_device(op->manifest, op->device_path, op->verify_mask,
+                                    verify_progress, op)) {
+            rufus_error("Verification of %s failed", op->device_path);
+            return false;
+        }
+    }
+
+    manifest_finish(op->manifest);
+
+    /* Growing rewrites the partition table and filesystem metadata */
+    if (op->manifest_path && !op->grow)
+        manifest_save(op->manifest, op->manifest_path);
+    return true;
+}
+
+static bool stage_persistence(void *data)
+{
+    write_op_t *op = data;
+    return persistence_create(op->device_path, op->iso_path, op->persistence,
+                              iso_extract_progress, op);
+}
+
+static bool stage_grow(void *data)
+{
+    write_op_t *op = data;
+    return grow_after_write(op->device_path, op->iso_path, iso_extract_progress, op);
+}
+
+static bool stage_multiboot_init(void *data)
+{
+    write_op_t *op = data;
+
+    rufus_log("Creating multi-image layout on %s", op->device_path);
+    return multiboot_init(op->device_path, iso_extract_progress, op);
+}
+
+static bool stage_multiboot_add(void *data)
+{
+    write_op_t *op = data;
+    return multiboot_add_image(op->device_path, op->iso_path, iso_extract_progress, op);
+}
+
+/* Express the operation as stages; stages on different partitions or on
+ * the source overlap, anything touching the whole device is serialized */
+static stage_graph_t *build_write_graph(write_op_t *op)
+{
+    stage_graph_t *graph = stage_graph_new(op->device_path);
+    if (!graph)
+        return NULL;
+
+    if (op->write_iso && op->multiboot) {
+        stage_t *init = NULL;
+        if (!op->multiboot_ready) {
+            init = stage_add(graph, "layout", stage_multiboot_init, op);
+            stage_use(init, "device");
+        }
+        stage_t *add = stage_add(graph, "add-image", stage_multiboot_add, op);
+        stage_use(add, "device");
+        stage_depends_on(add, init);
+    } else if (op->write_iso && op->iso_extract && op->fs_type == FS_NTFS) {
+        rufus_log("Copying ISO %s to NTFS on %s", op->iso_path, op->device_path);
+
+        stage_t *part = stage_add(graph, "partition", stage_partition_single, op);
+        stage_use(part, "device");
+
+        stage_t *format = stage_add(graph, "format", stage_format_data, op);
+        stage_use(format, "part1");
+        stage_depends_on(format, part);
+
+        stage_t *extract = stage_add(graph, "extract", stage_extract_ntfs, op);
+        stage_use(extract, "part1");
+        stage_use(extract, "source");
+        stage_depends_on(extract, format);
+    } else if (op->write_iso && op->iso_extract && op->fs_type != FS_FAT32) {
+        rufus_log("Building %s on %s from %s", fs_type_name(op->fs_type), op->device_path,
+                  op->iso_path);
+
+        /* mke2fs creates and fills the filesystem in one go */
+        stage_t *part = stage_add(graph, "partition", stage_partition_single, op);
+        stage_use(part, "device");
+
+        stage_t *populate = stage_add(graph, "populate", stage_populate_ext, op);
+        stage_use(populate, "part1");
+        stage_use(populate, "source");
+        stage_depends_on(populate, part);
+    } else if (op->write_iso && op->iso_extract && config_get()->prebuild_dir &&
+               prebuilt_is_supported()) {
+        rufus_log("Copying ISO %s to %s from a built image", op->iso_path, op->device_path);
+
+        /* The build is reused for every further stick of this size */
+        stage_t *build = stage_add(graph, "build", stage_prebuild, op);
+        stage_use(build, "source");
+
+        stage_t *flash = stage_add(graph, "write", stage_flash, op);
+        stage_use(flash, "device");
+        stage_depends_on(flash, build);
+    } else if (op->write_iso && op->iso_extract) {
+        rufus_log("Extracting ISO %s to %s", op->iso_path, op->device_path);
+
+        stage_t *part = stage_add(graph, "partition", stage_partition_efi, op);
+        stage_use(part, "device");
+
+        stage_t *prefetch = stage_add(graph, "prefetch", stage_prefetch, op);
+        stage_use(prefetch, "source");
+        stage_set_optional(prefetch, true);
+
+        stage_t *format = stage_add(graph, "format", stage_format_data, op);
+        stage_use(format, "part1");
+        stage_depends_on(format, part);
+
+        stage_t *extract = stage_add(graph, "extract", stage_extract, op);
+        stage_use(extract, "part1");
+        stage_depends_on(extract, format);
+    } else if (op->write_iso) {
+        rufus_log("Writing ISO %s to %s", op->iso_path, op->device_path);
+
+        stage_t *dd = stage_add(graph, "write", stage_dd, op);
+        stage_use(dd, "device");
+
+        if (op->prediscard) {
+            stage_t *discard = stage_add(graph, "discard", stage_discard, op);
+            stage_use(discard, "device");
+            stage_set_optional(discard, true);
+            stage_depends_on(dd, discard);
+        }
+
+        stage_t *verify = NULL;
+        if (op->manifest) {
+            verify = stage_add(graph, "verify", stage_verify, op);
+            stage_use(verify, "device");
+            stage_depends_on(verify, dd);
+        }
+
+        /* The image boots as written; failing to grow it only costs space */
+        if (op->grow) {
+            stage_t *grow = stage_add(graph, "grow", stage_grow, op);
+            stage_use(grow, "device");
+            stage_depends_on(grow, verify ? verify : dd);
+            stage_set_optional(grow, true);
+        }
+
+        if (op->persistence != PERSISTENCE_NONE) {
+            stage_t *persist = stage_add(graph, "persistence", stage_persistence, op);
+            stage_use(persist, "device");
+            stage_depends_on(persist, dd);
         }
     } else {
-        /* Format-only mode */
         rufus_log("Formatting %s as %s", op->device_path, fs_type_name(op->fs_type));
 
         bool needs_esp = (op->target != TARGET_BIOS &&
                           op->part_style == PARTITION_STYLE_GPT);
 
         if (needs_esp) {
-            if (!partition_create_bootable(op->device_path, op->part_style,
-                                           op->target, op->fs_type, op->label)) {
-                op->success = FALSE;
-                g_idle_add(write_complete_idle, op);
-                return NULL;
-            }
-
-            usleep(1000000);
+            stage_t *part = stage_add(graph, "partition", stage_partition_bootable, op);
+            stage_use(part, "device");
 
-            char *esp_path = partition_get_path(op->device_path, 1);
-            op->partition_path = partition_get_path(op->device_path, 2);
-            if (!esp_path || !op->partition_path) {
-                free(esp_path);
-                op->success = FALSE;
-                g_idle_add(write_complete_idle, op);
-                return NULL;
-            }
-
-            format_options_t esp_opts = {
-                .fs_type = FS_FAT32,
-                .label = "EFI",
-                .cluster_size = 0,
-                .quick_format = TRUE,
-            };
-
-            if (!format_partition(esp_path, &esp_opts, NULL, NULL)) {
-                free(esp_path);
-                op->success = FALSE;
-                g_idle_add(write_complete_idle, op);
-                return NULL;
-            }
+            stage_t *esp = stage_add(graph, "format-esp", stage_format_esp, op);
+            stage_use(esp, "part1");
+            stage_depends_on(esp, part);
 
-            free(esp_path);
+            stage_t *format = stage_add(graph, "format-data", stage_format_data, op);
+            stage_use(format, "part2");
+            stage_depends_on(format, part);
         } else {
-            if (!partition_create_single(op->device_path, op->part_style,
-                                         op->fs_type, op->label)) {
-                op->success = FALSE;
-                g_idle_add(write_complete_idle, op);
-                return NULL;
-            }
-
-            usleep(1000000);
+            stage_t *part = stage_add(graph, "partition", stage_partition_single, op);
+            stage_use(part, "device");
 
-            op->partition_path = partition_get_path(op->device_path, 1);
-            if (!op->partition_path) {
-                op->success = FALSE;
-                g_idle_add(write_complete_idle, op);
-                return NULL;
-            }
+            stage_t *format = stage_add(graph, "format", stage_format_data, op);
+            stage_use(format, "part1");
+            stage_depends_on(format, part);
         }
+    }
+
+    return graph;
+}
+
+static bool write_job_func(job_t *job, void *data)
+{
+    write_op_t *op = data;
 
-        format_options_t fmt_opts = {
-            .fs_type = op->fs_type,
-            .label = op->label,
-            .cluster_size = op->cluster_size,
-            .quick_format = TRUE,
-        };
+    /* Anything but a tracked raw write leaves the stick's manifest stale */
+    if (!op->manifest)
+        manifest_forget(op->manifest_path);
 
-        op->success = format_partition(op->partition_path, &fmt_opts, NULL, NULL);
+    stage_graph_t *graph = build_write_graph(op);
+    if (!graph) {
+        op->success = FALSE;
+        return false;
     }
 
-    g_idle_add(write_complete_idle, op);
-    return NULL;
+    throttle_add_device(op->device_path);
+    tuning_session_t *tuning = tuning_begin(op->device_path);
+    membudget_job_t *budget = membudget_job_new(op->device_path);
+    membudget_job_t *prev_budget = membudget_set_thread_job(budget);
+    op->success = stage_graph_run(graph, WRITE_STAGE_PARALLEL, job);
+    membudget_set_thread_job(prev_budget);
+    stage_graph_free(graph);
+
+    /* udevd catches up on the disk once it is unlocked */
+    partition_unlock_disk(op->disk_lock);
+    op->disk_lock = -1;
+
+    /* Don't leave a half-written layout behind, except the images already
+     * on a multi-image stick */
+    if (!op->success && job_is_cancelled(job) && !(op->multiboot && op->multiboot_ready))
+        partition_wipe_signatures(op->device_path);
+    tuning_end(tuning);
+    throttle_remove_device(op->device_path);
+    membudget_job_free(budget);
+    membudget_log();
+
+    return op->success;
 }
 
 /* Confirmation dialog callback */
@@ -548,26 +1253,39 @@ static void on_confirm_response(GObject *source, GAsyncResult *result, gpointer
         gtk_widget_set_sensitive(GTK_WIDGET(self->device_dropdown), FALSE);
         gtk_widget_set_sensitive(GTK_WIDGET(self->refresh_button), FALSE);
         gtk_widget_set_sensitive(GTK_WIDGET(self->start_button), FALSE);
-        gtk_widget_set_sensitive(GTK_WIDGET(self->close_button), FALSE);
         gtk_widget_set_sensitive(GTK_WIDGET(self->select_button), FALSE);
         gtk_widget_set_sensitive(GTK_WIDGET(self->write_mode_dropdown), FALSE);
+        gtk_widget_set_sensitive(GTK_WIDGET(self->persistence_dropdown), FALSE);
+        gtk_button_set_label(self->close_button, "Cancel");
 
         gtk_progress_bar_set_fraction(self->progress_bar, 0.0);
         gtk_progress_bar_set_text(self->progress_bar, "0%");
         if (op->write_iso && op->iso_extract) {
             set_status(self, "Extracting ISO...", "status-busy");
+        } else if (op->write_iso && op->multiboot) {
+            set_status(self, "Adding image...", "status-busy");
         } else {
             set_status(self, op->write_iso ? "Writing ISO..." : "Formatting...", "status-busy");
         }
 
-        pthread_t thread;
-        pthread_create(&thread, NULL, write_thread_func, op);
-        pthread_detach(thread);
+        /* The write owns the device now */
+        if (self->manifest_job) {
+            job_cancel(self->manifest_job);
+            g_clear_pointer(&self->manifest_job, job_unref);
+        }
+
+        job_t *job = job_new(write_job_func, op, JOB_PRIO_WRITE);
+        job_set_done(job, write_job_done);
+        self->write_job = job_ref(job);
+        job_submit(job);
     } else {
         /* Cancelled */
         g_free(op->device_path);
         g_free(op->iso_path);
         g_free(op->label);
+        free(op->manifest_path);
+        free(op->perf_key);
+        manifest_free(op->manifest);
         g_free(op);
     }
 }
@@ -588,6 +1306,7 @@ static void on_start_clicked(GtkButton *button, RufusWindow *self)
     gboolean write_iso = (boot_mode == 0 && self->iso_path != NULL);
     guint write_mode = gtk_drop_down_get_selected(self->write_mode_dropdown);
     gboolean iso_extract = (write_mode == 1);
+    gboolean multiboot = (write_mode == 2);
 
     if (write_iso && !self->iso_info) {
         set_status(self, "Please select an ISO image", "status-error");
@@ -603,7 +1322,26 @@ static void on_start_clicked(GtkButton *button, RufusWindow *self)
         return;
     }
 
-    if (write_iso && iso_extract) {
+    /* File copy onto ext4 builds the filesystem from the ISO directly; it
+     * makes a data stick, so the boot checks below do not apply */
+    gboolean extract_ext = write_iso && iso_extract &&
+                           gtk_drop_down_get_selected(self->fs_dropdown) == 3;
+    gboolean extract_ntfs = write_iso && iso_extract &&
+                            gtk_drop_down_get_selected(self->fs_dropdown) == 1;
+
+    if (extract_ntfs && (!format_is_supported(FS_NTFS) ||
+                         (!ntfs_extract_is_supported() && !iso_extract_is_supported()))) {
+        set_status(self, "NTFS file copy needs mkfs.ntfs and libntfs-3g or an extraction tool",
+                   "status-error");
+        return;
+    }
+
+    if (extract_ext && !iso_extract_ext_is_supported()) {
+        set_status(self, "ext4 file copy needs bsdtar and e2fsprogs 1.47.1", "status-error");
+        return;
+    }
+
+    if (write_iso && iso_extract && !extract_ext && !extract_ntfs) {
         if (!iso_extract_is_supported()) {
             set_status(self, "ISO file copy needs xorriso, bsdtar, or 7z", "status-error");
             return;
@@ -621,7 +1359,42 @@ static void on_start_clicked(GtkButton *button, RufusWindow *self)
             return;
         }
         if (gtk_drop_down_get_selected(self->fs_dropdown) != 0) {
-            set_status(self, "ISO file copy requires FAT32", "status-error");
+            set_status(self, "ISO file copy requires FAT32, NTFS or ext4", "status-error");
+            return;
+        }
+    }
+
+    gboolean multiboot_ready = FALSE;
+    if (write_iso && multiboot) {
+        if (!multiboot_is_supported()) {
+            set_status(self, "Multi-image mode needs GRUB and exFAT tools", "status-error");
+            return;
+        }
+        multiboot_ready = multiboot_is_initialized(dev->path);
+    }
+
+    if (write_iso && ((iso_extract && !extract_ext && !ntfs_extract_is_supported()) ||
+                      multiboot) &&
+        http_source_is_url(self->iso_path)) {
+        set_status(self, "Images from a URL can only be written in DD mode", "status-error");
+        return;
+    }
+
+    persistence_type_t persistence = PERSISTENCE_NONE;
+    if (write_iso && !iso_extract && !multiboot)
+        persistence = (persistence_type_t)gtk_drop_down_get_selected(self->persistence_dropdown);
+
+    if (persistence != PERSISTENCE_NONE) {
+        if (http_source_is_url(self->iso_path)) {
+            set_status(self, "Persistence needs a local image", "status-error");
+            return;
+        }
+        if (!persistence_is_supported()) {
+            set_status(self, "Persistence needs sfdisk and mkfs.ext4", "status-error");
+            return;
+        }
+        if (self->iso_info->size + PERSISTENCE_MIN_SIZE > dev->size) {
+            set_status(self, "Not enough space for persistence", "status-error");
             return;
         }
     }
@@ -634,13 +1407,38 @@ static void on_start_clicked(GtkButton *button, RufusWindow *self)
 
     /* Prepare operation */
     write_op_t *op = g_new0(write_op_t, 1);
-    op->window = self;
+    op->window = g_object_ref(self);
     op->device_path = g_strdup(dev->path);
+    op->device_size = dev->size;
+    op->disk_lock = -1;
     op->write_iso = write_iso;
     op->iso_extract = write_iso && iso_extract;
+    op->multiboot = write_iso && multiboot;
+    op->multiboot_ready = multiboot_ready;
+    op->manifest_path = manifest_path_for(dev);
 
     if (write_iso) {
         op->iso_path = g_strdup(self->iso_path);
+        op->persistence = persistence;
+
+        /* Raw writes learn per model whether a discard first pays off */
+        if (!op->iso_extract && !op->multiboot) {
+            op->perf_key = perfdb_key(dev);
+            discard_policy_t policy = config_get()->prediscard;
+            op->prediscard = discard_max_bytes(dev->path) > 0 &&
+                             (policy == DISCARD_ALWAYS ||
+                              (policy == DISCARD_AUTO && perfdb_prefers_discard(op->perf_key)));
+        }
+
+        /* Growing a compact image needs a partition table of its own */
+        op->grow = !op->iso_extract && !op->multiboot && persistence == PERSISTENCE_NONE &&
+                   config_get()->grow_images && self->iso_info->size < dev->size &&
+                   grow_probe(self->iso_path) != FS_UNKNOWN;
+
+        /* Persistence rewrites the partition table after the image */
+        if (!op->iso_extract && !op->multiboot && persistence == PERSISTENCE_NONE &&
+            config_get()->verify_writes)
+            op->manifest = manifest_new(dev, self->iso_path, self->iso_info->size);
         if (op->iso_extract) {
             op->part_style = gtk_drop_down_get_selected(self->partition_dropdown) == 1 ?
                              PARTITION_STYLE_GPT : PARTITION_STYLE_MBR;
@@ -652,7 +1450,7 @@ static void on_start_clicked(GtkButton *button, RufusWindow *self)
             default: op->target = TARGET_BIOS; break;
             }
 
-            op->fs_type = FS_FAT32;
+            op->fs_type = extract_ext ? FS_EXT4 : extract_ntfs ? FS_NTFS : FS_FAT32;
 
             guint cluster_idx = gtk_drop_down_get_selected(self->cluster_dropdown);
             if (cluster_idx > 0 && cluster_options[cluster_idx]) {
@@ -698,7 +1496,17 @@ static void on_start_clicked(GtkButton *button, RufusWindow *self)
     /* Show confirmation dialog */
     char *size_str = format_size(dev->size);
     char *message;
-    if (write_iso) {
+    if (op->multiboot && multiboot_ready) {
+        message = g_strdup_printf(
+            "This will add:\n\n%s\n\nto the multi-image stick on %s (%s). "
+            "Existing images are kept.\n\nContinue?",
+            self->iso_path, dev->path, size_str);
+    } else if (op->multiboot) {
+        message = g_strdup_printf(
+            "This will ERASE ALL DATA on %s (%s), set it up as a multi-image "
+            "stick and add:\n\n%s\n\nContinue?",
+            dev->path, size_str, self->iso_path);
+    } else if (write_iso) {
         message = g_strdup_printf(
             "This will ERASE ALL DATA on %s (%s) and write:\n\n%s\n\nContinue?",
             dev->path, size_str, self->iso_path);
@@ -720,9 +1528,172 @@ static void on_start_clicked(GtkButton *button, RufusWindow *self)
     g_object_unref(dialog);
 }
 
+/* ============== Multi-Image Removal ============== */
+
+typedef struct {
+    RufusWindow *window;
+    char *device_path;
+    char **images;
+    char *remove_name;
+    gboolean success;
+} image_remove_op_t;
+
+static void image_remove_op_free(image_remove_op_t *op)
+{
+    g_object_unref(op->window);
+    g_free(op->device_path);
+    g_free(op->remove_name);
+    multiboot_image_list_free(op->images);
+    g_free(op);
+}
+
+static void image_remove_job_done(job_t *job, void *data)
+{
+    (void)job;
+    image_remove_op_t *op = data;
+    RufusWindow *self = op->window;
+
+    self->operation_running = FALSE;
+    if (self->disposed) {
+        image_remove_op_free(op);
+        return;
+    }
+
+    update_start_sensitivity(self);
+
+    if (op->success)
+        set_status(self, "Image removed", "status-ready");
+    else
+        set_status(self, "Failed to remove image", "status-error");
+
+    image_remove_op_free(op);
+}
+
+static bool image_remove_job_func(job_t *job, void *data)
+{
+    (void)job;
+    image_remove_op_t *op = data;
+
+    op->success = multiboot_remove_image(op->device_path, op->remove_name);
+    return op->success;
+}
+
+static void on_remove_image_response(GObject *source, GAsyncResult *result, gpointer user_data)
+{
+    image_remove_op_t *op = user_data;
+    RufusWindow *self = op->window;
+
+    int response = gtk_alert_dialog_choose_finish(GTK_ALERT_DIALOG(source), result, NULL);
+
+    if (self->disposed) {
+        self->operation_running = FALSE;
+        image_remove_op_free(op);
+        return;
+    }
+
+    /* Button 0 is Cancel, images follow */
+    if (response <= 0 || !op->images || !op->images[response - 1]) {
+        self->operation_running = FALSE;
+        reset_status_ready(self);
+        update_start_sensitivity(self);
+        image_remove_op_free(op);
+        return;
+    }
+
+    op->remove_name = g_strdup(op->images[response - 1]);
+    set_status(self, "Removing image...", "status-busy");
+
+    job_t *job = job_new(image_remove_job_func, op, JOB_PRIO_WRITE);
+    job_set_done(job, image_remove_job_done);
+    job_submit(job);
+}
+
+static void image_list_job_done(job_t *job, void *data)
+{
+    (void)job;
+    image_remove_op_t *op = data;
+    RufusWindow *self = op->window;
+
+    if (self->disposed) {
+        self->operation_running = FALSE;
+        image_remove_op_free(op);
+        return;
+    }
+
+    if (!op->images || !op->images[0]) {
+        self->operation_running = FALSE;
+        update_start_sensitivity(self);
+        set_status(self, "No images on this stick", "status-error");
+        image_remove_op_free(op);
+        return;
+    }
+
+    GPtrArray *buttons = g_ptr_array_new();
+    g_ptr_array_add(buttons, (gpointer)"Cancel");
+    for (int i = 0; op->images[i]; i++)
+        g_ptr_array_add(buttons, op->images[i]);
+    g_ptr_array_add(buttons, NULL);
+
+    GtkAlertDialog *dialog = gtk_alert_dialog_new("Remove which image from %s?",
+                                                  op->device_path);
+    gtk_alert_dialog_set_buttons(dialog, (const char * const *)buttons->pdata);
+    gtk_alert_dialog_set_cancel_button(dialog, 0);
+    gtk_alert_dialog_set_default_button(dialog, 0);
+    gtk_alert_dialog_choose(dialog, GTK_WINDOW(self), NULL, on_remove_image_response, op);
+
+    g_ptr_array_free(buttons, TRUE);
+    g_object_unref(dialog);
+}
+
+static bool image_list_job_func(job_t *job, void *data)
+{
+    (void)job;
+    image_remove_op_t *op = data;
+
+    op->images = multiboot_list_images(op->device_path, NULL);
+    return true;
+}
+
+static void on_remove_image_clicked(GtkButton *button, RufusWindow *self)
+{
+    (void)button;
+
+    guint device_idx = gtk_drop_down_get_selected(self->device_dropdown);
+    if (device_idx == GTK_INVALID_LIST_POSITION || !self->devices ||
+        device_idx >= (guint)self->devices->count || self->operation_running)
+        return;
+
+    const device_info_t *dev = &self->devices->devices[device_idx];
+    if (!multiboot_is_initialized(dev->path)) {
+        set_status(self, "Not a multi-image stick", "status-error");
+        return;
+    }
+
+    image_remove_op_t *op = g_new0(image_remove_op_t, 1);
+    op->window = g_object_ref(self);
+    op->device_path = g_strdup(dev->path);
+
+    self->operation_running = TRUE;
+    update_start_sensitivity(self);
+    set_status(self, "Reading image list...", "status-busy");
+
+    job_t *job = job_new(image_list_job_func, op, JOB_PRIO_ANALYSIS);
+    job_set_done(job, image_list_job_done);
+    job_submit(job);
+}
+
 static void on_close_clicked(GtkButton *button, RufusWindow *self)
 {
     (void)button;
+
+    /* Doubles as Cancel while writing */
+    if (self->write_job) {
+        job_cancel(self->write_job);
+        gtk_widget_set_sensitive(GTK_WIDGET(self->close_button), FALSE);
+        set_status(self, "Cancelling...", "status-busy");
+        return;
+    }
+
     gtk_window_close(GTK_WINDOW(self));
 }
 
@@ -750,6 +1721,23 @@ static void on_device_change(void *user_data)
     g_idle_add(on_device_change_idle, user_data);
 }
 
+static RufusWindow *catalog_window = NULL;
+
+static gboolean on_catalog_change_idle(gpointer user_data)
+{
+    /* The window may be gone by the time this runs */
+    if (catalog_window != user_data)
+        return G_SOURCE_REMOVE;
+
+    refresh_library(catalog_window);
+    return G_SOURCE_REMOVE;
+}
+
+static void on_catalog_change(void *user_data)
+{
+    g_idle_add(on_catalog_change_idle, user_data);
+}
+
 static void rufus_window_dispose(GObject *object)
 {
     RufusWindow *self = RUFUS_WINDOW(object);
@@ -760,6 +1748,14 @@ static void rufus_window_dispose(GObject *object)
         hotplug_window = NULL;
     }
 
+    if (catalog_window == self) {
+        catalog_stop();
+        catalog_window = NULL;
+    }
+
+    catalog_list_free(self->catalog);
+    self->catalog = NULL;
+
     if (self->devices) {
         device_list_free(self->devices);
         self->devices = NULL;
@@ -775,6 +1771,28 @@ static void rufus_window_dispose(GObject *object)
         self->iso_writer = NULL;
     }
 
+    /* Pending jobs hold a window reference; these only cancel them */
+    self->disposed = TRUE;
+    if (self->analysis_job) {
+        job_cancel(self->analysis_job);
+        g_clear_pointer(&self->analysis_job, job_unref);
+    }
+
+    if (self->hash_job) {
+        job_cancel(self->hash_job);
+        g_clear_pointer(&self->hash_job, job_unref);
+    }
+
+    if (self->manifest_job) {
+        job_cancel(self->manifest_job);
+        g_clear_pointer(&self->manifest_job, job_unref);
+    }
+
+    if (self->write_job) {
+        job_cancel(self->write_job);
+        g_clear_pointer(&self->write_job, job_unref);
+    }
+
     g_free(self->iso_path);
     self->iso_path = NULL;
 
@@ -835,7 +1853,7 @@ static void rufus_window_init(RufusWindow *self)
     self->device_dropdown = GTK_DROP_DOWN(gtk_drop_down_new_from_strings(NULL));
     gtk_widget_set_hexpand(GTK_WIDGET(self->device_dropdown), TRUE);
     g_signal_connect(self->device_dropdown, "notify::selected",
-                     G_CALLBACK(on_param_changed), self);
+                     G_CALLBACK(on_device_selected), self);
 
     self->refresh_button = GTK_BUTTON(gtk_button_new_from_icon_name("view-refresh-symbolic"));
     gtk_widget_set_tooltip_text(GTK_WIDGET(self->refresh_button), "Refresh device list");
@@ -863,15 +1881,22 @@ static void rufus_window_init(RufusWindow *self)
     gtk_grid_attach(GTK_GRID(drive_grid), iso_label, 0, 2, 1, 1);
 
     self->iso_entry = GTK_ENTRY(gtk_entry_new());
-    gtk_editable_set_editable(GTK_EDITABLE(self->iso_entry), FALSE);
-    gtk_entry_set_placeholder_text(self->iso_entry, "Click SELECT to choose an ISO...");
+    gtk_entry_set_placeholder_text(self->iso_entry, "Click SELECT to choose an ISO, or enter a URL...");
+    g_signal_connect(self->iso_entry, "activate", G_CALLBACK(on_iso_entry_activate), self);
     gtk_widget_set_hexpand(GTK_WIDGET(self->iso_entry), TRUE);
 
     self->select_button = GTK_BUTTON(gtk_button_new_with_label("SELECT"));
     g_signal_connect(self->select_button, "clicked", G_CALLBACK(on_select_clicked), self);
 
+    self->library_dropdown = GTK_DROP_DOWN(gtk_drop_down_new_from_strings(NULL));
+    gtk_widget_set_tooltip_text(GTK_WIDGET(self->library_dropdown), "Images from the catalog");
+    gtk_widget_set_visible(GTK_WIDGET(self->library_dropdown), config_get()->catalog_dirs != NULL);
+    g_signal_connect(self->library_dropdown, "notify::selected",
+                     G_CALLBACK(on_library_selected), self);
+
     GtkWidget *iso_box = gtk_box_new(GTK_ORIENTATION_HORIZONTAL, 6);
     gtk_box_append(GTK_BOX(iso_box), GTK_WIDGET(self->iso_entry));
+    gtk_box_append(GTK_BOX(iso_box), GTK_WIDGET(self->library_dropdown));
     gtk_box_append(GTK_BOX(iso_box), GTK_WIDGET(self->select_button));
     gtk_widget_set_hexpand(iso_box, TRUE);
     gtk_grid_attach(GTK_GRID(drive_grid), iso_box, 1, 2, 3, 1);
@@ -885,7 +1910,36 @@ static void rufus_window_init(RufusWindow *self)
     gtk_drop_down_set_selected(self->write_mode_dropdown, 0);
     g_signal_connect(self->write_mode_dropdown, "notify::selected",
                      G_CALLBACK(on_write_mode_changed), self);
-    gtk_grid_attach(GTK_GRID(drive_grid), GTK_WIDGET(self->write_mode_dropdown), 1, 3, 3, 1);
+    gtk_widget_set_hexpand(GTK_WIDGET(self->write_mode_dropdown), TRUE);
+
+    self->remove_image_button = GTK_BUTTON(gtk_button_new_from_icon_name("list-remove-symbolic"));
+    gtk_widget_set_tooltip_text(GTK_WIDGET(self->remove_image_button),
+                                "Remove an image from the multi-image stick");
+    gtk_widget_set_visible(GTK_WIDGET(self->remove_image_button), FALSE);
+    g_signal_connect(self->remove_image_button, "clicked",
+                     G_CALLBACK(on_remove_image_clicked), self);
+
+    GtkWidget *mode_box = gtk_box_new(GTK_ORIENTATION_HORIZONTAL, 6);
+    gtk_box_append(GTK_BOX(mode_box), GTK_WIDGET(self->write_mode_dropdown));
+    gtk_box_append(GTK_BOX(mode_box), GTK_WIDGET(self->remove_image_button));
+    gtk_widget_set_hexpand(mode_box, TRUE);
+    gtk_grid_attach(GTK_GRID(drive_grid), mode_box, 1, 3, 3, 1);
+
+    /* Persistence row */
+    GtkWidget *persistence_label = gtk_label_new("Persistence");
+    gtk_widget_set_halign(persistence_label, GTK_ALIGN_START);
+    gtk_grid_attach(GTK_GRID(drive_grid), persistence_label, 0, 6, 1, 1);
+
+    /* Entries follow persistence_type_t, so the index is the type */
+    const char *persistence_options[PERSISTENCE_COUNT + 1] = { NULL };
+    for (int i = 0; i < PERSISTENCE_COUNT; i++)
+        persistence_options[i] = persistence_type_name((persistence_type_t)i);
+    self->persistence_dropdown = GTK_DROP_DOWN(gtk_drop_down_new_from_strings(persistence_options));
+    gtk_widget_set_tooltip_text(GTK_WIDGET(self->persistence_dropdown),
+                                "Use the free space behind a DD-written live ISO");
+    g_signal_connect(self->persistence_dropdown, "notify::selected",
+                     G_CALLBACK(on_param_changed), self);
+    gtk_grid_attach(GTK_GRID(drive_grid), GTK_WIDGET(self->persistence_dropdown), 1, 6, 3, 1);
 
     /* Hash row */
     self->hash_label = GTK_LABEL(gtk_label_new(""));
@@ -1006,6 +2060,14 @@ static void rufus_window_init(RufusWindow *self)
     if (!device_monitor_start(on_device_change, self)) {
         rufus_log("Warning: Device hotplug monitoring not available");
     }
+
+    /* Start watching the image library */
+    if (config_get()->catalog_dirs && !catalog_window) {
+        if (catalog_start(config_get()->catalog_dirs, on_catalog_change, self)) {
+            catalog_window = self;
+            refresh_library(self);
+        }
+    }
 }
 
 RufusWindow *rufus_window_new(RufusApp *app)
@@ -0,0 +1,70 @@
+/*
+ * Rufux - Chunk Digest Tests
+ * Francesco Lauritano
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ *
+ * The hardware CRC32C lanes (SSE4.2 or ARMv8) must give the same chunk
+ * digests as the table code, and a chunk too short for lanes must give the
+ * standard CRC32C of its bytes.
+ */
+
+#include "../src/common/hash.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MAX_LEN (4 * 1024 * 1024 + 7)
+
+int main(void)
+{
+    int failures = 0;
+
+    /* Under 32 bytes everything lands in the last lane */
+    uint8_t digest[CHUNK_DIGEST_SIZE];
+    hash_crc32c_set_hw(false);
+    hash_chunk(CHUNK_DIGEST_CRC32C, "123456789", 9, digest);
+    uint32_t check = digest[12] | digest[13] << 8 | digest[14] << 16 | (uint32_t)digest[15] << 24;
+    if (check != 0xE3069283) {
+        fprintf(stderr, "table: CRC32C(\"123456789\") = %08X\n", check);
+        failures++;
+    }
+
+    if (!hash_crc32c_set_hw(true)) {
+        printf("no hardware CRC32C on this CPU, table only\n");
+        return failures ? 1 : 0;
+    }
+    const char *hw_name = hash_crc32c_impl();
+
+    uint8_t *data = malloc(MAX_LEN);
+    if (!data)
+        return 1;
+    srand(1);
+    for (size_t i = 0; i < MAX_LEN; i++)
+        data[i] = (uint8_t)rand();
+
+    /* Lane and word boundaries, plus real chunk sizes */
+    static const size_t lengths[] = {
+        0, 1, 7, 8, 9, 31, 32, 33, 63, 64, 65, 100, 255, 256, 1000, 4095, 4096, 4097,
+        65536 + 3, 1024 * 1024, MAX_LEN - 7, MAX_LEN,
+    };
+    for (size_t i = 0; i < sizeof(lengths) / sizeof(lengths[0]); i++) {
+        for (size_t off = 0; off < 4; off++) {
+            size_t len = lengths[i] - (lengths[i] >= off ? off : 0);
+            uint8_t hw[CHUNK_DIGEST_SIZE], sw[CHUNK_DIGEST_SIZE];
+
+            hash_crc32c_set_hw(true);
+            hash_chunk(CHUNK_DIGEST_CRC32C, data + off, len, hw);
+            hash_crc32c_set_hw(false);
+            hash_chunk(CHUNK_DIGEST_CRC32C, data + off, len, sw);
+
+            if (memcmp(hw, sw, sizeof(hw)) != 0 && failures++ < 10)
+                fprintf(stderr, "%s: len %zu off %zu differs from table\n", hw_name, len, off);
+        }
+    }
+
+    hash_crc32c_set_hw(true);
+    printf("%s vs table: %s\n", hw_name, failures ? "FAIL" : "ok");
+    free(data);
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,229 @@
+/*
+ * Rufux - HTTP Source Tests
+ * Francesco Lauritano
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ *
+ * Streams an image from a small in-process HTTP server: parallel Range
+ * reads must return the exact bytes, reads must resume over dropped
+ * connections, and http_source_abort must end a read stuck on a stalled
+ * server well before curl's own stall timeout.
+ */
+
+#define _GNU_SOURCE
+#include "../src/iso/http_source.h"
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#define IMAGE_SIZE  (4 * 1024 * 1024 + 123)
+#define READ_SIZE   (256 * 1024)
+#define READERS     4
+
+enum { SERVE_OK, SERVE_DROP, SERVE_STALL };
+
+static uint8_t *image;
+static atomic_int mode;
+static atomic_int served;
+
+static bool send_all(int fd, const void *data, size_t len)
+{
+    const uint8_t *p = data;
+    while (len > 0) {
+        ssize_t n = send(fd, p, len, MSG_NOSIGNAL);
+        if (n <= 0)
+            return false;
+        p += n;
+        len -= n;
+    }
+    return true;
+}
+
+/* One keep-alive connection: HEAD and GET with an optional Range */
+static void *serve_conn(void *arg)
+{
+    int fd = (int)(intptr_t)arg;
+    char req[4096];
+    size_t have = 0;
+
+    for (;;) {
+        char *end;
+        while (!(end = memmem(req, have, "\r\n\r\n", 4))) {
+            ssize_t n = have < sizeof(req) ? recv(fd, req + have, sizeof(req) - have, 0) : -1;
+            if (n <= 0)
+                goto out;
+            have += n;
+        }
+
+        bool head = strncmp(req, "HEAD ", 5) == 0;
+        unsigned long long start = 0, last = IMAGE_SIZE - 1;
+        char *range = strcasestr(req, "\r\nRange: bytes=");
+        bool ranged = range && range < end &&
+                      sscanf(range + 15, "%llu-%llu", &start, &last) == 2;
+
+        char hdr[256];
+        int len = snprintf(hdr, sizeof(hdr), "HTTP/1.1 %s\r\nContent-Length: %llu\r\n"
+                           "ETag: \"v1\"\r\nAccept-Ranges: bytes\r\n",
+                           ranged ? "206 Partial Content" : "200 OK", last - start + 1);
+        if (ranged)
+            len += snprintf(hdr + len, sizeof(hdr) - len, "Content-Range: bytes %llu-%llu/%d\r\n",
+                            start, last, IMAGE_SIZE);
+        len += snprintf(hdr + len, sizeof(hdr) - len, "\r\n");
+
+        size_t consumed = end + 4 - req;
+        memmove(req, req + consumed, have - consumed);
+        have -= consumed;
+
+        if (!send_all(fd, hdr, len))
+            goto out;
+        if (head)
+            continue;
+
+        size_t body = last - start + 1;
+        int m = atomic_load(&mode);
+        if (ranged && m == SERVE_STALL) {
+            /* A few bytes, then nothing until the client gives up */
+            send_all(fd, image + start, 16);
+            while (recv(fd, req, sizeof(req), 0) > 0)
+                ;
+            goto out;
+        }
+        if (ranged && m == SERVE_DROP && atomic_fetch_add(&served, 1) % 3 == 1) {
+            send_all(fd, image + start, body / 3);
+            goto out;
+        }
+        if (!send_all(fd, image + start, body))
+            goto out;
+    }
+
+out:
+    close(fd);
+    return NULL;
+}
+
+static void *serve(void *arg)
+{
+    int listener = (int)(intptr_t)arg;
+    for (;;) {
+        int fd = accept(listener, NULL, NULL);
+        if (fd < 0)
+            continue;
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, serve_conn, (void *)(intptr_t)fd) == 0)
+            pthread_detach(thread);
+        else
+            close(fd);
+    }
+    return NULL;
+}
+
+typedef struct {
+    http_source_t *http;
+    int index;
+    bool ok;
+} reader_t;
+
+/* Reader i fetches every READERS-th block and checks it */
+static void *read_blocks(void *arg)
+{
+    reader_t *r = arg;
+    uint8_t *buf = malloc(READ_SIZE);
+    r->ok = buf != NULL;
+
+    for (uint64_t off = (uint64_t)r->index * READ_SIZE; r->ok && off < IMAGE_SIZE;
+         off += (uint64_t)READERS * READ_SIZE) {
+        size_t len = IMAGE_SIZE - off < READ_SIZE ? IMAGE_SIZE - off : READ_SIZE;
+        r->ok = http_source_pread(r->http, buf, len, off) && memcmp(buf, image + off, len) == 0;
+    }
+
+    free(buf);
+    return NULL;
+}
+
+static bool read_image(http_source_t *http)
+{
+    pthread_t threads[READERS];
+    reader_t readers[READERS];
+    for (int i = 0; i < READERS; i++) {
+        readers[i] = (reader_t){ .http = http, .index = i };
+        pthread_create(&threads[i], NULL, read_blocks, &readers[i]);
+    }
+
+    bool ok = true;
+    for (int i = 0; i < READERS; i++) {
+        pthread_join(threads[i], NULL);
+        ok = ok && readers[i].ok;
+    }
+    return ok;
+}
+
+static double now_sec(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(void)
+{
+    image = malloc(IMAGE_SIZE);
+    srand(1);
+    for (size_t i = 0; i < IMAGE_SIZE; i++)
+        image[i] = (uint8_t)rand();
+
+    int listener = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in addr = { .sin_family = AF_INET, .sin_addr.s_addr = htonl(INADDR_LOOPBACK) };
+    socklen_t addr_len = sizeof(addr);
+    if (listener < 0 || bind(listener, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+        listen(listener, 16) != 0 || getsockname(listener, (struct sockaddr *)&addr, &addr_len) != 0) {
+        perror("listen");
+        return 1;
+    }
+
+    pthread_t server;
+    pthread_create(&server, NULL, serve, (void *)(intptr_t)listener);
+
+    char url[64];
+    snprintf(url, sizeof(url), "http://127.0.0.1:%d/image.iso", ntohs(addr.sin_port));
+    http_source_t *http = http_source_open(url);
+    if (!http || http_source_size(http) != IMAGE_SIZE) {
+        fprintf(stderr, "open failed\n");
+        return 1;
+    }
+
+    int failures = 0;
+
+    bool ok = read_image(http);
+    printf("parallel reads: %s\n", ok ? "ok" : "FAIL");
+    failures += !ok;
+
+    atomic_store(&mode, SERVE_DROP);
+    ok = read_image(http);
+    printf("dropped connections: %s\n", ok ? "ok" : "FAIL");
+    failures += !ok;
+
+    /* Abort from another thread while a read hangs on the server */
+    atomic_store(&mode, SERVE_STALL);
+    reader_t stalled = { .http = http };
+    pthread_t thread;
+    double start = now_sec();
+    pthread_create(&thread, NULL, read_blocks, &stalled);
+    usleep(300000);
+    http_source_abort(http);
+    pthread_join(thread, NULL);
+    double took = now_sec() - start;
+    ok = !stalled.ok && took < 3.0;
+    printf("abort: %s after %.1fs\n", ok ? "ok" : "FAIL", took);
+    failures += !ok;
+
+    http_source_close(http);
+    free(image);
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,98 @@
+/*
+ * Rufux - Buffer Kernel Tests
+ * Francesco Lauritano
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ *
+ * Every level the CPU supports must agree with the scalar kernels, for all
+ * lengths across the vector block sizes, offsets and difference positions.
+ */
+
+#include "../src/common/kernels.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MAX_LEN 600
+
+static uint8_t a[MAX_LEN + 64], b[MAX_LEN + 64], zero[MAX_LEN + 64];
+static uint8_t want_fill[MAX_LEN + 64], got_fill[MAX_LEN + 64];
+static int failures;
+
+static void check(kernel_level_t level, const char *kernel, size_t off, size_t len, size_t pos,
+                  size_t got, size_t want)
+{
+    if (got != want && failures++ < 10)
+        fprintf(stderr, "%s %s: off %zu len %zu pos %zu: %zu, scalar %zu\n",
+                kernels_level_name(level), kernel, off, len, pos, got, want);
+}
+
+/* Run one case at the scalar level and at level */
+#define COMPARE(level, kernel, off, len, pos, expr)                   \
+    do {                                                              \
+        kernels_set_level(KERNEL_SCALAR);                             \
+        size_t want_ = (size_t)(expr);                                \
+        kernels_set_level(level);                                     \
+        check(level, kernel, off, len, pos, (size_t)(expr), want_);   \
+    } while (0)
+
+static void test_level(kernel_level_t level)
+{
+    for (size_t off = 0; off < 8; off++) {
+        for (size_t len = 0; len <= MAX_LEN; len++) {
+            /* pos == len leaves the buffers equal */
+            for (size_t pos = 0; pos <= len; pos += 1 + pos / 8) {
+                b[off + pos] ^= 0x10;
+                COMPARE(level, "first_diff", off, len, pos, buf_first_diff(a + off, b + off, len));
+                b[off + pos] ^= 0x10;
+
+                zero[off + pos] = 1;
+                COMPARE(level, "is_zero", off, len, pos, buf_is_zero(zero + off, len));
+                zero[off + pos] = 0;
+            }
+
+            /* Pattern position is off, not the buffer address */
+            uint64_t seed = 0x5EED0000 + len;
+            kernels_set_level(KERNEL_SCALAR);
+            pattern_fill(want_fill, len, seed, off * 13);
+            kernels_set_level(level);
+            pattern_fill(got_fill, len, seed, off * 13);
+            check(level, "pattern_fill", off, len, 0,
+                  buf_first_diff(got_fill, want_fill, len), len);
+
+            for (size_t pos = 0; pos <= len; pos += 1 + pos / 4) {
+                got_fill[pos] ^= 0x01;
+                COMPARE(level, "pattern_check", off, len, pos,
+                        pattern_check(got_fill, len, seed, off * 13));
+                got_fill[pos] ^= 0x01;
+            }
+        }
+    }
+}
+
+int main(void)
+{
+    srand(1);
+    for (size_t i = 0; i < sizeof(a); i++)
+        a[i] = b[i] = (uint8_t)rand();
+
+    /* The scalar pattern checks itself: regions line up with the whole */
+    uint8_t whole[64], part[64];
+    pattern_fill(whole, sizeof(whole), 7, 100);
+    pattern_fill(part, 29, 7, 117);
+    if (memcmp(whole + 17, part, 29) != 0 || pattern_check(whole, sizeof(whole), 7, 100) != 64) {
+        fprintf(stderr, "pattern is not position independent\n");
+        failures++;
+    }
+
+    for (kernel_level_t level = KERNEL_SSE2; level < KERNEL_LEVEL_COUNT; level++) {
+        if (!kernels_level_supported(level))
+            continue;
+
+        int before = failures;
+        test_level(level);
+        printf("%s: %s\n", kernels_level_name(level), failures > before ? "FAIL" : "ok");
+    }
+
+    return failures ? 1 : 0;
+}
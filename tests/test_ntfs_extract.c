@@ -0,0 +1,243 @@
+/*
+ * Rufux - Direct NTFS Population Tests
+ * Francesco Lauritano
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ *
+ * Builds a small ISO with libarchive, formats an image file with mkntfs
+ * (through a loop device when run as root), populates it with
+ * ntfs_extract_from_iso and reads every file back through libntfs-3g. The
+ * volume must then pass "ntfsfix -n". Skipped without mkntfs.
+ */
+
+#define _GNU_SOURCE
+#include "../src/iso/ntfs_extract.h"
+#include <archive.h>
+#include <archive_entry.h>
+#include <ntfs-3g/types.h>
+#include <ntfs-3g/attrib.h>
+#include <ntfs-3g/dir.h>
+#include <ntfs-3g/inode.h>
+#include <ntfs-3g/volume.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define VOLUME_SIZE (64 * 1024 * 1024)
+#define SKIP        77
+
+typedef struct {
+    const char *path;
+    size_t size; /* SIZE_MAX for a directory */
+} tree_entry_t;
+
+/* Resident, empty, multi-chunk and nested entries; libarchive adds the
+ * directories of deep/a/b itself */
+static const tree_entry_t tree[] = {
+    { "EFI", SIZE_MAX },
+    { "EFI/BOOT", SIZE_MAX },
+    { "EFI/BOOT/BOOTX64.EFI", 200 * 1024 },
+    { "casper", SIZE_MAX },
+    { "casper/vmlinuz", 1024 * 1024 + 1 },
+    { "casper/filesystem.squashfs", 9 * 1024 * 1024 + 123 },
+    { "README.diskdefines", 300 },
+    { "empty", 0 },
+    { "deep/a/b/notes.txt", 5000 },
+};
+#define TREE_COUNT (sizeof(tree) / sizeof(tree[0]))
+#define LARGEST    5
+
+static int failures;
+
+static void fill(uint8_t *buf, size_t len, size_t index)
+{
+    srand(1000 + index);
+    for (size_t i = 0; i < len; i++)
+        buf[i] = (uint8_t)rand();
+}
+
+static bool build_iso(const char *iso_path)
+{
+    struct archive *a = archive_write_new();
+    if (!a || archive_write_set_format_iso9660(a) != ARCHIVE_OK ||
+        archive_write_open_filename(a, iso_path) != ARCHIVE_OK) {
+        fprintf(stderr, "iso: %s\n", a ? archive_error_string(a) : "no memory");
+        archive_write_free(a);
+        return false;
+    }
+
+    bool ok = true;
+    for (size_t i = 0; ok && i < TREE_COUNT; i++) {
+        bool dir = tree[i].size == SIZE_MAX;
+        struct archive_entry *entry = archive_entry_new();
+        archive_entry_set_pathname(entry, tree[i].path);
+        archive_entry_set_filetype(entry, dir ? AE_IFDIR : AE_IFREG);
+        archive_entry_set_perm(entry, dir ? 0755 : 0644);
+        archive_entry_set_size(entry, dir ? 0 : (la_int64_t)tree[i].size);
+        ok = archive_write_header(a, entry) == ARCHIVE_OK;
+
+        if (ok && !dir && tree[i].size > 0) {
+            uint8_t *data = malloc(tree[i].size);
+            ok = data != NULL;
+            if (ok) {
+                fill(data, tree[i].size, i);
+                ok = archive_write_data(a, data, tree[i].size) == (la_ssize_t)tree[i].size;
+            }
+            free(data);
+        }
+        archive_entry_free(entry);
+    }
+
+    ok = archive_write_close(a) == ARCHIVE_OK && ok;
+    if (!ok)
+        fprintf(stderr, "iso: %s\n", archive_error_string(a));
+    archive_write_free(a);
+    return ok;
+}
+
+/* Attach image to a loop device when root; otherwise use the file itself */
+static char *attach(const char *image)
+{
+    if (geteuid() != 0)
+        return strdup(image);
+
+    char cmd[256], dev[64] = "";
+    snprintf(cmd, sizeof(cmd), "losetup --find --show '%s' 2>/dev/null", image);
+    FILE *p = popen(cmd, "r");
+    if (p) {
+        if (!fgets(dev, sizeof(dev), p))
+            dev[0] = '\0';
+        pclose(p);
+    }
+    dev[strcspn(dev, "\n")] = '\0';
+    return strdup(dev[0] ? dev : image);
+}
+
+static void detach(const char *dev, const char *image)
+{
+    if (strcmp(dev, image) != 0) {
+        char cmd[128];
+        snprintf(cmd, sizeof(cmd), "losetup -d '%s'", dev);
+        if (system(cmd) != 0)
+            fprintf(stderr, "cannot detach %s\n", dev);
+    }
+}
+
+static void check_file(ntfs_volume *vol, size_t index)
+{
+    const tree_entry_t *e = &tree[index];
+    ntfs_inode *ni = ntfs_pathname_to_inode(vol, NULL, e->path);
+    if (!ni) {
+        fprintf(stderr, "%s: missing\n", e->path);
+        failures++;
+        return;
+    }
+
+    if (e->size == SIZE_MAX) {
+        ntfs_inode_close(ni);
+        return;
+    }
+
+    ntfs_attr *na = ntfs_attr_open(ni, AT_DATA, AT_UNNAMED, 0);
+    uint8_t *want = malloc(e->size + 1), *got = malloc(e->size + 1);
+    if (!na || !want || !got || na->data_size != (s64)e->size) {
+        fprintf(stderr, "%s: size %lld, want %zu\n", e->path,
+                na ? (long long)na->data_size : -1LL, e->size);
+        failures++;
+    } else {
+        fill(want, e->size, index);
+        if (ntfs_attr_pread(na, 0, e->size, got) != (s64)e->size ||
+            memcmp(got, want, e->size) != 0) {
+            fprintf(stderr, "%s: contents differ\n", e->path);
+            failures++;
+        }
+
+        /* Sized up front, so the largest file is one run with no holes */
+        if (index == LARGEST) {
+            int runs = 0;
+            bool holes = ntfs_attr_map_whole_runlist(na) != 0;
+            for (runlist_element *rl = na->rl; !holes && rl && rl->length; rl++) {
+                holes = rl->lcn < 0;
+                runs++;
+            }
+            if (holes || runs != 1) {
+                fprintf(stderr, "%s: %d runs%s\n", e->path, runs, holes ? " with holes" : "");
+                failures++;
+            }
+        }
+    }
+
+    free(want);
+    free(got);
+    if (na)
+        ntfs_attr_close(na);
+    ntfs_inode_close(ni);
+}
+
+static void progress(double fraction, const char *status, void *user_data)
+{
+    (void)status;
+    *(double *)user_data = fraction;
+}
+
+int main(void)
+{
+    if (system("command -v mkntfs >/dev/null && command -v ntfsfix >/dev/null") != 0) {
+        printf("mkntfs or ntfsfix not found, skipping\n");
+        return SKIP;
+    }
+
+    const char *tmp = getenv("TMPDIR") ? getenv("TMPDIR") : "/tmp";
+    char iso[256], image[256];
+    snprintf(iso, sizeof(iso), "%s/rufux-ntfs-XXXXXX", tmp);
+    snprintf(image, sizeof(image), "%s/rufux-ntfs-XXXXXX", tmp);
+    int iso_fd = mkstemp(iso), image_fd = mkstemp(image);
+    if (iso_fd < 0 || image_fd < 0 || ftruncate(image_fd, VOLUME_SIZE) != 0) {
+        perror("temp files");
+        return 1;
+    }
+    close(iso_fd);
+    close(image_fd);
+
+    char *dev = NULL;
+    char cmd[512];
+    snprintf(cmd, sizeof(cmd), "mkntfs -F -f -q -L RUFUX '%s' >/dev/null", image);
+    if (!build_iso(iso) || system(cmd) != 0) {
+        fprintf(stderr, "setup failed\n");
+        failures++;
+        goto out;
+    }
+
+    dev = attach(image);
+    double last = 0.0;
+    bool ok = ntfs_extract_from_iso(iso, dev, progress, &last);
+    printf("populate: %s\n", ok && last == 1.0 ? "ok" : "FAIL");
+    failures += !ok || last != 1.0;
+
+    int before = failures;
+    ntfs_volume *vol = ntfs_mount(dev, NTFS_MNT_RDONLY);
+    if (!vol) {
+        perror("ntfs_mount");
+        failures++;
+    } else {
+        for (size_t i = 0; i < TREE_COUNT; i++)
+            check_file(vol, i);
+        ntfs_umount(vol, FALSE);
+    }
+    printf("tree: %s\n", failures > before ? "FAIL" : "ok");
+
+    snprintf(cmd, sizeof(cmd), "ntfsfix -n '%s' >/dev/null", dev);
+    ok = system(cmd) == 0;
+    printf("ntfsfix -n: %s\n", ok ? "ok" : "FAIL");
+    failures += !ok;
+
+    detach(dev, image);
+
+out:
+    free(dev);
+    unlink(iso);
+    unlink(image);
+    return failures ? 1 : 0;
+}